@@ -0,0 +1,179 @@
+/**
+ * @file driver.c
+ * @brief Runs a harness without libFuzzer, for AFL and compilers without
+ * -fsanitize=fuzzer.
+ *
+ * $ ./<harness> [-n mutations] [file or directory]...
+ * Each file, or each file of a directory, is run once, then mutated the
+ * given number of times, each mutant being run too. Mutations are bit
+ * flips, byte changes, insertions, deletions and truncations drawn from a
+ * fixed seed, so a run is reproducible. Without files, stdin is run once,
+ * which is what AFL expects.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "string.h"
+#include "dirent.h"
+#include "sys/stat.h"
+
+#include "fuzz.h"
+
+/* Largest input run, longer ones are truncated. */
+#define DRIVER_INPUT_MAX 65536
+/* Changes at most to make a mutant. */
+#define DRIVER_EDITS_MAX 4
+
+static uint8_t input[DRIVER_INPUT_MAX];
+static uint8_t mutant[DRIVER_INPUT_MAX];
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+static long runs;
+
+static uint32_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (uint32_t)(rng >> 16);
+}
+
+static size_t mutate(const uint8_t *data, size_t size)
+{
+	int edits = 1 + next_random() % DRIVER_EDITS_MAX;
+	size_t pos;
+
+	memcpy(mutant, data, size);
+	for (int i = 0; i < edits; i++) {
+		pos = size ? next_random() % size : 0;
+		switch (next_random() % 6) {
+			case 0: /* Flip a bit. */
+				if (size > 0)
+					mutant[pos] ^= 1 << (next_random() % 8);
+				break;
+			case 1: /* Change a byte, often to a boundary value. */
+				if (size > 0) {
+					const uint8_t edges[] = { 0x00, 0x7F, 0x80, 0xFF };
+
+					mutant[pos] = (next_random() % 2) ?
+								edges[next_random() % 4] :
+								(uint8_t)next_random();
+				}
+				break;
+			case 2: /* Insert a byte. */
+				if (size < DRIVER_INPUT_MAX) {
+					memmove(&mutant[pos + 1], &mutant[pos], size - pos);
+					mutant[pos] = (uint8_t)next_random();
+					size++;
+				}
+				break;
+			case 3: /* Delete a byte. */
+				if (size > 0) {
+					memmove(&mutant[pos], &mutant[pos + 1], size - pos - 1);
+					size--;
+				}
+				break;
+			case 4: /* Truncate. */
+				size = pos;
+				break;
+			default: /* Copy a run of bytes over another place. */
+				if (size > 1) {
+					size_t from = next_random() % size;
+					size_t len = 1 + next_random() % (size - from);
+
+					if (len > size - pos)
+						len = size - pos;
+					memmove(&mutant[pos], &mutant[from], len);
+				}
+				break;
+		}
+	}
+
+	return size;
+}
+
+static void run(const uint8_t *data, size_t size)
+{
+	/* A copy of the exact size, so ASan sees reads past the end. */
+	uint8_t *copy = (uint8_t *)malloc(size ? size : 1);
+
+	if (copy == NULL)
+		abort();
+	memcpy(copy, data, size);
+	LLVMFuzzerTestOneInput(copy, size);
+	free(copy);
+	runs++;
+}
+
+static int run_file(const char *path, long mutations)
+{
+	FILE *f = fopen(path, "rb");
+	size_t size;
+
+	if (f == NULL) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return -1;
+	}
+	size = fread(input, 1, sizeof(input), f);
+	fclose(f);
+
+	run(input, size);
+	for (long i = 0; i < mutations; i++)
+		run(mutant, mutate(input, size));
+
+	return 0;
+}
+
+static int run_path(const char *path, long mutations)
+{
+	char file[4096];
+	struct dirent *e;
+	struct stat st;
+	DIR *dir;
+	int ret = 0;
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return run_file(path, mutations);
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+	while ((e = readdir(dir)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+		if (run_file(file, mutations) < 0)
+			ret = -1;
+	}
+	closedir(dir);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	long mutations = 0;
+	int i = 1, ret = 0;
+
+	LLVMFuzzerInitialize(&argc, &argv);
+
+	if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+		mutations = atol(argv[2]);
+		i = 3;
+	}
+	if (i == argc) {
+		run(input, fread(input, 1, sizeof(input), stdin));
+		return 0;
+	}
+
+	for (; i < argc; i++) {
+		if (run_path(argv[i], mutations) < 0)
+			ret = 1;
+	}
+	fprintf(stderr, "%s: %ld inputs\n", argv[0], runs);
+
+	return ret;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file fuzz.h
+ * @brief Declarations shared by the fuzzing harnesses.
+ *
+ * Each harness defines LLVMFuzzerTestOneInput. Built with
+ * -fsanitize=fuzzer it is driven by libFuzzer, otherwise driver.c runs it
+ * over files, for AFL or the corpus check of the Makefile. A failed
+ * FUZZ_CHECK aborts, so every driver reports the input.
+ */
+
+#ifndef _FUZZ_H_
+#define _FUZZ_H_
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+
+#include "../mqtt_prot.h"
+
+/* Topics compressed with the dictionary of fuzz_dictionary. */
+#define FUZZ_DICT_FILTER "fuzz/dict/#"
+#define FUZZ_DICT_TOPIC "fuzz/dict/a"
+
+/* Abort on a broken property, the input is kept by the driver. */
+#define FUZZ_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s(%d): check failed: %s\n", __FILE__, \
+                    __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+/**
+ * @brief Run one input.
+ * @param data Input bytes.
+ * @param size Input length.
+ * @return 0.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/**
+ * @brief Called once before the first input, silences debug traces.
+ * @param argc Unused.
+ * @param argv Unused.
+ * @return 0.
+ */
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+
+/**
+ * @brief Compare two decoded property lists.
+ * @param a Properties.
+ * @param b Properties.
+ * @return 1 if the same properties have the same values, otherwise 0.
+ */
+int fuzz_props_equal(const mqtt_prot_properties *a,
+                        const mqtt_prot_properties *b);
+
+/**
+ * @brief Get the dictionary registered on FUZZ_DICT_FILTER.
+ * @param len Receives its length.
+ * @return Dictionary bytes.
+ */
+const uint8_t *fuzz_dictionary(size_t *len);
+
+#endif /* _FUZZ_H_ */
@@ -0,0 +1,114 @@
+/**
+ * @file fuzz_aggregate.c
+ * @brief Packed payload unpacking, and the aggregation round trip.
+ *
+ * The input is unpacked as a received payload. It is also split into
+ * messages, each behind one byte: bits 0 to 5 the length, times 16 if bit 6
+ * is set, bit 7 QoS 1 instead of 0. The messages go through an aggregator
+ * and the packed payloads it sends must unpack to them, in order.
+ */
+
+#include "string.h"
+
+#include "fuzz.h"
+#include "../mqtt_aggregate.h"
+
+#define AGGREGATE_TOPIC "fuzz/aggregate"
+#define AGGREGATE_BYTES 512
+#define AGGREGATE_MSGS_MAX 4096
+
+typedef struct {
+	const uint8_t *msgs[AGGREGATE_MSGS_MAX];
+	int lens[AGGREGATE_MSGS_MAX];
+	int added;
+	int sent;
+} aggregate_expected;
+
+static void unpack(const uint8_t *payload, int payload_len)
+{
+	const uint8_t *msg;
+	int pos, msg_len, ret;
+
+	pos = mqtt_aggregate_packed(payload, payload_len) ?
+			MQTT_AGGREGATE_HEADER : 0;
+	while ((ret = mqtt_aggregate_next(payload, payload_len, &pos, &msg,
+										&msg_len)) == 1) {
+		FUZZ_CHECK(msg >= payload && msg_len >= 0 &&
+					msg + msg_len <= payload + payload_len);
+		FUZZ_CHECK(pos <= payload_len);
+	}
+	FUZZ_CHECK(ret == 0 || ret == -1);
+}
+
+static int check_sent(void *ctx, const char *topic, uint8_t flags,
+						const uint8_t *payload, int payload_len)
+{
+	aggregate_expected *e = (aggregate_expected *)ctx;
+	const uint8_t *msg;
+	int pos = MQTT_AGGREGATE_HEADER, msg_len;
+
+	(void)flags;
+	FUZZ_CHECK(strcmp(topic, AGGREGATE_TOPIC) == 0);
+	FUZZ_CHECK(payload_len <= AGGREGATE_BYTES);
+	FUZZ_CHECK(mqtt_aggregate_packed(payload, payload_len));
+	while (mqtt_aggregate_next(payload, payload_len, &pos, &msg,
+								&msg_len) == 1) {
+		FUZZ_CHECK(e->sent < e->added);
+		FUZZ_CHECK(msg_len == e->lens[e->sent] &&
+					memcmp(msg, e->msgs[e->sent], msg_len) == 0);
+		e->sent++;
+	}
+	FUZZ_CHECK(pos == payload_len);
+
+	return 0;
+}
+
+static void round_trip(const uint8_t *data, size_t size)
+{
+	static aggregate_expected e;
+	mqtt_aggregator *a;
+	size_t i = 0;
+	uint8_t flags;
+	int len, ret;
+
+	a = mqtt_aggregator_create(1, AGGREGATE_BYTES, 100);
+	FUZZ_CHECK(a != NULL);
+	e.added = 0;
+	e.sent = 0;
+	while (i < size && e.added < AGGREGATE_MSGS_MAX) {
+		len = (data[i] & 0x3F) * ((data[i] & 0x40) ? 16 : 1);
+		flags = (data[i] & 0x80) ? 0x02 : 0x00;
+		i++;
+		if ((size_t)len > size - i)
+			len = (int)(size - i);
+
+		/* Counted before, a full slot is sent with the message in it. */
+		e.msgs[e.added] = &data[i];
+		e.lens[e.added] = len;
+		e.added++;
+		ret = mqtt_aggregator_add(a, AGGREGATE_TOPIC, flags, &data[i], len,
+									(long)i, check_sent, &e);
+		FUZZ_CHECK(ret == 0 || ret == 1);
+		if (ret == 0) {
+			/* Published on its own, after every message added before. */
+			e.added--;
+			FUZZ_CHECK(e.sent == e.added);
+		}
+		i += len;
+	}
+	FUZZ_CHECK(mqtt_aggregator_flush(a, 0, check_sent, &e) == 0);
+	FUZZ_CHECK(e.sent == e.added);
+	FUZZ_CHECK(mqtt_aggregator_deadline(a) == -1);
+	mqtt_aggregator_destroy(a);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size > INT32_MAX)
+		return 0;
+
+	unpack(data, (int)size);
+	round_trip(data, size);
+
+	return 0;
+}
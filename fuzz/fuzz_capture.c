@@ -0,0 +1,79 @@
+/**
+ * @file fuzz_capture.c
+ * @brief Capture file reader, and the decoding of each record as
+ * mqtt_replay does.
+ */
+
+#define _GNU_SOURCE
+
+#include "string.h"
+#include "unistd.h"
+#include "sys/mman.h"
+
+#include "fuzz.h"
+#include "../mqtt_capture.h"
+
+/* Records read at most, a corrupted file may hold many empty ones. */
+#define CAPTURE_RECORDS_MAX 100000
+
+static void decode_record(const mqtt_capture_record *rec,
+							const uint8_t *packet)
+{
+	mqtt_prot_publish_msg pub;
+	uint8_t *copy;
+	uint16_t id;
+
+	if (rec->len == 0)
+		return;
+
+	/* The mapping goes on after the packet, ASan checks a copy. */
+	copy = (uint8_t *)malloc(rec->len);
+	FUZZ_CHECK(copy != NULL);
+	memcpy(copy, packet, rec->len);
+
+	switch (copy[0] >> 4) {
+		case MQTT_PROT_PUBLISH:
+			if (mqtt_prot_publish_decode(rec->version, copy, (int)rec->len,
+											&pub) == 0)
+				FUZZ_CHECK(pub.payload + pub.payload_len <= copy + rec->len);
+			break;
+		case MQTT_PROT_PUBACK:
+			mqtt_prot_puback(rec->version, copy, (int)rec->len, &id);
+			break;
+		default:
+			mqtt_prot_packet_len(copy, (int)rec->len);
+			break;
+	}
+	free(copy);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	mqtt_capture_reader *r;
+	mqtt_capture_record rec;
+	const uint8_t *packet;
+	char path[64];
+	int fd, n = 0;
+
+	fd = memfd_create("fuzz_capture", MFD_CLOEXEC);
+	FUZZ_CHECK(fd >= 0);
+	FUZZ_CHECK(write(fd, data, size) == (ssize_t)size);
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	r = mqtt_capture_open(path);
+	close(fd);
+	if (r == NULL)
+		return 0;
+
+	for (int pass = 0; pass < 2; pass++) {
+		while (n < CAPTURE_RECORDS_MAX &&
+				mqtt_capture_next(r, &rec, &packet) == 1) {
+			decode_record(&rec, packet);
+			n++;
+		}
+		mqtt_capture_rewind(r);
+	}
+	mqtt_capture_close(r);
+
+	return 0;
+}
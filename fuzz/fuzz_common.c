@@ -0,0 +1,60 @@
+/**
+ * @file fuzz_common.c
+ * @brief Helpers shared by the fuzzing harnesses.
+ */
+
+#include "string.h"
+
+#include "fuzz.h"
+
+static const char dictionary[] =
+	"{\"sensor\":\"temperature\",\"unit\":\"celsius\",\"value\":"
+	"{\"sensor\":\"humidity\",\"unit\":\"percent\",\"value\":"
+	"\"timestamp\":\"2024-01-01T00:00:00Z\",\"status\":\"ok\"}";
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	(void)argc;
+	(void)argv;
+
+	/* mqtt_prot.c prints a trace on each call. */
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		abort();
+
+	return 0;
+}
+
+static int same_string(const uint8_t *a, uint16_t a_len, const uint8_t *b,
+						uint16_t b_len)
+{
+	return a_len == b_len && (a_len == 0 || memcmp(a, b, a_len) == 0);
+}
+
+int fuzz_props_equal(const mqtt_prot_properties *a,
+						const mqtt_prot_properties *b)
+{
+	return a->present == b->present &&
+			a->payload_format == b->payload_format &&
+			a->message_expiry == b->message_expiry &&
+			a->session_expiry == b->session_expiry &&
+			a->subscription_id == b->subscription_id &&
+			a->server_keepalive == b->server_keepalive &&
+			a->receive_max == b->receive_max &&
+			a->topic_alias_max == b->topic_alias_max &&
+			a->topic_alias == b->topic_alias &&
+			a->max_qos == b->max_qos &&
+			a->retain_available == b->retain_available &&
+			a->max_packet_size == b->max_packet_size &&
+			same_string(a->content_type, a->content_type_len,
+						b->content_type, b->content_type_len) &&
+			same_string(a->assigned_client_id, a->assigned_client_id_len,
+						b->assigned_client_id, b->assigned_client_id_len) &&
+			same_string(a->reason_string, a->reason_string_len,
+						b->reason_string, b->reason_string_len);
+}
+
+const uint8_t *fuzz_dictionary(size_t *len)
+{
+	*len = sizeof(dictionary) - 1;
+	return (const uint8_t *)dictionary;
+}
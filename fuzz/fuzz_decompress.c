@@ -0,0 +1,108 @@
+/**
+ * @file fuzz_decompress.c
+ * @brief Payload decompression, and the compression round trip: the input
+ * compressed by each algorithm and level, with and without a dictionary,
+ * decompresses to itself.
+ */
+
+#include "string.h"
+
+#include "fuzz.h"
+#include "../mqtt_compress.h"
+
+/* Largest payload decompressed. */
+#define DECOMPRESS_MAX (1024 * 1024)
+
+typedef struct {
+	mqtt_compress_algo algo;
+	int level;
+} compress_setting;
+
+static const compress_setting settings[] = {
+	{ MQTT_COMPRESS_LZ4, 0 },
+	{ MQTT_COMPRESS_LZ4, -8 },
+	{ MQTT_COMPRESS_LZ4, 9 },
+	{ MQTT_COMPRESS_ZSTD, 0 },
+	{ MQTT_COMPRESS_ZSTD, -5 },
+	{ MQTT_COMPRESS_ZSTD, 9 },
+};
+
+#define SETTINGS_LEN (sizeof(settings) / sizeof(settings[0]))
+
+static mqtt_compressor *decompressor;
+/* NULL for algorithms not built in. */
+static mqtt_compressor *compressors[SETTINGS_LEN];
+static uint8_t out[DECOMPRESS_MAX];
+static uint8_t packed[MQTT_COMPRESS_HEADER_MAX + 2 * DECOMPRESS_MAX];
+
+static mqtt_compressor *compressor_new(mqtt_compress_algo algo, int level)
+{
+	mqtt_compressor *c = mqtt_compressor_create(algo, level);
+	const uint8_t *dict;
+	size_t dict_len;
+
+	if (c == NULL)
+		return NULL;
+	dict = fuzz_dictionary(&dict_len);
+	FUZZ_CHECK(mqtt_compressor_add_dictionary(c, FUZZ_DICT_FILTER, dict,
+												dict_len) == 0);
+	return c;
+}
+
+static void setup(void)
+{
+	if (decompressor != NULL)
+		return;
+
+	decompressor = compressor_new(MQTT_COMPRESS_NONE, 0);
+	FUZZ_CHECK(decompressor != NULL);
+	for (size_t i = 0; i < SETTINGS_LEN; i++)
+		compressors[i] = compressor_new(settings[i].algo, settings[i].level);
+}
+
+static void round_trip(mqtt_compressor *c, const char *topic,
+						const uint8_t *data, size_t size)
+{
+	int n;
+
+	FUZZ_CHECK(mqtt_compress_bound(c, size) <= sizeof(packed));
+	n = mqtt_compress(c, topic, data, size, packed,
+						mqtt_compress_bound(c, size));
+	FUZZ_CHECK(n >= 0);
+	if (n == 0)
+		return;
+
+	FUZZ_CHECK((size_t)n < size);
+	FUZZ_CHECK(mqtt_compressed_len(packed, n) == (int)size);
+	FUZZ_CHECK(!mqtt_compress_escaped(packed, n));
+	FUZZ_CHECK(mqtt_decompress(decompressor, packed, n, out,
+								sizeof(out)) == (int)size);
+	FUZZ_CHECK(memcmp(out, data, size) == 0);
+	if (size > 0)
+		FUZZ_CHECK(mqtt_decompress(decompressor, packed, n, out,
+									size - 1) == -1);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	int len, n;
+
+	setup();
+
+	len = mqtt_compressed_len(data, size);
+	n = mqtt_decompress(decompressor, data, size, out, sizeof(out));
+	FUZZ_CHECK(n == -1 || (len >= 0 && n == len));
+	if (len > DECOMPRESS_MAX)
+		FUZZ_CHECK(n == -1);
+
+	if (size > DECOMPRESS_MAX)
+		return 0;
+	for (size_t i = 0; i < SETTINGS_LEN; i++) {
+		if (compressors[i] == NULL)
+			continue;
+		round_trip(compressors[i], "fuzz/plain", data, size);
+		round_trip(compressors[i], FUZZ_DICT_TOPIC, data, size);
+	}
+
+	return 0;
+}
@@ -0,0 +1,32 @@
+/**
+ * @file fuzz_properties.c
+ * @brief MQTT 5 properties parser, and its round trip: properties decoded
+ * then encoded decode to the same values.
+ */
+
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	mqtt_prot_properties props, again;
+	uint8_t *out;
+	int n, len;
+
+	n = mqtt_prot_properties_decode(data, (int)size, &props);
+	if (n < 0)
+		return 0;
+	FUZZ_CHECK(n > 0 && (size_t)n <= size);
+
+	len = mqtt_prot_properties_encode(&props, NULL, 0);
+	FUZZ_CHECK(len > 0 && len <= n);
+	out = (uint8_t *)malloc(len);
+	FUZZ_CHECK(out != NULL);
+	FUZZ_CHECK(mqtt_prot_properties_encode(&props, out, len - 1) == -1);
+	FUZZ_CHECK(mqtt_prot_properties_encode(&props, out, len) == len);
+
+	FUZZ_CHECK(mqtt_prot_properties_decode(out, len, &again) == len);
+	FUZZ_CHECK(fuzz_props_equal(&props, &again));
+	free(out);
+
+	return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file fuzz_prot.c
+ * @brief Decoders of received packets. The first input byte selects the
+ * protocol version, bit 0 set for MQTT v5, the packet follows.
+ *
+ * Decoded PUBLISH packets and publish responses are encoded again and the
+ * result decoded, which must give the same fields.
+ */
+
+#include "string.h"
+
+#include "fuzz.h"
+
+static const uint8_t resp_types[] = { MQTT_PROT_PUBACK, MQTT_PROT_PUBREC,
+										MQTT_PROT_PUBREL, MQTT_PROT_PUBCOMP };
+
+static void publish_round_trip(uint8_t version, const uint8_t *msg, int len)
+{
+	mqtt_prot_publish_msg pub, again;
+	uint8_t *out;
+	int out_len;
+
+	if (mqtt_prot_publish_decode(version, msg, len, &pub) < 0)
+		return;
+	FUZZ_CHECK(pub.payload >= msg &&
+				pub.payload + pub.payload_len <= msg + len);
+	FUZZ_CHECK(pub.topic_len == 0 || ((const uint8_t *)pub.topic >= msg &&
+				(const uint8_t *)pub.topic + pub.topic_len <= pub.payload));
+
+	out_len = mqtt_prot_publish(NULL, 0, version, pub.flags, pub.packet_id,
+								pub.topic, pub.topic_len, &pub.props,
+								pub.payload, pub.payload_len);
+	FUZZ_CHECK(out_len > 0 && out_len <= len);
+	out = (uint8_t *)malloc(out_len);
+	FUZZ_CHECK(out != NULL);
+	FUZZ_CHECK(mqtt_prot_publish(out, out_len - 1, version, pub.flags,
+									pub.packet_id, pub.topic, pub.topic_len,
+									&pub.props, pub.payload,
+									pub.payload_len) == -1);
+	FUZZ_CHECK(mqtt_prot_publish(out, out_len, version, pub.flags,
+									pub.packet_id, pub.topic, pub.topic_len,
+									&pub.props, pub.payload,
+									pub.payload_len) == out_len);
+	FUZZ_CHECK(mqtt_prot_packet_len(out, out_len) == out_len);
+
+	FUZZ_CHECK(mqtt_prot_publish_decode(version, out, out_len, &again) == 0);
+	FUZZ_CHECK(again.flags == pub.flags);
+	FUZZ_CHECK(again.packet_id == pub.packet_id);
+	FUZZ_CHECK(again.topic_len == pub.topic_len &&
+				memcmp(again.topic, pub.topic, pub.topic_len) == 0);
+	FUZZ_CHECK(again.payload_len == pub.payload_len &&
+				memcmp(again.payload, pub.payload, pub.payload_len) == 0);
+	FUZZ_CHECK(fuzz_props_equal(&again.props, &pub.props));
+	free(out);
+}
+
+static void pubresp_round_trip(uint8_t version, uint8_t type,
+								const uint8_t *msg, int len)
+{
+	uint16_t id, again_id;
+	uint8_t out[5];
+	int reason, out_len;
+
+	reason = mqtt_prot_pubresp_decode(version, type, msg, len, &id);
+	if (reason < 0)
+		return;
+	FUZZ_CHECK(reason <= 0xFF);
+
+	out_len = mqtt_prot_pubresp(out, sizeof(out), version, type, id,
+								(uint8_t)reason);
+	FUZZ_CHECK(out_len == 4 || out_len == 5);
+	FUZZ_CHECK(mqtt_prot_pubresp_decode(version, type, out, out_len,
+										&again_id) == reason);
+	FUZZ_CHECK(again_id == id);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	mqtt_prot_properties props;
+	uint8_t codes[64];
+	uint16_t id;
+	uint8_t version;
+	const uint8_t *msg;
+	int len, n;
+
+	if (size < 1)
+		return 0;
+	version = (data[0] & 1) ? MQTT_PROT_VERSION_5 : MQTT_PROT_VERSION_3_1_1;
+	msg = &data[1];
+	len = (int)(size - 1);
+
+	n = mqtt_prot_packet_len(msg, len);
+	FUZZ_CHECK(n >= -1);
+
+	n = mqtt_prot_connack(version, msg, len, &props);
+	FUZZ_CHECK(n >= -1 && n <= 0xFF);
+
+	n = mqtt_prot_suback(version, msg, len, &id, codes, sizeof(codes));
+	FUZZ_CHECK(n >= -1 && n < len);
+	n = mqtt_prot_suback(version, msg, len, NULL, NULL, 0);
+	FUZZ_CHECK(n >= -1 && n < len);
+	n = mqtt_prot_unsuback(version, msg, len, &id, codes, sizeof(codes));
+	FUZZ_CHECK(n >= -1 && n < len);
+
+	n = mqtt_prot_puback(version, msg, len, &id);
+	FUZZ_CHECK(n == 0 || n == -1);
+	for (size_t i = 0; i < sizeof(resp_types); i++)
+		pubresp_round_trip(version, resp_types[i], msg, len);
+
+	publish_round_trip(version, msg, len);
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file fuzz_validate.c
+ * @brief Differential check of the validators: the SIMD versions of this
+ * build, SSE2, SSSE3 with -mssse3 or AVX2 with -mavx2, and the portable
+ * scalar ones of validate_scalar.c against the byte by byte reference of
+ * validate_ref.c, which shares no code with them. The input is checked whole
+ * and from each of the first bytes, so every alignment and tail length is
+ * covered.
+ */
+
+#include "string.h"
+
+#include "fuzz.h"
+#include "../mqtt_validate.h"
+
+int scalar_valid_utf8(const char *str, size_t len);
+int scalar_valid_topic_name(const char *topic, size_t len);
+int scalar_valid_topic_filter(const char *filter, size_t len);
+int scalar_valid_clientID(const char *clientID, size_t len);
+int ref_valid_utf8(const char *str, size_t len);
+int ref_valid_topic_name(const char *topic, size_t len);
+int ref_valid_topic_filter(const char *filter, size_t len);
+int ref_valid_clientID(const char *clientID, size_t len);
+
+/* Start offsets checked. */
+#define VALIDATE_SHIFTS 33
+
+static void compare(const char *s, size_t len)
+{
+	int utf8 = ref_valid_utf8(s, len);
+	int name = ref_valid_topic_name(s, len);
+	int filter = ref_valid_topic_filter(s, len);
+	int id = ref_valid_clientID(s, len);
+
+	FUZZ_CHECK(mqtt_valid_utf8(s, len) == utf8);
+	FUZZ_CHECK(scalar_valid_utf8(s, len) == utf8);
+	FUZZ_CHECK(mqtt_valid_topic_name(s, len) == name);
+	FUZZ_CHECK(scalar_valid_topic_name(s, len) == name);
+	FUZZ_CHECK(mqtt_valid_topic_filter(s, len) == filter);
+	FUZZ_CHECK(scalar_valid_topic_filter(s, len) == filter);
+	FUZZ_CHECK(mqtt_valid_clientID(s, len) == id);
+	FUZZ_CHECK(scalar_valid_clientID(s, len) == id);
+
+	/* A topic name is a valid filter, and valid UTF-8. */
+	if (mqtt_valid_topic_name(s, len) == 0) {
+		FUZZ_CHECK(mqtt_valid_topic_filter(s, len) == 0);
+		FUZZ_CHECK(mqtt_valid_utf8(s, len) == 0);
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const char *s = (const char *)data;
+
+	for (size_t i = 0; i < VALIDATE_SHIFTS && i <= size; i++)
+		compare(&s[i], size - i);
+
+	return 0;
+}
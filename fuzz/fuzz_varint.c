@@ -0,0 +1,35 @@
+/**
+ * @file fuzz_varint.c
+ * @brief Variable Byte Integer decoder, and its round trip through the
+ * encoder.
+ */
+
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	uint8_t out[4];
+	uint32_t value, again;
+	int n, m;
+
+	n = mqtt_prot_decode_varint(data, (int)size, &value);
+	FUZZ_CHECK(n >= -1 && n <= 4 && (n <= 0 || (size_t)n <= size));
+	/* 0 means more bytes are needed. */
+	FUZZ_CHECK(n != 0 || size < 4);
+	if (n <= 0)
+		return 0;
+
+	FUZZ_CHECK(value <= MQTT_PROT_VARINT_MAX);
+	m = mqtt_prot_encode_varint(value, NULL);
+	FUZZ_CHECK(m > 0 && m <= n);
+	FUZZ_CHECK(mqtt_prot_encode_varint(value, out) == m);
+	FUZZ_CHECK(mqtt_prot_decode_varint(out, m, &again) == m);
+	FUZZ_CHECK(again == value);
+	/* The encoding is the shortest, the decoder reads no further. */
+	FUZZ_CHECK(m == 1 || out[m - 1] != 0);
+	FUZZ_CHECK(mqtt_prot_decode_varint(out, m - 1, &again) == 0);
+
+	mqtt_prot_packet_len(data, (int)size);
+
+	return 0;
+}
@@ -0,0 +1,289 @@
+/**
+ * @file seeds.c
+ * @brief Writes a seed corpus for each harness, made with the library
+ * encoders so every input starts valid.
+ *
+ * $ ./seeds <directory>
+ * Creates <directory>/<harness>/ with one file per seed.
+ */
+
+#include "string.h"
+#include "errno.h"
+#include "sys/stat.h"
+
+#include "fuzz.h"
+#include "../mqtt_aggregate.h"
+#include "../mqtt_capture.h"
+#include "../mqtt_compress.h"
+
+static const char *root;
+static char dir[4096];
+static int seeds;
+
+static int open_dir(const char *harness)
+{
+	snprintf(dir, sizeof(dir), "%s/%s", root, harness);
+	if (mkdir(root, 0755) < 0 && errno != EEXIST)
+		return -1;
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+	seeds = 0;
+	return 0;
+}
+
+static int write_seed(const void *data, size_t len)
+{
+	char path[4200];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/seed_%03d", dir, seeds++);
+	f = fopen(path, "wb");
+	if (f == NULL)
+		return -1;
+	if (len > 0 && fwrite(data, 1, len, f) != len) {
+		fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
+
+static void sample_props(mqtt_prot_properties *props)
+{
+	memset(props, 0, sizeof(mqtt_prot_properties));
+	props->payload_format = 1;
+	props->message_expiry = 3600;
+	props->subscription_id = 16384;
+	props->topic_alias = 7;
+	props->content_type = (const uint8_t *)"application/json";
+	props->content_type_len = 16;
+	props->reason_string = (const uint8_t *)"ok";
+	props->reason_string_len = 2;
+	props->present = MQTT_PROT_PROP_BIT(MQTT_PROP_PAYLOAD_FORMAT) |
+					MQTT_PROT_PROP_BIT(MQTT_PROP_MESSAGE_EXPIRY) |
+					MQTT_PROT_PROP_BIT(MQTT_PROP_SUBSCRIPTION_ID) |
+					MQTT_PROT_PROP_BIT(MQTT_PROP_TOPIC_ALIAS) |
+					MQTT_PROT_PROP_BIT(MQTT_PROP_CONTENT_TYPE) |
+					MQTT_PROT_PROP_BIT(MQTT_PROP_REASON_STRING);
+}
+
+static int varint_seeds(void)
+{
+	const uint32_t values[] = { 0, 1, 127, 128, 16383, 16384, 2097151,
+								2097152, MQTT_PROT_VARINT_MAX };
+	const uint8_t too_long[] = { 0x80, 0x80, 0x80, 0x80, 0x01 };
+	uint8_t out[4];
+	int ret = 0;
+
+	if (open_dir("fuzz_varint") < 0)
+		return -1;
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+		ret |= write_seed(out, mqtt_prot_encode_varint(values[i], out));
+	ret |= write_seed(too_long, sizeof(too_long));
+
+	return ret;
+}
+
+static int properties_seeds(void)
+{
+	mqtt_prot_properties props;
+	uint8_t out[256];
+	int ret;
+
+	if (open_dir("fuzz_properties") < 0)
+		return -1;
+	sample_props(&props);
+	ret = write_seed(out, mqtt_prot_properties_encode(&props, out,
+														sizeof(out)));
+	ret |= write_seed(out, mqtt_prot_properties_encode(NULL, out,
+														sizeof(out)));
+
+	return ret;
+}
+
+/* The version byte fuzz_prot.c expects, then the packet. */
+static int prot_seed(uint8_t version, const uint8_t *packet, int len)
+{
+	uint8_t seed[512];
+
+	if (len < 0 || len + 1 > (int)sizeof(seed))
+		return -1;
+	seed[0] = (version == MQTT_PROT_VERSION_5) ? 1 : 0;
+	memcpy(&seed[1], packet, len);
+	return write_seed(seed, len + 1);
+}
+
+static int prot_seeds(void)
+{
+	const uint8_t versions[] = { MQTT_PROT_VERSION_3_1_1, MQTT_PROT_VERSION_5 };
+	const uint8_t connack[] = { 0x20, 0x03, 0x00, 0x00, 0x00 };
+	const uint8_t suback[] = { 0x90, 0x06, 0x00, 0x01, 0x00, 0x00, 0x01,
+								0x80 };
+	const uint8_t unsuback[] = { 0xB0, 0x04, 0x00, 0x01, 0x00, 0x11 };
+	const uint8_t resp_types[] = { MQTT_PROT_PUBACK, MQTT_PROT_PUBREC,
+									MQTT_PROT_PUBREL, MQTT_PROT_PUBCOMP };
+	mqtt_prot_properties props;
+	uint8_t out[512];
+	int ret = 0, len;
+
+	if (open_dir("fuzz_prot") < 0)
+		return -1;
+	sample_props(&props);
+	for (int v = 0; v < 2; v++) {
+		for (uint8_t qos = 0; qos < 3; qos++) {
+			len = mqtt_prot_publish(out, sizeof(out), versions[v],
+									(qos << 1) | (qos == 1 ? 0x01 : 0x00),
+									qos ? 0x1234 : 0, "sensors/temperature",
+									19, &props, (const uint8_t *)"21.5", 4);
+			ret |= prot_seed(versions[v], out, len);
+		}
+		for (size_t t = 0; t < sizeof(resp_types); t++) {
+			len = mqtt_prot_pubresp(out, sizeof(out), versions[v],
+									resp_types[t], 0x1234, 0x10);
+			ret |= prot_seed(versions[v], out, len);
+		}
+		ret |= prot_seed(versions[v], suback, sizeof(suback));
+		ret |= prot_seed(versions[v], unsuback, sizeof(unsuback));
+	}
+	ret |= prot_seed(MQTT_PROT_VERSION_3_1_1, connack, 4);
+	ret |= prot_seed(MQTT_PROT_VERSION_5, connack, sizeof(connack));
+
+	return ret;
+}
+
+static int decompress_seeds(void)
+{
+	const mqtt_compress_algo algos[] = { MQTT_COMPRESS_LZ4,
+											MQTT_COMPRESS_ZSTD };
+	const char *topics[] = { "fuzz/plain", FUZZ_DICT_TOPIC };
+	const uint8_t escaped[] = { MQTT_COMPRESS_MARKER, MQTT_COMPRESS_ESCAPE,
+								0xFF, 0x01 };
+	uint8_t payload[1024], out[2048];
+	const uint8_t *dict;
+	mqtt_compressor *c;
+	size_t dict_len;
+	int ret = 0, len;
+
+	if (open_dir("fuzz_decompress") < 0)
+		return -1;
+	dict = fuzz_dictionary(&dict_len);
+	for (size_t i = 0; i < sizeof(payload); i++)
+		payload[i] = dict[i % 64];
+	for (size_t a = 0; a < sizeof(algos) / sizeof(algos[0]); a++) {
+		c = mqtt_compressor_create(algos[a], 0);
+		if (c == NULL)
+			continue;
+		mqtt_compressor_add_dictionary(c, FUZZ_DICT_FILTER, dict, dict_len);
+		for (int t = 0; t < 2; t++) {
+			len = mqtt_compress(c, topics[t], payload, sizeof(payload), out,
+								sizeof(out));
+			if (len > 0)
+				ret |= write_seed(out, len);
+		}
+		mqtt_compressor_destroy(c);
+	}
+	ret |= write_seed(escaped, sizeof(escaped));
+	ret |= write_seed(payload, 100);
+
+	return ret;
+}
+
+static int save_packed(void *ctx, const char *topic, uint8_t flags,
+						const uint8_t *payload, int payload_len)
+{
+	(void)ctx;
+	(void)topic;
+	(void)flags;
+	return write_seed(payload, payload_len);
+}
+
+static int aggregate_seeds(void)
+{
+	/* Messages behind their length byte, as fuzz_aggregate.c splits. */
+	const uint8_t split[] = { 0x03, 'a', 'b', 'c', 0x00, 0x82, 'd', 'e',
+								0x41, 'f' };
+	mqtt_aggregator *a;
+	int ret;
+
+	if (open_dir("fuzz_aggregate") < 0)
+		return -1;
+	a = mqtt_aggregator_create(1, 512, 100);
+	if (a == NULL)
+		return -1;
+	ret = 0;
+	if (mqtt_aggregator_add(a, "t", 0, (const uint8_t *)"first", 5, 0,
+							save_packed, NULL) < 0 ||
+		mqtt_aggregator_add(a, "t", 0, (const uint8_t *)"", 0, 0,
+							save_packed, NULL) < 0 ||
+		mqtt_aggregator_add(a, "t", 0, (const uint8_t *)"third", 5, 0,
+							save_packed, NULL) < 0 ||
+		mqtt_aggregator_flush(a, 0, save_packed, NULL) < 0)
+		ret = -1;
+	mqtt_aggregator_destroy(a);
+	ret |= write_seed(split, sizeof(split));
+
+	return ret;
+}
+
+static int capture_seeds(void)
+{
+	const uint8_t puback[] = { 0x40, 0x02, 0x12, 0x34 };
+	uint8_t out[256];
+	char path[4200];
+	int len;
+
+	if (open_dir("fuzz_capture") < 0)
+		return -1;
+	snprintf(path, sizeof(path), "%s/seed_000", dir);
+	if (mqtt_capture_start(path) < 0)
+		return -1;
+	len = mqtt_prot_publish(out, sizeof(out), MQTT_PROT_VERSION_3_1_1, 0x02,
+							0x1234, "a/b", 3, NULL, (const uint8_t *)"hello",
+							5);
+	mqtt_capture_packet(3, MQTT_PROT_VERSION_3_1_1, MQTT_CAPTURE_OUT, out,
+						len);
+	mqtt_capture_packet(3, MQTT_PROT_VERSION_3_1_1, MQTT_CAPTURE_IN, puback,
+						sizeof(puback));
+	len = mqtt_prot_publish(out, sizeof(out), MQTT_PROT_VERSION_5, 0x00, 0,
+							"a/c", 3, NULL, (const uint8_t *)"v5", 2);
+	mqtt_capture_packet(4, MQTT_PROT_VERSION_5, MQTT_CAPTURE_OUT, out, len);
+	mqtt_capture_stop();
+
+	return 0;
+}
+
+static int validate_seeds(void)
+{
+	const char *strings[] = {
+		"sensors/temperature", "a/+/c", "sport/tennis/#", "#", "+", "a/#/b",
+		"a+/b", "$SYS/broker", "client42", "caf\xC3\xA9/\xE2\x82\xAC",
+		"\xF0\x9F\x98\x80/emoji", "bad\xC0\xAF", "surrogate\xED\xA0\x80",
+		"a/very/long/topic/crossing/several/simd/blocks/of/sixteen/bytes/+",
+	};
+	int ret = 0;
+
+	if (open_dir("fuzz_validate") < 0)
+		return -1;
+	for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++)
+		ret |= write_seed(strings[i], strlen(strings[i]));
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <directory>\n", argv[0]);
+		return 1;
+	}
+	root = argv[1];
+	LLVMFuzzerInitialize(&argc, &argv);
+
+	if (varint_seeds() < 0 || properties_seeds() < 0 || prot_seeds() < 0 ||
+		decompress_seeds() < 0 || aggregate_seeds() < 0 ||
+		capture_seeds() < 0 || validate_seeds() < 0) {
+		fprintf(stderr, "Couldn't write the seeds in %s\n", root);
+		return 1;
+	}
+
+	return 0;
+}
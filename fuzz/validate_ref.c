@@ -0,0 +1,121 @@
+/**
+ * @file validate_ref.c
+ * @brief Reference validators of fuzz_validate.c, written apart from
+ * mqtt_validate.c: code points are decoded one byte at a time and checked
+ * against their ranges, wildcards against the bytes around them.
+ */
+
+#include "stdint.h"
+
+#include "../mqtt_validate.h"
+
+/*
+ * Decodes the code point starting at s[*i] and moves *i past it. Returns it
+ * or -1 if the sequence is cut, is not followed by continuation bytes or
+ * starts with one.
+ */
+static long ref_decode(const uint8_t *s, size_t len, size_t *i)
+{
+	uint8_t b = s[*i];
+	size_t n;
+	long cp;
+
+	if (b < 0x80) {
+		n = 1;
+		cp = b;
+	} else if ((b & 0xE0) == 0xC0) {
+		n = 2;
+		cp = b & 0x1F;
+	} else if ((b & 0xF0) == 0xE0) {
+		n = 3;
+		cp = b & 0x0F;
+	} else if ((b & 0xF8) == 0xF0) {
+		n = 4;
+		cp = b & 0x07;
+	} else {
+		return -1;
+	}
+
+	if (len - *i < n)
+		return -1;
+	for (size_t k = 1; k < n; k++) {
+		if ((s[*i + k] & 0xC0) != 0x80)
+			return -1;
+		cp = (cp << 6) | (s[*i + k] & 0x3F);
+	}
+	*i += n;
+
+	return cp;
+}
+
+int ref_valid_utf8(const char *str, size_t len)
+{
+	/* Smallest code point needing a sequence of n bytes. */
+	static const long min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+	const uint8_t *s = (const uint8_t *)str;
+	size_t i = 0, start;
+	long cp;
+
+	if (len > MQTT_STRING_MAX_LEN)
+		return -1;
+
+	while (i < len) {
+		start = i;
+		cp = ref_decode(s, len, &i);
+		if (cp <= 0 || cp < min[i - start] || cp > 0x10FFFF ||
+			(cp >= 0xD800 && cp <= 0xDFFF))
+			return -1;
+	}
+
+	return 0;
+}
+
+int ref_valid_topic_name(const char *topic, size_t len)
+{
+	if (len == 0 || ref_valid_utf8(topic, len) < 0)
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		if (topic[i] == '+' || topic[i] == '#')
+			return -1;
+	}
+
+	return 0;
+}
+
+int ref_valid_topic_filter(const char *filter, size_t len)
+{
+	int alone;
+
+	if (len == 0 || ref_valid_utf8(filter, len) < 0)
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		if (filter[i] != '+' && filter[i] != '#')
+			continue;
+		/* Both take a whole level, '#' only the last one. */
+		alone = (i == 0 || filter[i - 1] == '/') &&
+				(i + 1 == len || filter[i + 1] == '/');
+		if (!alone || (filter[i] == '#' && i + 1 != len))
+			return -1;
+	}
+
+	return 0;
+}
+
+int ref_valid_clientID(const char *clientID, size_t len)
+{
+	char c;
+
+	if (len > MQTT_STRING_MAX_LEN)
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		c = clientID[i];
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+				(c >= 'A' && c <= 'Z')))
+			return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+/**
+ * @file validate_scalar.c
+ * @brief The portable validators of mqtt_validate.c, built without SSE2,
+ * SSSE3 and AVX2 under other names, checked by fuzz_validate.c too.
+ */
+
+#undef __AVX2__
+#undef __SSSE3__
+#undef __SSE2__
+
+#define mqtt_valid_utf8 scalar_valid_utf8
+#define mqtt_valid_topic_name scalar_valid_topic_name
+#define mqtt_valid_topic_filter scalar_valid_topic_filter
+#define mqtt_valid_clientID scalar_valid_clientID
+#define mqtt_topic_match scalar_topic_match
+
+#include "../mqtt_validate.c"
@@ -5,8 +5,17 @@
 
 #include "mqtt.h"
 #include "mqtt_prot.h"
+#include "mqtt_alias.h"
 #include "network.h"
+#include "mqtt_validate.h"
+#include "mqtt_shm.h"
+#include "mqtt_capture.h"
+#include "mqtt_flow.h"
+#include "mqtt_aggregate.h"
 #include "unistd.h"
+#include "time.h"
+#include "errno.h"
+#include "sys/epoll.h"
 
 #if 0
 static const char *connack2str(mqtt_connack_err_codes err)
@@ -28,191 +37,2617 @@ static const char *connack2str(mqtt_connack_err_codes err)
 }
 #endif
 
-static int valid_clientID(const char *clientID)
+/*
+ * Asynchronous operation, one per packet waiting for acks. Operations live
+ * in a per connection open addressed pool indexed by packet identifier,
+ * packet identifiers whose slot is taken are skipped. A subscribe split into
+ * several packets is a group led by its first packet, whose slot is kept
+ * until every packet of the group was acknowledged.
+ */
+typedef struct {
+	uint16_t packet_id;
+	uint16_t first;
+	uint8_t type;
+	int pending;
+	int result;
+	int *results;
+	int nb_results;
+	/* Publish send time, for the round trip time of its ack. */
+	long sent_us;
+	mqtt_complete_callback callback;
+	void *user_data;
+} mqtt_async_op;
+
+/* Per connection state, found from the socket handler. */
+typedef struct {
+	int socket;
+	uint8_t version;
+	uint16_t keepalive;
+	uint16_t next_packet_id;
+	long last_send_ms;
+	mqtt_connection_limits limits;
+	mqtt_alias_table out_aliases;
+	mqtt_alias_table in_aliases;
+	mqtt_message_callback on_message;
+	void *user_data;
+	uint8_t *tx;
+	int tx_size;
+	uint8_t *rx;
+	int rx_size;
+	mqtt_compressor *compressor;
+	uint8_t *ztx;
+	int ztx_size;
+	uint8_t *zrx;
+	int zrx_size;
+	mqtt_cache *cache;
+	mqtt_shm *shm;
+	mqtt_flow flow;
+	mqtt_aggregator *aggregator;
+	mqtt_lanes *lanes;
+	char **priority_topics;
+	int priority_topics_len;
+	mqtt_async_op *ops;
+	int ops_len;
+	int ops_used;
+	uint8_t *codes;
+	int codes_size;
+	/* Memory given for the send queue, see mqtt_memory. */
+	uint8_t *lanes_mem;
+	int lanes_max;
+	int rx_len;
+	int rx_used;
+	/* Memory given by the caller, nothing is allocated or freed. */
+	int fixed;
+	/* Payloads starting with 0xFF are framed, see mqtt_set_framing. */
+	int framing;
+} mqtt_session;
+
+_Static_assert(sizeof(mqtt_session) <= MQTT_SESSION_BYTES,
+				"MQTT_SESSION_BYTES too small");
+_Static_assert(sizeof(mqtt_async_op) <= MQTT_ASYNC_OP_BYTES,
+				"MQTT_ASYNC_OP_BYTES too small");
+
+/* Parts of the memory given to a connection, see MQTT_MEMORY_SIZE. */
+typedef struct {
+	mqtt_session *session;
+	uint8_t *codes;
+	mqtt_async_op *ops;
+	int ops_len;
+	uint8_t *rx;
+	uint8_t *tx;
+	uint8_t *queue;
+	uint8_t *lanes;
+} memory_parts;
+
+#ifdef MQTT_STATIC_ALLOC
+static mqtt_session *sessions[MQTT_STATIC_SOCKETS];
+static const int sessions_len = MQTT_STATIC_SOCKETS;
+#else
+static mqtt_session **sessions;
+static int sessions_len;
+#endif
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+static mqtt_session *session_get(int mqtt_socket)
+{
+	if (mqtt_socket < 0 || mqtt_socket >= sessions_len)
+		return NULL;
+
+	return sessions[mqtt_socket];
+}
+
+static void session_free(mqtt_session *s)
+{
+	if (s == NULL)
+		return;
+
+	sessions[s->socket] = NULL;
+	if (s->fixed)
+		return;
+	mqtt_alias_free(&s->out_aliases);
+	mqtt_alias_free(&s->in_aliases);
+	mqtt_compressor_destroy(s->compressor);
+	mqtt_cache_destroy(s->cache);
+	mqtt_aggregator_destroy(s->aggregator);
+	mqtt_lanes_destroy(s->lanes);
+	for (int i = 0; i < s->priority_topics_len; i++)
+		free(s->priority_topics[i]);
+	free(s->priority_topics);
+	free(s->tx);
+	free(s->rx);
+	free(s->ztx);
+	free(s->zrx);
+	free(s->ops);
+	free(s->codes);
+	free(s);
+}
+
+/* Split the memory given to a connection, -1 if it is too small. */
+static int memory_layout(const mqtt_memory *m, memory_parts *parts)
+{
+	uint8_t *p;
+
+	size_t lanes_size = (m->send_queue_size > 0) ?
+						MQTT_LANES_SIZE(m->send_queue_size) : 0;
+
+	if (m->buf == NULL || m->rx_size <= 0 || m->tx_size <= 0 ||
+		m->inflight < 1 || m->queue_size < 0 || m->send_queue_size < 0 ||
+		m->size < MQTT_MEMORY_SIZE(m->rx_size, m->tx_size, m->inflight,
+									m->queue_size) + lanes_size) {
+		print_err("Connection memory too small for its sizes");
+		return -1;
+	}
+
+	/* The pool of in-flight operations is indexed by a mask and kept at most
+	 * half full. */
+	parts->ops_len = 2;
+	while (parts->ops_len * 2 <= 2 * m->inflight)
+		parts->ops_len *= 2;
+
+	p = (uint8_t *)MQTT_MEMORY_ALIGN((uintptr_t)m->buf);
+	parts->session = (mqtt_session *)p;
+	p += MQTT_SESSION_BYTES;
+	parts->codes = p;
+	p += MQTT_MEMORY_CODES;
+	parts->ops = (mqtt_async_op *)p;
+	p += MQTT_MEMORY_ALIGN(2 * (size_t)m->inflight * MQTT_ASYNC_OP_BYTES);
+	parts->rx = p;
+	p += MQTT_MEMORY_ALIGN(m->rx_size);
+	parts->tx = p;
+	p += MQTT_MEMORY_ALIGN(m->tx_size);
+	parts->queue = (m->queue_size > 0) ? p : NULL;
+	p += MQTT_MEMORY_ALIGN(m->queue_size);
+	parts->lanes = (lanes_size > 0) ? p : NULL;
+
+	return 0;
+}
+
+/* Set up a session in the memory given to its connection. */
+static mqtt_session *session_place(int mqtt_socket, const mqtt_memory *m)
+{
+	memory_parts parts;
+	mqtt_session *s;
+
+	if (memory_layout(m, &parts) < 0)
+		return NULL;
+
+	s = parts.session;
+	memset(s, 0, sizeof(mqtt_session));
+	memset(parts.ops, 0, parts.ops_len * sizeof(mqtt_async_op));
+	s->socket = mqtt_socket;
+	s->next_packet_id = 1;
+	s->fixed = 1;
+	s->codes = parts.codes;
+	s->codes_size = MQTT_MEMORY_CODES;
+	s->ops = parts.ops;
+	s->ops_len = parts.ops_len;
+	s->rx = parts.rx;
+	s->rx_size = m->rx_size;
+	s->tx = parts.tx;
+	s->tx_size = m->tx_size;
+	s->lanes_mem = parts.lanes;
+	s->lanes_max = m->send_queue_size;
+	sessions[mqtt_socket] = s;
+
+	return s;
+}
+
+static mqtt_session *session_new(int mqtt_socket, int rx_size,
+									const mqtt_memory *memory)
+{
+#ifndef MQTT_STATIC_ALLOC
+	mqtt_session **grown, *s;
+	int len;
+#endif
+
+	if (mqtt_socket >= sessions_len) {
+#ifdef MQTT_STATIC_ALLOC
+		print_err("Socket %d above MQTT_STATIC_SOCKETS", mqtt_socket);
+		return NULL;
+#else
+		len = (mqtt_socket + 1) * 2;
+		grown = (mqtt_session **)realloc(sessions, len * sizeof(mqtt_session *));
+		if (grown == NULL)
+			return NULL;
+		memset(&grown[sessions_len], 0,
+				(len - sessions_len) * sizeof(mqtt_session *));
+		sessions = grown;
+		sessions_len = len;
+#endif
+	}
+
+	if (memory != NULL)
+		return session_place(mqtt_socket, memory);
+#ifdef MQTT_STATIC_ALLOC
+	(void)rx_size;
+	print_err("Static builds need the connection memory");
+	return NULL;
+#else
+	s = (mqtt_session *)calloc(1, sizeof(mqtt_session));
+	if (s == NULL)
+		return NULL;
+
+	s->socket = mqtt_socket;
+	s->next_packet_id = 1;
+	s->rx_size = rx_size;
+	s->rx = (uint8_t *)malloc(rx_size);
+	s->tx_size = MQTT_PROT_PACKET_LEN;
+	s->tx = (uint8_t *)malloc(s->tx_size);
+	sessions[mqtt_socket] = s;
+	if (s->rx == NULL || s->tx == NULL) {
+		session_free(s);
+		return NULL;
+	}
+
+	return s;
+#endif
+}
+
+/* Packet identifiers whose pool slot is taken are skipped, so they are never
+ * used twice while in flight. */
+static uint16_t next_packet_id(mqtt_session *s)
+{
+	uint16_t id;
+
+	do {
+		id = s->next_packet_id++;
+		if (s->next_packet_id == 0)
+			s->next_packet_id = 1;
+	} while (s->ops_len > 0 && s->ops[id & (s->ops_len - 1)].packet_id != 0);
+
+	return id;
+}
+
+static int ensure_buf(uint8_t **buf, int *size, size_t len)
+{
+	uint8_t *grown;
+
+	if (len <= (size_t)*size)
+		return 0;
+	if (len > INT32_MAX)
+		return -1;
+
+	grown = (uint8_t *)realloc(*buf, len);
+	if (grown == NULL)
+		return -1;
+
+	*buf = grown;
+	*size = (int)len;
+	return 0;
+}
+
+/* Grow a session buffer, those of connections given their memory keep
+ * their size. */
+static int session_buf(mqtt_session *s, uint8_t **buf, int *size, size_t len)
+{
+	if (!s->fixed)
+		return ensure_buf(buf, size, len);
+	if (len <= (size_t)*size)
+		return 0;
+
+	print_err("%zu bytes do not fit the %d given", len, *size);
+	return -1;
+}
+
+/* Connections given their memory never allocate, features needing the heap
+ * are refused. */
+static int heap_refused(mqtt_session *s, const char *what)
+{
+	if (!s->fixed)
+		return 0;
+
+	print_err("%s needs the heap, refused on connections given memory", what);
+	return 1;
+}
+
+/* Small arrays live on the stack, larger ones on the heap if allowed. */
+static void *scratch_alloc(mqtt_session *s, void *stack, size_t stack_size,
+							size_t size)
+{
+	if (size <= stack_size)
+		return stack;
+	if (s != NULL && heap_refused(s, "Subscribing to that many filters"))
+		return NULL;
+
+	return malloc(size);
+}
+
+static void scratch_free(void *p, const void *stack)
+{
+	if (p != stack)
+		free(p);
+}
+
+/* Write the next chunk of the packets queued in the lanes. */
+static int lanes_write(mqtt_session *s)
+{
+	struct iovec parts[2];
+	const uint8_t *chunk;
+	int len, n;
+
+	len = mqtt_lanes_chunk(s->lanes, &chunk);
+	if (len == 0)
+		return 0;
+	/* Captured when written, packets leave in priority order. */
+	n = mqtt_lanes_starting(s->lanes, parts);
+	if (n > 0)
+		mqtt_capture_packetv(s->socket, s->version, MQTT_CAPTURE_OUT, parts,
+								n);
+	if (socket_send(s->socket, chunk, len) < 0)
+		return -1;
+
+	mqtt_lanes_sent(s->lanes, len);
+	s->last_send_ms = now_ms();
+	return 0;
+}
+
+/* Write the queued packets of a lane and of higher priority lanes. */
+static int lanes_drain(mqtt_session *s, mqtt_lane lane)
+{
+	while (s->lanes != NULL && mqtt_lanes_queued(s->lanes, lane) > 0) {
+		if (lanes_write(s) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int send_packet_lane(mqtt_session *s, const uint8_t *pkt, int len,
+							mqtt_lane lane)
+{
+	int ret;
+
+	if (len < 0)
+		return -1;
+	if (len > s->limits.max_packet_size) {
+		print_err("Packet of %d bytes exceeds broker limit", len);
+		return -1;
+	}
+
+	s->last_send_ms = now_ms();
+	if (s->lanes == NULL) {
+		mqtt_capture_packet(s->socket, s->version, MQTT_CAPTURE_OUT, pkt,
+							len);
+		return socket_send(s->socket, pkt, len);
+	}
+
+	while ((ret = mqtt_lanes_push(s->lanes, lane, pkt, len)) == 1) {
+		if (lanes_write(s) < 0)
+			return -1;
+	}
+	if (ret < 0) {
+		print_err("Packet of %d bytes exceeds the send queue", len);
+		return -1;
+	}
+
+	/* Bulk is written while waiting for the broker, the rest leaves now. */
+	if (lane == MQTT_LANE_BULK)
+		return 0;
+
+	return lanes_drain(s, lane);
+}
+
+static int send_packet(mqtt_session *s, const uint8_t *pkt, int len)
+{
+	return send_packet_lane(s, pkt, len, MQTT_LANE_CONTROL);
+}
+
+/* Send a packet made of several buffers without joining them, the payload
+ * of a publish is written from where the caller holds it. */
+static int send_packetv(mqtt_session *s, const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > (size_t)s->limits.max_packet_size) {
+		print_err("Packet of %zu bytes exceeds broker limit", len);
+		return -1;
+	}
+
+	s->last_send_ms = now_ms();
+	mqtt_capture_packetv(s->socket, s->version, MQTT_CAPTURE_OUT, iov, iovcnt);
+	return socket_sendv(s->socket, iov, iovcnt);
+}
+
+/* Read one full packet at the start of s->rx, returns its length, 0 on
+ * timeout or -1 if the connection is broken. */
+static int read_packet(mqtt_session *s, long deadline_ms)
+{
+	long wait_ms;
+	int len, n, writing;
+
+	if (s->rx_used > 0) {
+		s->rx_len -= s->rx_used;
+		memmove(s->rx, &s->rx[s->rx_used], s->rx_len);
+		s->rx_used = 0;
+	}
+
+	for (;;) {
+		len = mqtt_prot_packet_len(s->rx, s->rx_len);
+		if (len < 0 || len > s->rx_size) {
+			print_err("Malformed or too large packet");
+			return -1;
+		}
+		if (len > 0 && len <= s->rx_len) {
+			s->rx_used = len;
+			mqtt_capture_packet(s->socket, s->version, MQTT_CAPTURE_IN, s->rx,
+								len);
+			return len;
+		}
+
+		wait_ms = deadline_ms - now_ms();
+		if (wait_ms < 0)
+			wait_ms = 0;
+		/* Queued packets are written meanwhile, received ones are still
+		 * read between chunks. */
+		writing = s->lanes != NULL &&
+					mqtt_lanes_queued(s->lanes, MQTT_LANE_BULK) > 0;
+		if (writing) {
+			if (lanes_write(s) < 0)
+				return -1;
+			wait_ms = 0;
+		}
+		n = socket_receive_timeout(s->socket, &s->rx[s->rx_len],
+									s->rx_size - s->rx_len, (int)wait_ms);
+		if (n < 0)
+			return -1;
+		if (n == 0 && (!writing || now_ms() >= deadline_ms))
+			return 0;
+		s->rx_len += n;
+	}
+}
+
+/* Check if a whole packet was received after the one being handled. */
+static int packet_buffered(mqtt_session *s)
+{
+	int len = mqtt_prot_packet_len(&s->rx[s->rx_used], s->rx_len - s->rx_used);
+
+	return len > 0 && len <= s->rx_len - s->rx_used;
+}
+
+static int packet_id_of(const uint8_t *pkt, int len)
+{
+	int i = 1;
+
+	while (pkt[i] & 0x80)
+		i++;
+	i++;
+
+	if (len < i + 2)
+		return -1;
+
+	return ((int)pkt[i] << 8) | pkt[i + 1];
+}
+
+static int send_pubresp(mqtt_session *s, uint8_t type, uint16_t packet_id)
+{
+	uint8_t pkt[5];
+	int len;
+
+	len = mqtt_prot_pubresp(pkt, sizeof(pkt), s->version, type, packet_id, 0);
+	return send_packet(s, pkt, len);
+}
+
+/* Make room for one more operation, the pool is kept at most half full. */
+static int ops_reserve(mqtt_session *s)
+{
+	mqtt_async_op *grown, *op;
+	int len;
+
+	if (s->ops_used >= MQTT_ASYNC_MAX_OPS) {
+		print_err("Too many operations in flight");
+		return -1;
+	}
+	if ((s->ops_used + 1) * 2 <= s->ops_len)
+		return 0;
+	if (s->fixed) {
+		print_err("In-flight table of %d operations full", s->ops_len / 2);
+		return -1;
+	}
+
+	/* Identifiers in distinct slots stay in distinct slots when the mask
+	 * grows by one bit. */
+	len = s->ops_len ? s->ops_len * 2 : 16;
+	grown = (mqtt_async_op *)calloc(len, sizeof(mqtt_async_op));
+	if (grown == NULL)
+		return -1;
+	for (int i = 0; i < s->ops_len; i++) {
+		op = &s->ops[i];
+		if (op->packet_id != 0)
+			grown[op->packet_id & (len - 1)] = *op;
+	}
+
+	free(s->ops);
+	s->ops = grown;
+	s->ops_len = len;
+	return 0;
+}
+
+static mqtt_async_op *op_find(mqtt_session *s, int packet_id)
+{
+	mqtt_async_op *op;
+
+	if (s->ops_len == 0 || packet_id <= 0)
+		return NULL;
+
+	op = &s->ops[packet_id & (s->ops_len - 1)];
+	return (op->packet_id == packet_id) ? op : NULL;
+}
+
+/* Take the slot of an identifier from next_packet_id, after ops_reserve. */
+static mqtt_async_op *op_new(mqtt_session *s, uint16_t packet_id, uint8_t type)
+{
+	mqtt_async_op *op = &s->ops[packet_id & (s->ops_len - 1)];
+
+	memset(op, 0, sizeof(mqtt_async_op));
+	op->packet_id = packet_id;
+	op->first = packet_id;
+	op->type = type;
+	op->pending = 1;
+	s->ops_used++;
+	return op;
+}
+
+static void op_release(mqtt_session *s, mqtt_async_op *op)
+{
+	memset(op, 0, sizeof(mqtt_async_op));
+	s->ops_used--;
+}
+
+/* The slot is released before calling back, the callback may start new
+ * operations. */
+static void op_complete(mqtt_session *s, mqtt_async_op *op, int result)
+{
+	mqtt_complete_callback callback = op->callback;
+	void *user_data = op->user_data;
+
+	op_release(s, op);
+	if (callback != NULL)
+		callback(user_data, result);
+}
+
+/* Forget a group without calling back, when it could not be sent whole. */
+static void ops_release_group(mqtt_session *s, uint16_t first)
+{
+	for (int i = 0; i < s->ops_len; i++) {
+		if (s->ops[i].packet_id != 0 && s->ops[i].first == first)
+			op_release(s, &s->ops[i]);
+	}
+}
+
+/* Hold the slot of an identifier acknowledged synchronously, so operations
+ * started meanwhile, from callbacks, never take it. */
+static int id_hold(mqtt_session *s, uint16_t *packet_id)
+{
+	if (ops_reserve(s) < 0)
+		return -1;
+
+	*packet_id = next_packet_id(s);
+	op_new(s, *packet_id, 0);
+	return 0;
+}
+
+static void id_release(mqtt_session *s, uint16_t packet_id)
+{
+	mqtt_async_op *op = op_find(s, packet_id);
+
+	if (op != NULL)
+		op_release(s, op);
+}
+
+/* Complete every operation in flight with -1, when closing. */
+static void ops_fail_all(mqtt_session *s)
+{
+	mqtt_async_op *ops = s->ops;
+	int len = s->ops_len;
+
+	s->ops = NULL;
+	s->ops_len = 0;
+	s->ops_used = 0;
+
+	for (int i = 0; i < len; i++) {
+		if (ops[i].packet_id != 0 && ops[i].first == ops[i].packet_id &&
+			ops[i].callback != NULL)
+			ops[i].callback(ops[i].user_data, -1);
+	}
+	if (!s->fixed)
+		free(ops);
+}
+
+/* Handle an ack of an asynchronous operation. */
+static void flow_ack(mqtt_session *s, long sent_us, int in_flight)
+{
+	long now = now_us();
+
+	mqtt_flow_ack(&s->flow, now - sent_us, in_flight, now);
+}
+
+static int handle_ack(mqtt_session *s, const uint8_t *pkt, int len)
+{
+	uint8_t type = pkt[0] >> 4;
+	mqtt_async_op *op, *head;
+	int n, reason;
+
+	op = op_find(s, packet_id_of(pkt, len));
+	if (op == NULL || op->type != type) {
+		print_wrn("Unexpected packet 0x%02x", pkt[0]);
+		return 0;
+	}
+
+	switch (type) {
+		case MQTT_PROT_PUBACK:
+			flow_ack(s, op->sent_us, s->ops_used);
+			op_complete(s, op, mqtt_prot_puback(s->version, pkt, len, NULL));
+			return 0;
+		case MQTT_PROT_PUBREC:
+			flow_ack(s, op->sent_us, s->ops_used);
+			reason = mqtt_prot_pubresp_decode(s->version, MQTT_PROT_PUBREC,
+												pkt, len, NULL);
+			if (reason < 0 || reason >= 0x80) {
+				op_complete(s, op, -1);
+				return 0;
+			}
+			op->type = MQTT_PROT_PUBCOMP;
+			return send_pubresp(s, MQTT_PROT_PUBREL, op->packet_id);
+		case MQTT_PROT_PUBCOMP:
+			op_complete(s, op, 0);
+			return 0;
+		default:
+			break;
+	}
+
+	if (session_buf(s, &s->codes, &s->codes_size, op->nb_results) < 0)
+		return -1;
+	n = mqtt_prot_suback(s->version, pkt, len, NULL, s->codes,
+							op->nb_results);
+	if (n < 0) {
+		print_err("Bad ack!");
+		return -1;
+	}
+	for (int i = 0; i < op->nb_results; i++)
+		op->results[i] = (i < n) ? s->codes[i] : MQTT_RC_UNSPECIFIED_ERROR;
+
+	/* The group leader keeps its slot until the whole group is answered. */
+	head = op_find(s, op->first);
+	if (op != head)
+		op_release(s, op);
+	else
+		op->type = 0;
+	if (head != NULL && --head->pending == 0)
+		op_complete(s, head, 0);
+
+	return 0;
+}
+
+static mqtt_compressor *session_compressor(mqtt_session *s);
+
+static void deliver(mqtt_session *s, const mqtt_prot_publish_msg *pub,
+					const uint8_t *payload, int payload_len)
+{
+	if (s->cache != NULL)
+		mqtt_cache_put(s->cache, pub->topic, pub->topic_len, payload,
+						payload_len, pub->flags);
+	if (s->on_message != NULL)
+		s->on_message(s->user_data, pub->topic, pub->topic_len, payload,
+						payload_len, pub->flags);
+}
+
+/* Deliver each message of an aggregated payload, see mqtt_aggregate.h.
+ * It is checked whole first, a malformed one delivers nothing. */
+static void deliver_packed(mqtt_session *s, const mqtt_prot_publish_msg *pub,
+							const uint8_t *payload, int payload_len)
+{
+	const uint8_t *msg;
+	int pos = MQTT_AGGREGATE_HEADER, msg_len, ret;
+
+	while ((ret = mqtt_aggregate_next(payload, payload_len, &pos, &msg,
+										&msg_len)) == 1)
+		;
+	if (ret < 0) {
+		print_err("Malformed aggregated message, dropped");
+		return;
+	}
+
+	pos = MQTT_AGGREGATE_HEADER;
+	while (mqtt_aggregate_next(payload, payload_len, &pos, &msg,
+								&msg_len) == 1)
+		deliver(s, pub, msg, msg_len);
+}
+
+static int handle_publish(mqtt_session *s, const uint8_t *pkt, int len)
+{
+	mqtt_prot_publish_msg pub;
+	const uint8_t *payload;
+	int payload_len, orig_len;
+	uint8_t qos;
+
+	if (mqtt_prot_publish_decode(s->version, pkt, len, &pub) < 0) {
+		print_err("Malformed publish");
+		return -1;
+	}
+
+	if (pub.props.present & MQTT_PROT_PROP_BIT(MQTT_PROP_TOPIC_ALIAS) &&
+		mqtt_alias_inbound(&s->in_aliases, pub.props.topic_alias,
+							&pub.topic, &pub.topic_len) < 0) {
+		print_err("Invalid topic alias %d", pub.props.topic_alias);
+		return -1;
+	}
+
+	if (mqtt_valid_topic_name(pub.topic, pub.topic_len) < 0) {
+		print_err("Invalid topic name received");
+		return -1;
+	}
+
+	payload = pub.payload;
+	payload_len = (int)pub.payload_len;
+	if (!s->framing) {
+		deliver(s, &pub, payload, payload_len);
+		goto ack;
+	}
+	if (mqtt_compress_escaped(payload, payload_len)) {
+		deliver(s, &pub, &payload[MQTT_COMPRESS_ESCAPE_LEN],
+				payload_len - MQTT_COMPRESS_ESCAPE_LEN);
+		goto ack;
+	}
+
+	orig_len = mqtt_compressed_len(payload, payload_len);
+	if (orig_len > MQTT_MAX_DECOMPRESSED_SIZE) {
+		print_err("Compressed message of %d bytes too large, dropped",
+					orig_len);
+		goto ack;
+	}
+	if (orig_len >= 0) {
+		if (s->fixed || session_compressor(s) == NULL ||
+			ensure_buf(&s->zrx, &s->zrx_size, orig_len) < 0) {
+			payload_len = -1;
+		} else {
+			payload_len = mqtt_decompress(s->compressor, pub.payload,
+											pub.payload_len, s->zrx,
+											s->zrx_size);
+			payload = s->zrx;
+		}
+	}
+
+	/* Only this message is lost, the connection goes on. */
+	if (payload_len < 0)
+		print_err("Couldn't decompress message, dropped");
+	else if (mqtt_aggregate_packed(payload, payload_len))
+		deliver_packed(s, &pub, payload, payload_len);
+	else
+		deliver(s, &pub, payload, payload_len);
+
+ack:
+	qos = (pub.flags >> 1) & 0x03;
+	if (qos == 1)
+		return send_pubresp(s, MQTT_PROT_PUBACK, pub.packet_id);
+	if (qos == 2)
+		return send_pubresp(s, MQTT_PROT_PUBREC, pub.packet_id);
+
+	return 0;
+}
+
+/* Handle packets nobody is waiting for. */
+static int handle_packet(mqtt_session *s, const uint8_t *pkt, int len)
+{
+	switch (pkt[0] >> 4) {
+		case MQTT_PROT_PUBLISH:
+			return handle_publish(s, pkt, len);
+		case MQTT_PROT_PUBREL:
+			if (packet_id_of(pkt, len) < 0)
+				return -1;
+			return send_pubresp(s, MQTT_PROT_PUBCOMP, packet_id_of(pkt, len));
+		case MQTT_PROT_PUBACK:
+		case MQTT_PROT_PUBREC:
+		case MQTT_PROT_PUBCOMP:
+		case MQTT_PROT_SUBACK:
+			return handle_ack(s, pkt, len);
+		case MQTT_PROT_PINGRESP:
+			return 0;
+		case MQTT_PROT_DISCONNECT:
+			print_err("Disconnected by broker, reason 0x%02x",
+						len > 2 ? pkt[2] : 0);
+			return -1;
+		default:
+			print_wrn("Unexpected packet 0x%02x", pkt[0]);
+			return 0;
+	}
+}
+
+/* Wait for a packet of the given type and packet identifier (-1 for none),
+ * delivering anything else received meanwhile. */
+static int wait_packet(mqtt_session *s, uint8_t type, int packet_id)
+{
+	long deadline_ms = now_ms() + MQTT_ACK_TIMEOUT_MS;
+	int len;
+
+	for (;;) {
+		len = read_packet(s, deadline_ms);
+		if (len <= 0) {
+			print_err("No answer packet");
+			return -1;
+		}
+
+		if ((s->rx[0] >> 4) == type &&
+			(packet_id < 0 || packet_id_of(s->rx, len) == packet_id))
+			return len;
+
+		if (handle_packet(s, s->rx, len) < 0)
+			return -1;
+	}
+}
+
+/* Publish through the local multiplexer if one runs. Only plain clean
+ * sessions without will can share its broker connection. */
+static int connect_shm(const char *hostname, int port,
+						uint8_t connect_flags, const char *username,
+						const char *password)
+{
+	mqtt_session *s;
+	mqtt_shm *shm;
+	int mqtt_socket;
+
+	if (!(connect_flags & CONNECT_FLAG_CLEAN_SESSION) ||
+		(connect_flags & (CONNECT_FLAG_WILL | CONNECT_FLAG_WILL_QOS_1 |
+							CONNECT_FLAG_WILL_QOS_2 | CONNECT_FLAG_WILL_RETAIN)))
+		return -1;
+
+	mqtt_socket = mqtt_shm_connect(hostname, port,
+						(connect_flags & CONNECT_FLAG_USERNAME) ? username : NULL,
+						(connect_flags & CONNECT_FLAG_PASSWORD) ? password : NULL,
+						&shm);
+	if (mqtt_socket < 0)
+		return -1;
+
+	s = session_new(mqtt_socket, MQTT_PROT_PACKET_LEN, NULL);
+	if (s == NULL) {
+		mqtt_shm_close(shm);
+		return -1;
+	}
+	s->shm = shm;
+	s->version = MQTT_VERSION_3_1_1;
+	s->limits.version = MQTT_VERSION_3_1_1;
+	s->limits.receive_max = 65535;
+	s->limits.max_packet_size = MQTT_SHM_RING_SIZE / 2;
+	s->limits.max_qos = 2;
+	s->limits.retain_available = 1;
+	mqtt_flow_init(&s->flow, MQTT_ASYNC_MAX_OPS, now_us());
+
+	return mqtt_socket;
+}
+
+/* Fill the defaults of the connection options, -1 if unsupported. Writes
+ * of a connection given its memory are coalesced in its queue, with the
+ * socket options set up in sock_opts. */
+static int connect_options(const mqtt_connect_options *options,
+							mqtt_connect_options *opts,
+							socket_options *sock_opts)
+{
+	memory_parts parts;
+
+	memset(opts, 0, sizeof(mqtt_connect_options));
+	if (options != NULL)
+		*opts = *options;
+	if (opts->version == 0)
+		opts->version = MQTT_VERSION_3_1_1;
+	if (opts->max_packet_size <= 0)
+		opts->max_packet_size = MQTT_MAX_PACKET_SIZE;
+
+	if (opts->version != MQTT_VERSION_3_1_1 &&
+		opts->version != MQTT_VERSION_5) {
+		print_err("Unsupported MQTT version %d", opts->version);
+		return -1;
+	}
+
+	if (opts->memory == NULL) {
+#ifdef MQTT_STATIC_ALLOC
+		print_err("Static builds need the connection memory");
+		return -1;
+#else
+		return 0;
+#endif
+	}
+
+	if (memory_layout(opts->memory, &parts) < 0)
+		return -1;
+	/* Packets must fit the receive buffer, topic aliases need the heap. */
+	opts->max_packet_size = opts->memory->rx_size;
+	opts->topic_alias_max = 0;
+
+	if (parts.queue != NULL) {
+		if (opts->socket != NULL)
+			*sock_opts = *opts->socket;
+		else
+			memset(sock_opts, 0, sizeof(socket_options));
+		sock_opts->coalesce_bytes = opts->memory->queue_size;
+		sock_opts->coalesce_buf = parts.queue;
+		opts->socket = sock_opts;
+	} else if (opts->socket != NULL && opts->socket->coalesce_bytes > 0 &&
+				opts->socket->coalesce_buf == NULL) {
+		print_err("Coalescing writes needs a queue in the connection memory");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_clientID(const char *clientID)
+{
+	if (clientID == NULL) {
+		print_err("ClientID is mandatory !!!");
+		return -1;
+	}
+	if (mqtt_valid_clientID(clientID, strlen(clientID)) == -1) {
+		print_err("Invalid ClientID !!!");
+		print_err("ClientID must contain [0-9][a-z][A-Z] only!");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Create the session of a connected socket and build its CONNECT packet in
+ * s->tx, returns the packet length or -1 if error. */
+static int session_connect(int mqtt_socket, uint8_t connect_flags,
+							int keepalive, const mqtt_connect_options *opts,
+							const char *clientID, const char *username,
+							const char *password)
+{
+	mqtt_prot_properties props;
+	mqtt_session *s;
+	int buf_len;
+
+	s = session_new(mqtt_socket, opts->max_packet_size, opts->memory);
+	if (s == NULL) {
+		print_err("Couldn't allocate session");
+		return -1;
+	}
+	s->version = opts->version;
+	s->keepalive = keepalive;
+	/* Nothing can be larger than a CONNECT before CONNACK tells otherwise. */
+	s->limits.max_packet_size = MQTT_PROT_VARINT_MAX;
+
+	if ((connect_flags & CONNECT_FLAG_USERNAME && username == NULL) ||
+		(!(connect_flags & CONNECT_FLAG_USERNAME) && username != NULL) ||
+		(connect_flags & CONNECT_FLAG_PASSWORD && password == NULL) ||
+		(!(connect_flags & CONNECT_FLAG_PASSWORD) && password != NULL)) {
+		print_wrn("Username/Passwrd connection flag is set but username field \
+					is empty, we'll try to connect without authentication!");
+		connect_flags &= ~(CONNECT_FLAG_USERNAME);
+		connect_flags &= ~(CONNECT_FLAG_PASSWORD);
+		username = NULL;
+		password = NULL;
+	}
+
+	memset(&props, 0, sizeof(props));
+	if (opts->receive_max > 0) {
+		props.receive_max = opts->receive_max;
+		props.present |= MQTT_PROT_PROP_BIT(MQTT_PROP_RECEIVE_MAX);
+	}
+	if (opts->topic_alias_max > 0) {
+		props.topic_alias_max = opts->topic_alias_max;
+		props.present |= MQTT_PROT_PROP_BIT(MQTT_PROP_TOPIC_ALIAS_MAX);
+	}
+	if (opts->session_expiry > 0) {
+		props.session_expiry = opts->session_expiry;
+		props.present |= MQTT_PROT_PROP_BIT(MQTT_PROP_SESSION_EXPIRY);
+	}
+	props.max_packet_size = opts->max_packet_size;
+	props.present |= MQTT_PROT_PROP_BIT(MQTT_PROP_MAX_PACKET_SIZE);
+
+	buf_len = mqtt_prot_connect(NULL, 0, s->version, connect_flags, keepalive,
+								&props, clientID, username, password);
+	if (buf_len < 0 || session_buf(s, &s->tx, &s->tx_size, buf_len) < 0) {
+		print_err("Couldn't build connect packet");
+		session_free(s);
+		return -1;
+	}
+
+	return mqtt_prot_connect(s->tx, s->tx_size, s->version, connect_flags,
+								keepalive, &props, clientID, username,
+								password);
+}
+
+/* Apply the CONNACK at the start of s->rx, returns its return code or -1 if
+ * malformed or the session can not be set up. */
+static int session_connack(mqtt_session *s, const mqtt_connect_options *opts,
+							int buf_len)
+{
+	mqtt_prot_properties connack_props;
+	int window, ret;
+
+	ret = mqtt_prot_connack(s->version, s->rx, buf_len, &connack_props);
+	if (ret != MQTT_CONNACK_ACCEPTED)
+		return ret;
+
+	/* Protocol defaults, overridden by MQTT v5 CONNACK properties. */
+	s->limits.version = s->version;
+	s->limits.receive_max = 65535;
+	s->limits.max_packet_size = MQTT_PROT_VARINT_MAX;
+	s->limits.topic_alias_max = 0;
+	s->limits.max_qos = 2;
+	s->limits.retain_available = 1;
+	if (s->version == MQTT_VERSION_5) {
+		if (connack_props.present & MQTT_PROT_PROP_BIT(MQTT_PROP_RECEIVE_MAX))
+			s->limits.receive_max = connack_props.receive_max;
+		if (connack_props.present & MQTT_PROT_PROP_BIT(MQTT_PROP_MAX_PACKET_SIZE))
+			s->limits.max_packet_size = connack_props.max_packet_size;
+		if (connack_props.present & MQTT_PROT_PROP_BIT(MQTT_PROP_TOPIC_ALIAS_MAX))
+			s->limits.topic_alias_max = connack_props.topic_alias_max;
+		if (connack_props.present & MQTT_PROT_PROP_BIT(MQTT_PROP_MAX_QOS))
+			s->limits.max_qos = connack_props.max_qos;
+		if (connack_props.present & MQTT_PROT_PROP_BIT(MQTT_PROP_RETAIN_AVAILABLE))
+			s->limits.retain_available = connack_props.retain_available;
+		if (connack_props.present & MQTT_PROT_PROP_BIT(MQTT_PROP_SERVER_KEEPALIVE))
+			s->keepalive = connack_props.server_keepalive;
+	}
+
+	window = (s->limits.receive_max < MQTT_ASYNC_MAX_OPS) ?
+				s->limits.receive_max : MQTT_ASYNC_MAX_OPS;
+	/* Publishes wait for room in the in-flight table given. */
+	if (s->fixed && window > s->ops_len / 2)
+		window = s->ops_len / 2;
+	mqtt_flow_init(&s->flow, window, now_us());
+
+	/* Aliases sent are never used without the heap. */
+	if (mqtt_alias_init(&s->out_aliases,
+						s->fixed ? 0 : s->limits.topic_alias_max) < 0 ||
+		mqtt_alias_init(&s->in_aliases, opts->topic_alias_max) < 0) {
+		print_err("Couldn't allocate topic aliases");
+		return -1;
+	}
+
+	return MQTT_CONNACK_ACCEPTED;
+}
+
+int mqtt_connect_opts(const char *hostname,
+						int port,
+						const char *clientID,
+						mqtt_connect_flags connection_flags,
+						int keepalive,
+						const char *username,
+						const char *password,
+						const mqtt_connect_options *options)
+{
+	mqtt_connect_options opts;
+	socket_options sock_opts;
+	mqtt_session *s;
+	int mqtt_socket, buf_len, ret;
+	uint8_t connect_flags = (uint8_t)connection_flags;
+
+	print_dbg("IN");
+
+	if (hostname == NULL) {
+		print_err("Hostname is NULL !!!");
+		return -1;
+	}
+	if (check_clientID(clientID) < 0 ||
+		connect_options(options, &opts, &sock_opts) < 0)
+		return -1;
+
+	if (options == NULL) {
+		mqtt_socket = connect_shm(hostname, port, connect_flags, username,
+									password);
+		if (mqtt_socket >= 0)
+			return mqtt_socket;
+	}
+
+	mqtt_socket = socket_create_opts(hostname, port, opts.tls, opts.socket);
+	if (mqtt_socket < 0) {
+		print_err("Couldn't create socket, MQTT not connecting ...");
+		return -1;
+	}
+
+	print_dbg("Socket creation OK, try sending MQTT Connect");
+
+	buf_len = session_connect(mqtt_socket, connect_flags, keepalive, &opts,
+								clientID, username, password);
+	if (buf_len < 0) {
+		socket_close(mqtt_socket);
+		return -1;
+	}
+	s = session_get(mqtt_socket);
+	if (send_packet(s, s->tx, buf_len) < 0) {
+		print_err("Couldn't send connect packet");
+		goto fail;
+	}
+
+	buf_len = wait_packet(s, MQTT_PROT_CONNACK, -1);
+	if (buf_len < 0)
+		goto fail;
+
+	ret = session_connack(s, &opts, buf_len);
+	if (ret != MQTT_CONNACK_ACCEPTED) {
+		print_err("Bad conack! (0x%02x)", ret);
+		goto fail;
+	}
+
+	return mqtt_socket;
+fail:
+	session_free(s);
+	socket_close(mqtt_socket);
+	return -1;
+}
+
+int mqtt_connect(const char *hostname,
+					int port,
+					const char *clientID,
+					mqtt_connect_flags connection_flags,
+					int keepalive,
+					const char *username,
+					const char *password)
+{
+	return mqtt_connect_opts(hostname, port, clientID, connection_flags,
+								keepalive, username, password, NULL);
+}
+
+int mqtt_connect_simple(const char *hostname,
+							int port,
+							const char *clientID)
+{
+	return mqtt_connect(hostname, port, clientID, CONNECT_FLAG_CLEAN_SESSION,
+						60, NULL, NULL);
+}
+
+#ifndef MQTT_STATIC_ALLOC
+/* Events read at once by mqtt_connect_bulk. */
+#define BULK_EVENTS 256
+
+typedef enum {
+	BULK_WAITING = 0,
+	BULK_CONNECTING,
+	BULK_CONNACK,
+	BULK_DONE
+} bulk_state;
+
+typedef struct {
+	bulk_state state;
+	int fd;
+	/* Position in the active list. */
+	int active_pos;
+	/* Start of the next attempt, end of the current one. */
+	long next_ms;
+	long deadline_ms;
+} bulk_entry;
+
+typedef struct {
+	const char *hostname;
+	int port;
+	uint8_t connect_flags;
+	int keepalive;
+	mqtt_connect_options opts;
+	mqtt_bulk_options bo;
+	mqtt_bulk_session *fleet;
+	bulk_entry *entries;
+	/* Sessions in an attempt. */
+	int *active;
+	int active_len;
+	/* Sessions waiting to retry, a min heap on next_ms. */
+	int *retries;
+	int retries_len;
+	int epoll_fd;
+	int left;
+	uint32_t seed;
+	long start_ms;
+	mqtt_bulk_report report;
+} bulk_ctx;
+
+static void retries_push(bulk_ctx *b, int i)
+{
+	int pos = b->retries_len++, parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (b->entries[b->retries[parent]].next_ms <= b->entries[i].next_ms)
+			break;
+		b->retries[pos] = b->retries[parent];
+		pos = parent;
+	}
+	b->retries[pos] = i;
+}
+
+static int retries_pop(bulk_ctx *b)
+{
+	int top = b->retries[0], last = b->retries[--b->retries_len];
+	int pos = 0, child;
+
+	for (;;) {
+		child = 2 * pos + 1;
+		if (child >= b->retries_len)
+			break;
+		if (child + 1 < b->retries_len &&
+			b->entries[b->retries[child + 1]].next_ms <
+			b->entries[b->retries[child]].next_ms)
+			child++;
+		if (b->entries[last].next_ms <= b->entries[b->retries[child]].next_ms)
+			break;
+		b->retries[pos] = b->retries[child];
+		pos = child;
+	}
+	b->retries[pos] = last;
+
+	return top;
+}
+
+static void bulk_deactivate(bulk_ctx *b, int i)
+{
+	int pos = b->entries[i].active_pos;
+
+	b->active[pos] = b->active[--b->active_len];
+	b->entries[b->active[pos]].active_pos = pos;
+}
+
+/* Close the attempt in progress, then retry later or give up. */
+static void bulk_retry(bulk_ctx *b, int i, long now)
+{
+	bulk_entry *e = &b->entries[i];
+	long delay;
+
+	if (e->state == BULK_CONNACK) {
+		session_free(session_get(e->fd));
+		socket_close(e->fd);
+	} else if (e->state == BULK_CONNECTING) {
+		socket_close(e->fd);
+	}
+	if (e->state != BULK_WAITING)
+		bulk_deactivate(b, i);
+	e->state = BULK_WAITING;
+
+	if (b->fleet[i].attempts >= b->bo.max_attempts) {
+		e->state = BULK_DONE;
+		b->report.failed++;
+		b->left--;
+		return;
+	}
+
+	delay = b->bo.backoff_ms;
+	for (int n = 1; n < b->fleet[i].attempts && delay < b->bo.backoff_max_ms; n++)
+		delay *= 2;
+	if (delay > b->bo.backoff_max_ms)
+		delay = b->bo.backoff_max_ms;
+	/* xorshift32, for the jitter only. */
+	b->seed ^= b->seed << 13;
+	b->seed ^= b->seed >> 17;
+	b->seed ^= b->seed << 5;
+	e->next_ms = now + delay / 2 + (long)(b->seed % (uint32_t)(delay / 2 + 1));
+	retries_push(b, i);
+}
+
+static void bulk_start(bulk_ctx *b, int i, const char *addr, long now)
+{
+	struct epoll_event ev = { .events = EPOLLOUT };
+	bulk_entry *e = &b->entries[i];
+
+	b->fleet[i].attempts++;
+	b->report.attempts++;
+
+	e->fd = socket_connect_start(addr, b->port, b->opts.socket);
+	if (e->fd < 0) {
+		bulk_retry(b, i, now);
+		return;
+	}
+
+	e->state = BULK_CONNECTING;
+	e->deadline_ms = now + b->bo.timeout_ms;
+	e->active_pos = b->active_len;
+	b->active[b->active_len++] = i;
+
+	ev.data.u32 = (uint32_t)i;
+	if (epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, e->fd, &ev) < 0)
+		bulk_retry(b, i, now);
+}
+
+/* TCP connected, send CONNECT. */
+static void bulk_connected(bulk_ctx *b, int i, long now)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	bulk_entry *e = &b->entries[i];
+	mqtt_bulk_session *f = &b->fleet[i];
+	mqtt_session *s;
+	int len;
+
+	epoll_ctl(b->epoll_fd, EPOLL_CTL_DEL, e->fd, NULL);
+	if (socket_connect_finish(e->fd, b->hostname, b->port, b->opts.tls,
+								b->opts.socket) < 0) {
+		e->state = BULK_WAITING;
+		bulk_deactivate(b, i);
+		bulk_retry(b, i, now);
+		return;
+	}
+
+	len = session_connect(e->fd, b->connect_flags, b->keepalive, &b->opts,
+							f->client_id, f->username, f->password);
+	if (len < 0) {
+		bulk_retry(b, i, now);
+		return;
+	}
+	e->state = BULK_CONNACK;
+
+	s = session_get(e->fd);
+	ev.data.u32 = (uint32_t)i;
+	if (send_packet(s, s->tx, len) < 0 || socket_flush(e->fd) < 0 ||
+		epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, e->fd, &ev) < 0)
+		bulk_retry(b, i, now);
+}
+
+/* Refusals worth another attempt, the broker is only overloaded. */
+static int bulk_retryable(int code)
+{
+	return code < 0 || code == MQTT_CONNACK_REFUSED_SERVER_UNAVAILABLE ||
+			code == MQTT_RC_SERVER_UNAVAILABLE || code == MQTT_RC_SERVER_BUSY ||
+			code == MQTT_RC_QUOTA_EXCEEDED ||
+			code == MQTT_RC_CONNECTION_RATE_EXCEEDED;
+}
+
+static void bulk_connack(bulk_ctx *b, int i, long now)
+{
+	bulk_entry *e = &b->entries[i];
+	mqtt_session *s = session_get(e->fd);
+	int len, ret;
+
+	len = read_packet(s, now);
+	if (len == 0)
+		return;
+	if (len < 0 || (s->rx[0] >> 4) != MQTT_PROT_CONNACK) {
+		bulk_retry(b, i, now);
+		return;
+	}
+
+	ret = session_connack(s, &b->opts, len);
+	if (ret != MQTT_CONNACK_ACCEPTED) {
+		print_wrn("%s refused (0x%02x)", b->fleet[i].client_id, ret);
+		if (!bulk_retryable(ret))
+			b->fleet[i].attempts = b->bo.max_attempts;
+		bulk_retry(b, i, now);
+		return;
+	}
+
+	epoll_ctl(b->epoll_fd, EPOLL_CTL_DEL, e->fd, NULL);
+	bulk_deactivate(b, i);
+	e->state = BULK_DONE;
+	b->fleet[i].mqtt_socket = e->fd;
+	b->fleet[i].connect_ms = now - b->start_ms;
+	b->report.connected++;
+	b->report.all_connected_ms = b->fleet[i].connect_ms;
+	b->left--;
+}
+
+/* Time to wait for events, until the next attempt may start or the first
+ * attempt in progress times out. */
+static int bulk_wait_ms(bulk_ctx *b, int next, int count, mqtt_flow *pace,
+						long now)
+{
+	long wake = now + MQTT_ACK_TIMEOUT_MS, pace_ms;
+
+	if (b->active_len < b->bo.concurrency &&
+		(next < count || b->retries_len > 0)) {
+		pace_ms = now + (mqtt_flow_delay(pace, now_us()) + 999) / 1000;
+		if (next >= count &&
+			b->entries[b->retries[0]].next_ms > pace_ms)
+			pace_ms = b->entries[b->retries[0]].next_ms;
+		if (pace_ms < wake)
+			wake = pace_ms;
+	}
+	for (int j = 0; j < b->active_len; j++) {
+		if (b->entries[b->active[j]].deadline_ms < wake)
+			wake = b->entries[b->active[j]].deadline_ms;
+	}
+
+	return (wake > now) ? (int)(wake - now) : 0;
+}
+#endif /* MQTT_STATIC_ALLOC */
+
+int mqtt_connect_bulk(const char *hostname,
+						int port,
+						mqtt_connect_flags connection_flags,
+						int keepalive,
+						const mqtt_connect_options *options,
+						mqtt_bulk_session *fleet,
+						int count,
+						const mqtt_bulk_options *bulk,
+						mqtt_bulk_report *report)
+{
+#ifndef MQTT_STATIC_ALLOC
+	struct epoll_event events[BULK_EVENTS];
+	char addr[IPV4_MAX_LEN] = { 0 };
+	bulk_ctx b;
+	mqtt_flow pace;
+	int next = 0, n, i, ret = -1;
+	long now;
+
+	print_dbg("IN");
+
+	if (options != NULL && options->memory != NULL) {
+		print_err("Bulk connects allocate their sessions, memory is refused");
+		return -1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.epoll_fd = -1;
+	if (hostname == NULL || fleet == NULL || count < 0 ||
+		connect_options(options, &b.opts, NULL) < 0)
+		return -1;
+	if (bulk != NULL)
+		b.bo = *bulk;
+	if (b.bo.concurrency <= 0)
+		b.bo.concurrency = MQTT_BULK_CONCURRENCY;
+	if (b.bo.max_attempts <= 0)
+		b.bo.max_attempts = MQTT_BULK_ATTEMPTS;
+	if (b.bo.backoff_ms <= 0)
+		b.bo.backoff_ms = MQTT_BULK_BACKOFF_MS;
+	if (b.bo.backoff_max_ms < b.bo.backoff_ms)
+		b.bo.backoff_max_ms = (b.bo.backoff_ms > MQTT_BULK_BACKOFF_MAX_MS) ?
+								b.bo.backoff_ms : MQTT_BULK_BACKOFF_MAX_MS;
+	if (b.bo.timeout_ms <= 0)
+		b.bo.timeout_ms = MQTT_ACK_TIMEOUT_MS;
+
+	b.hostname = hostname;
+	b.port = port;
+	b.connect_flags = (uint8_t)connection_flags;
+	b.keepalive = keepalive;
+	b.fleet = fleet;
+	b.left = count;
+	b.start_ms = now_ms();
+	b.seed = (uint32_t)now_us() | 1;
+	memset(&pace, 0, sizeof(pace));
+	mqtt_flow_set_rate(&pace, b.bo.rate, 1, now_us());
+
+	if (resolve_hostname(hostname, addr) < 0)
+		return -1;
+
+	b.entries = (bulk_entry *)calloc(count + 1, sizeof(bulk_entry));
+	b.retries = (int *)malloc((count + 1) * sizeof(int));
+	b.active = (int *)malloc(b.bo.concurrency * sizeof(int));
+	b.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (b.entries == NULL || b.retries == NULL || b.active == NULL ||
+		b.epoll_fd < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		fleet[i].mqtt_socket = -1;
+		fleet[i].attempts = 0;
+		fleet[i].connect_ms = -1;
+		if (check_clientID(fleet[i].client_id) < 0) {
+			b.entries[i].state = BULK_DONE;
+			b.report.failed++;
+			b.left--;
+		}
+	}
+
+	while (b.left > 0) {
+		now = now_ms();
+
+		/* Start attempts, retries first once due. */
+		while (b.active_len < b.bo.concurrency &&
+				mqtt_flow_delay(&pace, now_us()) == 0) {
+			if (b.retries_len > 0 && b.entries[b.retries[0]].next_ms <= now) {
+				i = retries_pop(&b);
+			} else {
+				while (next < count && b.entries[next].state == BULK_DONE)
+					next++;
+				if (next >= count)
+					break;
+				i = next++;
+			}
+			mqtt_flow_take(&pace);
+			bulk_start(&b, i, addr, now);
+		}
+
+		n = epoll_wait(b.epoll_fd, events, BULK_EVENTS,
+						bulk_wait_ms(&b, next, count, &pace, now));
+		if (n < 0 && errno != EINTR)
+			goto out;
+
+		now = now_ms();
+		for (int j = 0; j < n; j++) {
+			i = (int)events[j].data.u32;
+			if (b.entries[i].state == BULK_CONNECTING)
+				bulk_connected(&b, i, now);
+			else if (b.entries[i].state == BULK_CONNACK)
+				bulk_connack(&b, i, now);
+		}
+
+		for (int j = 0; j < b.active_len; j++) {
+			i = b.active[j];
+			if (b.entries[i].deadline_ms > now)
+				continue;
+			bulk_retry(&b, i, now);
+			/* The last active session took its place. */
+			j--;
+		}
+	}
+
+	ret = b.report.connected;
+out:
+	/* Only left on error, attempts in progress are dropped. */
+	while (b.active_len > 0) {
+		i = b.active[0];
+		b.fleet[i].attempts = b.bo.max_attempts;
+		bulk_retry(&b, i, now_ms());
+	}
+	b.report.elapsed_ms = now_ms() - b.start_ms;
+	if (b.report.failed > 0)
+		b.report.all_connected_ms = -1;
+	if (report != NULL)
+		*report = b.report;
+	if (b.epoll_fd >= 0)
+		close(b.epoll_fd);
+	free(b.entries);
+	free(b.retries);
+	free(b.active);
+	return ret;
+#else
+	(void)hostname;
+	(void)port;
+	(void)connection_flags;
+	(void)keepalive;
+	(void)options;
+	(void)fleet;
+	(void)count;
+	(void)bulk;
+	(void)report;
+	print_err("Bulk connects allocate their sessions, not in static builds");
+	return -1;
+#endif
+}
+
+static int check_filters(mqtt_session *s, int subs_params_len,
+							const mqtt_subs_params *subs_params)
+{
+	if (s == NULL) {
+		print_err("Not connected !!!");
+		return -1;
+	}
+	if (s->shm != NULL) {
+		print_err("Subscriptions are not available through the multiplexer");
+		return -1;
+	}
+	if (subs_params == NULL || subs_params_len <= 0) {
+		print_err("Subscribe parameters is NULL !!!");
+		return -1;
+	}
+
+	for (int i = 0; i < subs_params_len; i++) {
+		print_dbg("Topic [%d] : %s", i+1, subs_params[i].topic);
+		if (mqtt_valid_topic_filter(subs_params[i].topic,
+									subs_params[i].topic_len) < 0) {
+			print_err("Invalid topic filter [%d] !!!", i+1);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Largest filters packet, the transmit buffer is sized for it. */
+static int filters_max_len(mqtt_session *s)
+{
+	int max_len = s->limits.max_packet_size;
+
+	if (max_len > MQTT_MAX_PACKET_SIZE)
+		max_len = MQTT_MAX_PACKET_SIZE;
+	if (s->fixed && max_len > s->tx_size)
+		max_len = s->tx_size;
+	if (s->lanes != NULL && max_len > mqtt_lanes_max(s->lanes))
+		max_len = mqtt_lanes_max(s->lanes);
+	if (session_buf(s, &s->tx, &s->tx_size, max_len) < 0)
+		return -1;
+
+	return max_len;
+}
+
+/* Send one SUBSCRIBE or UNSUBSCRIBE packet holding as many filters as fit,
+ * returns the number of filters sent. Acks of connections given their
+ * memory are decoded in its codes array, their packets hold no more filters
+ * than it does. */
+static int send_filter_packet(mqtt_session *s, uint8_t type, int max_len,
+								uint16_t packet_id,
+								const mqtt_subs_params *subs_params,
+								int subs_params_len)
+{
+	int buf_len, n;
+
+	if (s->fixed && subs_params_len > s->codes_size)
+		subs_params_len = s->codes_size;
+	if (type == MQTT_PROT_SUBSCRIBE)
+		buf_len = mqtt_prot_subscribe(s->tx, max_len, s->version, packet_id,
+										subs_params, subs_params_len, &n);
+	else
+		buf_len = mqtt_prot_unsubscribe(s->tx, max_len, s->version,
+										packet_id, subs_params,
+										subs_params_len, &n);
+	if (buf_len < 0) {
+		print_err("Topic filter does not fit in a packet");
+		return -1;
+	}
+	if (send_packet(s, s->tx, buf_len) < 0) {
+		print_err("Couldn't send packet");
+		return -1;
+	}
+
+	return n;
+}
+
+/*
+ * Send SUBSCRIBE or UNSUBSCRIBE packets for any number of filters. Filters
+ * are split into packets as large as the broker accepts, all packets are
+ * sent before waiting so the whole set costs about one round trip, then
+ * acks are matched to their packet by identifier in whatever order they
+ * arrive. results receives one return code per filter, 0 when the ack
+ * carries none (UNSUBACK with MQTT v3.1.1).
+ */
+static int send_filters(mqtt_session *s, uint8_t type, int subs_params_len,
+						const mqtt_subs_params *subs_params, int *results)
+{
+	uint8_t ack_type = (type == MQTT_PROT_SUBSCRIBE) ?
+						MQTT_PROT_SUBACK : MQTT_PROT_UNSUBACK;
+	uint16_t ids_stack[MQTT_FILTERS_STACK];
+	int firsts_stack[MQTT_FILTERS_STACK + 1];
+	uint8_t codes_stack[MQTT_FILTERS_STACK];
+	uint8_t *codes = NULL;
+	uint16_t *ids = NULL, packet_id;
+	int *firsts = NULL;
+	int max_len, buf_len, nb_packets = 0, pending, done = 0, n, i, k;
+	int codes_len;
+
+	max_len = filters_max_len(s);
+	if (max_len < 0)
+		goto fail;
+
+	/* At most one packet per filter, firsts[k] is the first filter of packet
+	 * k and firsts[nb_packets] the end of the last one. */
+	ids = (uint16_t *)scratch_alloc(s, ids_stack, sizeof(ids_stack),
+									subs_params_len * sizeof(uint16_t));
+	firsts = (int *)scratch_alloc(s, firsts_stack, sizeof(firsts_stack),
+									(subs_params_len + 1) * sizeof(int));
+	/* A filter takes at least 4 bytes, acks never hold more codes than that
+	 * nor than the filters sent. */
+	codes_len = (max_len / 4 < subs_params_len) ? max_len / 4 : subs_params_len;
+	codes = (uint8_t *)scratch_alloc(s, codes_stack, sizeof(codes_stack),
+										codes_len);
+	if (ids == NULL || firsts == NULL || codes == NULL)
+		goto fail;
+
+	while (done < subs_params_len) {
+		if (id_hold(s, &packet_id) < 0)
+			goto fail;
+		ids[nb_packets] = packet_id;
+		firsts[nb_packets++] = done;
+
+		n = send_filter_packet(s, type, max_len, packet_id,
+								&subs_params[done], subs_params_len - done);
+		if (n < 0)
+			goto fail;
+		done += n;
+	}
+	firsts[nb_packets] = done;
+	print_dbg("%d filters sent in %d packets", done, nb_packets);
+
+	for (pending = nb_packets; pending > 0; pending--) {
+		buf_len = wait_packet(s, ack_type, -1);
+		if (buf_len < 0)
+			goto fail;
+
+		n = (type == MQTT_PROT_SUBSCRIBE) ?
+			mqtt_prot_suback(s->version, s->rx, buf_len, &packet_id,
+								codes, codes_len) :
+			mqtt_prot_unsuback(s->version, s->rx, buf_len, &packet_id,
+								codes, codes_len);
+		if (n < 0) {
+			print_err("Bad ack!");
+			goto fail;
+		}
+
+		/* Not ours, may belong to an asynchronous subscribe. */
+		for (k = 0; k < nb_packets && ids[k] != packet_id; k++)
+			;
+		if (k == nb_packets) {
+			if (handle_packet(s, s->rx, buf_len) < 0)
+				goto fail;
+			pending++;
+			continue;
+		}
+		/* Packet identifiers may be reused once acknowledged. */
+		id_release(s, packet_id);
+		ids[k] = 0;
+
+		for (i = firsts[k]; i < firsts[k + 1]; i++) {
+			if (n == 0)
+				results[i] = 0;
+			else if (i - firsts[k] < n && i - firsts[k] < codes_len)
+				results[i] = codes[i - firsts[k]];
+			else
+				results[i] = MQTT_RC_UNSPECIFIED_ERROR;
+		}
+	}
+
+	scratch_free(ids, ids_stack);
+	scratch_free(firsts, firsts_stack);
+	scratch_free(codes, codes_stack);
+	return 0;
+fail:
+	for (k = 0; k < nb_packets; k++) {
+		if (ids[k] != 0)
+			id_release(s, ids[k]);
+	}
+	scratch_free(ids, ids_stack);
+	scratch_free(firsts, firsts_stack);
+	scratch_free(codes, codes_stack);
+	return -1;
+}
+
+static int all_granted(const int *results, int len)
+{
+	for (int i = 0; i < len; i++) {
+		if (results[i] >= 0x80) {
+			print_err("Topic filter [%d] refused, code 0x%02x", i+1,
+						results[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int mqtt_subscribe_results(int mqtt_socket,
+							int subs_params_len,
+							subscribe_parameters *subs_parameters,
+							int *results)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	mqtt_subs_params *subs_params = (mqtt_subs_params*)subs_parameters;
+
+	print_dbg("IN");
+
+	if (check_filters(s, subs_params_len, subs_params) < 0 || results == NULL)
+		return -1;
+
+	return send_filters(s, MQTT_PROT_SUBSCRIBE, subs_params_len, subs_params,
+						results);
+}
+
+int mqtt_subscribe(int mqtt_socket,
+					int subs_params_len,
+					subscribe_parameters *subs_parameters)
+{
+	int results_stack[MQTT_FILTERS_STACK];
+	int *results;
+	int ret = -1;
+
+	if (subs_params_len <= 0)
+		return -1;
+
+	results = (int *)scratch_alloc(session_get(mqtt_socket), results_stack,
+									sizeof(results_stack),
+									subs_params_len * sizeof(int));
+	if (results == NULL)
+		return -1;
+
+	if (mqtt_subscribe_results(mqtt_socket, subs_params_len, subs_parameters,
+								results) == 0)
+		ret = all_granted(results, subs_params_len);
+
+	scratch_free(results, results_stack);
+	return ret;
+}
+
+int mqtt_subscribe_async(int mqtt_socket,
+							int subs_params_len,
+							subscribe_parameters *subs_parameters,
+							int *results,
+							mqtt_complete_callback callback,
+							void *user_data)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	mqtt_subs_params *subs_params = (mqtt_subs_params*)subs_parameters;
+	mqtt_async_op *op;
+	uint16_t packet_id, first = 0;
+	int max_len, done = 0, n;
+
+	print_dbg("IN");
+
+	if (check_filters(s, subs_params_len, subs_params) < 0 || results == NULL)
+		return -1;
+
+	max_len = filters_max_len(s);
+	if (max_len < 0)
+		return -1;
+
+	while (done < subs_params_len) {
+		if (ops_reserve(s) < 0)
+			goto fail;
+		packet_id = next_packet_id(s);
+		n = send_filter_packet(s, MQTT_PROT_SUBSCRIBE, max_len, packet_id,
+								&subs_params[done], subs_params_len - done);
+		if (n < 0)
+			goto fail;
+
+		op = op_new(s, packet_id, MQTT_PROT_SUBACK);
+		op->results = &results[done];
+		op->nb_results = n;
+		if (first == 0) {
+			first = packet_id;
+			op->callback = callback;
+			op->user_data = user_data;
+		} else {
+			op->first = first;
+			op_find(s, first)->pending++;
+		}
+		done += n;
+	}
+
+	return 0;
+fail:
+	if (first != 0)
+		ops_release_group(s, first);
+	return -1;
+}
+
+static mqtt_lane publish_lane(mqtt_session *s, const char *topic)
+{
+	for (int i = 0; i < s->priority_topics_len; i++) {
+		if (mqtt_topic_match(s->priority_topics[i], topic, strlen(topic)))
+			return MQTT_LANE_HIGH;
+	}
+
+	return MQTT_LANE_BULK;
+}
+
+/* Escape prefix of payloads starting with the compression marker. */
+static const uint8_t payload_escape[MQTT_COMPRESS_ESCAPE_LEN] = {
+	MQTT_COMPRESS_MARKER, MQTT_COMPRESS_ESCAPE
+};
+
+/* Build a whole publish and queue it in its lane. */
+static int send_publish_queued(mqtt_session *s, uint8_t publish_flags,
+								uint16_t packet_id, const char *topic,
+								uint16_t sent_topic_len,
+								const mqtt_prot_properties *props,
+								const uint8_t *payload, uint32_t payload_len,
+								int escape)
+{
+	uint32_t esc_len = escape ? MQTT_COMPRESS_ESCAPE_LEN : 0;
+	int header_len, buf_len;
+
+	header_len = mqtt_prot_publish_header(NULL, 0, s->version, publish_flags,
+											packet_id, topic, sent_topic_len,
+											props, esc_len + payload_len);
+	buf_len = header_len + esc_len + payload_len;
+	if (header_len < 0 || session_buf(s, &s->tx, &s->tx_size, buf_len) < 0) {
+		print_err("Couldn't build publish packet");
+		return -1;
+	}
+	mqtt_prot_publish_header(s->tx, s->tx_size, s->version, publish_flags,
+								packet_id, topic, sent_topic_len, props,
+								esc_len + payload_len);
+	memcpy(&s->tx[header_len], payload_escape, esc_len);
+	memcpy(&s->tx[header_len + esc_len], payload, payload_len);
+	if (send_packet_lane(s, s->tx, buf_len, publish_lane(s, topic)) < 0) {
+		print_err("Couldn't send publish packet");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Build and send a publish, the topic is replaced by an alias if possible.
+ * escape is set for payloads given by the application that look framed. */
+static int send_publish(mqtt_session *s, uint8_t publish_flags,
+						uint16_t packet_id, const char *topic,
+						const uint8_t *payload, uint32_t payload_len,
+						int escape)
+{
+	uint32_t esc_len = escape ? MQTT_COMPRESS_ESCAPE_LEN : 0;
+	mqtt_prot_properties props;
+	uint16_t topic_len, sent_topic_len, alias = 0;
+	struct iovec iov[3];
+	int buf_len, n = 0, new_alias = 0;
+
+	topic_len = sent_topic_len = strlen(topic);
+	memset(&props, 0, sizeof(props));
+	if (s->version == MQTT_VERSION_5) {
+		switch (mqtt_alias_outbound(&s->out_aliases, topic, topic_len, &alias)) {
+			case 1:
+				new_alias = 1;
+				props.topic_alias = alias;
+				props.present |= MQTT_PROT_PROP_BIT(MQTT_PROP_TOPIC_ALIAS);
+				break;
+			case 0:
+				sent_topic_len = 0;
+				props.topic_alias = alias;
+				props.present |= MQTT_PROT_PROP_BIT(MQTT_PROP_TOPIC_ALIAS);
+				break;
+			default:
+				break;
+		}
+	}
+
+	/* Queued packets are copied whole, otherwise only the header is built
+	 * and the payload is written from the caller's buffer. */
+	if (s->lanes != NULL) {
+		if (send_publish_queued(s, publish_flags, packet_id, topic,
+								sent_topic_len, &props, payload, payload_len,
+								escape) < 0)
+			goto fail;
+		return 0;
+	}
+
+	buf_len = mqtt_prot_publish_header(NULL, 0, s->version, publish_flags,
+										packet_id, topic, sent_topic_len,
+										&props, esc_len + payload_len);
+	if (buf_len < 0 || session_buf(s, &s->tx, &s->tx_size, buf_len) < 0) {
+		print_err("Couldn't build publish packet");
+		goto fail;
+	}
+	iov[n].iov_base = s->tx;
+	iov[n++].iov_len = mqtt_prot_publish_header(s->tx, s->tx_size, s->version,
+												publish_flags, packet_id, topic,
+												sent_topic_len, &props,
+												esc_len + payload_len);
+	if (escape) {
+		iov[n].iov_base = (void *)payload_escape;
+		iov[n++].iov_len = esc_len;
+	}
+	iov[n].iov_base = (void *)payload;
+	iov[n++].iov_len = payload_len;
+	if (send_packetv(s, iov, n) < 0) {
+		print_err("Couldn't send publish packet");
+		goto fail;
+	}
+
+	return 0;
+fail:
+	/* The broker never saw the topic of this alias, later publishes must
+	 * announce it again. */
+	if (new_alias)
+		mqtt_alias_cancel(&s->out_aliases, alias);
+	return -1;
+}
+
+/* Wait until the rate limit allows a publish and take its token, handling
+ * received packets meanwhile. */
+static int wait_token(mqtt_session *s)
+{
+	struct timespec ts;
+	long delay;
+	int len;
+
+	while ((delay = mqtt_flow_delay(&s->flow, now_us())) > 0) {
+		if (s->shm != NULL) {
+			ts.tv_sec = delay / 1000000L;
+			ts.tv_nsec = (delay % 1000000L) * 1000L;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		len = read_packet(s, now_ms() + (delay + 999) / 1000);
+		if (len < 0 || (len > 0 && handle_packet(s, s->rx, len) < 0))
+			return -1;
+	}
+
+	mqtt_flow_take(&s->flow);
+	return 0;
+}
+
+/* Send a publish and complete its QoS flow. Through the multiplexer,
+ * payloads are sent as they are. */
+static int publish(mqtt_session *s, uint8_t publish_flags, const char *topic,
+					const uint8_t *payload, uint32_t payload_len, int escape)
+{
+	uint16_t packet_id = 0;
+	uint8_t qos = (publish_flags >> 1) & 0x03;
+	long sent_us;
+	int buf_len, ret = -1;
+
+	if (wait_token(s) < 0)
+		return -1;
+
+	if (s->shm != NULL)
+		return mqtt_shm_publish(s->shm, publish_flags, topic, strlen(topic),
+								payload, payload_len, MQTT_ACK_TIMEOUT_MS);
+
+	if (qos == 0)
+		return send_publish(s, publish_flags, 0, topic, payload, payload_len,
+							escape);
+
+	if (id_hold(s, &packet_id) < 0)
+		return -1;
+	sent_us = now_us();
+	if (send_publish(s, publish_flags, packet_id, topic, payload,
+						payload_len, escape) < 0)
+		goto out;
+
+	buf_len = wait_packet(s, (qos == 1) ? MQTT_PROT_PUBACK : MQTT_PROT_PUBREC,
+							packet_id);
+	if (buf_len < 0) {
+		mqtt_flow_timeout(&s->flow, now_us());
+		print_err("No ack!");
+		goto out;
+	}
+	flow_ack(s, sent_us, s->ops_used);
+
+	if (qos == 1) {
+		if (mqtt_prot_puback(s->version, s->rx, buf_len, NULL) != 0) {
+			print_err("Bad puback!");
+			goto out;
+		}
+		ret = 0;
+		goto out;
+	}
+
+	if (mqtt_prot_pubresp_decode(s->version, MQTT_PROT_PUBREC, s->rx,
+									buf_len, NULL) >= 0x80) {
+		print_err("Bad pubrec!");
+		goto out;
+	}
+	if (send_pubresp(s, MQTT_PROT_PUBREL, packet_id) < 0) {
+		print_err("Couldn't send pubrel packet");
+		goto out;
+	}
+	buf_len = wait_packet(s, MQTT_PROT_PUBCOMP, packet_id);
+	if (buf_len < 0) {
+		print_err("Bad pubcomp!");
+		goto out;
+	}
+	ret = 0;
+out:
+	id_release(s, packet_id);
+	return ret;
+}
+
+static int check_publish(mqtt_session *s, const char *topic, const void *msg)
+{
+	if (s == NULL) {
+		print_err("Not connected !!!");
+		return -1;
+	}
+	if (topic == NULL || msg == NULL) {
+		print_err("Topic or msg is NULL !!!");
+		return -1;
+	}
+	if (mqtt_valid_topic_name(topic, strlen(topic)) < 0) {
+		print_err("Invalid topic name !!!");
+		return -1;
+	}
+
+	return 0;
+}
+
+int mqtt_publish(int mqtt_socket, mqtt_publish_flags publish_flags,
+					const char *topic, const char *msg)
+{
+	print_dbg("IN");
+
+	if (msg == NULL) {
+		print_err("Topic or msg is NULL !!!");
+		return -1;
+	}
+
+	return mqtt_publish_bin(mqtt_socket, publish_flags, topic,
+							(const uint8_t *)msg, strlen(msg));
+}
+
+/* Payloads given by the application are escaped only on connections
+ * framing them. */
+static int needs_escape(const mqtt_session *s, const uint8_t *payload,
+						int payload_len)
 {
-	int id_len = strlen(clientID);
-	for (int i = 0; i < id_len - 1; i++) {
-		if ((clientID[i] >= '0' && clientID[i] <= '9') ||
-			(clientID[i] >= 'A' && clientID[i] <= 'Z') ||
-			(clientID[i] >= 'a' && clientID[i] <= 'z')) {
-			continue;
-		} else {
-			return -1;
-		}
+	return s->framing && mqtt_compress_needs_escape(payload, payload_len);
+}
+
+/* Replace the payload by its compressed form if compression is set and
+ * worth it. Payloads to escape are left as they are. */
+static int compress_payload(mqtt_session *s, const char *topic,
+							const uint8_t **payload, int *payload_len)
+{
+	int len;
+
+	if (s->compressor == NULL || !s->framing ||
+		mqtt_compress_needs_escape(*payload, *payload_len))
+		return 0;
+
+	len = mqtt_compress_bound(s->compressor, *payload_len);
+	if (ensure_buf(&s->ztx, &s->ztx_size, len) < 0)
+		return -1;
+	len = mqtt_compress(s->compressor, topic, *payload, *payload_len,
+						s->ztx, s->ztx_size);
+	if (len > 0) {
+		*payload = s->ztx;
+		*payload_len = len;
 	}
+
 	return 0;
 }
 
-int mqtt_connect(const char *hostname,
-					int port,
-					const char *clientID,
-					mqtt_connect_flags connection_flags,
-					int keepalive,
-					const char *username,
-					const char *password)
+/* Publish a packed payload from the aggregator. */
+static int aggregate_send(void *ctx, const char *topic, uint8_t flags,
+							const uint8_t *payload, int payload_len)
 {
-	int mqtt_socket, buf_len;
-	uint8_t buffer[BUFFER_SIZE];
-	uint8_t connect_flags = (uint8_t)connection_flags;
+	mqtt_session *s = (mqtt_session *)ctx;
+
+	if (compress_payload(s, topic, &payload, &payload_len) < 0)
+		return -1;
+
+	return publish(s, flags, topic, payload, payload_len, 0);
+}
+
+/* Send the aggregated payloads due at now_ms, all of them for 0. */
+static int flush_aggregated(mqtt_session *s, long now)
+{
+	if (s->aggregator == NULL)
+		return 0;
+
+	return mqtt_aggregator_flush(s->aggregator, now, aggregate_send, s);
+}
+
+int mqtt_publish_bin(int mqtt_socket, mqtt_publish_flags publish_flags,
+						const char *topic, const uint8_t *payload,
+						int payload_len)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	long now;
+	int escape, ret;
 
 	print_dbg("IN");
 
-	if (hostname == NULL) {
-		print_err("Hostname is NULL !!!");
+	if (check_publish(s, topic, payload) < 0 || payload_len < 0)
 		return -1;
+	escape = needs_escape(s, payload, payload_len);
+
+	if (publish_flags & PUBLISH_FLAG_AS_IS)
+		return publish(s, publish_flags & ~PUBLISH_FLAG_AS_IS, topic, payload,
+						payload_len, 0);
+
+	if (s->aggregator != NULL && s->framing) {
+		now = now_ms();
+		if (flush_aggregated(s, now) < 0)
+			return -1;
+		ret = mqtt_aggregator_add(s->aggregator, topic, publish_flags,
+									payload, payload_len, now,
+									aggregate_send, s);
+		if (ret != 0)
+			return (ret < 0) ? -1 : 0;
 	}
-	if (clientID == NULL) {
-		print_err("ClientID is mandatory !!!");
+
+	if (compress_payload(s, topic, &payload, &payload_len) < 0)
 		return -1;
-	}
-	if (valid_clientID(clientID) == -1) {
-		print_err("Invalid ClientID !!!");
-		print_err("ClientID must contain [0-9][a-z][A-Z] only!");
+
+	return publish(s, publish_flags, topic, payload, payload_len, escape);
+}
+
+int mqtt_publish_async(int mqtt_socket, mqtt_publish_flags publish_flags,
+						const char *topic, const uint8_t *payload,
+						int payload_len, mqtt_complete_callback callback,
+						void *user_data)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	uint8_t qos = (publish_flags >> 1) & 0x03;
+	mqtt_async_op *op;
+	uint16_t packet_id;
+	long sent_us;
+	int escape;
+
+	print_dbg("IN");
+
+	if (check_publish(s, topic, payload) < 0 || payload_len < 0)
+		return -1;
+	escape = needs_escape(s, payload, payload_len);
+	if (publish_flags & PUBLISH_FLAG_AS_IS) {
+		publish_flags &= ~PUBLISH_FLAG_AS_IS;
+		escape = 0;
+	} else if (compress_payload(s, topic, &payload, &payload_len) < 0) {
 		return -1;
 	}
 
-	mqtt_socket = socket_create(hostname, port);
-	if (mqtt_socket < 0) {
-		print_err("Couldn't create socket, MQTT not connecting ...");
+	/* The multiplexer completes its publishes before returning. */
+	if (s->shm != NULL)
+		return (publish(s, publish_flags, topic, payload, payload_len,
+						escape) < 0) ? -1 : 1;
+
+	if (qos != 0 && s->ops_used >= s->flow.window) {
+		print_err("In-flight window of %d publishes full", s->flow.window);
 		return -1;
 	}
+	if (wait_token(s) < 0)
+		return -1;
+	if (qos == 0)
+		return (send_publish(s, publish_flags, 0, topic, payload,
+								payload_len, escape) < 0) ? -1 : 1;
 
-	print_dbg("Socket creation OK, try sending MQTT Connect");
-	memset(&buffer[0], 0, BUFFER_SIZE * sizeof(uint8_t));
+	if (ops_reserve(s) < 0)
+		return -1;
 
-	if ((connect_flags & CONNECT_FLAG_USERNAME && username == NULL) ||
-		(!(connect_flags & CONNECT_FLAG_USERNAME) && username != NULL) ||
-		(connect_flags & CONNECT_FLAG_PASSWORD && password == NULL) ||
-		(!(connect_flags & CONNECT_FLAG_PASSWORD) && password != NULL)) {
-		print_wrn("Username/Passwrd connection flag is set but username field \
-					is empty, we'll try to connect without authentication!");
-		connect_flags &= !(CONNECT_FLAG_USERNAME);
-		connect_flags &= !(CONNECT_FLAG_PASSWORD);
-		username = NULL;
-		password = NULL;
-	}
+	/* Taken first, the broker may answer before send returns. */
+	sent_us = now_us();
+	packet_id = next_packet_id(s);
+	if (send_publish(s, publish_flags, packet_id, topic, payload,
+						payload_len, escape) < 0)
+		return -1;
 
-	buf_len = mqtt_prot_connect(buffer, connect_flags, keepalive,
-									clientID, username, password);
-	if (socket_send(mqtt_socket, buffer, buf_len) < 0) {
-		print_err("Couldn't send connect packet");
+	op = op_new(s, packet_id, (qos == 1) ? MQTT_PROT_PUBACK : MQTT_PROT_PUBREC);
+	op->sent_us = sent_us;
+	op->callback = callback;
+	op->user_data = user_data;
+	return 0;
+}
+
+int mqtt_publish_batch(int mqtt_socket, mqtt_publish_flags publish_flags,
+						int count, const mqtt_message *msgs)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	int as_is = (publish_flags & PUBLISH_FLAG_AS_IS) != 0;
+	mqtt_compress_item *items;
+	size_t bound = 0;
+	int escape, ret = -1;
+
+	print_dbg("IN");
+
+	if (s == NULL) {
+		print_err("Not connected !!!");
 		return -1;
 	}
-
-	usleep(RECV_TIMEOUT);
-	buf_len = socket_receive(mqtt_socket, buffer);
-	if (buf_len < 0) {
-		print_err("No answer packet");
+	if (msgs == NULL || count < 0)
 		return -1;
+	for (int i = 0; i < count; i++) {
+		if (check_publish(s, msgs[i].topic, msgs[i].payload) < 0 ||
+			msgs[i].payload_len < 0)
+			return -1;
 	}
 
-	if (mqtt_prot_connack(buffer, buf_len) != MQTT_CONNACK_ACCEPTED) {
-		print_err("Bad conack!");
+	publish_flags &= ~PUBLISH_FLAG_AS_IS;
+	if (s->compressor == NULL || !s->framing || as_is) {
+		for (int i = 0; i < count; i++) {
+			escape = !as_is && needs_escape(s, msgs[i].payload,
+											msgs[i].payload_len);
+			if (publish(s, publish_flags, msgs[i].topic, msgs[i].payload,
+						msgs[i].payload_len, escape) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	items = (mqtt_compress_item *)calloc(count, sizeof(mqtt_compress_item));
+	if (items == NULL)
 		return -1;
+	for (int i = 0; i < count; i++) {
+		items[i].topic = msgs[i].topic;
+		items[i].in = msgs[i].payload;
+		items[i].in_len = msgs[i].payload_len;
+		bound += mqtt_compress_bound(s->compressor, msgs[i].payload_len);
 	}
 
-	return mqtt_socket;
+	if (bound > INT32_MAX || ensure_buf(&s->ztx, &s->ztx_size, bound) < 0 ||
+		mqtt_compress_batch(s->compressor, items, count, s->ztx,
+							s->ztx_size) < 0) {
+		print_err("Couldn't compress batch");
+		goto out;
+	}
+
+	/* Payloads to escape were left uncompressed. */
+	for (int i = 0; i < count; i++) {
+		escape = needs_escape(s, msgs[i].payload, msgs[i].payload_len);
+		if (publish(s, publish_flags, msgs[i].topic, items[i].out,
+					items[i].out_len, escape) < 0)
+			goto out;
+	}
+
+	ret = 0;
+out:
+	free(items);
+	return ret;
 }
 
-int mqtt_connect_simple(const char *hostname,
-							int port,
-							const char *clientID)
+int mqtt_async_pending(int mqtt_socket)
 {
-	return mqtt_connect(hostname, port, clientID, CONNECT_FLAG_CLEAN_SESSION,
-						60, NULL, NULL);
+	mqtt_session *s = session_get(mqtt_socket);
+
+	if (s == NULL)
+		return -1;
+
+	return s->ops_used;
 }
 
-int mqtt_subscribe(int mqtt_socket,
-					int subs_params_len,
-					subscribe_parameters *subs_parameters)
+int mqtt_async_window(int mqtt_socket)
 {
-	int buf_len, i;
-	uint8_t buffer[BUFFER_SIZE];
-	mqtt_subs_params *subs_params = (mqtt_subs_params*)subs_parameters;
+	mqtt_session *s = session_get(mqtt_socket);
 
-	print_dbg("IN");
+	if (s == NULL)
+		return -1;
 
-	if (subs_params == NULL || subs_params->topic == NULL) {
-		print_err("Subscribe parameters is NULL !!!");
-		goto fail;
-	}
+	return s->flow.window;
+}
 
-	print_dbg("Subscribing to topic(s):");
-	for (i = 0; i < subs_params_len; i++)
-		print_dbg("Topic [%d] : %s", i+1, subs_params[i].topic);
+int mqtt_async_ready(int mqtt_socket, mqtt_publish_flags publish_flags)
+{
+	mqtt_session *s = session_get(mqtt_socket);
 
-	memset(&buffer[0], 0, BUFFER_SIZE * sizeof(uint8_t));
-	buf_len = mqtt_prot_subscribe(subs_params, subs_params_len, buffer);
-	if (socket_send(mqtt_socket, buffer, buf_len) < 0) {
-		print_err("Couldn't send subscribe packet");
-		goto fail;
-	}
+	if (s == NULL)
+		return -1;
 
-	usleep(RECV_TIMEOUT);
-	buf_len = socket_receive(mqtt_socket, buffer);
-	if (buf_len < 0) {
-		print_err("No answer packet");
-		goto fail;
+	if (((publish_flags >> 1) & 0x03) != 0 && s->shm == NULL &&
+		s->ops_used >= s->flow.window)
+		return 0;
+
+	return mqtt_flow_delay(&s->flow, now_us()) == 0;
+}
+
+int mqtt_set_rate_limit(int mqtt_socket, int rate, int burst)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+
+	if (s == NULL || rate < 0)
+		return -1;
+
+	mqtt_flow_set_rate(&s->flow, rate, burst, now_us());
+	return 0;
+}
+
+int mqtt_get_flow_stats(int mqtt_socket, mqtt_flow_stats *stats)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+
+	if (s == NULL || stats == NULL)
+		return -1;
+
+	stats->window = s->flow.window;
+	stats->in_flight = s->ops_used;
+	stats->srtt_us = s->flow.srtt_us;
+	stats->min_rtt_us = s->flow.min_rtt_us;
+	stats->delivery_rate = s->flow.bw;
+	return 0;
+}
+
+static mqtt_compressor *session_compressor(mqtt_session *s)
+{
+	if (s->compressor == NULL)
+		s->compressor = mqtt_compressor_create(MQTT_COMPRESS_NONE, 0);
+
+	return s->compressor;
+}
+
+int mqtt_set_compression(int mqtt_socket, mqtt_compress_algo algo, int level)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	mqtt_compressor *c;
+
+	if (s == NULL || heap_refused(s, "Compression"))
+		return -1;
+	/* The multiplexer publishes payloads as it gets them. */
+	if (s->shm != NULL && algo != MQTT_COMPRESS_NONE) {
+		print_err("Compression needs a direct connection");
+		return -1;
 	}
 
-	if (mqtt_prot_suback(buffer, buf_len) != 0) {
-		print_err("Bad suback!");
-		goto fail;
+	c = mqtt_compressor_create(algo, level);
+	if (c == NULL)
+		return -1;
+
+	mqtt_compressor_destroy(s->compressor);
+	s->compressor = c;
+	if (algo != MQTT_COMPRESS_NONE)
+		s->framing = 1;
+	return 0;
+}
+
+int mqtt_set_framing(int mqtt_socket, int enable)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+
+	if (s == NULL || (!enable && flush_aggregated(s, 0) < 0))
+		return -1;
+	/* The multiplexer publishes payloads as it gets them. */
+	if (s->shm != NULL && enable) {
+		print_err("Framing needs a direct connection");
+		return -1;
 	}
 
+	s->framing = (enable != 0);
 	return 0;
-fail:
-	return -1;
 }
 
-int mqtt_publish(int mqtt_socket, mqtt_publish_flags publish_flags, 
-					const char *topic, const char *msg)
+int mqtt_add_compression_dictionary(int mqtt_socket,
+									const char *topic_filter,
+									const void *dict,
+									int dict_len)
 {
-	int buf_len;
-	uint8_t buffer[BUFFER_SIZE];
+	mqtt_session *s = session_get(mqtt_socket);
 
-	print_dbg("IN");
+	if (s == NULL || dict_len <= 0 || session_compressor(s) == NULL)
+		return -1;
 
-	if (topic == NULL || msg == NULL) {
-		print_err("Topic or msg is NULL !!!");
+	return mqtt_compressor_add_dictionary(s->compressor, topic_filter, dict,
+											dict_len);
+}
+
+int mqtt_set_cache(int mqtt_socket, size_t memory_budget, int entry_size)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	mqtt_cache *c = NULL;
+
+	if (s == NULL || entry_size < 0 ||
+		(memory_budget > 0 && heap_refused(s, "A cache")))
 		return -1;
+
+	if (memory_budget > 0) {
+		c = mqtt_cache_create(memory_budget, entry_size);
+		if (c == NULL)
+			return -1;
 	}
 
-	/* TODO: Receive publish flags */
-	memset(&buffer[0], 0, BUFFER_SIZE * sizeof(uint8_t));
-	buf_len = mqtt_prot_publish(publish_flags, topic, msg, buffer);
-	if (socket_send(mqtt_socket, buffer, buf_len) < 0) {
-		print_err("Couldn't send publish packet");
+	mqtt_cache_destroy(s->cache);
+	s->cache = c;
+	return 0;
+}
+
+int mqtt_set_aggregation(int mqtt_socket, int max_topics, int max_bytes,
+							int max_delay_ms)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	mqtt_aggregator *a = NULL;
+	int max;
+
+	if (s == NULL || (max_topics > 0 && heap_refused(s, "Aggregation")) ||
+		flush_aggregated(s, 0) < 0)
+		return -1;
+	/* The multiplexer publishes each message, it does not frame them. */
+	if (s->shm != NULL && max_topics > 0) {
+		print_err("Aggregation needs a direct connection");
 		return -1;
 	}
 
-	usleep(RECV_TIMEOUT);
-	buf_len = socket_receive(mqtt_socket, buffer);
-	if (buf_len < 0) {
-		print_err("No answer packet");
+	/* Room for the topic and headers in the broker packet size. */
+	max = s->limits.max_packet_size - MQTT_AGGREGATE_TOPIC_MAX - 32;
+	if (max_bytes > max)
+		max_bytes = max;
+
+	if (max_topics > 0) {
+		a = mqtt_aggregator_create(max_topics, max_bytes, max_delay_ms);
+		if (a == NULL)
+			return -1;
+	}
+
+	mqtt_aggregator_destroy(s->aggregator);
+	s->aggregator = a;
+	if (a != NULL)
+		s->framing = 1;
+	return 0;
+}
+
+int mqtt_set_send_queue(int mqtt_socket, int max_bytes, int chunk_bytes)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	mqtt_lanes *l = NULL;
+
+	if (s == NULL || s->shm != NULL || max_bytes < 0 || chunk_bytes < 0 ||
+		lanes_drain(s, MQTT_LANE_BULK) < 0)
+		return -1;
+	if (s->fixed && max_bytes > s->lanes_max) {
+		print_err("Send queue of %d bytes above the %d given", max_bytes,
+					s->lanes_max);
 		return -1;
 	}
 
-	if (mqtt_prot_puback(buffer, buf_len) != 0) {
-		print_err("Bad puback!");
+	/* The memory given is reused, the previous lanes are drained. */
+	mqtt_lanes_destroy(s->lanes);
+	s->lanes = NULL;
+	if (max_bytes == 0)
+		return 0;
+
+	if (s->fixed)
+		l = mqtt_lanes_init(s->lanes_mem, MQTT_LANES_SIZE(max_bytes),
+							max_bytes, chunk_bytes);
+	else
+		l = mqtt_lanes_create(max_bytes, chunk_bytes);
+	if (l == NULL)
+		return -1;
+
+	s->lanes = l;
+	return 0;
+}
+
+int mqtt_add_priority_topic(int mqtt_socket, const char *topic_filter)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	char **grown;
+
+	if (s == NULL || topic_filter == NULL ||
+		heap_refused(s, "Priority topics"))
+		return -1;
+	if (mqtt_valid_topic_filter(topic_filter, strlen(topic_filter)) < 0) {
+		print_err("Invalid topic filter %s", topic_filter);
 		return -1;
 	}
 
+	grown = (char **)realloc(s->priority_topics,
+								(s->priority_topics_len + 1) * sizeof(char *));
+	if (grown == NULL)
+		return -1;
+	s->priority_topics = grown;
+	s->priority_topics[s->priority_topics_len] = strdup(topic_filter);
+	if (s->priority_topics[s->priority_topics_len] == NULL)
+		return -1;
+	s->priority_topics_len++;
+
 	return 0;
 }
 
+int mqtt_get_last(int mqtt_socket, const char *topic, void *payload,
+					int payload_len, uint8_t *flags)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+
+	if (s == NULL || s->cache == NULL || topic == NULL || payload_len < 0)
+		return -1;
+
+	return mqtt_cache_get(s->cache, topic, strlen(topic), payload,
+							payload_len, flags);
+}
+
+/* Forget cached values of unsubscribed filters. A topic still matched by
+ * another subscription is dropped too and comes back with its next
+ * message. */
+/* Drop the cached topics of the filters the broker unsubscribed. */
+static void cache_drop(mqtt_session *s, int subs_params_len,
+						const mqtt_subs_params *subs_params,
+						const int *results)
+{
+	char *filter;
+
+	for (int i = 0; i < subs_params_len; i++) {
+		if (results[i] >= 0x80)
+			continue;
+		filter = strndup(subs_params[i].topic, subs_params[i].topic_len);
+		if (filter == NULL)
+			continue;
+		mqtt_cache_drop(s->cache, filter);
+		free(filter);
+	}
+}
+
 void mqtt_disconnect(int mqtt_socket)
 {
+	mqtt_session *s = session_get(mqtt_socket);
+	uint8_t buffer[3];
 	int buf_len;
-	uint8_t buffer[BUFFER_SIZE];
 
 	print_dbg("IN");
 
-	memset(&buffer[0], 0, BUFFER_SIZE * sizeof(uint8_t));
-	buf_len = mqtt_prot_disconnect(buffer);
+	/* Aggregated messages are still sent, delivery is best effort. */
+	if (s != NULL && flush_aggregated(s, 0) < 0)
+		print_wrn("Couldn't send aggregated messages");
+	if (s != NULL && lanes_drain(s, MQTT_LANE_BULK) < 0)
+		print_wrn("Couldn't send queued packets");
+
+	if (s != NULL && s->shm != NULL) {
+		mqtt_shm_close(s->shm);
+		session_free(s);
+		return;
+	}
+
+	buf_len = mqtt_prot_disconnect(buffer, s ? s->version : 0, 0);
+	mqtt_capture_packet(mqtt_socket, s ? s->version : 0, MQTT_CAPTURE_OUT,
+						buffer, buf_len);
 	if (socket_send(mqtt_socket, buffer, buf_len) < 0)
 		print_wrn("Couldn't send disconnect packet");
-	
+
+	if (s != NULL)
+		ops_fail_all(s);
+
+	session_free(s);
 	socket_close(mqtt_socket);
 }
 
@@ -220,37 +2655,110 @@ int mqtt_unsubscribe(int mqtt_socket,
 						int subs_params_len,
 						subscribe_parameters *subs_parameters)
 {
-	int buf_len;
-	uint8_t buffer[BUFFER_SIZE];
+	mqtt_session *s = session_get(mqtt_socket);
 	mqtt_subs_params *subs_params = (mqtt_subs_params*)subs_parameters;
+	int results_stack[MQTT_FILTERS_STACK];
+	int *results;
+	int ret = -1;
 
 	print_dbg("IN");
 
-	if (subs_params == NULL || subs_params->topic == NULL) {
-		print_err("Topic is NULL !!!");
-		goto fail;
-	}
+	if (check_filters(s, subs_params_len, subs_params) < 0)
+		return -1;
 
-	memset(&buffer[0], 0, BUFFER_SIZE * sizeof(uint8_t));
-	buf_len = mqtt_prot_unsubscribe(subs_params, subs_params_len, buffer);
-	if (socket_send(mqtt_socket, buffer, buf_len) < 0) {
-		print_err("Couldn't send unsubscribe packet");
-		goto fail;
-	}
+	results = (int *)scratch_alloc(s, results_stack, sizeof(results_stack),
+									subs_params_len * sizeof(int));
+	if (results == NULL)
+		return -1;
 
-	usleep(RECV_TIMEOUT);
-	buf_len = socket_receive(mqtt_socket, buffer);
-	if (buf_len < 0) {
-		print_err("No answer packet");
-		goto fail;
+	if (send_filters(s, MQTT_PROT_UNSUBSCRIBE, subs_params_len, subs_params,
+						results) == 0) {
+		ret = all_granted(results, subs_params_len);
+		if (s->cache != NULL)
+			cache_drop(s, subs_params_len, subs_params, results);
 	}
 
-	if (mqtt_prot_unsuback(buffer, buf_len) != 0) {
-		print_err("Bad unsuuback!");
-		goto fail;
-	}
+	scratch_free(results, results_stack);
+	return ret;
+}
+
+int mqtt_flush(int mqtt_socket)
+{
+	mqtt_session *s = session_get(mqtt_socket);
 
+	if (s == NULL || flush_aggregated(s, 0) < 0 ||
+		lanes_drain(s, MQTT_LANE_BULK) < 0)
+		return -1;
+	if (s->shm != NULL)
+		return 0;
+
+	return socket_flush(mqtt_socket);
+}
+
+int mqtt_get_limits(int mqtt_socket, mqtt_connection_limits *limits)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+
+	if (s == NULL || limits == NULL)
+		return -1;
+
+	*limits = s->limits;
 	return 0;
-fail:
-	return -1;
-}
\ No newline at end of file
+}
+
+int mqtt_set_message_callback(int mqtt_socket,
+								mqtt_message_callback callback,
+								void *user_data)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+
+	if (s == NULL)
+		return -1;
+
+	s->on_message = callback;
+	s->user_data = user_data;
+	return 0;
+}
+
+int mqtt_loop(int mqtt_socket, int timeout_ms)
+{
+	mqtt_session *s = session_get(mqtt_socket);
+	long deadline_ms = now_ms() + timeout_ms, ping_ms;
+	uint8_t ping[2];
+	int len;
+
+	if (s == NULL || flush_aggregated(s, now_ms()) < 0)
+		return -1;
+	if (s->shm != NULL)
+		return mqtt_shm_wait(s->shm, timeout_ms);
+
+	do {
+		/* Wake up in time to keep the connection alive and to send the
+		 * aggregated messages due. */
+		ping_ms = deadline_ms;
+		if (s->keepalive > 0 &&
+			s->last_send_ms + s->keepalive * 1000L < ping_ms)
+			ping_ms = s->last_send_ms + s->keepalive * 1000L;
+		if (s->aggregator != NULL &&
+			mqtt_aggregator_deadline(s->aggregator) >= 0 &&
+			mqtt_aggregator_deadline(s->aggregator) < ping_ms)
+			ping_ms = mqtt_aggregator_deadline(s->aggregator);
+
+		len = read_packet(s, ping_ms);
+		if (len < 0)
+			return -1;
+		if (len > 0 && handle_packet(s, s->rx, len) < 0)
+			return -1;
+		if (flush_aggregated(s, now_ms()) < 0)
+			return -1;
+
+		if (s->keepalive > 0 &&
+			now_ms() >= s->last_send_ms + s->keepalive * 1000L) {
+			len = mqtt_prot_pingreq(ping);
+			if (send_packet(s, ping, len) < 0)
+				return -1;
+		}
+	} while (now_ms() < deadline_ms || packet_buffered(s));
+
+	return 0;
+}
@@ -9,6 +9,12 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
+#include "stdint.h"
+
+#include "mqtt_compress.h"
+#include "mqtt_cache.h"
+#include "mqtt_lanes.h"
+#include "network.h"
 
 #define ENABLE_TRACES
 #include "trace.h"
@@ -23,6 +29,48 @@ typedef enum {
     MQTT_CONNACK_REFUSED_NOT_AUTHORIZED
 } mqtt_connack_err_codes;
 
+/* MQTT v5 reason codes, section 2.4. */
+typedef enum {
+    MQTT_RC_SUCCESS = 0x00,
+    MQTT_RC_GRANTED_QOS_1 = 0x01,
+    MQTT_RC_GRANTED_QOS_2 = 0x02,
+    MQTT_RC_NO_MATCHING_SUBSCRIBERS = 0x10,
+    MQTT_RC_UNSPECIFIED_ERROR = 0x80,
+    MQTT_RC_MALFORMED_PACKET = 0x81,
+    MQTT_RC_PROTOCOL_ERROR = 0x82,
+    MQTT_RC_IMPLEMENTATION_SPECIFIC_ERROR = 0x83,
+    MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION = 0x84,
+    MQTT_RC_CLIENT_ID_NOT_VALID = 0x85,
+    MQTT_RC_BAD_USER_NAME_OR_PASSWORD = 0x86,
+    MQTT_RC_NOT_AUTHORIZED = 0x87,
+    MQTT_RC_SERVER_UNAVAILABLE = 0x88,
+    MQTT_RC_SERVER_BUSY = 0x89,
+    MQTT_RC_BANNED = 0x8A,
+    MQTT_RC_SERVER_SHUTTING_DOWN = 0x8B,
+    MQTT_RC_KEEPALIVE_TIMEOUT = 0x8D,
+    MQTT_RC_SESSION_TAKEN_OVER = 0x8E,
+    MQTT_RC_TOPIC_FILTER_INVALID = 0x8F,
+    MQTT_RC_TOPIC_NAME_INVALID = 0x90,
+    MQTT_RC_PACKET_ID_IN_USE = 0x91,
+    MQTT_RC_PACKET_ID_NOT_FOUND = 0x92,
+    MQTT_RC_RECEIVE_MAXIMUM_EXCEEDED = 0x93,
+    MQTT_RC_TOPIC_ALIAS_INVALID = 0x94,
+    MQTT_RC_PACKET_TOO_LARGE = 0x95,
+    MQTT_RC_MESSAGE_RATE_TOO_HIGH = 0x96,
+    MQTT_RC_QUOTA_EXCEEDED = 0x97,
+    MQTT_RC_PAYLOAD_FORMAT_INVALID = 0x99,
+    MQTT_RC_RETAIN_NOT_SUPPORTED = 0x9A,
+    MQTT_RC_QOS_NOT_SUPPORTED = 0x9B,
+    MQTT_RC_USE_ANOTHER_SERVER = 0x9C,
+    MQTT_RC_SERVER_MOVED = 0x9D,
+    MQTT_RC_CONNECTION_RATE_EXCEEDED = 0x9F
+} mqtt_reason_code;
+
+typedef enum {
+    MQTT_VERSION_3_1_1 = 4,
+    MQTT_VERSION_5 = 5
+} mqtt_version;
+
 typedef enum {
     CONNECT_FLAG_RESERVED_BIT = 0b00000000,
     CONNECT_FLAG_CLEAN_SESSION = 0b00000010,
@@ -39,7 +87,10 @@ typedef enum {
     PUBLISH_FLAG_RETAIN = 0b00000001,
     PUBLISH_FLAG_QOS_2 = 0b00000010,
     PUBLISH_FLAG_QOS_3 = 0b00000100,
-    PUBLISH_FLAG_DUP = 0b0001000
+    PUBLISH_FLAG_DUP = 0b0001000,
+    /* Payload already framed by this library, as captured from the wire:
+     * sent as is, neither escaped, compressed nor aggregated. */
+    PUBLISH_FLAG_AS_IS = 0b10000000
 } mqtt_publish_flags;
 
 typedef enum {
@@ -54,9 +105,175 @@ typedef struct {
     const char *topic;
 } subscribe_parameters;
 
+/* Maximum time waiting for CONNACK, SUBACK, UNSUBACK and publish acks. */
+#define MQTT_ACK_TIMEOUT_MS 5000
+/* Default largest packet accepted from the broker. */
+#define MQTT_MAX_PACKET_SIZE 65536
+/* Largest message size a received compression header may announce, the
+ * decompression buffer is allocated from it before decoding. Larger
+ * messages are dropped. */
+#define MQTT_MAX_DECOMPRESSED_SIZE (16 * 1024 * 1024)
+
+/* Upper bounds of the connection state and of an in-flight table slot,
+ * checked at build time. */
+#define MQTT_SESSION_BYTES 512
+#define MQTT_ASYNC_OP_BYTES 64
+/* Return codes of one SUBACK kept by a connection given its memory. */
+#define MQTT_MEMORY_CODES 64
+#define MQTT_MEMORY_ALIGN(len) (((size_t)(len) + 15) & ~(size_t)15)
+
+/* Bytes of memory a connection needs, see mqtt_memory. Fixed for a given
+ * configuration: nothing else is allocated for the connection. */
+#define MQTT_MEMORY_SIZE(rx_size, tx_size, inflight, queue_size) \
+    (16 + MQTT_SESSION_BYTES + MQTT_MEMORY_CODES + \
+     MQTT_MEMORY_ALIGN(2 * (size_t)(inflight) * MQTT_ASYNC_OP_BYTES) + \
+     MQTT_MEMORY_ALIGN(rx_size) + MQTT_MEMORY_ALIGN(tx_size) + \
+     MQTT_MEMORY_ALIGN(queue_size))
+
+/**
+ * @brief Memory given to a connection, which then never allocates: its
+ * state, buffers and in-flight table live in buf, so its footprint is
+ * known in advance and no call waits for the allocator. Static builds
+ * (-DMQTT_STATIC_ALLOC) require it and allocate nothing after start up.
+ * Features needing the heap are refused on such connections: compression,
+ * caching, aggregation, priority topics, topic aliases and subscribing to
+ * more than MQTT_FILTERS_STACK filters at once. SUBSCRIBE packets hold at
+ * most MQTT_MEMORY_CODES filters. Compressed messages received are dropped.
+ * buf: MQTT_MEMORY_SIZE(rx_size, tx_size, inflight, queue_size) bytes, for
+ * instance a static array, used until mqtt_disconnect returns.
+ * size: Bytes of buf.
+ * rx_size: Receive buffer, the largest packet accepted from the broker, also
+ * announced as maximum packet size with MQTT v5.
+ * tx_size: Send buffer for every packet but publish payloads, which are
+ * written from the caller's buffer: CONNECT, publish headers and
+ * SUBSCRIBE packets, split to fit. Whole publishes with a send queue.
+ * inflight: Asynchronous operations waiting for acks at once, at least 1,
+ * rounded down to a power of two. Also caps the in-flight window.
+ * queue_size: Buffer coalescing writes, see socket_options, 0 for none.
+ * send_queue_size: Largest max_bytes given to mqtt_set_send_queue, 0 for
+ * none. buf then needs MQTT_LANES_SIZE(send_queue_size) more bytes.
+ */
+typedef struct {
+    void *buf;
+    size_t size;
+    int rx_size;
+    int tx_size;
+    int inflight;
+    int queue_size;
+    int send_queue_size;
+} mqtt_memory;
+
+/* Filters subscribed to at once without allocating. */
+#define MQTT_FILTERS_STACK 16
+
+/**
+ * @brief Connection options, a zero value selects the default.
+ * version: Protocol version, MQTT_VERSION_3_1_1 by default.
+ * The following fields are MQTT v5 only.
+ * receive_max: QoS 1 and 2 publishes the broker may send us unacknowledged,
+ * 65535 by default.
+ * max_packet_size: Largest packet accepted from the broker,
+ * MQTT_MAX_PACKET_SIZE by default. Also sizes the receive buffer with
+ * MQTT v3.1.1.
+ * topic_alias_max: Topic aliases the broker may use towards us, none by
+ * default.
+ * session_expiry: Seconds the broker keeps the session after disconnecting.
+ * tls: Connect over TLS with these options, usually to MQTT_TLS_PORT. NULL
+ * for plain TCP.
+ * socket: Socket options, to coalesce writes or tune buffers and keepalive.
+ * NULL for kernel defaults.
+ * memory: Memory of the connection, see mqtt_memory. NULL to allocate it,
+ * required by static builds.
+ */
+typedef struct {
+    mqtt_version version;
+    int receive_max;
+    int max_packet_size;
+    int topic_alias_max;
+    int session_expiry;
+    const socket_tls_options *tls;
+    const socket_options *socket;
+    const mqtt_memory *memory;
+} mqtt_connect_options;
+
+/**
+ * @brief Limits announced by the broker in CONNACK. With MQTT v3.1.1 the
+ * protocol defaults are reported.
+ * receive_max: QoS 1 and 2 publishes we may have unacknowledged, that is the
+ * in-flight window of this connection.
+ * max_packet_size: Largest packet the broker accepts.
+ * topic_alias_max: Topic aliases we may use towards the broker.
+ * max_qos: Highest QoS the broker supports.
+ * retain_available: 1 if the broker supports retained messages.
+ */
+typedef struct {
+    mqtt_version version;
+    int receive_max;
+    int max_packet_size;
+    int topic_alias_max;
+    int max_qos;
+    int retain_available;
+} mqtt_connection_limits;
+
+typedef struct {
+    const char *topic;
+    const uint8_t *payload;
+    int payload_len;
+} mqtt_message;
+
+/**
+ * @brief Called for each message received on subscribed topics.
+ * @param user_data Pointer given to mqtt_set_message_callback.
+ * @param topic Topic name, not NUL terminated.
+ * @param topic_len Topic name length.
+ * @param payload Message, already decompressed if it was compressed.
+ * @param payload_len Message length.
+ * @param flags Publish flags of the received message.
+ */
+typedef void (*mqtt_message_callback)(void *user_data,
+                                        const char *topic,
+                                        int topic_len,
+                                        const uint8_t *payload,
+                                        int payload_len,
+                                        uint8_t flags);
+
+/**
+ * @brief Flow control state of a connection.
+ * window: Asynchronous operations allowed to wait for acks.
+ * in_flight: Asynchronous operations waiting for acks.
+ * srtt_us: Smoothed ack round trip time.
+ * min_rtt_us: Lowest recent ack round trip time.
+ * delivery_rate: Acks per second, highest recent sample.
+ */
+typedef struct {
+    int window;
+    int in_flight;
+    long srtt_us;
+    long min_rtt_us;
+    long delivery_rate;
+} mqtt_flow_stats;
+
+/* Asynchronous operations in flight on a connection at most. */
+#define MQTT_ASYNC_MAX_OPS 32768
+
+/**
+ * @brief Called once an asynchronous operation completes, from the function
+ * that read its last ack: mqtt_loop or any call waiting for an answer. It
+ * may start other asynchronous operations but must not call functions
+ * waiting for an answer.
+ * @param user_data Pointer given with the operation.
+ * @param result 0 if completed or -1 if refused or if the connection was
+ * closed first.
+ */
+typedef void (*mqtt_complete_callback)(void *user_data, int result);
+
 /**
  * @brief This function initializes MQTT connection. Create socket and send
  * connection message packet, expects a valid connack answer.
+ * Clean sessions without will go through the local multiplexer (mqtt_mux)
+ * when it runs, see mqtt_shm.h: messages are handed to it in shared memory
+ * and it publishes them on its own broker connection. Such connections can
+ * only publish.
  * @param hostname MQTT server hostname.
  * @param port MQTT server port.
  * @param clientID Client identification.
@@ -74,6 +291,28 @@ int mqtt_connect(const char *hostname,
                     const char *username,
                     const char *password);
 
+/**
+ * @brief Same as mqtt_connect, with protocol version and MQTT v5 flow
+ * control options.
+ * @param hostname MQTT server hostname.
+ * @param port MQTT server port.
+ * @param clientID Client identification.
+ * @param connection_flags Connection flags.
+ * @param keepalive
+ * @param username Username to authenticate to MQTT Broker.
+ * @param password Password to authenticate to MQTT Broker.
+ * @param options Connection options, NULL for MQTT v3.1.1 defaults.
+ * @return MQTT socket handler or -1 if error.
+ */
+int mqtt_connect_opts(const char *hostname,
+                        int port,
+                        const char *clientID,
+                        mqtt_connect_flags connection_flags,
+                        int keepalive,
+                        const char *username,
+                        const char *password,
+                        const mqtt_connect_options *options);
+
 /**
  * @brief Simple mqtt connection function.
  * @param hostname MQTT server hostname.
@@ -85,17 +324,145 @@ int mqtt_connect_simple(const char *hostname,
                             int port,
                             const char *clientID);
 
+/* Defaults of mqtt_bulk_options. */
+#define MQTT_BULK_CONCURRENCY 256
+#define MQTT_BULK_ATTEMPTS 5
+#define MQTT_BULK_BACKOFF_MS 100
+#define MQTT_BULK_BACKOFF_MAX_MS 10000
+
+/**
+ * @brief One session of mqtt_connect_bulk.
+ * client_id, username, password: As given to mqtt_connect.
+ * mqtt_socket: Set to the MQTT socket handler, -1 if it never connected.
+ * attempts: Set to the connection attempts made.
+ * connect_ms: Set to the time from the call start to CONNACK, -1 if it never
+ * connected.
+ */
+typedef struct {
+    const char *client_id;
+    const char *username;
+    const char *password;
+    int mqtt_socket;
+    int attempts;
+    long connect_ms;
+} mqtt_bulk_session;
+
+/**
+ * @brief Bulk connect options, a zero value selects the default.
+ * concurrency: Connections between TCP connect and CONNACK at once,
+ * MQTT_BULK_CONCURRENCY by default.
+ * rate: Connection attempts started per second, no limit by default.
+ * max_attempts: Attempts per session before giving up, MQTT_BULK_ATTEMPTS
+ * by default.
+ * backoff_ms: Delay before the first retry, doubled for each following one
+ * up to backoff_max_ms, with a random half of it taken off so retries of
+ * sessions refused together spread. MQTT_BULK_BACKOFF_MS and
+ * MQTT_BULK_BACKOFF_MAX_MS by default.
+ * timeout_ms: Time for one attempt, TCP connect to CONNACK,
+ * MQTT_ACK_TIMEOUT_MS by default.
+ */
+typedef struct {
+    int concurrency;
+    int rate;
+    int max_attempts;
+    int backoff_ms;
+    int backoff_max_ms;
+    int timeout_ms;
+} mqtt_bulk_options;
+
+/**
+ * @brief Outcome of mqtt_connect_bulk.
+ * connected, failed: Sessions connected and given up.
+ * attempts: Connection attempts, retries included.
+ * all_connected_ms: Time until the last session connected, the time to bring
+ * the whole fleet up. -1 if some failed.
+ * elapsed_ms: Time spent in the call.
+ */
+typedef struct {
+    int connected;
+    int failed;
+    int attempts;
+    long all_connected_ms;
+    long elapsed_ms;
+} mqtt_bulk_report;
+
 /**
- * @brief This function sends subscribe packet.
+ * @brief Connect many sessions to one broker in parallel. The hostname is
+ * resolved once, TCP connects do not block and CONNACKs are read as they
+ * come, so start up is bounded by the broker accept rate. Failed attempts,
+ * timeouts and CONNACKs refusing with server unavailable, server busy,
+ * quota exceeded or connection rate exceeded are retried after a backoff,
+ * other refusals are final. Multiplexers are never used. Each session needs
+ * its own file descriptor, raise RLIMIT_NOFILE for large fleets.
+ * @param hostname MQTT server hostname.
+ * @param port MQTT server port.
+ * @param connection_flags Connect flags of every session.
+ * @param keepalive Keepalive of every session in seconds.
+ * @param options Connection options of every session, NULL for defaults.
+ * @param fleet Sessions to connect, their results are set.
+ * @param count Number of sessions.
+ * @param bulk Bulk connect options, NULL for defaults.
+ * @param report Receives the outcome, may be NULL.
+ * @return Number of sessions connected or -1 if error.
+ */
+int mqtt_connect_bulk(const char *hostname,
+                        int port,
+                        mqtt_connect_flags connection_flags,
+                        int keepalive,
+                        const mqtt_connect_options *options,
+                        mqtt_bulk_session *fleet,
+                        int count,
+                        const mqtt_bulk_options *bulk,
+                        mqtt_bulk_report *report);
+
+/**
+ * @brief This function sends subscribe packet. Any number of filters is
+ * accepted, they are split into as few packets as the broker packet size
+ * allows and all packets are sent before waiting for their acks.
  * @param mqtt_socket MQTT socket created in mqtt_connect
  * @param subs_params_len MQTT subscribe parameters array length.
  * @param subs_parameters MQTT subscribe parameters array.
- * @return 0 if success or -1 if error.
+ * @return 0 if success or -1 if error or if a filter was refused.
  */
 int mqtt_subscribe(int mqtt_socket,
                     int subs_params_len,
                     subscribe_parameters *subs_parameters);
 
+/**
+ * @brief Same as mqtt_subscribe, reporting the broker answer for each
+ * filter.
+ * @param mqtt_socket MQTT socket created in mqtt_connect
+ * @param subs_params_len MQTT subscribe parameters array length.
+ * @param subs_parameters MQTT subscribe parameters array.
+ * @param results Array of subs_params_len entries, receives the granted QoS
+ * of each filter or a reason code of 0x80 and above if refused.
+ * @return 0 if every filter was answered or -1 if error.
+ */
+int mqtt_subscribe_results(int mqtt_socket,
+                            int subs_params_len,
+                            subscribe_parameters *subs_parameters,
+                            int *results);
+
+/**
+ * @brief Same as mqtt_subscribe_results without waiting: packets are sent
+ * and the callback is called once every filter was answered.
+ * @param mqtt_socket MQTT socket created in mqtt_connect
+ * @param subs_params_len MQTT subscribe parameters array length.
+ * @param subs_parameters MQTT subscribe parameters array, may be released
+ * once sent.
+ * @param results Array of subs_params_len entries, filled as acks arrive,
+ * must stay valid until completion.
+ * @param callback Completion callback.
+ * @param user_data Pointer given back to the callback.
+ * @return 0 if sent, the callback will be called, or -1 if error.
+ */
+int mqtt_subscribe_async(int mqtt_socket,
+                            int subs_params_len,
+                            subscribe_parameters *subs_parameters,
+                            int *results,
+                            mqtt_complete_callback callback,
+                            void *user_data);
+
 /**
  * @brief Publish message to topic.
  * @param mqtt_socket MQTT socket handler.
@@ -107,15 +474,233 @@ int mqtt_subscribe(int mqtt_socket,
 int mqtt_publish(int mqtt_socket, mqtt_publish_flags publish_flags, 
                     const char *topic, const char *msg);
 
+/**
+ * @brief Publish binary message to topic, compressed if compression is set.
+ * @param mqtt_socket MQTT socket handler.
+ * @param publish_flags Related flags to the related publish action.
+ * @param topic MQTT topic to publish.
+ * @param payload Message to publish.
+ * @param payload_len Message length.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_publish_bin(int mqtt_socket, mqtt_publish_flags publish_flags,
+                        const char *topic, const uint8_t *payload,
+                        int payload_len);
+
+/**
+ * @brief Publish several messages, compressing them all at once first if
+ * compression is set.
+ * @param mqtt_socket MQTT socket handler.
+ * @param publish_flags Related flags to the related publish action.
+ * @param count Number of messages.
+ * @param msgs Messages to publish.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_publish_batch(int mqtt_socket, mqtt_publish_flags publish_flags,
+                        int count, const mqtt_message *msgs);
+
+/**
+ * @brief Same as mqtt_publish_bin without waiting for the QoS flow. Up to
+ * the in-flight window, see mqtt_async_window, publishes may be in flight,
+ * their state is kept in a per connection pool so no memory is allocated
+ * per publish.
+ * @param mqtt_socket MQTT socket handler.
+ * @param publish_flags Related flags to the related publish action.
+ * @param topic MQTT topic to publish.
+ * @param payload Message to publish, may be released once sent.
+ * @param payload_len Message length.
+ * @param callback Completion callback, not called with QoS 0.
+ * @param user_data Pointer given back to the callback.
+ * @return 1 if completed (QoS 0), 0 if sent and waiting for acks, the
+ * callback will be called, or -1 if error.
+ */
+int mqtt_publish_async(int mqtt_socket, mqtt_publish_flags publish_flags,
+                        const char *topic, const uint8_t *payload,
+                        int payload_len, mqtt_complete_callback callback,
+                        void *user_data);
+
+/**
+ * @brief Get the number of asynchronous operations waiting for acks, QoS 1
+ * and 2 publishes are refused once it reaches the window, see
+ * mqtt_async_window.
+ * @param mqtt_socket MQTT socket handler.
+ * @return Operations in flight or -1 if error.
+ */
+int mqtt_async_pending(int mqtt_socket);
+
+/**
+ * @brief Get the in-flight window: asynchronous operations allowed to wait
+ * for acks. It adapts to the ack round trip time and delivery rate, see
+ * mqtt_flow.h, up to the receive_max limit.
+ * @param mqtt_socket MQTT socket handler.
+ * @return Window or -1 if error.
+ */
+int mqtt_async_window(int mqtt_socket);
+
+/**
+ * @brief Check that mqtt_publish_async would send now: the window has room
+ * for a QoS 1 or 2 publish and the rate limit allows one. Otherwise
+ * mqtt_publish_async refuses a publish when the window is full and waits
+ * for the rate limit.
+ * @param mqtt_socket MQTT socket handler.
+ * @param publish_flags Flags of the publish.
+ * @return 1 if ready, 0 if not or -1 if error.
+ */
+int mqtt_async_ready(int mqtt_socket, mqtt_publish_flags publish_flags);
+
+/**
+ * @brief Limit the publish rate of a connection with a token bucket.
+ * Publishing functions wait for the limit, processing received packets
+ * meanwhile.
+ * @param mqtt_socket MQTT socket handler.
+ * @param rate Publishes per second, 0 for no limit.
+ * @param burst Publishes allowed at once after an idle period, at least 1.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_set_rate_limit(int mqtt_socket, int rate, int burst);
+
+/**
+ * @brief Get the flow control state of a connection.
+ * @param mqtt_socket MQTT socket handler.
+ * @param stats Flow control state.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_get_flow_stats(int mqtt_socket, mqtt_flow_stats *stats);
+
+/**
+ * @brief Frame the payloads of a connection as described in
+ * mqtt_compress.h: published payloads starting with 0xFF are escaped, and
+ * received ones starting with 0xFF are unescaped, decompressed or split
+ * into the aggregated messages. Off by default, so binary payloads are
+ * published and delivered as they are; turn it on only when the publishers
+ * of the subscribed topics use this library with framing. Received frames
+ * that are malformed or too large drop that message only. Compression and
+ * aggregation turn it on, turning it off stops them.
+ * @param mqtt_socket MQTT socket handler.
+ * @param enable 1 to frame payloads, 0 to publish and deliver them as they
+ * are.
+ * @return 0 if success or -1 if error or if enabled on a connection through
+ * the multiplexer.
+ */
+int mqtt_set_framing(int mqtt_socket, int enable);
+
+/**
+ * @brief Compress published payloads, which turns framing on, see
+ * mqtt_set_framing. Connections through the multiplexer publish
+ * uncompressed.
+ * @param mqtt_socket MQTT socket handler.
+ * @param algo Algorithm, MQTT_COMPRESS_NONE to stop compressing.
+ * @param level Compression level, 0 for the library default, see
+ * mqtt_compressor_create.
+ * @return 0 if success or -1 if the algorithm is not built in or the
+ * connection goes through the multiplexer.
+ */
+int mqtt_set_compression(int mqtt_socket, mqtt_compress_algo algo, int level);
+
+/**
+ * @brief Register a dictionary for topics matching a filter. Subscribers
+ * must register the same dictionary to decompress.
+ * @param mqtt_socket MQTT socket handler.
+ * @param topic_filter Topics using this dictionary.
+ * @param dict Dictionary content, see mqtt_compress_train_dictionary.
+ * @param dict_len Dictionary length.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_add_compression_dictionary(int mqtt_socket,
+                                    const char *topic_filter,
+                                    const void *dict,
+                                    int dict_len);
+
+/**
+ * @brief Keep the last message received on each topic, to be read with
+ * mqtt_get_last from any thread while mqtt_loop runs.
+ * @param mqtt_socket MQTT socket handler.
+ * @param memory_budget Memory used by the cache, 0 to disable it.
+ * @param entry_size Largest topic plus payload kept, 0 for
+ * MQTT_CACHE_ENTRY_SIZE.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_set_cache(int mqtt_socket, size_t memory_budget, int entry_size);
+
+/**
+ * @brief Pack the messages published on a topic into one publish, sent once
+ * max_bytes are reached or once the oldest message waited max_delay_ms, see
+ * mqtt_aggregate.h. Turns framing on, see mqtt_set_framing. Subscribers
+ * using this library with framing receive each message.
+ * mqtt_publish returns once the message is aggregated, QoS 1 and 2 acks and
+ * errors then concern the whole publish and are reported by the call sending
+ * it: mqtt_publish, mqtt_loop, mqtt_flush or mqtt_disconnect. Retained and
+ * asynchronous publishes are not aggregated. Connections through the
+ * multiplexer publish each message.
+ * @param mqtt_socket MQTT socket handler.
+ * @param max_topics Topics aggregated at once, 0 to disable aggregation.
+ * @param max_bytes Packed payload size, lowered to fit the broker maximum
+ * packet size.
+ * @param max_delay_ms Longest time a message is held back.
+ * @return 0 if success or -1 if error or if the connection goes through the
+ * multiplexer.
+ */
+int mqtt_set_aggregation(int mqtt_socket, int max_topics, int max_bytes,
+                            int max_delay_ms);
+
+/**
+ * @brief Queue outgoing packets in priority lanes, see mqtt_lanes.h: control
+ * packets (acks, PINGREQ, subscriptions) first, then publishes on topics
+ * added with mqtt_add_priority_topic, then other publishes (bulk). Control
+ * and priority packets are written before their call returns, waiting at
+ * most for the rest of the packet being written. Bulk publishes are queued
+ * and written chunk_bytes at a time by the calls waiting for the broker,
+ * mqtt_loop included, with received packets handled between chunks.
+ * mqtt_flush and mqtt_disconnect write everything queued. Not available on
+ * multiplexer connections. Packets, bulk publishes included, are at most
+ * max_bytes, so a control packet waits for at most max_bytes: split larger
+ * payloads over several publishes. Lanes are allocated once here, or placed
+ * in mqtt_memory for connections given their memory.
+ * @param mqtt_socket MQTT socket handler.
+ * @param max_bytes Bytes each lane holds, publishes wait for room once
+ * reached, and largest packet. 0 to write every packet at once. Packets
+ * queued are written first.
+ * @param chunk_bytes Bytes written at once, 0 for MQTT_LANES_CHUNK.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_set_send_queue(int mqtt_socket, int max_bytes, int chunk_bytes);
+
+/**
+ * @brief Send publishes on topics matching a filter ahead of bulk ones, once
+ * mqtt_set_send_queue is set.
+ * @param mqtt_socket MQTT socket handler.
+ * @param topic_filter Priority topics.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_add_priority_topic(int mqtt_socket, const char *topic_filter);
+
+/**
+ * @brief Read the last message received on a topic without waiting. Topics
+ * are dropped from the cache when unsubscribed, when the broker clears their
+ * retained message or when room is needed for more recently used topics.
+ * @param mqtt_socket MQTT socket handler.
+ * @param topic Topic name.
+ * @param payload Output buffer.
+ * @param payload_len Output buffer length.
+ * @param flags Publish flags of the message, PUBLISH_FLAG_RETAIN is set if
+ * it is the retained message sent on subscribe. May be NULL.
+ * @return Message length, nothing is copied if larger than payload_len, or
+ * -1 if the topic is not cached.
+ */
+int mqtt_get_last(int mqtt_socket, const char *topic, void *payload,
+                    int payload_len, uint8_t *flags);
+
 /**
  * @brief This function sends disconnect packet to MQTT Broker.
+ * Asynchronous operations still in flight complete with -1.
  * @param mqtt_socket MQTT socket handler.
  * @return None.
  */
 void mqtt_disconnect(int mqtt_socket);
 
 /**
- * @brief This function unsubscribe from topic.
+ * @brief This function unsubscribe from topic. Any number of filters is
+ * accepted, as with mqtt_subscribe.
  * @param mqtt_socket MQTT socket handler.
  * @param subs_params_len MQTT subscribe parameters array length.
  * @param subs_parameters MQTT subscribe parameters array.
@@ -125,4 +710,43 @@ int mqtt_unsubscribe(int mqtt_socket,
                         int subs_params_len,
                         subscribe_parameters *subs_parameters);
 
+/**
+ * @brief Send now the packets held back by write coalescing, see
+ * socket_options, and the aggregated messages, see mqtt_set_aggregation.
+ * Not needed before waiting for messages, mqtt_loop and every call waiting
+ * for an answer flush first.
+ * @param mqtt_socket MQTT socket handler.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_flush(int mqtt_socket);
+
+/**
+ * @brief Get the limits negotiated with the broker.
+ * @param mqtt_socket MQTT socket handler.
+ * @param limits Connection limits.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_get_limits(int mqtt_socket, mqtt_connection_limits *limits);
+
+/**
+ * @brief Set the function called for received messages.
+ * @param mqtt_socket MQTT socket handler.
+ * @param callback Message callback, NULL to drop messages.
+ * @param user_data Pointer given back to the callback.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_set_message_callback(int mqtt_socket,
+                                mqtt_message_callback callback,
+                                void *user_data);
+
+/**
+ * @brief Process received packets and keep the connection alive. Messages
+ * received while waiting for acks in other functions are also delivered.
+ * @param mqtt_socket MQTT socket handler.
+ * @param timeout_ms Time to spend processing packets, 0 to process only
+ * what was already received.
+ * @return 0 if success or -1 if the connection is lost.
+ */
+int mqtt_loop(int mqtt_socket, int timeout_ms);
+
 #endif /* _MQTT_H_ */
\ No newline at end of file
@@ -0,0 +1,252 @@
+/**
+ * @file mqtt_aggregate.c
+ * @brief Per topic message aggregation implementation.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+
+#include "mqtt_aggregate.h"
+#include "mqtt_prot.h"
+
+/* Retain flag of the publish flags, such messages are never packed. */
+#define AGGREGATE_RETAIN 0x01
+/* Length prefix bytes at most. */
+#define AGGREGATE_PREFIX_MAX 4
+
+typedef struct {
+	char topic[MQTT_AGGREGATE_TOPIC_MAX + 1];
+	uint16_t topic_len;
+	uint8_t flags;
+	uint32_t hash;
+	long deadline_ms;
+	/* Packed payload bytes, 0 for a free slot. */
+	int used;
+	uint8_t *buf;
+} aggregate_slot;
+
+struct mqtt_aggregator {
+	aggregate_slot *slots;
+	int slots_len;
+	int max_bytes;
+	int max_delay_ms;
+	/* Set while a slot is sent, messages published meanwhile from
+	 * callbacks are not aggregated. */
+	int sending;
+	uint8_t *bufs;
+};
+
+/* FNV-1a, to compare topics quickly. */
+static uint32_t topic_hash(const char *topic, int len)
+{
+	uint32_t h = 2166136261u;
+
+	for (int i = 0; i < len; i++)
+		h = (h ^ (uint8_t)topic[i]) * 16777619u;
+
+	return h;
+}
+
+mqtt_aggregator *mqtt_aggregator_create(int max_topics, int max_bytes,
+										int max_delay_ms)
+{
+	mqtt_aggregator *a;
+
+	if (max_topics <= 0 || max_delay_ms < 0 ||
+		max_bytes < MQTT_AGGREGATE_HEADER + AGGREGATE_PREFIX_MAX + 1)
+		return NULL;
+
+	a = (mqtt_aggregator *)calloc(1, sizeof(mqtt_aggregator));
+	if (a == NULL)
+		return NULL;
+
+	a->slots = (aggregate_slot *)calloc(max_topics, sizeof(aggregate_slot));
+	a->bufs = (uint8_t *)malloc((size_t)max_topics * max_bytes);
+	if (a->slots == NULL || a->bufs == NULL) {
+		mqtt_aggregator_destroy(a);
+		return NULL;
+	}
+
+	for (int i = 0; i < max_topics; i++)
+		a->slots[i].buf = &a->bufs[(size_t)i * max_bytes];
+	a->slots_len = max_topics;
+	a->max_bytes = max_bytes;
+	a->max_delay_ms = max_delay_ms;
+
+	return a;
+}
+
+void mqtt_aggregator_destroy(mqtt_aggregator *a)
+{
+	if (a == NULL)
+		return;
+
+	free(a->slots);
+	free(a->bufs);
+	free(a);
+}
+
+/* The slot is emptied first, so the buffer may be reused by the time send
+ * returns. send encodes the packet before processing anything else. */
+static int slot_send(mqtt_aggregator *a, aggregate_slot *slot,
+						mqtt_aggregate_send send, void *ctx)
+{
+	int len = slot->used, ret;
+
+	if (len == 0)
+		return 0;
+
+	slot->used = 0;
+	a->sending = 1;
+	ret = send(ctx, slot->topic, slot->flags, slot->buf, len);
+	a->sending = 0;
+
+	return ret;
+}
+
+static aggregate_slot *slot_find(mqtt_aggregator *a, const char *topic,
+									int topic_len, uint32_t hash)
+{
+	aggregate_slot *slot;
+
+	for (int i = 0; i < a->slots_len; i++) {
+		slot = &a->slots[i];
+		if (slot->used > 0 && slot->hash == hash &&
+			slot->topic_len == topic_len &&
+			memcmp(slot->topic, topic, topic_len) == 0)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/* A free slot, or the one waiting the longest once sent. */
+static aggregate_slot *slot_take(mqtt_aggregator *a,
+									mqtt_aggregate_send send, void *ctx)
+{
+	aggregate_slot *oldest = &a->slots[0];
+
+	for (int i = 0; i < a->slots_len; i++) {
+		if (a->slots[i].used == 0)
+			return &a->slots[i];
+		if (a->slots[i].deadline_ms < oldest->deadline_ms)
+			oldest = &a->slots[i];
+	}
+
+	if (slot_send(a, oldest, send, ctx) < 0)
+		return NULL;
+
+	return oldest;
+}
+
+int mqtt_aggregator_add(mqtt_aggregator *a, const char *topic, uint8_t flags,
+						const uint8_t *payload, int payload_len, long now_ms,
+						mqtt_aggregate_send send, void *ctx)
+{
+	int topic_len = (int)strlen(topic);
+	uint32_t hash = topic_hash(topic, topic_len);
+	aggregate_slot *slot;
+
+	if (a->sending)
+		return 0;
+
+	slot = slot_find(a, topic, topic_len, hash);
+
+	/* Sent on its own, after what is waiting so the order is kept. */
+	if ((flags & AGGREGATE_RETAIN) || topic_len > MQTT_AGGREGATE_TOPIC_MAX ||
+		payload_len > a->max_bytes - MQTT_AGGREGATE_HEADER -
+						AGGREGATE_PREFIX_MAX) {
+		if (slot != NULL && slot_send(a, slot, send, ctx) < 0)
+			return -1;
+		return 0;
+	}
+
+	if (slot != NULL && (slot->flags != flags ||
+		slot->used + AGGREGATE_PREFIX_MAX + payload_len > a->max_bytes)) {
+		if (slot_send(a, slot, send, ctx) < 0)
+			return -1;
+	}
+
+	if (slot == NULL || slot->used == 0) {
+		slot = slot_take(a, send, ctx);
+		if (slot == NULL)
+			return -1;
+		memcpy(slot->topic, topic, topic_len);
+		slot->topic[topic_len] = '\0';
+		slot->topic_len = (uint16_t)topic_len;
+		slot->hash = hash;
+		slot->flags = flags;
+		slot->deadline_ms = now_ms + a->max_delay_ms;
+		slot->buf[0] = MQTT_AGGREGATE_MARKER;
+		slot->buf[1] = MQTT_AGGREGATE_TAG;
+		slot->used = MQTT_AGGREGATE_HEADER;
+	}
+
+	slot->used += mqtt_prot_encode_varint((uint32_t)payload_len,
+											&slot->buf[slot->used]);
+	memcpy(&slot->buf[slot->used], payload, payload_len);
+	slot->used += payload_len;
+
+	/* Size reached, nothing more would fit. */
+	if (slot->used + AGGREGATE_PREFIX_MAX + 1 > a->max_bytes &&
+		slot_send(a, slot, send, ctx) < 0)
+		return -1;
+
+	return 1;
+}
+
+int mqtt_aggregator_flush(mqtt_aggregator *a, long now_ms,
+							mqtt_aggregate_send send, void *ctx)
+{
+	aggregate_slot *slot;
+	int ret = 0;
+
+	for (int i = 0; i < a->slots_len; i++) {
+		slot = &a->slots[i];
+		if (slot->used > 0 && (now_ms == 0 || now_ms >= slot->deadline_ms) &&
+			slot_send(a, slot, send, ctx) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+long mqtt_aggregator_deadline(const mqtt_aggregator *a)
+{
+	long deadline = -1;
+
+	for (int i = 0; i < a->slots_len; i++) {
+		if (a->slots[i].used > 0 &&
+			(deadline < 0 || a->slots[i].deadline_ms < deadline))
+			deadline = a->slots[i].deadline_ms;
+	}
+
+	return deadline;
+}
+
+int mqtt_aggregate_packed(const uint8_t *payload, int payload_len)
+{
+	return payload_len >= MQTT_AGGREGATE_HEADER &&
+			payload[0] == MQTT_AGGREGATE_MARKER &&
+			payload[1] == MQTT_AGGREGATE_TAG;
+}
+
+int mqtt_aggregate_next(const uint8_t *payload, int payload_len, int *pos,
+						const uint8_t **msg, int *msg_len)
+{
+	uint32_t len;
+	int n;
+
+	if (*pos >= payload_len)
+		return 0;
+
+	n = mqtt_prot_decode_varint(&payload[*pos], payload_len - *pos, &len);
+	if (n <= 0 || len > (uint32_t)(payload_len - *pos - n))
+		return -1;
+
+	*msg = &payload[*pos + n];
+	*msg_len = (int)len;
+	*pos += n + (int)len;
+
+	return 1;
+}
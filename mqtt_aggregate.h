@@ -0,0 +1,122 @@
+/**
+ * @file mqtt_aggregate.h
+ * @brief Per topic message aggregation declaration.
+ *
+ * Messages published on a topic are packed into one payload, sent once it
+ * reaches a size or once its oldest message waited long enough. Receivers
+ * using this library detect packed payloads and deliver each message. They
+ * are framed as compressed payloads, see mqtt_compress.h: application
+ * payloads starting with 0xFF are escaped, so only packed payloads start
+ * with these two bytes:
+ * Byte 1: MQTT_AGGREGATE_MARKER, 0xFF.
+ * Byte 2: MQTT_AGGREGATE_TAG, never a compression algorithm.
+ * Following bytes: for each message its length as a Variable Byte Integer
+ * then its bytes.
+ * A packed payload may itself be compressed. Messages in it are not escaped,
+ * their length tells where they end.
+ *
+ * Slots holding the topic and packed payload are allocated once, when the
+ * aggregator is created. Retained messages, topics longer than
+ * MQTT_AGGREGATE_TOPIC_MAX and messages that do not fit a slot are not
+ * aggregated.
+ */
+
+#ifndef _MQTT_AGGREGATE_H_
+#define _MQTT_AGGREGATE_H_
+
+#include "stdint.h"
+
+#define MQTT_AGGREGATE_MARKER 0xFF
+#define MQTT_AGGREGATE_TAG 0x10
+#define MQTT_AGGREGATE_HEADER 2
+#define MQTT_AGGREGATE_TOPIC_MAX 256
+
+typedef struct mqtt_aggregator mqtt_aggregator;
+
+/**
+ * @brief Called to publish a packed payload.
+ * @param ctx Pointer given to the aggregator call.
+ * @param topic Topic name, NUL terminated.
+ * @param flags Publish flags of the aggregated messages.
+ * @param payload Packed payload.
+ * @param payload_len Packed payload length.
+ * @return 0 if success or -1 if error.
+ */
+typedef int (*mqtt_aggregate_send)(void *ctx, const char *topic, uint8_t flags,
+                                    const uint8_t *payload, int payload_len);
+
+/**
+ * @brief Create an aggregator.
+ * @param max_topics Topics aggregated at once. When all slots are taken,
+ * the one waiting the longest is sent to make room.
+ * @param max_bytes Packed payload size sent at once.
+ * @param max_delay_ms Longest time a message waits in a slot.
+ * @return Aggregator or NULL if error.
+ */
+mqtt_aggregator *mqtt_aggregator_create(int max_topics, int max_bytes,
+                                        int max_delay_ms);
+
+/**
+ * @brief Release an aggregator, messages still in it are lost.
+ * @param a Aggregator.
+ * @return None.
+ */
+void mqtt_aggregator_destroy(mqtt_aggregator *a);
+
+/**
+ * @brief Add a message to the slot of its topic. Slots sent meanwhile, to
+ * make room or keep messages in order, go through send.
+ * @param a Aggregator.
+ * @param topic Topic name, NUL terminated.
+ * @param flags Publish flags.
+ * @param payload Message.
+ * @param payload_len Message length.
+ * @param now_ms Current monotonic time.
+ * @param send Publishes packed payloads.
+ * @param ctx Pointer given back to send.
+ * @return 1 if aggregated, 0 if the message must be published on its own
+ * or -1 if sending a slot failed.
+ */
+int mqtt_aggregator_add(mqtt_aggregator *a, const char *topic, uint8_t flags,
+                        const uint8_t *payload, int payload_len, long now_ms,
+                        mqtt_aggregate_send send, void *ctx);
+
+/**
+ * @brief Send the slots whose oldest message waited max_delay_ms.
+ * @param a Aggregator.
+ * @param now_ms Current monotonic time, 0 to send every slot.
+ * @param send Publishes packed payloads.
+ * @param ctx Pointer given back to send.
+ * @return 0 if success or -1 if sending a slot failed.
+ */
+int mqtt_aggregator_flush(mqtt_aggregator *a, long now_ms,
+                            mqtt_aggregate_send send, void *ctx);
+
+/**
+ * @brief Get the time the next slot is due.
+ * @param a Aggregator.
+ * @return Monotonic time in ms, or -1 if every slot is empty.
+ */
+long mqtt_aggregator_deadline(const mqtt_aggregator *a);
+
+/**
+ * @brief Check if a received payload is packed.
+ * @param payload Payload.
+ * @param payload_len Payload length.
+ * @return 1 if packed, otherwise 0.
+ */
+int mqtt_aggregate_packed(const uint8_t *payload, int payload_len);
+
+/**
+ * @brief Get the next message of a packed payload.
+ * @param payload Packed payload.
+ * @param payload_len Packed payload length.
+ * @param pos Read position, MQTT_AGGREGATE_HEADER for the first message.
+ * @param msg Receives the message.
+ * @param msg_len Receives the message length.
+ * @return 1 if a message was read, 0 at the end or -1 if malformed.
+ */
+int mqtt_aggregate_next(const uint8_t *payload, int payload_len, int *pos,
+                        const uint8_t **msg, int *msg_len);
+
+#endif /* _MQTT_AGGREGATE_H_ */
@@ -0,0 +1,158 @@
+/**
+ * @file mqtt_alias.c
+ * @brief MQTT v5 topic alias tables implementation.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+
+#include "mqtt_alias.h"
+
+static uint32_t topic_hash(const char *topic, uint16_t topic_len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (uint16_t i = 0; i < topic_len; i++) {
+		hash ^= (uint8_t)topic[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+int mqtt_alias_init(mqtt_alias_table *table, uint16_t max)
+{
+	uint32_t slots = 1;
+
+	memset(table, 0, sizeof(mqtt_alias_table));
+	if (max == 0)
+		return 0;
+
+	/* Keep the index at most half full. */
+	while (slots < 2 * (uint32_t)max)
+		slots <<= 1;
+
+	table->topics = (char **)calloc(max, sizeof(char *));
+	table->topics_len = (uint16_t *)calloc(max, sizeof(uint16_t));
+	table->slots = (uint16_t *)calloc(slots, sizeof(uint16_t));
+	if (table->topics == NULL || table->topics_len == NULL ||
+		table->slots == NULL) {
+		mqtt_alias_free(table);
+		return -1;
+	}
+
+	table->max = max;
+	table->slots_mask = slots - 1;
+
+	return 0;
+}
+
+void mqtt_alias_free(mqtt_alias_table *table)
+{
+	if (table->topics != NULL) {
+		for (uint16_t i = 0; i < table->max; i++)
+			free(table->topics[i]);
+	}
+	free(table->topics);
+	free(table->topics_len);
+	free(table->slots);
+	memset(table, 0, sizeof(mqtt_alias_table));
+}
+
+static char *topic_dup(const char *topic, uint16_t topic_len)
+{
+	char *copy = (char *)malloc(topic_len + 1);
+
+	if (copy != NULL) {
+		memcpy(copy, topic, topic_len);
+		copy[topic_len] = '\0';
+	}
+
+	return copy;
+}
+
+int mqtt_alias_outbound(mqtt_alias_table *table,
+						const char *topic,
+						uint16_t topic_len,
+						uint16_t *alias)
+{
+	uint32_t slot;
+	uint16_t found;
+
+	if (table->max == 0 || topic_len == 0)
+		return -1;
+
+	slot = topic_hash(topic, topic_len) & table->slots_mask;
+	while ((found = table->slots[slot]) != 0) {
+		if (table->topics_len[found - 1] == topic_len &&
+			memcmp(table->topics[found - 1], topic, topic_len) == 0) {
+			*alias = found;
+			return 0;
+		}
+		slot = (slot + 1) & table->slots_mask;
+	}
+
+	if (table->used == table->max)
+		return -1;
+
+	found = table->used + 1;
+	table->topics[found - 1] = topic_dup(topic, topic_len);
+	if (table->topics[found - 1] == NULL)
+		return -1;
+	table->topics_len[found - 1] = topic_len;
+	table->slots[slot] = found;
+	table->used++;
+
+	*alias = found;
+	return 1;
+}
+
+void mqtt_alias_cancel(mqtt_alias_table *table, uint16_t alias)
+{
+	uint32_t slot;
+
+	if (alias == 0 || alias != table->used)
+		return;
+
+	/* The latest entry ends its probe sequence, nothing inserted earlier
+	 * probed past its slot, so clearing it keeps the others reachable. */
+	slot = topic_hash(table->topics[alias - 1], table->topics_len[alias - 1]) &
+			table->slots_mask;
+	while (table->slots[slot] != alias)
+		slot = (slot + 1) & table->slots_mask;
+	table->slots[slot] = 0;
+
+	free(table->topics[alias - 1]);
+	table->topics[alias - 1] = NULL;
+	table->topics_len[alias - 1] = 0;
+	table->used--;
+}
+
+int mqtt_alias_inbound(mqtt_alias_table *table,
+						uint16_t alias,
+						const char **topic,
+						uint16_t *topic_len)
+{
+	char *copy;
+
+	if (alias == 0 || alias > table->max)
+		return -1;
+
+	if (*topic_len > 0) {
+		copy = topic_dup(*topic, *topic_len);
+		if (copy == NULL)
+			return -1;
+		free(table->topics[alias - 1]);
+		table->topics[alias - 1] = copy;
+		table->topics_len[alias - 1] = *topic_len;
+		return 0;
+	}
+
+	if (table->topics[alias - 1] == NULL)
+		return -1;
+
+	*topic = table->topics[alias - 1];
+	*topic_len = table->topics_len[alias - 1];
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file mqtt_alias.h
+ * @brief MQTT v5 topic alias tables declaration.
+ * One table is kept per direction. The outbound table maps topics to the
+ * aliases we announced to the broker, up to the Topic Alias Maximum sent in
+ * CONNACK. The inbound table maps aliases announced by the broker, up to the
+ * Topic Alias Maximum we sent in CONNECT, back to topics.
+ */
+
+#ifndef _MQTT_ALIAS_H_
+#define _MQTT_ALIAS_H_
+
+#include "stdint.h"
+
+typedef struct {
+    uint16_t max;
+    uint16_t used;
+    char **topics;
+    uint16_t *topics_len;
+    uint16_t *slots;
+    uint32_t slots_mask;
+} mqtt_alias_table;
+
+/**
+ * @brief Allocate an alias table.
+ * @param table Table to initialize.
+ * @param max Highest alias value, 0 disables topic aliases.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_alias_init(mqtt_alias_table *table, uint16_t max);
+
+/**
+ * @brief Release an alias table.
+ * @param table Table to release.
+ * @return None.
+ */
+void mqtt_alias_free(mqtt_alias_table *table);
+
+/**
+ * @brief Find or assign the alias to publish a topic with. Aliases are
+ * assigned in order of first use and kept for the connection lifetime, once
+ * they are all taken new topics are sent without alias.
+ * @param table Outbound table.
+ * @param topic Topic name.
+ * @param topic_len Topic name length.
+ * @param alias Alias to set in the publish properties.
+ * @return 1 if the alias is new and the topic must be sent with it, 0 if the
+ * alias is known and the topic can be left empty, -1 if no alias is available.
+ */
+int mqtt_alias_outbound(mqtt_alias_table *table,
+                        const char *topic,
+                        uint16_t topic_len,
+                        uint16_t *alias);
+
+/**
+ * @brief Forget the alias just assigned by mqtt_alias_outbound, when the
+ * publish announcing it was not sent. The next publish on the topic
+ * announces an alias again.
+ * @param table Outbound table.
+ * @param alias Alias returned with 1 by the last mqtt_alias_outbound call.
+ * @return None.
+ */
+void mqtt_alias_cancel(mqtt_alias_table *table, uint16_t alias);
+
+/**
+ * @brief Apply a received topic alias. A non empty topic updates the alias,
+ * an empty one is replaced by the topic previously set for the alias.
+ * @param table Inbound table.
+ * @param alias Alias received in the publish properties.
+ * @param topic Received topic, replaced by the stored one if empty.
+ * @param topic_len Received topic length, replaced if empty.
+ * @return 0 if success or -1 if the alias is invalid or unknown.
+ */
+int mqtt_alias_inbound(mqtt_alias_table *table,
+                        uint16_t alias,
+                        const char **topic,
+                        uint16_t *topic_len);
+
+#endif /* _MQTT_ALIAS_H_ */
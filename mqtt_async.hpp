@@ -0,0 +1,698 @@
+/**
+ * @file mqtt_async.hpp
+ * @brief C++20 coroutine layer over mqtt.h, header only.
+ *
+ * Publishes and subscribes are awaited instead of blocking:
+ *
+ *     mqtt::task producer(mqtt::client &c)
+ *     {
+ *         int ret = co_await c.publish(PUBLISH_FLAG_QOS_2, "a/b", "hello");
+ *         while (auto msg = co_await c.next_message())
+ *             ...
+ *     }
+ *
+ * Operations are sent at once and completed by client::run, which drives
+ * mqtt_loop: a single thread runs any number of coroutines, each waiting
+ * for its own acks. Awaiters live in the awaiting coroutine frame and the
+ * per operation state in the connection pool of mqtt.c, nothing is
+ * allocated per operation. Frames of mqtt::task coroutines taking a client
+ * as first parameter are allocated from the client arena.
+ *
+ * Coroutines are resumed from within client::run once mqtt_loop returned,
+ * never from the callbacks of mqtt.c, so they may close the client. They
+ * must only use the client through its awaitables. A client and its tasks
+ * belong to one thread.
+ */
+
+#ifndef _MQTT_ASYNC_HPP_
+#define _MQTT_ASYNC_HPP_
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include "mqtt.h"
+}
+
+namespace mqtt {
+
+/**
+ * @brief Allocator of coroutine frames. Sizes are rounded to size classes
+ * with a free list each, freed frames are reused by the next frame of the
+ * same class and memory is only returned when the arena is destroyed.
+ * Larger frames go to operator new.
+ */
+class arena {
+public:
+    static constexpr std::size_t granule = 64;
+    static constexpr std::size_t classes = 32;
+    static constexpr std::size_t chunk_size = 64 * 1024;
+
+    arena() = default;
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+
+    ~arena()
+    {
+        for (void *chunk : chunks_)
+            ::operator delete(chunk);
+    }
+
+    void *allocate(std::size_t size)
+    {
+        std::size_t cls = (size + granule - 1) / granule - 1;
+        node *n;
+
+        if (cls >= classes)
+            return ::operator new(size);
+
+        n = free_[cls];
+        if (n != nullptr) {
+            free_[cls] = n->next;
+            return n;
+        }
+
+        size = (cls + 1) * granule;
+        if (left_ < size) {
+            chunks_.reserve(chunks_.size() + 1);
+            cur_ = static_cast<char *>(::operator new(chunk_size));
+            chunks_.push_back(cur_);
+            left_ = chunk_size;
+        }
+        left_ -= size;
+        cur_ += size;
+        return cur_ - size;
+    }
+
+    void deallocate(void *p, std::size_t size) noexcept
+    {
+        std::size_t cls = (size + granule - 1) / granule - 1;
+        node *n = static_cast<node *>(p);
+
+        if (cls >= classes) {
+            ::operator delete(p);
+            return;
+        }
+
+        n->next = free_[cls];
+        free_[cls] = n;
+    }
+
+private:
+    struct node {
+        node *next;
+    };
+
+    node *free_[classes] = {};
+    std::vector<void *> chunks_;
+    char *cur_ = nullptr;
+    std::size_t left_ = 0;
+};
+
+class client;
+
+/**
+ * @brief Awaiter completed from a callback, its coroutine is queued and
+ * resumed by client::run.
+ */
+class resumable {
+protected:
+    friend class client;
+
+    std::coroutine_handle<> handle_;
+    resumable *ready_next_ = nullptr;
+};
+
+/**
+ * @brief Message received on a subscribed topic. Topic and payload point
+ * into the client backlog and are valid until the consumer awaits again.
+ */
+struct message {
+    std::string_view topic;
+    std::span<const uint8_t> payload;
+    uint8_t flags;
+};
+
+/**
+ * @brief Awaitable publish, resumes with 0 once the QoS flow completed or
+ * -1 if error. Publishes wait, in order, while the in-flight window is
+ * full or the rate limit is reached, see mqtt_async_ready.
+ */
+class publish_awaiter : public resumable {
+public:
+    publish_awaiter(client &c, mqtt_publish_flags flags, const char *topic,
+                    const void *payload, int payload_len) noexcept
+        : client_(c), flags_(flags), topic_(topic),
+          payload_(static_cast<const uint8_t *>(payload)),
+          payload_len_(payload_len)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    inline bool await_suspend(std::coroutine_handle<> h) noexcept;
+
+    int await_resume() const noexcept
+    {
+        return result_;
+    }
+
+private:
+    friend class client;
+
+    /* Same as mqtt_publish_async. */
+    inline int send() noexcept;
+    static inline void complete(void *user_data, int result);
+
+    client &client_;
+    mqtt_publish_flags flags_;
+    const char *topic_;
+    const uint8_t *payload_;
+    int payload_len_;
+    int result_ = -1;
+    publish_awaiter *next_ = nullptr;
+};
+
+/**
+ * @brief Awaitable subscribe, resumes with 0 once every filter was answered,
+ * the broker answer of each filter is in results, or -1 if error. A single
+ * filter resumes with its granted QoS or refusal code instead.
+ */
+class subscribe_awaiter : public resumable {
+public:
+    subscribe_awaiter(client &c, subscribe_parameters *params, int nb_params,
+                        int *results) noexcept
+        : client_(c), params_(params), nb_params_(nb_params),
+          results_(results)
+    {
+    }
+
+    subscribe_awaiter(client &c, const char *filter,
+                        mqtt_subscribe_qos qos) noexcept
+        : client_(c), params_(&single_), nb_params_(1), results_(&granted_)
+    {
+        single_.qos = qos;
+        single_.topic = filter;
+        single_.topic_len = (int)std::strlen(filter);
+    }
+
+    /* Points to itself with a single filter, only returned by value. */
+    subscribe_awaiter(const subscribe_awaiter &) = delete;
+    subscribe_awaiter &operator=(const subscribe_awaiter &) = delete;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    inline bool await_suspend(std::coroutine_handle<> h) noexcept;
+
+    int await_resume() const noexcept
+    {
+        if (result_ < 0 || params_ != &single_)
+            return result_;
+
+        return granted_;
+    }
+
+private:
+    static inline void complete(void *user_data, int result);
+
+    client &client_;
+    subscribe_parameters *params_;
+    int nb_params_;
+    int *results_;
+    subscribe_parameters single_ = {};
+    int granted_ = -1;
+    int result_ = -1;
+};
+
+/**
+ * @brief Awaitable next message, resumes with std::nullopt once the
+ * connection is closed. Consumers waiting together get messages in turn.
+ */
+class message_awaiter {
+public:
+    explicit message_awaiter(client &c) noexcept : client_(c)
+    {
+    }
+
+    inline bool await_ready() noexcept;
+    inline void await_suspend(std::coroutine_handle<> h) noexcept;
+
+    std::optional<message> await_resume() noexcept
+    {
+        return result_;
+    }
+
+private:
+    friend class client;
+
+    client &client_;
+    std::optional<message> result_;
+    std::coroutine_handle<> handle_;
+    message_awaiter *next_ = nullptr;
+};
+
+/**
+ * @brief Asynchronous client over a connection from mqtt_connect. Messages
+ * are kept from their arrival in mqtt_loop until consumers take them, up
+ * to max_backlog bytes, then dropped.
+ */
+class client {
+public:
+    static constexpr std::size_t default_backlog = 1024 * 1024;
+
+    explicit client(int mqtt_socket,
+                    std::size_t max_backlog = default_backlog) noexcept
+        : sock_(mqtt_socket), max_backlog_(max_backlog)
+    {
+        mqtt_set_message_callback(sock_, &client::on_message, this);
+    }
+
+    client(const client &) = delete;
+    client &operator=(const client &) = delete;
+
+    ~client()
+    {
+        close();
+    }
+
+    int socket() const noexcept
+    {
+        return sock_;
+    }
+
+    arena &frames() noexcept
+    {
+        return frames_;
+    }
+
+    /**
+     * @brief Number of messages dropped because the backlog was full.
+     */
+    std::size_t dropped() const noexcept
+    {
+        return dropped_;
+    }
+
+    publish_awaiter publish(mqtt_publish_flags flags, const char *topic,
+                            const void *payload, int payload_len) noexcept
+    {
+        return publish_awaiter(*this, flags, topic, payload, payload_len);
+    }
+
+    publish_awaiter publish(mqtt_publish_flags flags, const char *topic,
+                            std::string_view payload) noexcept
+    {
+        return publish_awaiter(*this, flags, topic, payload.data(),
+                                (int)payload.size());
+    }
+
+    subscribe_awaiter subscribe(const char *filter,
+                                mqtt_subscribe_qos qos) noexcept
+    {
+        return subscribe_awaiter(*this, filter, qos);
+    }
+
+    subscribe_awaiter subscribe(subscribe_parameters *params, int nb_params,
+                                int *results) noexcept
+    {
+        return subscribe_awaiter(*this, params, nb_params, results);
+    }
+
+    message_awaiter next_message() noexcept
+    {
+        return message_awaiter(*this);
+    }
+
+    /**
+     * @brief Process received packets for timeout_ms, then resume the
+     * coroutines whose operation completed and the consumers of the
+     * messages received, and send the publishes the rate limit held back.
+     * The client is closed if the connection is lost.
+     * @return 0 if success or -1 if the connection is lost or closed.
+     */
+    int run(int timeout_ms) noexcept
+    {
+        int ret;
+
+        if (sock_ < 0)
+            return -1;
+
+        ret = mqtt_loop(sock_, timeout_ms);
+        resume_ready();
+        if (ret < 0)
+            close();
+        /* Publishes held back by the rate limit. */
+        unpark();
+
+        return (sock_ < 0) ? -1 : 0;
+    }
+
+    /**
+     * @brief Disconnect, pending operations resume with -1 and consumers
+     * with std::nullopt.
+     */
+    void close() noexcept
+    {
+        message_awaiter *w;
+        publish_awaiter *p;
+        int sock = sock_;
+
+        if (sock < 0)
+            return;
+
+        sock_ = -1;
+        /* Operations in flight complete with -1, queued. */
+        mqtt_disconnect(sock);
+        resume_ready();
+
+        while ((p = parked_) != nullptr) {
+            parked_ = p->next_;
+            p->result_ = -1;
+            p->handle_.resume();
+        }
+        parked_tail_ = nullptr;
+
+        while ((w = waiters_) != nullptr) {
+            waiters_ = w->next_;
+            w->result_.reset();
+            w->handle_.resume();
+        }
+        waiters_tail_ = nullptr;
+    }
+
+private:
+    friend class message_awaiter;
+    friend class publish_awaiter;
+    friend class subscribe_awaiter;
+
+    /* Called back from within mqtt.c, resumed by resume_ready. */
+    void ready(resumable *r) noexcept
+    {
+        r->ready_next_ = nullptr;
+        if (ready_tail_ != nullptr)
+            ready_tail_->ready_next_ = r;
+        else
+            ready_ = r;
+        ready_tail_ = r;
+    }
+
+    /* Completed operations in order, then messages to their consumers,
+     * until resumed coroutines leave nothing more to do. */
+    void resume_ready() noexcept
+    {
+        message_awaiter *w;
+        resumable *r;
+
+        for (;;) {
+            if ((r = ready_) != nullptr) {
+                ready_ = r->ready_next_;
+                if (ready_ == nullptr)
+                    ready_tail_ = nullptr;
+                r->handle_.resume();
+            } else if ((w = waiters_) != nullptr && pop_backlog(w->result_)) {
+                waiters_ = w->next_;
+                if (waiters_ == nullptr)
+                    waiters_tail_ = nullptr;
+                w->handle_.resume();
+            } else {
+                break;
+            }
+        }
+    }
+
+    /* In-flight window full or rate limit reached. */
+    bool window_full(mqtt_publish_flags flags) const noexcept
+    {
+        return mqtt_async_ready(sock_, flags) == 0;
+    }
+
+    void park(publish_awaiter *p) noexcept
+    {
+        p->next_ = nullptr;
+        if (parked_tail_ != nullptr)
+            parked_tail_->next_ = p;
+        else
+            parked_ = p;
+        parked_tail_ = p;
+    }
+
+    /* Send parked publishes while the window has room, in order. */
+    void unpark() noexcept
+    {
+        publish_awaiter *p;
+        int ret;
+
+        while (parked_ != nullptr && !window_full(parked_->flags_)) {
+            p = parked_;
+            parked_ = p->next_;
+            if (parked_ == nullptr)
+                parked_tail_ = nullptr;
+
+            ret = p->send();
+            if (ret != 0) {
+                p->result_ = (ret < 0) ? -1 : 0;
+                p->handle_.resume();
+            }
+        }
+    }
+
+    /* Backlog record, followed by the topic and the payload. */
+    struct record {
+        uint32_t topic_len;
+        uint32_t payload_len;
+        uint8_t flags;
+    };
+
+    bool pop_backlog(std::optional<message> &out) noexcept
+    {
+        record r;
+
+        if (read_ == backlog_.size())
+            return false;
+
+        std::memcpy(&r, &backlog_[read_], sizeof(r));
+        read_ += sizeof(r);
+        out = message{
+            std::string_view((const char *)&backlog_[read_], r.topic_len),
+            std::span<const uint8_t>(&backlog_[read_ + r.topic_len],
+                                        r.payload_len),
+            r.flags};
+        read_ += r.topic_len + r.payload_len;
+        return true;
+    }
+
+    void push_backlog(const char *topic, int topic_len, const uint8_t *payload,
+                        int payload_len, uint8_t flags)
+    {
+        record r = {(uint32_t)topic_len, (uint32_t)payload_len, flags};
+        std::size_t at;
+
+        /* Views handed out before are released by now, see message. */
+        if (read_ == backlog_.size()) {
+            backlog_.clear();
+            read_ = 0;
+        }
+
+        if (backlog_.size() - read_ + sizeof(r) + topic_len + payload_len >
+            max_backlog_) {
+            dropped_++;
+            return;
+        }
+
+        at = backlog_.size();
+        backlog_.resize(at + sizeof(r) + topic_len + payload_len);
+        std::memcpy(&backlog_[at], &r, sizeof(r));
+        std::memcpy(&backlog_[at + sizeof(r)], topic, topic_len);
+        if (payload_len > 0)
+            std::memcpy(&backlog_[at + sizeof(r) + topic_len], payload,
+                        payload_len);
+    }
+
+    /* Copied even when a consumer waits: it is resumed by resume_ready,
+     * once mqtt_loop is done with the session. */
+    static void on_message(void *user_data, const char *topic, int topic_len,
+                            const uint8_t *payload, int payload_len,
+                            uint8_t flags)
+    {
+        client *self = static_cast<client *>(user_data);
+
+        try {
+            self->push_backlog(topic, topic_len, payload, payload_len, flags);
+        } catch (const std::bad_alloc &) {
+            self->dropped_++;
+        }
+    }
+
+    int sock_;
+    publish_awaiter *parked_ = nullptr;
+    publish_awaiter *parked_tail_ = nullptr;
+    std::size_t max_backlog_;
+    std::size_t dropped_ = 0;
+    std::vector<uint8_t> backlog_;
+    std::size_t read_ = 0;
+    message_awaiter *waiters_ = nullptr;
+    message_awaiter *waiters_tail_ = nullptr;
+    resumable *ready_ = nullptr;
+    resumable *ready_tail_ = nullptr;
+    arena frames_;
+};
+
+int publish_awaiter::send() noexcept
+{
+    return mqtt_publish_async(client_.sock_, flags_, topic_, payload_,
+                                payload_len_, &publish_awaiter::complete, this);
+}
+
+/* Sent here, not resumed later if the publish completed at once. */
+bool publish_awaiter::await_suspend(std::coroutine_handle<> h) noexcept
+{
+    int ret;
+
+    handle_ = h;
+    if (client_.sock_ >= 0 &&
+        (client_.parked_ != nullptr || client_.window_full(flags_))) {
+        client_.park(this);
+        return true;
+    }
+
+    ret = send();
+    if (ret == 0)
+        return true;
+
+    result_ = (ret < 0) ? -1 : 0;
+    return false;
+}
+
+void publish_awaiter::complete(void *user_data, int result)
+{
+    publish_awaiter *self = static_cast<publish_awaiter *>(user_data);
+
+    self->result_ = result;
+    self->client_.ready(self);
+}
+
+bool subscribe_awaiter::await_suspend(std::coroutine_handle<> h) noexcept
+{
+    handle_ = h;
+    if (mqtt_subscribe_async(client_.sock_, nb_params_, params_, results_,
+                                &subscribe_awaiter::complete, this) == 0)
+        return true;
+
+    result_ = -1;
+    return false;
+}
+
+void subscribe_awaiter::complete(void *user_data, int result)
+{
+    subscribe_awaiter *self = static_cast<subscribe_awaiter *>(user_data);
+
+    self->result_ = result;
+    self->client_.ready(self);
+}
+
+bool message_awaiter::await_ready() noexcept
+{
+    /* Behind the consumers already waiting. */
+    if (client_.waiters_ == nullptr && client_.pop_backlog(result_))
+        return true;
+
+    /* Closed, nothing will come. */
+    return client_.sock_ < 0;
+}
+
+void message_awaiter::await_suspend(std::coroutine_handle<> h) noexcept
+{
+    handle_ = h;
+    next_ = nullptr;
+    if (client_.waiters_tail_ != nullptr)
+        client_.waiters_tail_->next_ = this;
+    else
+        client_.waiters_ = this;
+    client_.waiters_tail_ = this;
+}
+
+/**
+ * @brief Fire and forget coroutine, started at once and destroyed when it
+ * returns. A task whose first parameter is a client takes its frame from
+ * the client arena, the client must outlive it.
+ */
+class task {
+public:
+    struct promise_type {
+        /* Frames start with the arena they came from, null for the heap. */
+        static constexpr std::size_t header = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+        template <typename... Args>
+        static void *operator new(std::size_t size, client &c, Args &&...)
+        {
+            char *p = static_cast<char *>(c.frames().allocate(size + header));
+            arena *a = &c.frames();
+
+            std::memcpy(p, &a, sizeof(a));
+            return p + header;
+        }
+
+        static void *operator new(std::size_t size)
+        {
+            char *p = static_cast<char *>(::operator new(size + header));
+            arena *a = nullptr;
+
+            std::memcpy(p, &a, sizeof(a));
+            return p + header;
+        }
+
+        static void operator delete(void *frame, std::size_t size) noexcept
+        {
+            char *p = static_cast<char *>(frame) - header;
+            arena *a;
+
+            std::memcpy(&a, p, sizeof(a));
+            if (a != nullptr)
+                a->deallocate(p, size + header);
+            else
+                ::operator delete(p);
+        }
+
+        task get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+} /* namespace mqtt */
+
+#endif /* _MQTT_ASYNC_HPP_ */
@@ -0,0 +1,263 @@
+/**
+ * @file mqtt_bench.c
+ * @brief Loopback publish benchmark comparing the socket backends, see
+ * socket_set_backend. A sink broker thread answers on 127.0.0.1, the
+ * publishing thread reports its wall and CPU time with each backend.
+ *
+ * $ ./mqtt_bench [messages] [payload size] [qos]
+ * qos: 0 (default) or 1, QoS 1 publishes are asynchronous.
+ */
+
+#define _GNU_SOURCE
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "sys/resource.h"
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+
+#include "mqtt.h"
+#include "mqtt_shm.h"
+
+#define BENCH_MESSAGES 200000
+#define BENCH_SIZE 64
+#define BENCH_TOPIC "bench/loopback"
+/* Bytes read at once by the sink. */
+#define SINK_BUF 65536
+
+static int sink_fd = -1;
+static int acked;
+static int failed;
+
+static long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+/* CPU time of the calling thread, the sink is not counted. */
+static long cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L +
+			ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Answer CONNECT, QoS 1 publishes and pings of one connection, until it is
+ * closed. */
+static void sink_serve(int fd)
+{
+	static uint8_t buf[SINK_BUF];
+	uint8_t out[SINK_BUF];
+	int len = 0, pos, out_len, n, pkt_len, i;
+	uint32_t rem, mult;
+
+	for (;;) {
+		n = recv(fd, &buf[len], sizeof(buf) - len, 0);
+		if (n <= 0)
+			return;
+		len += n;
+
+		pos = 0;
+		out_len = 0;
+		for (;;) {
+			/* Fixed header: type and remaining length. */
+			rem = 0;
+			mult = 1;
+			for (i = pos + 1; i < len && i < pos + 5; i++) {
+				rem += (buf[i] & 0x7F) * mult;
+				mult *= 128;
+				if (!(buf[i] & 0x80))
+					break;
+			}
+			if (i >= len || i >= pos + 5)
+				break;
+			pkt_len = i + 1 - pos + (int)rem;
+			if (pos + pkt_len > len)
+				break;
+
+			switch (buf[pos] >> 4) {
+				case 1: /* CONNECT */
+					memcpy(&out[out_len], "\x20\x02\x00\x00", 4);
+					out_len += 4;
+					break;
+				case 3: /* PUBLISH, acked if QoS 1 */
+					if (((buf[pos] >> 1) & 0x03) == 1) {
+						i++;
+						i += 2 + ((buf[i] << 8) | buf[i + 1]);
+						out[out_len++] = 0x40;
+						out[out_len++] = 0x02;
+						out[out_len++] = buf[i];
+						out[out_len++] = buf[i + 1];
+					}
+					break;
+				case 12: /* PINGREQ */
+					memcpy(&out[out_len], "\xD0\x00", 2);
+					out_len += 2;
+					break;
+				case 14: /* DISCONNECT */
+					return;
+				default:
+					break;
+			}
+			pos += pkt_len;
+			if (out_len > SINK_BUF - 8) {
+				send(fd, out, out_len, MSG_NOSIGNAL);
+				out_len = 0;
+			}
+		}
+		if (out_len > 0)
+			send(fd, out, out_len, MSG_NOSIGNAL);
+		memmove(buf, &buf[pos], len - pos);
+		len -= pos;
+		if (len == (int)sizeof(buf))
+			return;
+	}
+}
+
+static void *sink_run(void *arg)
+{
+	int fd;
+
+	(void)arg;
+	while ((fd = accept(sink_fd, NULL, NULL)) >= 0) {
+		sink_serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* Listen on an ephemeral loopback port, returns it or -1. */
+static int sink_start(void)
+{
+	struct sockaddr_in addr = { 0 };
+	socklen_t addr_len = sizeof(addr);
+	pthread_t thread;
+
+	sink_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sink_fd < 0)
+		return -1;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sink_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(sink_fd, 1) < 0 ||
+		getsockname(sink_fd, (struct sockaddr *)&addr, &addr_len) < 0 ||
+		pthread_create(&thread, NULL, sink_run, NULL) != 0) {
+		close(sink_fd);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return ntohs(addr.sin_port);
+}
+
+static void publish_done(void *user_data, int result)
+{
+	(void)user_data;
+	if (result < 0)
+		failed++;
+	else
+		acked++;
+}
+
+/* Publish messages on one connection, prints the times taken. */
+static int bench_run(const char *name, int port, int messages,
+						const uint8_t *payload, int size, int qos)
+{
+	mqtt_publish_flags flags = qos ? PUBLISH_FLAG_QOS_2 : PUBLISH_FLAG_QOS_1;
+	long start_us, start_cpu, wall, cpu;
+	int sock, i;
+
+	sock = mqtt_connect_simple("127.0.0.1", port, "mqttbench");
+	if (sock < 0) {
+		printf("%s: couldn't connect\n", name);
+		return -1;
+	}
+	acked = 0;
+	failed = 0;
+
+	start_us = now_us();
+	start_cpu = cpu_us();
+	for (i = 0; i < messages; i++) {
+		if (qos == 0) {
+			if (mqtt_publish_bin(sock, flags, BENCH_TOPIC, payload,
+									size) < 0)
+				break;
+			continue;
+		}
+		while (mqtt_async_ready(sock, flags) == 0) {
+			if (mqtt_loop(sock, 10) < 0)
+				break;
+		}
+		if (mqtt_publish_async(sock, flags, BENCH_TOPIC, payload, size,
+								publish_done, NULL) < 0)
+			break;
+	}
+	while (qos && i == messages && acked + failed < messages) {
+		if (mqtt_loop(sock, 100) < 0)
+			break;
+	}
+	mqtt_flush(sock);
+	wall = now_us() - start_us;
+	cpu = cpu_us() - start_cpu;
+	mqtt_disconnect(sock);
+
+	if (i < messages || failed > 0) {
+		printf("%s: failed after %d publishes\n", name, i);
+		return -1;
+	}
+	printf("%-6s %d publishes in %ld ms, %ld ms of CPU, %.2f us CPU each\n",
+			name, messages, wall / 1000, cpu / 1000,
+			(double)cpu / messages);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int messages = (argc > 1) ? atoi(argv[1]) : BENCH_MESSAGES;
+	int size = (argc > 2) ? atoi(argv[2]) : BENCH_SIZE;
+	int qos = (argc > 3) ? atoi(argv[3]) : 0;
+	uint8_t *payload;
+	int port, ret = 0;
+
+	if (messages <= 0 || size < 0 || size > SINK_BUF / 2 || qos < 0 ||
+		qos > 1) {
+		printf("Usage: %s [messages] [payload size] [qos]\n", argv[0]);
+		return -1;
+	}
+
+	port = sink_start();
+	payload = (uint8_t *)malloc(size + 1);
+	if (port < 0 || payload == NULL) {
+		printf("Couldn't start the sink broker\n");
+		free(payload);
+		return -1;
+	}
+	memset(payload, 'x', size);
+
+	/* Always a direct connection, even while a multiplexer runs. */
+	mqtt_shm_set_path(NULL);
+	printf("%d publishes of %d bytes at QoS %d on loopback\n", messages,
+			size, qos);
+	socket_set_backend(SOCKET_BACKEND_PLAIN);
+	if (bench_run("plain", port, messages, payload, size, qos) < 0)
+		ret = -1;
+	if (socket_set_backend(SOCKET_BACKEND_URING) < 0)
+		printf("uring: not built in\n");
+	else if (bench_run("uring", port, messages, payload, size, qos) < 0)
+		ret = -1;
+
+	free(payload);
+	return ret;
+}
@@ -0,0 +1,333 @@
+/**
+ * @file mqtt_bridge.c
+ * @brief Forward the messages of topic filters from one broker to another.
+ *
+ * $ ./mqtt_bridge <broker A> <port A> <broker B> <port B> <route>...
+ * route: <filter>[,<qos>[,<qos on B>[,<prefix on A>,<prefix on B>]]]
+ * Messages matching filter are received from A with QoS qos (0 by default)
+ * and published on B with QoS qos on B, or the QoS they were received with
+ * if it is empty, lowered to what B supports. Topics starting with prefix
+ * on A have it replaced by prefix on B, others get prefix on B prepended.
+ * Commas can not appear in routes. Run a second bridge with the brokers
+ * swapped to forward the other way.
+ *
+ * Payloads are published from the receive buffer of A, never copied on the
+ * way unless small enough to be coalesced with other writes. When B has as
+ * many publishes waiting for acks as its window allows, A is not read until
+ * acks come back, so A's broker slows down to the pace of B. Messages from
+ * A are acknowledged once handed to B.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "signal.h"
+#include "time.h"
+#include "unistd.h"
+#include "poll.h"
+
+#include "mqtt.h"
+#include "mqtt_validate.h"
+
+#define BRIDGE_ROUTES_MAX 64
+/* Longest wait for packets, keepalives are sent meanwhile. */
+#define BRIDGE_IDLE_MS 100
+#define BRIDGE_REPORT_MS 1000
+#define BRIDGE_KEEPALIVE 60
+
+typedef struct {
+	char *filter;
+	int qos;
+	/* QoS published on B, -1 to keep the received one. */
+	int out_qos;
+	const char *from;
+	size_t from_len;
+	const char *to;
+	size_t to_len;
+} bridge_route;
+
+static bridge_route routes[BRIDGE_ROUTES_MAX];
+static int routes_len;
+static int src = -1;
+static int dst = -1;
+static mqtt_connection_limits dst_limits;
+static char topic[UINT16_MAX + 1];
+static volatile sig_atomic_t stop;
+/* Set when B was lost while forwarding. */
+static int broken;
+static long forwarded;
+static long unrouted;
+static long failed;
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/* Split a route argument in place. */
+static int parse_route(char *arg, bridge_route *r)
+{
+	char *field[5] = { arg };
+	int n = 1;
+
+	for (char *p = arg; *p != '\0' && n < 5; p++) {
+		if (*p == ',') {
+			*p = '\0';
+			field[n++] = p + 1;
+		}
+	}
+
+	memset(r, 0, sizeof(bridge_route));
+	r->filter = field[0];
+	r->out_qos = -1;
+	if (n > 1 && *field[1] != '\0')
+		r->qos = atoi(field[1]);
+	if (n > 2 && *field[2] != '\0')
+		r->out_qos = atoi(field[2]);
+	if (n > 3) {
+		r->from = field[3];
+		r->from_len = strlen(r->from);
+	}
+	if (n > 4) {
+		r->to = field[4];
+		r->to_len = strlen(r->to);
+	}
+
+	if (n == 4 || mqtt_valid_topic_filter(r->filter, strlen(r->filter)) < 0 ||
+		r->qos < 0 || r->qos > 2 || r->out_qos > 2) {
+		printf("Bad route %s\n", arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+static const bridge_route *route_find(const char *name, int name_len)
+{
+	for (int i = 0; i < routes_len; i++) {
+		if (mqtt_topic_match(routes[i].filter, name, name_len))
+			return &routes[i];
+	}
+
+	return NULL;
+}
+
+/* Build the topic on B into topic, returns -1 if too long. */
+static int route_topic(const bridge_route *r, const char *name, int name_len)
+{
+	size_t len;
+
+	if (r->from_len > 0 && (size_t)name_len >= r->from_len &&
+		memcmp(name, r->from, r->from_len) == 0) {
+		name += r->from_len;
+		name_len -= (int)r->from_len;
+	}
+
+	len = r->to_len + name_len;
+	if (len == 0 || len > UINT16_MAX)
+		return -1;
+
+	memcpy(topic, r->to, r->to_len);
+	memcpy(&topic[r->to_len], name, name_len);
+	topic[len] = '\0';
+	return 0;
+}
+
+static void forward_done(void *user_data, int result)
+{
+	(void)user_data;
+
+	if (result < 0)
+		failed++;
+}
+
+/* Wait until B takes one more publish, reading its acks. A is not read
+ * meanwhile. */
+static int wait_room(mqtt_publish_flags flags)
+{
+	struct pollfd pfd = { .fd = dst, .events = POLLIN };
+	int ready;
+
+	while ((ready = mqtt_async_ready(dst, flags)) == 0) {
+		if (mqtt_flush(dst) < 0)
+			return -1;
+		if (poll(&pfd, 1, BRIDGE_IDLE_MS) < 0 && errno != EINTR)
+			return -1;
+		if (mqtt_loop(dst, 0) < 0)
+			return -1;
+	}
+
+	return (ready < 0) ? -1 : 0;
+}
+
+/* Called from mqtt_loop on A, the payload points into its receive buffer. */
+static void bridge_message(void *user_data, const char *name, int name_len,
+							const uint8_t *payload, int payload_len,
+							uint8_t flags)
+{
+	const bridge_route *r = route_find(name, name_len);
+	int qos = (flags >> 1) & 0x03;
+	mqtt_publish_flags out;
+
+	(void)user_data;
+
+	if (broken)
+		return;
+	if (r == NULL) {
+		unrouted++;
+		return;
+	}
+	if (route_topic(r, name, name_len) < 0) {
+		printf("Topic too long for B, dropped\n");
+		failed++;
+		return;
+	}
+
+	if (r->out_qos >= 0)
+		qos = r->out_qos;
+	if (qos > dst_limits.max_qos)
+		qos = dst_limits.max_qos;
+	out = (mqtt_publish_flags)(qos << 1);
+	if ((flags & PUBLISH_FLAG_RETAIN) && dst_limits.retain_available)
+		out |= PUBLISH_FLAG_RETAIN;
+
+	if (wait_room(out) < 0) {
+		printf("Connection to B lost\n");
+		broken = 1;
+		return;
+	}
+	if (mqtt_publish_async(dst, out, topic, payload, payload_len,
+							forward_done, NULL) < 0) {
+		failed++;
+		return;
+	}
+	forwarded++;
+}
+
+static int bridge_subscribe(void)
+{
+	subscribe_parameters params[BRIDGE_ROUTES_MAX];
+
+	for (int i = 0; i < routes_len; i++) {
+		params[i].qos = (mqtt_subscribe_qos)routes[i].qos;
+		params[i].topic = routes[i].filter;
+		params[i].topic_len = (int)strlen(routes[i].filter);
+	}
+
+	return mqtt_subscribe(src, routes_len, params);
+}
+
+static void report(long elapsed_ms, long count)
+{
+	mqtt_flow_stats flow;
+
+	printf("%ld msg/s, forwarded %ld, unrouted %ld, failed %ld",
+			elapsed_ms > 0 ? count * 1000 / elapsed_ms : 0, forwarded,
+			unrouted, failed);
+	if (mqtt_get_flow_stats(dst, &flow) == 0)
+		printf(", window %d, ack rtt %ld us", flow.window, flow.srtt_us);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	/* Writes are coalesced, several messages leave in one system call. */
+	socket_options sock_opts = {
+		.nodelay = 1,
+		.coalesce_bytes = SOCKET_COALESCE_BYTES,
+		.coalesce_us = SOCKET_COALESCE_US,
+	};
+	/* Options given, so the bridge never goes through a multiplexer. */
+	mqtt_connect_options opts = { .socket = &sock_opts };
+	struct pollfd pfd[2];
+	char client_id[32];
+	long last_ms, last_count;
+	int ret = -1;
+
+	if (argc < 6) {
+		printf("Usage: %s <broker A> <port A> <broker B> <port B> "
+				"<route>...\n", argv[0]);
+		printf("route: <filter>[,<qos>[,<qos on B>[,<prefix on A>,"
+				"<prefix on B>]]]\n");
+		return -1;
+	}
+	if (argc - 5 > BRIDGE_ROUTES_MAX) {
+		printf("At most %d routes\n", BRIDGE_ROUTES_MAX);
+		return -1;
+	}
+	for (int i = 5; i < argc; i++) {
+		if (parse_route(argv[i], &routes[routes_len++]) < 0)
+			return -1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	snprintf(client_id, sizeof(client_id), "bridge%da", (int)getpid());
+	src = mqtt_connect_opts(argv[1], atoi(argv[2]), client_id,
+							CONNECT_FLAG_CLEAN_SESSION, BRIDGE_KEEPALIVE, NULL,
+							NULL, &opts);
+	snprintf(client_id, sizeof(client_id), "bridge%db", (int)getpid());
+	dst = mqtt_connect_opts(argv[3], atoi(argv[4]), client_id,
+							CONNECT_FLAG_CLEAN_SESSION, BRIDGE_KEEPALIVE, NULL,
+							NULL, &opts);
+	if (src < 0 || dst < 0) {
+		printf("MQTT connect failure!\n");
+		goto finish;
+	}
+	if (mqtt_get_limits(dst, &dst_limits) < 0 ||
+		mqtt_set_message_callback(src, bridge_message, NULL) < 0)
+		goto finish;
+	if (bridge_subscribe() != 0) {
+		printf("MQTT subscribe failure!\n");
+		goto finish;
+	}
+
+	printf("Bridging %d routes from %s:%s to %s:%s\n", routes_len, argv[1],
+			argv[2], argv[3], argv[4]);
+	last_ms = now_ms();
+	last_count = 0;
+	while (!stop) {
+		pfd[0].fd = src;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = dst;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, BRIDGE_IDLE_MS) < 0 && errno != EINTR)
+			goto finish;
+
+		/* Everything received from A is forwarded, then acks are read and
+		 * what was coalesced is written. */
+		if (mqtt_loop(src, 0) < 0) {
+			printf("Connection to A lost\n");
+			goto finish;
+		}
+		if (broken || mqtt_loop(dst, 0) < 0 || mqtt_flush(dst) < 0 ||
+			mqtt_flush(src) < 0)
+			goto finish;
+
+		if (now_ms() - last_ms >= BRIDGE_REPORT_MS) {
+			report(now_ms() - last_ms, forwarded - last_count);
+			last_ms = now_ms();
+			last_count = forwarded;
+		}
+	}
+	ret = 0;
+
+finish:
+	if (dst >= 0)
+		mqtt_disconnect(dst);
+	if (src >= 0)
+		mqtt_disconnect(src);
+	report(0, 0);
+	return ret;
+}
@@ -0,0 +1,481 @@
+/**
+ * @file mqtt_cache.c
+ * @brief Last known value cache implementation.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "pthread.h"
+
+#include "mqtt_cache.h"
+#include "mqtt_validate.h"
+
+/* Slots are cache line aligned so readers of one topic never share a line
+ * with a writer of another one. */
+#define CACHE_LINE 64
+
+/* Index entries: slot + INDEX_FIRST in the low half, topic hash in the high
+ * half. */
+#define INDEX_EMPTY 0
+#define INDEX_REMOVED 1
+#define INDEX_FIRST 2
+
+#define RETAIN_FLAG 0x01
+
+#define DATA_WORD 8
+
+/* Fields read by lock free readers are atomic, accessed relaxed and
+ * validated by seq, which is odd while a writer changes the slot. The topic
+ * then the payload are stored in words for the same reason, the writer
+ * holding the lock reads them as bytes. */
+typedef struct {
+	_Atomic uint32_t seq;
+	_Atomic uint32_t hash;
+	_Atomic uint32_t payload_len;
+	_Atomic uint16_t topic_len;
+	_Atomic uint8_t flags;
+	_Atomic uint8_t used;
+	_Atomic uint8_t ref;
+	_Atomic uint64_t data[];
+} cache_slot;
+
+struct mqtt_cache {
+	pthread_mutex_t lock;
+	uint8_t *slots;
+	size_t stride;
+	size_t entry_size;
+	/* Topic and payload of the slot being written, then stored by words. */
+	uint8_t *scratch;
+	uint32_t nb_slots;
+	uint32_t hand;
+	_Atomic uint64_t *index;
+	uint32_t index_mask;
+	uint32_t index_free;
+	/* Odd while the index is rebuilt. */
+	_Atomic uint32_t index_seq;
+};
+
+static uint32_t topic_hash(const char *topic, size_t topic_len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < topic_len; i++) {
+		hash ^= (uint8_t)topic[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static inline cache_slot *slot_at(const mqtt_cache *c, uint32_t i)
+{
+	return (cache_slot *)(c->slots + (size_t)i * c->stride);
+}
+
+static inline uint64_t index_entry(uint32_t hash, uint32_t slot)
+{
+	return ((uint64_t)hash << 32) | (slot + INDEX_FIRST);
+}
+
+mqtt_cache *mqtt_cache_create(size_t memory_budget, size_t entry_size)
+{
+	mqtt_cache *c;
+	size_t nb_slots;
+	uint32_t index_size = 1;
+
+	if (entry_size == 0)
+		entry_size = MQTT_CACHE_ENTRY_SIZE;
+	if (entry_size > UINT32_MAX)
+		return NULL;
+
+	c = (mqtt_cache *)calloc(1, sizeof(mqtt_cache));
+	if (c == NULL)
+		return NULL;
+
+	c->entry_size = entry_size;
+	entry_size = (entry_size + DATA_WORD - 1) & ~(size_t)(DATA_WORD - 1);
+	c->stride = (sizeof(cache_slot) + entry_size + CACHE_LINE - 1) &
+				~(size_t)(CACHE_LINE - 1);
+
+	/* The index is kept at most half full, count up to 4 entries a slot. */
+	nb_slots = memory_budget / (c->stride + 4 * sizeof(uint64_t));
+	if (nb_slots == 0 || nb_slots > (1u << 30)) {
+		free(c);
+		return NULL;
+	}
+	while (index_size < 2 * nb_slots)
+		index_size <<= 1;
+
+	c->nb_slots = (uint32_t)nb_slots;
+	c->index_mask = index_size - 1;
+	c->index_free = index_size;
+	c->slots = (uint8_t *)aligned_alloc(CACHE_LINE, nb_slots * c->stride);
+	c->index = (_Atomic uint64_t *)calloc(index_size, sizeof(uint64_t));
+	c->scratch = (uint8_t *)malloc(entry_size);
+	if (c->slots == NULL || c->index == NULL || c->scratch == NULL ||
+		pthread_mutex_init(&c->lock, NULL) != 0) {
+		free(c->slots);
+		free(c->index);
+		free(c->scratch);
+		free(c);
+		return NULL;
+	}
+	memset(c->slots, 0, nb_slots * c->stride);
+
+	return c;
+}
+
+void mqtt_cache_destroy(mqtt_cache *c)
+{
+	if (c == NULL)
+		return;
+
+	pthread_mutex_destroy(&c->lock);
+	free(c->slots);
+	free(c->index);
+	free(c->scratch);
+	free(c);
+}
+
+/* Writer side lookup, returns the index position of a topic or -1. */
+static int64_t index_find(mqtt_cache *c, uint32_t hash, const char *topic,
+							size_t topic_len)
+{
+	uint32_t pos = hash & c->index_mask;
+	uint64_t e;
+	cache_slot *sl;
+
+	for (uint32_t n = 0; n <= c->index_mask; n++) {
+		e = atomic_load_explicit(&c->index[pos], memory_order_relaxed);
+		if (e == INDEX_EMPTY)
+			break;
+		if (e != INDEX_REMOVED && (uint32_t)(e >> 32) == hash) {
+			sl = slot_at(c, (uint32_t)e - INDEX_FIRST);
+			if (sl->topic_len == topic_len &&
+				memcmp((const char *)sl->data, topic, topic_len) == 0)
+				return pos;
+		}
+		pos = (pos + 1) & c->index_mask;
+	}
+
+	return -1;
+}
+
+static void index_insert(mqtt_cache *c, uint32_t hash, uint32_t slot)
+{
+	uint32_t pos = hash & c->index_mask;
+	uint64_t e;
+
+	for (;;) {
+		e = atomic_load_explicit(&c->index[pos], memory_order_relaxed);
+		if (e == INDEX_EMPTY || e == INDEX_REMOVED)
+			break;
+		pos = (pos + 1) & c->index_mask;
+	}
+
+	if (e == INDEX_EMPTY)
+		c->index_free--;
+	/* Release so a reader finding the entry sees the slot content. */
+	atomic_store_explicit(&c->index[pos], index_entry(hash, slot),
+							memory_order_release);
+}
+
+/* Removed entries are never reused as empty ones, rebuild the index once
+ * they take too many positions. */
+static void index_rebuild(mqtt_cache *c)
+{
+	uint32_t seq = atomic_load_explicit(&c->index_seq, memory_order_relaxed);
+	cache_slot *sl;
+
+	atomic_store_explicit(&c->index_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for (uint32_t i = 0; i <= c->index_mask; i++)
+		atomic_store_explicit(&c->index[i], INDEX_EMPTY, memory_order_relaxed);
+	c->index_free = c->index_mask + 1;
+
+	for (uint32_t i = 0; i < c->nb_slots; i++) {
+		sl = slot_at(c, i);
+		if (sl->used)
+			index_insert(c, sl->hash, i);
+	}
+
+	atomic_store_explicit(&c->index_seq, seq + 2, memory_order_release);
+}
+
+static inline void slot_write_begin(cache_slot *sl)
+{
+	uint32_t seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&sl->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void slot_write_end(cache_slot *sl)
+{
+	uint32_t seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&sl->seq, seq + 1, memory_order_release);
+}
+
+/* Store the first len bytes of the scratch buffer in the slot data. */
+static void slot_store(mqtt_cache *c, cache_slot *sl, size_t len)
+{
+	uint64_t word;
+
+	for (size_t off = 0; off < len; off += DATA_WORD) {
+		word = 0;
+		memcpy(&word, c->scratch + off,
+				(len - off < DATA_WORD) ? len - off : DATA_WORD);
+		atomic_store_explicit(&sl->data[off / DATA_WORD], word,
+								memory_order_relaxed);
+	}
+}
+
+/* Compare the topic and copy the payload if out is not NULL, word by word.
+ * Returns 0 if the slot holds the topic. */
+static int slot_load(cache_slot *sl, const char *topic, size_t topic_len,
+						uint8_t *out, size_t payload_len)
+{
+	size_t total = topic_len + payload_len, end, from;
+	uint8_t bytes[DATA_WORD];
+	uint64_t word;
+
+	for (size_t off = 0; off < total; off += DATA_WORD) {
+		if (out == NULL && off >= topic_len)
+			break;
+		word = atomic_load_explicit(&sl->data[off / DATA_WORD],
+									memory_order_relaxed);
+		memcpy(bytes, &word, DATA_WORD);
+		end = (total - off < DATA_WORD) ? total : off + DATA_WORD;
+
+		if (off < topic_len &&
+			memcmp(bytes, &topic[off],
+					((end < topic_len) ? end : topic_len) - off) != 0)
+			return -1;
+		from = (off > topic_len) ? off : topic_len;
+		if (out != NULL && from < end)
+			memcpy(&out[from - topic_len], &bytes[from - off], end - from);
+	}
+
+	return 0;
+}
+
+static void slot_remove(mqtt_cache *c, uint32_t pos)
+{
+	uint64_t e = atomic_load_explicit(&c->index[pos], memory_order_relaxed);
+	cache_slot *sl = slot_at(c, (uint32_t)e - INDEX_FIRST);
+
+	atomic_store_explicit(&c->index[pos], INDEX_REMOVED, memory_order_relaxed);
+
+	slot_write_begin(sl);
+	atomic_store_explicit(&sl->used, 0, memory_order_relaxed);
+	slot_write_end(sl);
+}
+
+/* CLOCK: take the first slot either free or not read since the hand last
+ * went over it. */
+static uint32_t slot_evict(mqtt_cache *c)
+{
+	cache_slot *sl;
+	uint32_t i;
+	int64_t pos;
+
+	for (;;) {
+		i = c->hand;
+		c->hand = (c->hand + 1 == c->nb_slots) ? 0 : c->hand + 1;
+		sl = slot_at(c, i);
+		if (!sl->used)
+			return i;
+		if (atomic_exchange_explicit(&sl->ref, 0, memory_order_relaxed) == 0)
+			break;
+	}
+
+	pos = index_find(c, sl->hash, (const char *)sl->data, sl->topic_len);
+	if (pos >= 0)
+		slot_remove(c, (uint32_t)pos);
+
+	return i;
+}
+
+int mqtt_cache_put(mqtt_cache *c,
+					const char *topic,
+					size_t topic_len,
+					const uint8_t *payload,
+					size_t payload_len,
+					uint8_t flags)
+{
+	uint32_t hash, i;
+	cache_slot *sl;
+	int64_t pos;
+	int ret = 0;
+
+	if (c == NULL || topic == NULL || topic_len == 0 ||
+		topic_len > MQTT_STRING_MAX_LEN || (payload == NULL && payload_len))
+		return -1;
+
+	hash = topic_hash(topic, topic_len);
+
+	pthread_mutex_lock(&c->lock);
+
+	pos = index_find(c, hash, topic, topic_len);
+
+	/* A stale value is worse than none when the new one does not fit. */
+	if ((payload_len == 0 && (flags & RETAIN_FLAG)) ||
+		topic_len + payload_len > c->entry_size) {
+		if (pos >= 0)
+			slot_remove(c, (uint32_t)pos);
+		ret = (payload_len == 0) ? 0 : 1;
+		goto out;
+	}
+
+	if (pos >= 0) {
+		i = (uint32_t)atomic_load_explicit(&c->index[pos],
+											memory_order_relaxed) - INDEX_FIRST;
+	} else {
+		i = slot_evict(c);
+	}
+
+	sl = slot_at(c, i);
+	slot_write_begin(sl);
+	atomic_store_explicit(&sl->hash, hash, memory_order_relaxed);
+	atomic_store_explicit(&sl->topic_len, (uint16_t)topic_len,
+							memory_order_relaxed);
+	atomic_store_explicit(&sl->payload_len, (uint32_t)payload_len,
+							memory_order_relaxed);
+	atomic_store_explicit(&sl->flags, flags, memory_order_relaxed);
+	atomic_store_explicit(&sl->used, 1, memory_order_relaxed);
+	atomic_store_explicit(&sl->ref, 1, memory_order_relaxed);
+	memcpy(c->scratch, topic, topic_len);
+	if (payload_len)
+		memcpy(c->scratch + topic_len, payload, payload_len);
+	slot_store(c, sl, topic_len + payload_len);
+	slot_write_end(sl);
+
+	if (pos < 0) {
+		index_insert(c, hash, i);
+		if (c->index_free < (c->index_mask + 1) / 4)
+			index_rebuild(c);
+	}
+
+out:
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+/* Read a slot if it holds the topic. Returns the message length, -1 if the
+ * slot holds another topic. */
+static int slot_read(const mqtt_cache *c, cache_slot *sl, uint32_t hash,
+						const char *topic, size_t topic_len,
+						uint8_t *payload, size_t payload_len, uint8_t *flags)
+{
+	uint32_t seq, len;
+	uint8_t f;
+	int ret;
+
+	for (;;) {
+		seq = atomic_load_explicit(&sl->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		ret = -1;
+		len = atomic_load_explicit(&sl->payload_len, memory_order_relaxed);
+		f = atomic_load_explicit(&sl->flags, memory_order_relaxed);
+		/* Fields may be torn until seq is checked, bound them first. */
+		if (atomic_load_explicit(&sl->used, memory_order_relaxed) &&
+			atomic_load_explicit(&sl->hash, memory_order_relaxed) == hash &&
+			atomic_load_explicit(&sl->topic_len, memory_order_relaxed) ==
+			topic_len && topic_len + len <= c->entry_size &&
+			slot_load(sl, topic, topic_len,
+						(len <= payload_len) ? payload : NULL, len) == 0)
+			ret = (int)len;
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&sl->seq, memory_order_relaxed) == seq)
+			break;
+	}
+
+	if (ret >= 0) {
+		if (flags != NULL)
+			*flags = f;
+		if (!atomic_load_explicit(&sl->ref, memory_order_relaxed))
+			atomic_store_explicit(&sl->ref, 1, memory_order_relaxed);
+	}
+
+	return ret;
+}
+
+int mqtt_cache_get(mqtt_cache *c,
+					const char *topic,
+					size_t topic_len,
+					uint8_t *payload,
+					size_t payload_len,
+					uint8_t *flags)
+{
+	uint32_t hash, seq, pos, n;
+	uint64_t e;
+	int ret;
+
+	if (c == NULL || topic == NULL || topic_len == 0)
+		return -1;
+
+	hash = topic_hash(topic, topic_len);
+
+	for (;;) {
+		seq = atomic_load_explicit(&c->index_seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		pos = hash & c->index_mask;
+		for (n = 0; n <= c->index_mask; n++) {
+			e = atomic_load_explicit(&c->index[pos], memory_order_acquire);
+			if (e == INDEX_EMPTY)
+				break;
+			if (e != INDEX_REMOVED && (uint32_t)(e >> 32) == hash) {
+				ret = slot_read(c, slot_at(c, (uint32_t)e - INDEX_FIRST),
+								hash, topic, topic_len, payload, payload_len,
+								flags);
+				if (ret >= 0)
+					return ret;
+			}
+			pos = (pos + 1) & c->index_mask;
+		}
+
+		/* Only trust a miss if the index was not rebuilt meanwhile. */
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&c->index_seq, memory_order_relaxed) == seq)
+			return -1;
+	}
+}
+
+int mqtt_cache_drop(mqtt_cache *c, const char *filter)
+{
+	cache_slot *sl;
+	int64_t pos;
+	int dropped = 0;
+
+	if (c == NULL || filter == NULL)
+		return 0;
+
+	pthread_mutex_lock(&c->lock);
+
+	for (uint32_t i = 0; i < c->nb_slots; i++) {
+		sl = slot_at(c, i);
+		if (!sl->used ||
+			!mqtt_topic_match(filter, (const char *)sl->data, sl->topic_len))
+			continue;
+
+		pos = index_find(c, sl->hash, (const char *)sl->data, sl->topic_len);
+		if (pos >= 0) {
+			slot_remove(c, (uint32_t)pos);
+			dropped++;
+		}
+	}
+
+	if (c->index_free < (c->index_mask + 1) / 4)
+		index_rebuild(c);
+
+	pthread_mutex_unlock(&c->lock);
+	return dropped;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file mqtt_cache.h
+ * @brief Last known value cache declaration.
+ * Keeps the latest payload received on each topic so it can be read at any
+ * time without waiting for the next message.
+ *
+ * Memory is allocated once: a pool of fixed size slots, each holding one
+ * topic and its payload, and an open addressing index from topic to slot.
+ * Readers never lock, each slot is protected by a sequence counter and a
+ * read is retried if a writer changed the slot meanwhile. Writers are
+ * serialized by a mutex. When the pool is full the least recently used slot
+ * is reused, approximated with the CLOCK algorithm: reads mark the slot and
+ * the eviction hand skips marked slots once.
+ */
+
+#ifndef _MQTT_CACHE_H_
+#define _MQTT_CACHE_H_
+
+#include "stddef.h"
+#include "stdint.h"
+
+/* Topic and payload bytes of one slot when not given. */
+#define MQTT_CACHE_ENTRY_SIZE 256
+
+typedef struct mqtt_cache mqtt_cache;
+
+/**
+ * @brief Create a cache.
+ * @param memory_budget Bytes used by slots and index, sets the number of
+ * topics kept.
+ * @param entry_size Largest topic plus payload kept, 0 for
+ * MQTT_CACHE_ENTRY_SIZE. Larger messages are not cached.
+ * @return Cache or NULL if error.
+ */
+mqtt_cache *mqtt_cache_create(size_t memory_budget, size_t entry_size);
+
+/**
+ * @brief Release a cache. No reader may use it anymore.
+ * @param c Cache.
+ * @return None.
+ */
+void mqtt_cache_destroy(mqtt_cache *c);
+
+/**
+ * @brief Store the latest message of a topic. A retained message with an
+ * empty payload removes the topic, as it does on the broker.
+ * @param c Cache.
+ * @param topic Topic name.
+ * @param topic_len Topic name length.
+ * @param payload Message.
+ * @param payload_len Message length.
+ * @param flags Publish flags of the message.
+ * @return 0 if stored or removed, 1 if too large to be cached or -1 if error.
+ */
+int mqtt_cache_put(mqtt_cache *c,
+                    const char *topic,
+                    size_t topic_len,
+                    const uint8_t *payload,
+                    size_t payload_len,
+                    uint8_t flags);
+
+/**
+ * @brief Read the latest message of a topic, lock free.
+ * @param c Cache.
+ * @param topic Topic name.
+ * @param topic_len Topic name length.
+ * @param payload Output buffer.
+ * @param payload_len Output buffer length.
+ * @param flags Publish flags of the message, the retain flag tells it was
+ * the retained value sent by the broker on subscribe. May be NULL.
+ * @return Message length, nothing is copied if larger than payload_len, or
+ * -1 if the topic is not cached.
+ */
+int mqtt_cache_get(mqtt_cache *c,
+                    const char *topic,
+                    size_t topic_len,
+                    uint8_t *payload,
+                    size_t payload_len,
+                    uint8_t *flags);
+
+/**
+ * @brief Remove every topic matching a filter.
+ * @param c Cache.
+ * @param filter Topic filter, NUL terminated.
+ * @return Number of topics removed.
+ */
+int mqtt_cache_drop(mqtt_cache *c, const char *filter);
+
+#endif /* _MQTT_CACHE_H_ */
@@ -0,0 +1,379 @@
+/**
+ * @file mqtt_capture.c
+ * @brief Packet capture implementation.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+#include "stdio.h"
+#include "time.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+
+#include "mqtt_capture.h"
+#include "mqtt_prot.h"
+
+#define ENABLE_TRACES
+#include "trace.h"
+
+#define CAPTURE_ALIGN(len) (((len) + 7) & ~(size_t)7)
+
+typedef struct {
+	pthread_mutex_t lock;
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	/* Bytes written, header included. */
+	size_t used;
+	struct timespec start;
+} capture_state;
+
+struct mqtt_capture_reader {
+	uint8_t *map;
+	size_t size;
+	size_t end;
+	size_t pos;
+};
+
+/* Started and stopped while no packet is sent or received, so the fast path
+ * reads it unlocked. */
+static capture_state *capture;
+static int env_checked;
+static int exit_registered;
+
+static mqtt_capture_header *capture_header(capture_state *c)
+{
+	return (mqtt_capture_header *)c->map;
+}
+
+/* Map more of the file, by whole chunks. */
+static int capture_grow(capture_state *c, size_t needed)
+{
+	size_t size = c->map_size;
+	uint8_t *map;
+
+	while (size < needed)
+		size += MQTT_CAPTURE_CHUNK;
+
+	if (ftruncate(c->fd, (off_t)size) < 0) {
+		print_err("Couldn't grow capture: %s", strerror(errno));
+		return -1;
+	}
+	map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+							c->fd, 0);
+	if (map == MAP_FAILED) {
+		print_err("Couldn't map capture: %s", strerror(errno));
+		return -1;
+	}
+
+	if (c->map != NULL)
+		munmap(c->map, c->map_size);
+	c->map = map;
+	c->map_size = size;
+	return 0;
+}
+
+/* Skip a length prefixed field at *pos, bounded by end. */
+static int skip_field(const uint8_t *pkt, size_t *pos, size_t end)
+{
+	size_t len;
+
+	if (end - *pos < 2)
+		return -1;
+	len = ((size_t)pkt[*pos] << 8) | pkt[*pos + 1];
+	if (end - *pos - 2 < len)
+		return -1;
+	*pos += 2 + len;
+	return 0;
+}
+
+/* Skip MQTT v5 properties at *pos, bounded by end. */
+static int skip_properties(const uint8_t *pkt, size_t *pos, size_t end)
+{
+	uint32_t len;
+	int n;
+
+	n = mqtt_prot_decode_varint(&pkt[*pos], (int)(end - *pos), &len);
+	if (n <= 0 || end - *pos - n < len)
+		return -1;
+	*pos += n + len;
+	return 0;
+}
+
+/* Remove the password of a CONNECT packet, the last field, and clear its
+ * flag. Returns the new packet length, len if there is none or the packet
+ * could not be parsed. */
+static size_t scrub_password(uint8_t *pkt, size_t len)
+{
+	size_t pos, hdr, field, flags_pos, scrubbed;
+	uint32_t rem;
+	uint8_t level;
+	int n;
+
+	n = mqtt_prot_decode_varint(&pkt[1], (int)(len - 1), &rem);
+	if (n <= 0 || 1 + n + (size_t)rem != len)
+		return len;
+	hdr = 1 + n;
+	pos = hdr;
+
+	/* Protocol name, level, flags and keepalive. */
+	if (skip_field(pkt, &pos, len) < 0 || len - pos < 4)
+		return len;
+	level = pkt[pos];
+	flags_pos = pos + 1;
+	pos += 4;
+	if (!(pkt[flags_pos] & 0x40))
+		return len;
+	if (level == MQTT_PROT_VERSION_5 && skip_properties(pkt, &pos, len) < 0)
+		return len;
+
+	/* Client identifier, will, user name. */
+	if (skip_field(pkt, &pos, len) < 0)
+		return len;
+	if ((pkt[flags_pos] & 0x04) &&
+		((level == MQTT_PROT_VERSION_5 &&
+		skip_properties(pkt, &pos, len) < 0) ||
+		skip_field(pkt, &pos, len) < 0 || skip_field(pkt, &pos, len) < 0))
+		return len;
+	if ((pkt[flags_pos] & 0x80) && skip_field(pkt, &pos, len) < 0)
+		return len;
+
+	field = pos;
+	if (skip_field(pkt, &pos, len) < 0 || pos != len)
+		return len;
+
+	pkt[flags_pos] &= ~0x40;
+	rem -= (uint32_t)(len - field);
+	n = mqtt_prot_encode_varint(rem, &pkt[1]);
+	memmove(&pkt[1 + n], &pkt[hdr], field - hdr);
+	scrubbed = 1 + n + (field - hdr);
+	memset(&pkt[scrubbed], 0, len - scrubbed);
+
+	return scrubbed;
+}
+
+static void capture_from_env(void)
+{
+	const char *env = getenv(MQTT_CAPTURE_ENV);
+
+	env_checked = 1;
+	if (env != NULL && env[0] != '\0')
+		mqtt_capture_start(env);
+}
+
+int mqtt_capture_start(const char *path)
+{
+	mqtt_capture_header *h;
+	struct timespec now;
+	capture_state *c;
+
+	env_checked = 1;
+	mqtt_capture_stop();
+
+	c = (capture_state *)calloc(1, sizeof(capture_state));
+	if (c == NULL)
+		return -1;
+
+	/* Packets may hold private data, only the owner can read them. */
+	c->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (c->fd < 0 || fchmod(c->fd, 0600) < 0) {
+		print_err("Couldn't open capture %s: %s", path, strerror(errno));
+		if (c->fd >= 0)
+			close(c->fd);
+		free(c);
+		return -1;
+	}
+	if (capture_grow(c, MQTT_CAPTURE_CHUNK) < 0) {
+		close(c->fd);
+		unlink(path);
+		free(c);
+		return -1;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	clock_gettime(CLOCK_REALTIME, &now);
+	h = capture_header(c);
+	h->magic = MQTT_CAPTURE_MAGIC;
+	h->version = MQTT_CAPTURE_VERSION;
+	h->start_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	c->used = sizeof(mqtt_capture_header);
+
+	if (!exit_registered) {
+		atexit(mqtt_capture_stop);
+		exit_registered = 1;
+	}
+	capture = c;
+	print_dbg("Capturing packets to %s", path);
+
+	return 0;
+}
+
+void mqtt_capture_stop(void)
+{
+	capture_state *c = capture;
+
+	if (c == NULL)
+		return;
+
+	capture = NULL;
+	munmap(c->map, c->map_size);
+	if (ftruncate(c->fd, (off_t)c->used) < 0)
+		print_wrn("Couldn't truncate capture");
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+void mqtt_capture_packet(int conn, uint8_t version, mqtt_capture_dir dir,
+							const uint8_t *packet, int len)
+{
+	struct iovec iov = { .iov_base = (void *)packet, .iov_len = len };
+
+	if (len > 0)
+		mqtt_capture_packetv(conn, version, dir, &iov, 1);
+}
+
+void mqtt_capture_packetv(int conn, uint8_t version, mqtt_capture_dir dir,
+							const struct iovec *iov, int iovcnt)
+{
+	capture_state *c;
+	mqtt_capture_record *rec;
+	mqtt_capture_header *h;
+	struct timespec now;
+	uint8_t *dst;
+	size_t size, len = 0;
+
+	if (!env_checked)
+		capture_from_env();
+
+	c = capture;
+	if (c == NULL)
+		return;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len == 0 || len > UINT32_MAX)
+		return;
+
+	size = CAPTURE_ALIGN(sizeof(mqtt_capture_record) + (size_t)len);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&c->lock);
+	if (c->used + size > c->map_size &&
+		capture_grow(c, c->used + size) < 0) {
+		/* The file keeps what fit. */
+		pthread_mutex_unlock(&c->lock);
+		print_err("Capture stopped");
+		mqtt_capture_stop();
+		return;
+	}
+
+	rec = (mqtt_capture_record *)&c->map[c->used];
+	dst = (uint8_t *)(rec + 1);
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+	/* Replays do not need credentials, none are left in the file. */
+	dst = (uint8_t *)(rec + 1);
+	if (dir == MQTT_CAPTURE_OUT && (dst[0] >> 4) == MQTT_PROT_CONNECT) {
+		len = scrub_password(dst, len);
+		size = CAPTURE_ALIGN(sizeof(mqtt_capture_record) + len);
+	}
+	rec->time_us = (uint64_t)(now.tv_sec - c->start.tv_sec) * 1000000ULL +
+					(now.tv_nsec - c->start.tv_nsec) / 1000;
+	rec->len = (uint32_t)len;
+	rec->conn = (uint16_t)conn;
+	rec->dir = (uint8_t)dir;
+	rec->version = version;
+	c->used += size;
+
+	h = capture_header(c);
+	h->records_len = c->used - sizeof(mqtt_capture_header);
+	h->records++;
+	pthread_mutex_unlock(&c->lock);
+}
+
+mqtt_capture_reader *mqtt_capture_open(const char *path)
+{
+	const mqtt_capture_header *h;
+	mqtt_capture_reader *r;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		print_err("Couldn't open capture %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	r = (mqtt_capture_reader *)calloc(1, sizeof(mqtt_capture_reader));
+	if (r == NULL || fstat(fd, &st) < 0 ||
+		(size_t)st.st_size < sizeof(mqtt_capture_header))
+		goto fail;
+
+	r->size = (size_t)st.st_size;
+	r->map = (uint8_t *)mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		goto fail;
+	}
+	madvise(r->map, r->size, MADV_SEQUENTIAL);
+	close(fd);
+
+	h = (const mqtt_capture_header *)r->map;
+	if (h->magic != MQTT_CAPTURE_MAGIC || h->version != MQTT_CAPTURE_VERSION ||
+		h->records_len > r->size - sizeof(mqtt_capture_header)) {
+		print_err("%s is not a capture", path);
+		mqtt_capture_close(r);
+		return NULL;
+	}
+	r->end = sizeof(mqtt_capture_header) + h->records_len;
+	r->pos = sizeof(mqtt_capture_header);
+
+	return r;
+fail:
+	print_err("Couldn't map capture %s", path);
+	close(fd);
+	free(r);
+	return NULL;
+}
+
+int mqtt_capture_next(mqtt_capture_reader *r, mqtt_capture_record *rec,
+						const uint8_t **packet)
+{
+	if (r->pos == r->end)
+		return 0;
+	if (r->end - r->pos < sizeof(mqtt_capture_record))
+		return -1;
+
+	memcpy(rec, &r->map[r->pos], sizeof(mqtt_capture_record));
+	if (rec->len > r->end - r->pos - sizeof(mqtt_capture_record))
+		return -1;
+
+	*packet = &r->map[r->pos + sizeof(mqtt_capture_record)];
+	r->pos += CAPTURE_ALIGN(sizeof(mqtt_capture_record) + rec->len);
+	if (r->pos > r->end)
+		r->pos = r->end;
+
+	return 1;
+}
+
+void mqtt_capture_rewind(mqtt_capture_reader *r)
+{
+	r->pos = sizeof(mqtt_capture_header);
+}
+
+void mqtt_capture_close(mqtt_capture_reader *r)
+{
+	if (r == NULL)
+		return;
+
+	if (r->map != NULL)
+		munmap(r->map, r->size);
+	free(r);
+}
@@ -0,0 +1,132 @@
+/**
+ * @file mqtt_capture.h
+ * @brief Packet capture to a binary file, and reading it back.
+ *
+ * Every packet sent or received on direct connections is appended to a
+ * memory mapped file, grown by MQTT_CAPTURE_CHUNK bytes at a time. The file
+ * starts with mqtt_capture_header, followed by records: mqtt_capture_record
+ * then the packet bytes as on the wire, padded to 8 bytes. The header is
+ * kept up to date after each record, so a capture is readable even if the
+ * process did not stop it. The file is readable by its owner only, and
+ * CONNECT packets are recorded without their password.
+ *
+ * Set MQTT_CAPTURE to a file name in the environment, or call
+ * mqtt_capture_start. mqtt_replay.c replays the captured publishes.
+ */
+
+#ifndef _MQTT_CAPTURE_H_
+#define _MQTT_CAPTURE_H_
+
+#include "stdint.h"
+#include "sys/uio.h"
+
+#define MQTT_CAPTURE_ENV "MQTT_CAPTURE"
+/* "MQCP" */
+#define MQTT_CAPTURE_MAGIC 0x5043514D
+#define MQTT_CAPTURE_VERSION 1
+#define MQTT_CAPTURE_CHUNK (16 * 1024 * 1024)
+
+typedef enum {
+    MQTT_CAPTURE_OUT = 0,
+    MQTT_CAPTURE_IN = 1
+} mqtt_capture_dir;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    /* Wall clock time of the start, in ns since the epoch. */
+    uint64_t start_ns;
+    /* Bytes of records following the header. */
+    uint64_t records_len;
+    uint64_t records;
+} mqtt_capture_header;
+
+typedef struct {
+    /* Time since the start of the capture. */
+    uint64_t time_us;
+    /* Packet length, the record is padded to 8 bytes after it. */
+    uint32_t len;
+    /* Connection, the socket handler. */
+    uint16_t conn;
+    /* mqtt_capture_dir. */
+    uint8_t dir;
+    /* Protocol version of the connection, to decode the packet. */
+    uint8_t version;
+} mqtt_capture_record;
+
+typedef struct mqtt_capture_reader mqtt_capture_reader;
+
+/**
+ * @brief Start capturing to a file, replacing it. A running capture is
+ * stopped first.
+ * @param path File name.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_capture_start(const char *path);
+
+/**
+ * @brief Stop capturing and truncate the file to what was captured. Also
+ * called at exit.
+ * @return None.
+ */
+void mqtt_capture_stop(void);
+
+/**
+ * @brief Append a packet to the capture, if one is running.
+ * @param conn Connection, the socket handler.
+ * @param version Protocol version of the connection.
+ * @param dir MQTT_CAPTURE_OUT or MQTT_CAPTURE_IN.
+ * @param packet Packet bytes.
+ * @param len Packet length.
+ * @return None.
+ */
+void mqtt_capture_packet(int conn, uint8_t version, mqtt_capture_dir dir,
+                            const uint8_t *packet, int len);
+
+/**
+ * @brief Append a packet sent in several buffers, see socket_sendv.
+ * @param conn Connection, the socket handler.
+ * @param version Protocol version of the connection.
+ * @param dir MQTT_CAPTURE_OUT or MQTT_CAPTURE_IN.
+ * @param iov Packet bytes, in order.
+ * @param iovcnt Number of buffers.
+ * @return None.
+ */
+void mqtt_capture_packetv(int conn, uint8_t version, mqtt_capture_dir dir,
+                            const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Map a capture file for reading.
+ * @param path File name.
+ * @return Reader or NULL if the file is not a capture.
+ */
+mqtt_capture_reader *mqtt_capture_open(const char *path);
+
+/**
+ * @brief Get the next record. The packet stays valid until the reader is
+ * closed.
+ * @param r Reader.
+ * @param rec Receives the record header.
+ * @param packet Receives the packet bytes.
+ * @return 1 if a record was read, 0 at the end or -1 if the file is
+ * corrupted.
+ */
+int mqtt_capture_next(mqtt_capture_reader *r, mqtt_capture_record *rec,
+                        const uint8_t **packet);
+
+/**
+ * @brief Restart reading from the first record.
+ * @param r Reader.
+ * @return None.
+ */
+void mqtt_capture_rewind(mqtt_capture_reader *r);
+
+/**
+ * @brief Unmap a capture file.
+ * @param r Reader.
+ * @return None.
+ */
+void mqtt_capture_close(mqtt_capture_reader *r);
+
+#endif /* _MQTT_CAPTURE_H_ */
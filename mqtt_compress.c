@@ -0,0 +1,505 @@
+/**
+ * @file mqtt_compress.c
+ * @brief Payload compression implementation.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+
+#include "mqtt_compress.h"
+#include "mqtt_prot.h"
+#include "mqtt_validate.h"
+
+#ifdef MQTT_WITH_LZ4
+#include "lz4.h"
+#include "lz4hc.h"
+#endif
+#ifdef MQTT_WITH_ZSTD
+#include "zstd.h"
+#include "zdict.h"
+#endif
+
+#define COMPRESS_HAS_DICT 0x80
+/* Largest output of one byte of LZ4 block data, a match length byte
+ * stands for 255 bytes. */
+#define LZ4_MAX_RATIO 255
+
+typedef struct {
+	char *filter;
+	uint32_t id;
+	uint8_t *data;
+	size_t len;
+#ifdef MQTT_WITH_ZSTD
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+#endif
+} compress_dict;
+
+struct mqtt_compressor {
+	mqtt_compress_algo algo;
+	int level;
+	compress_dict *dicts;
+	int dicts_len;
+#ifdef MQTT_WITH_LZ4
+	LZ4_stream_t *lz4;
+	/* Levels above 1 compress with LZ4 HC. */
+	LZ4_streamHC_t *lz4hc;
+#endif
+#ifdef MQTT_WITH_ZSTD
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+#endif
+};
+
+static uint32_t dict_id(const uint8_t *data, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static compress_dict *dict_for_topic(mqtt_compressor *c, const char *topic)
+{
+	if (topic == NULL)
+		return NULL;
+
+	for (int i = 0; i < c->dicts_len; i++) {
+		if (mqtt_topic_match(c->dicts[i].filter, topic, strlen(topic)))
+			return &c->dicts[i];
+	}
+
+	return NULL;
+}
+
+static compress_dict *dict_for_id(mqtt_compressor *c, uint32_t id)
+{
+	for (int i = 0; i < c->dicts_len; i++) {
+		if (c->dicts[i].id == id)
+			return &c->dicts[i];
+	}
+
+	return NULL;
+}
+
+mqtt_compressor *mqtt_compressor_create(mqtt_compress_algo algo, int level)
+{
+	mqtt_compressor *c;
+
+	switch (algo) {
+		case MQTT_COMPRESS_NONE:
+#ifdef MQTT_WITH_LZ4
+		case MQTT_COMPRESS_LZ4:
+#endif
+#ifdef MQTT_WITH_ZSTD
+		case MQTT_COMPRESS_ZSTD:
+#endif
+			break;
+		default:
+			print_err("Compression algorithm %d not built in", algo);
+			return NULL;
+	}
+
+	c = (mqtt_compressor *)calloc(1, sizeof(mqtt_compressor));
+	if (c == NULL)
+		return NULL;
+
+	c->algo = algo;
+	c->level = level;
+#ifdef MQTT_WITH_LZ4
+	c->lz4 = LZ4_createStream();
+	if (c->lz4 == NULL)
+		goto fail;
+	if (algo == MQTT_COMPRESS_LZ4 && level > 1) {
+		c->lz4hc = LZ4_createStreamHC();
+		if (c->lz4hc == NULL)
+			goto fail;
+	}
+#endif
+#ifdef MQTT_WITH_ZSTD
+	if (c->level == 0)
+		c->level = ZSTD_CLEVEL_DEFAULT;
+	c->cctx = ZSTD_createCCtx();
+	c->dctx = ZSTD_createDCtx();
+	if (c->cctx == NULL || c->dctx == NULL)
+		goto fail;
+#endif
+
+	return c;
+#if defined(MQTT_WITH_LZ4) || defined(MQTT_WITH_ZSTD)
+fail:
+	mqtt_compressor_destroy(c);
+	return NULL;
+#endif
+}
+
+void mqtt_compressor_destroy(mqtt_compressor *c)
+{
+	if (c == NULL)
+		return;
+
+	for (int i = 0; i < c->dicts_len; i++) {
+		free(c->dicts[i].filter);
+		free(c->dicts[i].data);
+#ifdef MQTT_WITH_ZSTD
+		ZSTD_freeCDict(c->dicts[i].cdict);
+		ZSTD_freeDDict(c->dicts[i].ddict);
+#endif
+	}
+	free(c->dicts);
+#ifdef MQTT_WITH_LZ4
+	LZ4_freeStream(c->lz4);
+	LZ4_freeStreamHC(c->lz4hc);
+#endif
+#ifdef MQTT_WITH_ZSTD
+	ZSTD_freeCCtx(c->cctx);
+	ZSTD_freeDCtx(c->dctx);
+#endif
+	free(c);
+}
+
+int mqtt_compressor_add_dictionary(mqtt_compressor *c,
+									const char *topic_filter,
+									const void *dict,
+									size_t dict_len)
+{
+	compress_dict *grown, *d;
+
+	if (c == NULL || topic_filter == NULL || dict == NULL || dict_len == 0)
+		return -1;
+	if (mqtt_valid_topic_filter(topic_filter, strlen(topic_filter)) < 0) {
+		print_err("Invalid topic filter %s", topic_filter);
+		return -1;
+	}
+
+	grown = (compress_dict *)realloc(c->dicts,
+									(c->dicts_len + 1) * sizeof(compress_dict));
+	if (grown == NULL)
+		return -1;
+	c->dicts = grown;
+
+	d = &c->dicts[c->dicts_len];
+	memset(d, 0, sizeof(compress_dict));
+	d->filter = strdup(topic_filter);
+	d->data = (uint8_t *)malloc(dict_len);
+	if (d->filter == NULL || d->data == NULL)
+		goto fail;
+	memcpy(d->data, dict, dict_len);
+	d->len = dict_len;
+	d->id = dict_id(d->data, d->len);
+#ifdef MQTT_WITH_ZSTD
+	/* Digested once here instead of on every message. */
+	d->cdict = ZSTD_createCDict(d->data, d->len, c->level);
+	d->ddict = ZSTD_createDDict(d->data, d->len);
+	if (d->cdict == NULL || d->ddict == NULL) {
+		ZSTD_freeCDict(d->cdict);
+		ZSTD_freeDDict(d->ddict);
+		goto fail;
+	}
+#endif
+
+	c->dicts_len++;
+	return 0;
+fail:
+	free(d->filter);
+	free(d->data);
+	return -1;
+}
+
+int mqtt_compress_train_dictionary(void *dict,
+									size_t dict_cap,
+									const void *samples,
+									const size_t *sample_sizes,
+									unsigned int nb_samples)
+{
+#ifdef MQTT_WITH_ZSTD
+	size_t ret;
+
+	ret = ZDICT_trainFromBuffer(dict, dict_cap, samples, sample_sizes,
+								nb_samples);
+	if (ZDICT_isError(ret)) {
+		print_err("Dictionary training failed: %s", ZDICT_getErrorName(ret));
+		return -1;
+	}
+
+	return (int)ret;
+#else
+	(void)dict;
+	(void)dict_cap;
+	(void)samples;
+	(void)sample_sizes;
+	(void)nb_samples;
+	print_err("zstd support not built in");
+	return -1;
+#endif
+}
+
+size_t mqtt_compress_bound(const mqtt_compressor *c, size_t in_len)
+{
+	size_t bound = in_len;
+
+	switch (c->algo) {
+#ifdef MQTT_WITH_LZ4
+		case MQTT_COMPRESS_LZ4:
+			bound = LZ4_compressBound((int)in_len);
+			break;
+#endif
+#ifdef MQTT_WITH_ZSTD
+		case MQTT_COMPRESS_ZSTD:
+			bound = ZSTD_compressBound(in_len);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	return MQTT_COMPRESS_HEADER_MAX + bound;
+}
+
+int mqtt_compress(mqtt_compressor *c,
+					const char *topic,
+					const uint8_t *in,
+					size_t in_len,
+					uint8_t *out,
+					size_t out_len)
+{
+	compress_dict *d;
+	size_t ret = 0;
+	int i = 0;
+
+	if (c == NULL || in == NULL || out == NULL)
+		return -1;
+	if (c->algo == MQTT_COMPRESS_NONE || in_len < MQTT_COMPRESS_MIN_SIZE ||
+		in_len > MQTT_PROT_VARINT_MAX || out_len < MQTT_COMPRESS_HEADER_MAX)
+		return 0;
+
+	d = dict_for_topic(c, topic);
+
+	out[i++] = MQTT_COMPRESS_MARKER;
+	out[i++] = (uint8_t)c->algo | (d ? COMPRESS_HAS_DICT : 0);
+	i += mqtt_prot_encode_varint((uint32_t)in_len, &out[i]);
+	if (d != NULL) {
+		out[i++] = (uint8_t)(d->id >> 24);
+		out[i++] = (uint8_t)(d->id >> 16);
+		out[i++] = (uint8_t)(d->id >> 8);
+		out[i++] = (uint8_t)d->id;
+	}
+
+	switch (c->algo) {
+#ifdef MQTT_WITH_LZ4
+		case MQTT_COMPRESS_LZ4: {
+			/* Acceleration grows as negative levels go down. */
+			int accel = c->level < 0 ? -c->level : 1;
+			int n;
+
+			if (c->lz4hc != NULL) {
+				LZ4_resetStreamHC_fast(c->lz4hc, c->level);
+				if (d != NULL)
+					LZ4_loadDictHC(c->lz4hc, (const char *)d->data,
+									(int)d->len);
+				n = LZ4_compress_HC_continue(c->lz4hc, (const char *)in,
+												(char *)&out[i], (int)in_len,
+												(int)(out_len - i));
+			} else {
+				LZ4_resetStream_fast(c->lz4);
+				if (d != NULL)
+					LZ4_loadDict(c->lz4, (const char *)d->data, (int)d->len);
+				n = LZ4_compress_fast_continue(c->lz4, (const char *)in,
+												(char *)&out[i], (int)in_len,
+												(int)(out_len - i), accel);
+			}
+			ret = n > 0 ? (size_t)n : 0;
+			break;
+		}
+#endif
+#ifdef MQTT_WITH_ZSTD
+		case MQTT_COMPRESS_ZSTD:
+			if (d != NULL)
+				ret = ZSTD_compress_usingCDict(c->cctx, &out[i], out_len - i,
+												in, in_len, d->cdict);
+			else
+				ret = ZSTD_compressCCtx(c->cctx, &out[i], out_len - i,
+										in, in_len, c->level);
+			if (ZSTD_isError(ret))
+				ret = 0;
+			break;
+#endif
+		default:
+			break;
+	}
+
+	/* Not compressible or did not fit, caller sends it as is. */
+	if (ret == 0 || i + ret >= in_len)
+		return 0;
+
+	return i + (int)ret;
+}
+
+/* Parse the header, returns its size or -1 if not compressed. */
+/* Check the uncompressed size announced can come from the data. */
+static int size_possible(uint8_t algo, const uint8_t *data, size_t len,
+							uint32_t orig_len)
+{
+	if (algo == MQTT_COMPRESS_LZ4)
+		return orig_len <= (uint64_t)len * LZ4_MAX_RATIO;
+#ifdef MQTT_WITH_ZSTD
+	return ZSTD_getFrameContentSize(data, len) == orig_len;
+#else
+	(void)data;
+	return 1;
+#endif
+}
+
+static int compress_header(const uint8_t *in, size_t in_len, uint8_t *algo,
+							uint32_t *orig_len, uint32_t *id)
+{
+	int i = 2, n;
+
+	if (in == NULL || in_len < 3 || in[0] != MQTT_COMPRESS_MARKER)
+		return -1;
+
+	*algo = in[1] & ~COMPRESS_HAS_DICT;
+	if (*algo != MQTT_COMPRESS_LZ4 && *algo != MQTT_COMPRESS_ZSTD)
+		return -1;
+
+	n = mqtt_prot_decode_varint(&in[i], (int)(in_len - i), orig_len);
+	if (n <= 0)
+		return -1;
+	i += n;
+
+	*id = 0;
+	if (in[1] & COMPRESS_HAS_DICT) {
+		if (in_len < (size_t)i + 4)
+			return -1;
+		*id = ((uint32_t)in[i] << 24) | ((uint32_t)in[i + 1] << 16) |
+				((uint32_t)in[i + 2] << 8) | in[i + 3];
+		i += 4;
+	}
+
+	if (!size_possible(*algo, &in[i], in_len - i, *orig_len))
+		return -1;
+
+	return i;
+}
+
+int mqtt_compress_needs_escape(const uint8_t *in, size_t in_len)
+{
+	return in_len > 0 && in[0] == MQTT_COMPRESS_MARKER;
+}
+
+int mqtt_compress_escaped(const uint8_t *in, size_t in_len)
+{
+	return in_len >= MQTT_COMPRESS_ESCAPE_LEN &&
+			in[0] == MQTT_COMPRESS_MARKER && in[1] == MQTT_COMPRESS_ESCAPE;
+}
+
+int mqtt_compressed_len(const uint8_t *in, size_t in_len)
+{
+	uint32_t orig_len, id;
+	uint8_t algo;
+
+	if (compress_header(in, in_len, &algo, &orig_len, &id) < 0)
+		return -1;
+
+	return (int)orig_len;
+}
+
+int mqtt_decompress(mqtt_compressor *c,
+					const uint8_t *in,
+					size_t in_len,
+					uint8_t *out,
+					size_t out_len)
+{
+	compress_dict *d = NULL;
+	uint32_t orig_len, id;
+	uint8_t algo;
+	int i;
+
+	if (c == NULL || out == NULL)
+		return -1;
+
+	i = compress_header(in, in_len, &algo, &orig_len, &id);
+	if (i < 0 || orig_len > out_len)
+		return -1;
+
+	if (id != 0) {
+		d = dict_for_id(c, id);
+		if (d == NULL) {
+			print_err("Unknown dictionary 0x%08x", id);
+			return -1;
+		}
+	}
+
+	switch (algo) {
+#ifdef MQTT_WITH_LZ4
+		case MQTT_COMPRESS_LZ4: {
+			int n;
+
+			if (d != NULL)
+				n = LZ4_decompress_safe_usingDict((const char *)&in[i],
+							(char *)out, (int)(in_len - i), (int)orig_len,
+							(const char *)d->data, (int)d->len);
+			else
+				n = LZ4_decompress_safe((const char *)&in[i], (char *)out,
+										(int)(in_len - i), (int)orig_len);
+			if (n != (int)orig_len)
+				return -1;
+			break;
+		}
+#endif
+#ifdef MQTT_WITH_ZSTD
+		case MQTT_COMPRESS_ZSTD: {
+			size_t ret;
+
+			if (d != NULL)
+				ret = ZSTD_decompress_usingDDict(c->dctx, out, orig_len,
+												&in[i], in_len - i, d->ddict);
+			else
+				ret = ZSTD_decompressDCtx(c->dctx, out, orig_len,
+											&in[i], in_len - i);
+			if (ZSTD_isError(ret) || ret != orig_len)
+				return -1;
+			break;
+		}
+#endif
+		default:
+			print_err("Compression algorithm %d not built in", algo);
+			return -1;
+	}
+
+	return (int)orig_len;
+}
+
+int mqtt_compress_batch(mqtt_compressor *c,
+						mqtt_compress_item *items,
+						int count,
+						uint8_t *out,
+						size_t out_len)
+{
+	size_t used = 0;
+	int n;
+
+	for (int i = 0; i < count; i++) {
+		n = 0;
+		if (!mqtt_compress_needs_escape(items[i].in, items[i].in_len))
+			n = mqtt_compress(c, items[i].topic, items[i].in, items[i].in_len,
+								&out[used], out_len - used);
+		if (n < 0)
+			return -1;
+
+		if (n == 0) {
+			items[i].out = items[i].in;
+			items[i].out_len = items[i].in_len;
+		} else {
+			items[i].out = &out[used];
+			items[i].out_len = n;
+			used += n;
+		}
+	}
+
+	return (int)used;
+}
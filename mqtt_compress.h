@@ -0,0 +1,194 @@
+/**
+ * @file mqtt_compress.h
+ * @brief Payload compression declaration.
+ * LZ4 support is built with -DMQTT_WITH_LZ4 -llz4 and zstd support with
+ * -DMQTT_WITH_ZSTD -lzstd. Without them only uncompressed payloads pass.
+ *
+ * On connections framing their payloads, see mqtt_set_framing, payloads
+ * starting with 0xFF are framed by this library, so receivers using it
+ * detect compressed payloads whatever the protocol version:
+ * Byte 1: 0xFF.
+ * Byte 2: MQTT_COMPRESS_ESCAPE, an algorithm or MQTT_AGGREGATE_TAG.
+ * Payloads given by the application that start with 0xFF are escaped: they
+ * are sent uncompressed after 0xFF MQTT_COMPRESS_ESCAPE, which receivers
+ * strip, so binary payloads arrive as sent.
+ *
+ * A compressed payload continues with:
+ * Byte 2: Algorithm, bit 7 set if a dictionary identifier follows.
+ * Following bytes: Uncompressed size as a Variable Byte Integer.
+ * Optional 4 bytes: Dictionary identifier.
+ * Following bytes: Compressed data.
+ * Payloads that must be escaped are never compressed, so a decompressed
+ * payload starting with 0xFF is framed. The uncompressed size must be one
+ * the compressed data can produce, so a short payload cannot claim a large
+ * buffer.
+ */
+
+#ifndef _MQTT_COMPRESS_H_
+#define _MQTT_COMPRESS_H_
+
+#include "stddef.h"
+#include "stdint.h"
+
+#define MQTT_COMPRESS_MARKER 0xFF
+#define MQTT_COMPRESS_ESCAPE 0x00
+#define MQTT_COMPRESS_ESCAPE_LEN 2
+#define MQTT_COMPRESS_HEADER_MAX 10
+/* Smaller payloads are always sent uncompressed. */
+#define MQTT_COMPRESS_MIN_SIZE 64
+
+typedef enum {
+    MQTT_COMPRESS_NONE = 0,
+    MQTT_COMPRESS_LZ4 = 1,
+    MQTT_COMPRESS_ZSTD = 2
+} mqtt_compress_algo;
+
+typedef struct mqtt_compressor mqtt_compressor;
+
+/**
+ * @brief One message of a batch. in and in_len are set by the caller, out
+ * and out_len by the batch call. out points either into the batch output
+ * buffer or to in when the message is left uncompressed.
+ */
+typedef struct {
+    const char *topic;
+    const uint8_t *in;
+    size_t in_len;
+    const uint8_t *out;
+    size_t out_len;
+} mqtt_compress_item;
+
+/**
+ * @brief Create a compression context. Contexts are reused for every
+ * message, so setup costs are paid once.
+ * @param algo Algorithm used to compress, any algorithm can be decompressed.
+ * @param level Compression level, 0 for the library default. Higher levels
+ * compress better and slower. With LZ4, levels above 1 select LZ4 HC and
+ * negative levels trade ratio for speed.
+ * @return Compression context or NULL if the algorithm is not built in.
+ */
+mqtt_compressor *mqtt_compressor_create(mqtt_compress_algo algo, int level);
+
+/**
+ * @brief Release a compression context and its dictionaries.
+ * @param c Compression context.
+ * @return None.
+ */
+void mqtt_compressor_destroy(mqtt_compressor *c);
+
+/**
+ * @brief Register a dictionary used to compress topics matching a filter.
+ * Dictionaries are also used to decompress, they are identified by their
+ * content so publisher and subscribers must register the same bytes.
+ * @param c Compression context.
+ * @param topic_filter Topics using this dictionary.
+ * @param dict Dictionary content, copied.
+ * @param dict_len Dictionary length.
+ * @return 0 if success or -1 if error.
+ */
+int mqtt_compressor_add_dictionary(mqtt_compressor *c,
+                                    const char *topic_filter,
+                                    const void *dict,
+                                    size_t dict_len);
+
+/**
+ * @brief Train a zstd dictionary from sample payloads of a topic.
+ * @param dict Output dictionary.
+ * @param dict_cap Output dictionary capacity, around 100 times smaller than
+ * the samples total size is a good start.
+ * @param samples Sample payloads, concatenated.
+ * @param sample_sizes Size of each sample.
+ * @param nb_samples Number of samples.
+ * @return Dictionary size or -1 if error.
+ */
+int mqtt_compress_train_dictionary(void *dict,
+                                    size_t dict_cap,
+                                    const void *samples,
+                                    const size_t *sample_sizes,
+                                    unsigned int nb_samples);
+
+/**
+ * @brief Worst case size of a compressed payload, header included.
+ * @param c Compression context.
+ * @param in_len Uncompressed size.
+ * @return Size in bytes.
+ */
+size_t mqtt_compress_bound(const mqtt_compressor *c, size_t in_len);
+
+/**
+ * @brief Compress one payload.
+ * @param c Compression context.
+ * @param topic Topic name, selects the dictionary.
+ * @param in Payload.
+ * @param in_len Payload length.
+ * @param out Compressed payload with header.
+ * @param out_len Output capacity, mqtt_compress_bound is always enough.
+ * @return Compressed size, 0 if it would not be smaller than the payload
+ * (send it uncompressed) or -1 if error.
+ */
+int mqtt_compress(mqtt_compressor *c,
+                    const char *topic,
+                    const uint8_t *in,
+                    size_t in_len,
+                    uint8_t *out,
+                    size_t out_len);
+
+/**
+ * @brief Check if a payload given by the application must be escaped.
+ * @param in Payload.
+ * @param in_len Payload length.
+ * @return 1 if it starts with MQTT_COMPRESS_MARKER, 0 otherwise.
+ */
+int mqtt_compress_needs_escape(const uint8_t *in, size_t in_len);
+
+/**
+ * @brief Check if a received payload was escaped.
+ * @param in Received payload.
+ * @param in_len Received payload length.
+ * @return 1 if escaped, the payload sent follows the first
+ * MQTT_COMPRESS_ESCAPE_LEN bytes, 0 otherwise.
+ */
+int mqtt_compress_escaped(const uint8_t *in, size_t in_len);
+
+/**
+ * @brief Get the uncompressed size of a payload.
+ * @param in Received payload.
+ * @param in_len Received payload length.
+ * @return Uncompressed size or -1 if the payload is not compressed or its
+ * header announces a size the compressed data cannot produce.
+ */
+int mqtt_compressed_len(const uint8_t *in, size_t in_len);
+
+/**
+ * @brief Decompress one payload.
+ * @param c Compression context.
+ * @param in Compressed payload with header.
+ * @param in_len Compressed payload length.
+ * @param out Uncompressed payload.
+ * @param out_len Output capacity, at least mqtt_compressed_len.
+ * @return Uncompressed size or -1 if error.
+ */
+int mqtt_decompress(mqtt_compressor *c,
+                    const uint8_t *in,
+                    size_t in_len,
+                    uint8_t *out,
+                    size_t out_len);
+
+/**
+ * @brief Compress several payloads with the same context. Payloads needing
+ * to be escaped are left uncompressed.
+ * @param c Compression context.
+ * @param items Messages to compress.
+ * @param count Number of messages.
+ * @param out Output buffer shared by all messages.
+ * @param out_len Output capacity, the sum of mqtt_compress_bound is always
+ * enough.
+ * @return Bytes used in out or -1 if error.
+ */
+int mqtt_compress_batch(mqtt_compressor *c,
+                        mqtt_compress_item *items,
+                        int count,
+                        uint8_t *out,
+                        size_t out_len);
+
+#endif /* _MQTT_COMPRESS_H_ */
@@ -0,0 +1,443 @@
+/**
+ * @file mqtt_encode.hpp
+ * @brief C++20 packet encoders specialized at compile time, header only.
+ *
+ * Each packet type is a template whose constant parts, the QoS, a static
+ * topic or filter and the protocol version, are template parameters:
+ *
+ *     using temperature = mqtt::prot::publish<1, "sensors/temperature">;
+ *
+ *     len = mqtt::prot::encode<temperature>(buf, sizeof(buf), packet_id,
+ *                                           payload, payload_len);
+ *
+ * Fixed headers, protocol names, topics with their length and empty property
+ * lists are built by constexpr functions into byte arrays, copied as they
+ * are. Only packet identifiers, lengths depending on the payload and the
+ * payload itself are written at run time, with no branch on the packet
+ * layout. The bytes are the same as those of the mqtt_prot.h encoder of the
+ * packet, with no properties and success reason codes. Encoders follow its
+ * conventions: they return the packet length, the needed size when out is
+ * NULL or -1 if out_len is too small.
+ */
+
+#ifndef _MQTT_ENCODE_HPP_
+#define _MQTT_ENCODE_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include "mqtt_prot.h"
+}
+
+namespace mqtt {
+namespace prot {
+
+/**
+ * @brief String usable as a template parameter, for static topics.
+ */
+template <std::size_t N>
+struct fixed_string {
+    char data[N] = {};
+
+    constexpr fixed_string(const char (&str)[N])
+    {
+        for (std::size_t i = 0; i < N; i++)
+            data[i] = str[i];
+    }
+
+    static constexpr std::size_t size()
+    {
+        return N - 1;
+    }
+};
+
+template <std::size_t N>
+using bytes = std::array<std::uint8_t, N>;
+
+constexpr int varint_len(std::uint32_t value)
+{
+    return (value < 128) ? 1 : (value < 16384) ? 2 :
+            (value < 2097152) ? 3 : 4;
+}
+
+/* Same bytes as mqtt_prot_encode_varint, value already checked. */
+inline int put_varint(std::uint8_t *out, std::uint32_t value)
+{
+    int i = 0;
+
+    while (value >= 128) {
+        out[i++] = static_cast<std::uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[i++] = static_cast<std::uint8_t>(value);
+
+    return i;
+}
+
+/* Fixed header of a packet whose remaining length is constant. */
+template <std::uint8_t First, std::uint32_t Remaining>
+constexpr auto fixed_header()
+{
+    static_assert(Remaining <= MQTT_PROT_VARINT_MAX, "Packet too large");
+    bytes<1 + varint_len(Remaining)> out{};
+    std::uint32_t value = Remaining;
+
+    out[0] = First;
+    for (std::size_t i = 1; i < out.size(); i++) {
+        out[i] = static_cast<std::uint8_t>(value & 0x7F);
+        value >>= 7;
+        if (value > 0)
+            out[i] |= 0x80;
+    }
+
+    return out;
+}
+
+/* UTF-8 string with its two bytes length. */
+template <fixed_string Str>
+constexpr auto utf8_string()
+{
+    static_assert(Str.size() <= UINT16_MAX, "String too long");
+    bytes<2 + Str.size()> out{};
+
+    out[0] = static_cast<std::uint8_t>(Str.size() >> 8);
+    out[1] = static_cast<std::uint8_t>(Str.size());
+    for (std::size_t i = 0; i < Str.size(); i++)
+        out[2 + i] = static_cast<std::uint8_t>(Str.data[i]);
+
+    return out;
+}
+
+template <std::size_t A, std::size_t B>
+constexpr bytes<A + B> concat(const bytes<A> &a, const bytes<B> &b)
+{
+    bytes<A + B> out{};
+
+    for (std::size_t i = 0; i < A; i++)
+        out[i] = a[i];
+    for (std::size_t i = 0; i < B; i++)
+        out[A + i] = b[i];
+
+    return out;
+}
+
+/* Topic names are not empty and have no wildcard. */
+template <fixed_string Topic>
+constexpr bool valid_topic_name()
+{
+    if (Topic.size() == 0)
+        return false;
+    for (std::size_t i = 0; i < Topic.size(); i++) {
+        if (Topic.data[i] == '+' || Topic.data[i] == '#' ||
+            Topic.data[i] == '\0')
+            return false;
+    }
+
+    return true;
+}
+
+constexpr bool valid_version(std::uint8_t version)
+{
+    return version == MQTT_PROT_VERSION_3_1_1 || version == MQTT_PROT_VERSION_5;
+}
+
+/* Empty property list of MQTT v5, nothing for MQTT 3.1.1. */
+template <std::uint8_t Version>
+constexpr auto no_properties()
+{
+    if constexpr (Version == MQTT_PROT_VERSION_5)
+        return bytes<1>{ 0x00 };
+    else
+        return bytes<0>{};
+}
+
+/* Write a constant byte array, returns its size. */
+template <std::size_t N>
+inline int put(std::uint8_t *out, const bytes<N> &b)
+{
+    if constexpr (N > 0)
+        std::memcpy(out, b.data(), N);
+    return static_cast<int>(N);
+}
+
+inline int put_id(std::uint8_t *out, std::uint16_t packet_id)
+{
+    out[0] = static_cast<std::uint8_t>(packet_id >> 8);
+    out[1] = static_cast<std::uint8_t>(packet_id);
+    return 2;
+}
+
+/* Packets whose length is constant. */
+template <std::size_t N>
+inline int check_fixed(const std::uint8_t *out, int out_len)
+{
+    if (out == nullptr)
+        return static_cast<int>(N);
+    if (static_cast<int>(N) > out_len)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief CONNECT, see mqtt_prot_connect. The protocol name and level are
+ * constant.
+ */
+template <std::uint8_t Version = MQTT_PROT_VERSION_3_1_1>
+struct connect {
+    static_assert(valid_version(Version), "Unknown protocol version");
+
+    /* Protocol name then level. */
+    static constexpr auto name = concat(utf8_string<"MQTT">(),
+                                        bytes<1>{ Version });
+
+    static int encode(std::uint8_t *out, int out_len, std::uint8_t conn_flags,
+                      std::uint16_t keepalive, const char *client_id,
+                      const char *username = nullptr,
+                      const char *password = nullptr,
+                      const mqtt_prot_properties *props = nullptr)
+    {
+        std::size_t id_len = std::strlen(client_id), user_len = 0, pass_len = 0;
+        std::uint32_t remaining;
+        int props_len = 0, total, i;
+
+        if (username != nullptr)
+            user_len = std::strlen(username);
+        if (password != nullptr)
+            pass_len = std::strlen(password);
+        if (id_len > UINT16_MAX || user_len > UINT16_MAX ||
+            pass_len > UINT16_MAX)
+            return -1;
+        if constexpr (Version == MQTT_PROT_VERSION_5) {
+            props_len = mqtt_prot_properties_encode(props, nullptr, 0);
+            if (props_len < 0)
+                return -1;
+        }
+
+        remaining = name.size() + 3 + props_len + 2 + id_len;
+        if (username != nullptr)
+            remaining += 2 + user_len;
+        if (password != nullptr)
+            remaining += 2 + pass_len;
+
+        total = 1 + varint_len(remaining) + static_cast<int>(remaining);
+        if (out == nullptr)
+            return total;
+        if (total > out_len)
+            return -1;
+
+        out[0] = MQTT_PROT_CONNECT << 4;
+        i = 1 + put_varint(&out[1], remaining);
+        i += put(&out[i], name);
+        out[i++] = conn_flags;
+        i += put_id(&out[i], keepalive);
+        if constexpr (Version == MQTT_PROT_VERSION_5)
+            i += mqtt_prot_properties_encode(props, &out[i], out_len - i);
+        i += put_id(&out[i], static_cast<std::uint16_t>(id_len));
+        std::memcpy(&out[i], client_id, id_len);
+        i += static_cast<int>(id_len);
+        if (username != nullptr) {
+            i += put_id(&out[i], static_cast<std::uint16_t>(user_len));
+            std::memcpy(&out[i], username, user_len);
+            i += static_cast<int>(user_len);
+        }
+        if (password != nullptr) {
+            i += put_id(&out[i], static_cast<std::uint16_t>(pass_len));
+            std::memcpy(&out[i], password, pass_len);
+            i += static_cast<int>(pass_len);
+        }
+
+        return i;
+    }
+};
+
+/**
+ * @brief PUBLISH on a static topic, see mqtt_prot_publish. The first byte,
+ * the topic with its length and the empty property list are constant, the
+ * packet identifier is only taken for QoS 1 and 2.
+ */
+template <int Qos, fixed_string Topic,
+          std::uint8_t Version = MQTT_PROT_VERSION_3_1_1, bool Retain = false>
+struct publish {
+    static_assert(Qos >= 0 && Qos <= 2, "QoS is 0, 1 or 2");
+    static_assert(valid_topic_name<Topic>(), "Invalid topic name");
+    static_assert(valid_version(Version), "Unknown protocol version");
+
+    static constexpr std::uint8_t first =
+        (MQTT_PROT_PUBLISH << 4) | (Qos << 1) | (Retain ? 1 : 0);
+    static constexpr auto topic = utf8_string<Topic>();
+    static constexpr auto props = no_properties<Version>();
+    /* Remaining length without the payload. */
+    static constexpr std::uint32_t header_len =
+        topic.size() + (Qos ? 2 : 0) + props.size();
+
+    static int encode(std::uint8_t *out, int out_len, const void *payload,
+                      std::uint32_t payload_len) requires (Qos == 0)
+    {
+        return write(out, out_len, 0, payload, payload_len);
+    }
+
+    static int encode(std::uint8_t *out, int out_len, std::uint16_t packet_id,
+                      const void *payload,
+                      std::uint32_t payload_len) requires (Qos > 0)
+    {
+        return write(out, out_len, packet_id, payload, payload_len);
+    }
+
+private:
+    static int write(std::uint8_t *out, int out_len, std::uint16_t packet_id,
+                     const void *payload, std::uint32_t payload_len)
+    {
+        std::uint32_t remaining;
+        int total, i;
+
+        if (payload_len > MQTT_PROT_VARINT_MAX - header_len)
+            return -1;
+        remaining = header_len + payload_len;
+        total = 1 + varint_len(remaining) + static_cast<int>(remaining);
+        if (out == nullptr)
+            return total;
+        if (total > out_len)
+            return -1;
+
+        out[0] = first;
+        i = 1 + put_varint(&out[1], remaining);
+        i += put(&out[i], topic);
+        if constexpr (Qos > 0)
+            i += put_id(&out[i], packet_id);
+        i += put(&out[i], props);
+        if (payload_len > 0)
+            std::memcpy(&out[i], payload, payload_len);
+
+        return i + static_cast<int>(payload_len);
+    }
+};
+
+/**
+ * @brief PUBACK, PUBREC, PUBREL or PUBCOMP with a success reason code, see
+ * mqtt_prot_pubresp. Same bytes for both protocol versions.
+ */
+template <std::uint8_t Type>
+struct pubresp {
+    static_assert(Type == MQTT_PROT_PUBACK || Type == MQTT_PROT_PUBREC ||
+                  Type == MQTT_PROT_PUBREL || Type == MQTT_PROT_PUBCOMP,
+                  "Not a publish response");
+
+    static constexpr auto header =
+        fixed_header<(Type << 4) | (Type == MQTT_PROT_PUBREL ? 0x02 : 0), 2>();
+
+    static int encode(std::uint8_t *out, int out_len, std::uint16_t packet_id)
+    {
+        int ret = check_fixed<header.size() + 2>(out, out_len);
+
+        if (ret != 0)
+            return ret;
+
+        put(out, header);
+        return static_cast<int>(header.size()) +
+                put_id(&out[header.size()], packet_id);
+    }
+};
+
+using puback = pubresp<MQTT_PROT_PUBACK>;
+using pubrec = pubresp<MQTT_PROT_PUBREC>;
+using pubrel = pubresp<MQTT_PROT_PUBREL>;
+using pubcomp = pubresp<MQTT_PROT_PUBCOMP>;
+
+/**
+ * @brief SUBSCRIBE to one static filter, see mqtt_prot_subscribe. Only the
+ * packet identifier is written at run time.
+ */
+template <fixed_string Filter, int Qos = 0,
+          std::uint8_t Version = MQTT_PROT_VERSION_3_1_1>
+struct subscribe {
+    static_assert(Qos >= 0 && Qos <= 2, "QoS is 0, 1 or 2");
+    static_assert(Filter.size() > 0, "Empty topic filter");
+    static_assert(valid_version(Version), "Unknown protocol version");
+
+    static constexpr auto tail = concat(concat(no_properties<Version>(),
+                                               utf8_string<Filter>()),
+                                        bytes<1>{ Qos });
+    static constexpr auto header =
+        fixed_header<(MQTT_PROT_SUBSCRIBE << 4) | 0x02, 2 + tail.size()>();
+
+    static int encode(std::uint8_t *out, int out_len, std::uint16_t packet_id)
+    {
+        int ret = check_fixed<header.size() + 2 + tail.size()>(out, out_len);
+        int i;
+
+        if (ret != 0)
+            return ret;
+
+        i = put(out, header);
+        i += put_id(&out[i], packet_id);
+        return i + put(&out[i], tail);
+    }
+};
+
+/**
+ * @brief UNSUBSCRIBE from one static filter, see mqtt_prot_unsubscribe.
+ */
+template <fixed_string Filter, std::uint8_t Version = MQTT_PROT_VERSION_3_1_1>
+struct unsubscribe {
+    static_assert(Filter.size() > 0, "Empty topic filter");
+    static_assert(valid_version(Version), "Unknown protocol version");
+
+    static constexpr auto tail = concat(no_properties<Version>(),
+                                        utf8_string<Filter>());
+    static constexpr auto header =
+        fixed_header<(MQTT_PROT_UNSUBSCRIBE << 4) | 0x02, 2 + tail.size()>();
+
+    static int encode(std::uint8_t *out, int out_len, std::uint16_t packet_id)
+    {
+        int ret = check_fixed<header.size() + 2 + tail.size()>(out, out_len);
+        int i;
+
+        if (ret != 0)
+            return ret;
+
+        i = put(out, header);
+        i += put_id(&out[i], packet_id);
+        return i + put(&out[i], tail);
+    }
+};
+
+/**
+ * @brief Packets made of constant bytes only.
+ */
+template <std::uint8_t First>
+struct constant {
+    static constexpr auto packet = fixed_header<First, 0>();
+
+    static int encode(std::uint8_t *out, int out_len)
+    {
+        int ret = check_fixed<packet.size()>(out, out_len);
+
+        return (ret != 0) ? ret : put(out, packet);
+    }
+};
+
+/* See mqtt_prot_pingreq. */
+using pingreq = constant<MQTT_PROT_PINGREQ << 4>;
+/* See mqtt_prot_disconnect, with reason code 0. */
+using disconnect = constant<MQTT_PROT_DISCONNECT << 4>;
+
+/**
+ * @brief Encode a packet.
+ * @param out Output buffer, NULL to get the needed size.
+ * @param out_len Output buffer length.
+ * @param args Run time fields of the packet, see its encode function.
+ * @return Packet length, or -1 if out_len is too small.
+ */
+template <class Packet, class... Args>
+inline int encode(std::uint8_t *out, int out_len, Args &&...args)
+{
+    return Packet::encode(out, out_len, static_cast<Args &&>(args)...);
+}
+
+} // namespace prot
+} // namespace mqtt
+
+#endif /* _MQTT_ENCODE_HPP_ */
@@ -0,0 +1,153 @@
+/**
+ * @file mqtt_flow.c
+ * @brief Adaptive in-flight window and publish rate limit implementation.
+ */
+
+#include "string.h"
+
+#include "mqtt_flow.h"
+
+#define TOKEN 1000000L
+
+void mqtt_flow_init(mqtt_flow *f, int window_max, long now_us)
+{
+	memset(f, 0, sizeof(mqtt_flow));
+	if (window_max < MQTT_FLOW_MIN_WINDOW)
+		window_max = MQTT_FLOW_MIN_WINDOW;
+	f->window_max = window_max;
+	f->window = (window_max < MQTT_FLOW_INITIAL_WINDOW) ?
+				window_max : MQTT_FLOW_INITIAL_WINDOW;
+	f->slow_start = 1;
+	f->sample_start_us = now_us;
+	f->refill_us = now_us;
+}
+
+/* Acks delivered per lowest round trip time, what the path carries
+ * without queueing. */
+static long flow_bdp(const mqtt_flow *f)
+{
+	return f->bw * f->min_rtt_us / 1000000L;
+}
+
+static void flow_set_window(mqtt_flow *f, long window)
+{
+	if (window < MQTT_FLOW_MIN_WINDOW)
+		window = MQTT_FLOW_MIN_WINDOW;
+	if (window > f->window_max)
+		window = f->window_max;
+	f->window = (int)window;
+}
+
+static void flow_sample_rate(mqtt_flow *f, long now_us)
+{
+	long elapsed = now_us - f->sample_start_us;
+	long interval = (f->srtt_us > 1000) ? f->srtt_us : 1000;
+	long rate;
+
+	f->delivered++;
+	if (elapsed < interval)
+		return;
+
+	rate = (f->delivered - f->sample_delivered) * 1000000L / elapsed;
+	if (rate >= f->bw || now_us - f->bw_stamp_us > MQTT_FLOW_EXPIRY_US) {
+		f->bw = rate;
+		f->bw_stamp_us = now_us;
+	}
+	f->sample_delivered = f->delivered;
+	f->sample_start_us = now_us;
+}
+
+void mqtt_flow_ack(mqtt_flow *f, long rtt_us, int in_flight, long now_us)
+{
+	long target;
+
+	if (rtt_us < 0)
+		rtt_us = 0;
+
+	f->srtt_us = (f->srtt_us == 0) ? rtt_us :
+					f->srtt_us + (rtt_us - f->srtt_us) / 8;
+	if (f->min_rtt_us == 0 || rtt_us <= f->min_rtt_us ||
+		now_us - f->min_rtt_stamp_us > MQTT_FLOW_EXPIRY_US) {
+		f->min_rtt_us = rtt_us;
+		f->min_rtt_stamp_us = now_us;
+	}
+	flow_sample_rate(f, now_us);
+
+	if (rtt_us > 2 * f->min_rtt_us + MQTT_FLOW_RTT_SLACK_US) {
+		/* Once per round trip, acks of publishes sent before the
+		 * decrease still carry the old queue. */
+		if (now_us - f->last_decrease_us < f->srtt_us)
+			return;
+		f->slow_start = 0;
+		f->acked = 0;
+		f->last_decrease_us = now_us;
+		target = f->window * 7L / 10;
+		if (flow_bdp(f) > target)
+			target = (flow_bdp(f) < f->window) ? flow_bdp(f) : f->window;
+		flow_set_window(f, target);
+		return;
+	}
+
+	/* Not grown while the application does not use it. */
+	if (2 * in_flight < f->window)
+		return;
+	if (f->slow_start) {
+		flow_set_window(f, f->window + 1L);
+		return;
+	}
+	if (++f->acked >= f->window) {
+		f->acked = 0;
+		flow_set_window(f, f->window + 1L);
+	}
+}
+
+void mqtt_flow_timeout(mqtt_flow *f, long now_us)
+{
+	f->slow_start = 0;
+	f->acked = 0;
+	f->last_decrease_us = now_us;
+	flow_set_window(f, f->window / 2);
+}
+
+void mqtt_flow_set_rate(mqtt_flow *f, long rate, long burst, long now_us)
+{
+	if (rate < 0)
+		rate = 0;
+	if (burst < 1)
+		burst = 1;
+
+	f->rate = rate;
+	f->burst = burst;
+	f->tokens = (int64_t)burst * TOKEN;
+	f->refill_us = now_us;
+}
+
+long mqtt_flow_delay(mqtt_flow *f, long now_us)
+{
+	int64_t max = (int64_t)f->burst * TOKEN;
+
+	if (f->rate == 0)
+		return 0;
+
+	if (now_us > f->refill_us) {
+		/* Capped first, so long idle periods cannot overflow. */
+		if (now_us - f->refill_us > max / f->rate)
+			f->tokens = max;
+		else
+			f->tokens += (int64_t)(now_us - f->refill_us) * f->rate;
+		if (f->tokens > max)
+			f->tokens = max;
+		f->refill_us = now_us;
+	}
+
+	if (f->tokens >= TOKEN)
+		return 0;
+
+	return (long)((TOKEN - f->tokens + f->rate - 1) / f->rate);
+}
+
+void mqtt_flow_take(mqtt_flow *f)
+{
+	if (f->rate != 0)
+		f->tokens -= TOKEN;
+}
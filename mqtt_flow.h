@@ -0,0 +1,111 @@
+/**
+ * @file mqtt_flow.h
+ * @brief Adaptive in-flight window and publish rate limit declaration.
+ *
+ * The window bounds the QoS 1 and 2 publishes waiting for their ack. It
+ * follows the ack round trip time the way delay based TCP congestion
+ * control does: it grows by one per ack while the round trip time stays
+ * near the lowest one seen (slow start), then by one per window of acks
+ * (additive increase). Once acks take much longer than that lowest time,
+ * a queue is building at the broker or on the path and the window shrinks
+ * to 7/10, at most once per round trip (multiplicative decrease). As with
+ * BBR it never shrinks below the acks delivered per lowest round trip, the
+ * bandwidth delay product, so a slow path is not mistaken for congestion.
+ * An ack timeout halves it.
+ *
+ * The rate limit is a token bucket: one token per publish, refilled at the
+ * configured rate, holding at most burst tokens.
+ */
+
+#ifndef _MQTT_FLOW_H_
+#define _MQTT_FLOW_H_
+
+#include "stdint.h"
+
+/* Window at connection time, as TCP initial windows. */
+#define MQTT_FLOW_INITIAL_WINDOW 10
+#define MQTT_FLOW_MIN_WINDOW 1
+/* Round trip time above the lowest one still taken as jitter. Acks taking
+ * twice the lowest time plus this signal a queue. */
+#define MQTT_FLOW_RTT_SLACK_US 2000
+/* Lowest round trip time and delivery rate are measured again after this,
+ * so the window follows a path or broker whose speed changed. */
+#define MQTT_FLOW_EXPIRY_US (10 * 1000000L)
+
+typedef struct {
+    int window;
+    int window_max;
+    /* Acks counted toward the next additive increase. */
+    int acked;
+    int slow_start;
+    long srtt_us;
+    long min_rtt_us;
+    long min_rtt_stamp_us;
+    long last_decrease_us;
+    /* Delivery rate in acks per second, the highest recent sample. */
+    long bw;
+    long bw_stamp_us;
+    long delivered;
+    long sample_delivered;
+    long sample_start_us;
+    /* Token bucket, tokens in millionths. 0 rate for no limit. */
+    long rate;
+    long burst;
+    int64_t tokens;
+    long refill_us;
+} mqtt_flow;
+
+/**
+ * @brief Initialize the flow state of a connection.
+ * @param f Flow state.
+ * @param window_max Highest window, the broker receive maximum.
+ * @param now_us Current monotonic time.
+ * @return None.
+ */
+void mqtt_flow_init(mqtt_flow *f, int window_max, long now_us);
+
+/**
+ * @brief Account for an ack.
+ * @param f Flow state.
+ * @param rtt_us Time between the publish and its ack.
+ * @param in_flight Publishes that were waiting for their ack, this one
+ * included. The window only grows while at least half of it is used.
+ * @param now_us Current monotonic time.
+ * @return None.
+ */
+void mqtt_flow_ack(mqtt_flow *f, long rtt_us, int in_flight, long now_us);
+
+/**
+ * @brief Account for an ack that never came.
+ * @param f Flow state.
+ * @param now_us Current monotonic time.
+ * @return None.
+ */
+void mqtt_flow_timeout(mqtt_flow *f, long now_us);
+
+/**
+ * @brief Set the publish rate limit.
+ * @param f Flow state.
+ * @param rate Publishes per second, 0 for no limit.
+ * @param burst Publishes allowed at once after an idle period, at least 1.
+ * @param now_us Current monotonic time.
+ * @return None.
+ */
+void mqtt_flow_set_rate(mqtt_flow *f, long rate, long burst, long now_us);
+
+/**
+ * @brief Get the time until a publish is allowed by the rate limit.
+ * @param f Flow state.
+ * @param now_us Current monotonic time.
+ * @return 0 if allowed now, otherwise the time to wait in microseconds.
+ */
+long mqtt_flow_delay(mqtt_flow *f, long now_us);
+
+/**
+ * @brief Take the token of a publish, mqtt_flow_delay must have returned 0.
+ * @param f Flow state.
+ * @return None.
+ */
+void mqtt_flow_take(mqtt_flow *f);
+
+#endif /* _MQTT_FLOW_H_ */
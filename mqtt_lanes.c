@@ -0,0 +1,206 @@
+/**
+ * @file mqtt_lanes.c
+ * @brief Outbound priority lanes implementation.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+
+#include "mqtt_lanes.h"
+
+/* Packets stored one after the other, each behind its length, wrapping
+ * around the end of buf. */
+typedef struct {
+	uint8_t *buf;
+	size_t size;
+	size_t head;
+	/* Bytes stored, length prefixes included. */
+	size_t used;
+	/* Bytes left to write, those of the current packet included. */
+	size_t bytes;
+} lane_ring;
+
+struct mqtt_lanes {
+	lane_ring lanes[MQTT_LANES_LEN];
+	/* Packet being written, at the head of its ring, 0 if none. */
+	int current_len;
+	int current_off;
+	mqtt_lane current_lane;
+	int max_bytes;
+	int chunk_bytes;
+	/* Allocated by mqtt_lanes_create, freed by mqtt_lanes_destroy. */
+	void *owned;
+};
+
+_Static_assert(sizeof(struct mqtt_lanes) <= MQTT_LANES_STATE_BYTES,
+				"MQTT_LANES_STATE_BYTES too small");
+
+#define RING_SIZE(max_bytes) \
+	(((size_t)(max_bytes) + MQTT_LANES_PREFIX + 15) & ~(size_t)15)
+
+static void ring_write(lane_ring *r, const uint8_t *data, size_t len)
+{
+	size_t tail = (r->head + r->used) % r->size;
+	size_t n = r->size - tail;
+
+	if (n > len)
+		n = len;
+	memcpy(&r->buf[tail], data, n);
+	memcpy(r->buf, &data[n], len - n);
+	r->used += len;
+}
+
+static void ring_read(lane_ring *r, uint8_t *data, size_t len)
+{
+	size_t n = r->size - r->head;
+
+	if (n > len)
+		n = len;
+	memcpy(data, &r->buf[r->head], n);
+	memcpy(&data[n], r->buf, len - n);
+	r->head = (r->head + len) % r->size;
+	r->used -= len;
+}
+
+mqtt_lanes *mqtt_lanes_init(void *buf, size_t size, int max_bytes,
+							int chunk_bytes)
+{
+	uint8_t *p = (uint8_t *)(((uintptr_t)buf + 15) & ~(uintptr_t)15);
+	mqtt_lanes *l = (mqtt_lanes *)p;
+
+	if (buf == NULL || max_bytes <= 0 || chunk_bytes < 0 ||
+		size < MQTT_LANES_SIZE(max_bytes))
+		return NULL;
+
+	memset(l, 0, sizeof(mqtt_lanes));
+	p += MQTT_LANES_STATE_BYTES;
+	for (int i = 0; i < MQTT_LANES_LEN; i++) {
+		l->lanes[i].buf = p;
+		l->lanes[i].size = RING_SIZE(max_bytes);
+		p += RING_SIZE(max_bytes);
+	}
+	l->max_bytes = max_bytes;
+	l->chunk_bytes = (chunk_bytes > 0) ? chunk_bytes : MQTT_LANES_CHUNK;
+	return l;
+}
+
+mqtt_lanes *mqtt_lanes_create(int max_bytes, int chunk_bytes)
+{
+	mqtt_lanes *l;
+	void *buf;
+
+	if (max_bytes <= 0)
+		return NULL;
+
+	buf = malloc(MQTT_LANES_SIZE(max_bytes));
+	if (buf == NULL)
+		return NULL;
+
+	l = mqtt_lanes_init(buf, MQTT_LANES_SIZE(max_bytes), max_bytes,
+						chunk_bytes);
+	if (l == NULL) {
+		free(buf);
+		return NULL;
+	}
+	l->owned = buf;
+	return l;
+}
+
+void mqtt_lanes_destroy(mqtt_lanes *l)
+{
+	if (l != NULL)
+		free(l->owned);
+}
+
+int mqtt_lanes_push(mqtt_lanes *l, mqtt_lane lane, const uint8_t *pkt,
+					int len)
+{
+	lane_ring *r = &l->lanes[lane];
+	uint32_t prefix = (uint32_t)len;
+
+	if (len <= 0 || len > l->max_bytes)
+		return -1;
+	if (r->used + MQTT_LANES_PREFIX + (size_t)len > r->size)
+		return 1;
+
+	ring_write(r, (const uint8_t *)&prefix, MQTT_LANES_PREFIX);
+	ring_write(r, pkt, len);
+	r->bytes += len;
+
+	return 0;
+}
+
+int mqtt_lanes_chunk(mqtt_lanes *l, const uint8_t **chunk)
+{
+	lane_ring *r;
+	uint32_t prefix;
+	int len;
+
+	for (int i = 0; i < MQTT_LANES_LEN && l->current_len == 0; i++) {
+		r = &l->lanes[i];
+		if (r->used == 0)
+			continue;
+		ring_read(r, (uint8_t *)&prefix, MQTT_LANES_PREFIX);
+		l->current_len = (int)prefix;
+		l->current_off = 0;
+		l->current_lane = (mqtt_lane)i;
+	}
+	if (l->current_len == 0)
+		return 0;
+
+	r = &l->lanes[l->current_lane];
+	len = l->current_len - l->current_off;
+	if (len > l->chunk_bytes)
+		len = l->chunk_bytes;
+	if ((size_t)len > r->size - r->head)
+		len = (int)(r->size - r->head);
+	*chunk = &r->buf[r->head];
+
+	return len;
+}
+
+int mqtt_lanes_starting(const mqtt_lanes *l, struct iovec parts[2])
+{
+	const lane_ring *r = &l->lanes[l->current_lane];
+	size_t n = r->size - r->head;
+
+	if (l->current_len == 0 || l->current_off > 0)
+		return 0;
+
+	parts[0].iov_base = &r->buf[r->head];
+	if (n >= (size_t)l->current_len) {
+		parts[0].iov_len = l->current_len;
+		return 1;
+	}
+	parts[0].iov_len = n;
+	parts[1].iov_base = r->buf;
+	parts[1].iov_len = l->current_len - n;
+	return 2;
+}
+
+void mqtt_lanes_sent(mqtt_lanes *l, int len)
+{
+	lane_ring *r = &l->lanes[l->current_lane];
+
+	r->head = (r->head + len) % r->size;
+	r->used -= len;
+	r->bytes -= len;
+	l->current_off += len;
+	if (l->current_off >= l->current_len)
+		l->current_len = 0;
+}
+
+size_t mqtt_lanes_queued(const mqtt_lanes *l, mqtt_lane lane)
+{
+	size_t bytes = 0;
+
+	for (int i = 0; i <= (int)lane; i++)
+		bytes += l->lanes[i].bytes;
+
+	return bytes;
+}
+
+int mqtt_lanes_max(const mqtt_lanes *l)
+{
+	return l->max_bytes;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file mqtt_lanes.h
+ * @brief Outbound priority lanes declaration.
+ *
+ * Packets waiting to be written are queued in one lane per priority class.
+ * They are written a chunk at a time, so the caller can handle received
+ * packets and queue more between chunks. Each chunk continues the packet
+ * being written, MQTT packets can not be interleaved on the stream, then
+ * starts the oldest packet of the highest priority lane. A control packet
+ * thus waits for the rest of one packet at most, whatever the bulk queued.
+ * Packets are at most max_bytes, which bounds that wait: larger payloads
+ * must be split over several publishes.
+ *
+ * Each lane is a ring of max_bytes, allocated once with the lanes or placed
+ * in memory given by the caller, so queuing a packet never allocates.
+ */
+
+#ifndef _MQTT_LANES_H_
+#define _MQTT_LANES_H_
+
+#include "stddef.h"
+#include "stdint.h"
+#include "sys/uio.h"
+
+/* Bytes written at once. */
+#define MQTT_LANES_CHUNK 16384
+
+/* Priority classes, highest first. */
+typedef enum {
+    MQTT_LANE_CONTROL = 0,
+    MQTT_LANE_HIGH,
+    MQTT_LANE_BULK,
+    MQTT_LANES_LEN
+} mqtt_lane;
+
+/* Length stored in front of each queued packet. */
+#define MQTT_LANES_PREFIX 4
+/* Bytes of the lanes state, the rings follow. */
+#define MQTT_LANES_STATE_BYTES 256
+
+/* Bytes of memory lanes of max_bytes need, see mqtt_lanes_init. */
+#define MQTT_LANES_SIZE(max_bytes) \
+    (16 + MQTT_LANES_STATE_BYTES + MQTT_LANES_LEN * \
+     (((size_t)(max_bytes) + MQTT_LANES_PREFIX + 15) & ~(size_t)15))
+
+typedef struct mqtt_lanes mqtt_lanes;
+
+/**
+ * @brief Create the lanes of a connection.
+ * @param max_bytes Bytes each lane holds, also the largest packet.
+ * @param chunk_bytes Bytes written at once, 0 for MQTT_LANES_CHUNK.
+ * @return Lanes or NULL if error.
+ */
+mqtt_lanes *mqtt_lanes_create(int max_bytes, int chunk_bytes);
+
+/**
+ * @brief Set up lanes in memory given by the caller, nothing is allocated.
+ * @param buf MQTT_LANES_SIZE(max_bytes) bytes, used until
+ * mqtt_lanes_destroy.
+ * @param size Bytes of buf.
+ * @param max_bytes Bytes each lane holds, also the largest packet.
+ * @param chunk_bytes Bytes written at once, 0 for MQTT_LANES_CHUNK.
+ * @return Lanes or NULL if error.
+ */
+mqtt_lanes *mqtt_lanes_init(void *buf, size_t size, int max_bytes,
+                            int chunk_bytes);
+
+/**
+ * @brief Release lanes, packets still queued are lost.
+ * @param l Lanes.
+ * @return None.
+ */
+void mqtt_lanes_destroy(mqtt_lanes *l);
+
+/**
+ * @brief Queue a copy of a packet.
+ * @param l Lanes.
+ * @param lane Priority class.
+ * @param pkt Packet.
+ * @param len Packet length.
+ * @return 0 if queued, 1 if chunks must be written first to make room or -1
+ * if the packet is larger than max_bytes.
+ */
+int mqtt_lanes_push(mqtt_lanes *l, mqtt_lane lane, const uint8_t *pkt,
+                    int len);
+
+/**
+ * @brief Get the next bytes to write.
+ * @param l Lanes.
+ * @param chunk Receives the bytes, valid until mqtt_lanes_sent.
+ * @return Chunk length, 0 if nothing is queued.
+ */
+int mqtt_lanes_chunk(mqtt_lanes *l, const uint8_t **chunk);
+
+/**
+ * @brief Get the whole packet the chunk returned by mqtt_lanes_chunk
+ * starts, to record packets in the order they are written.
+ * @param l Lanes.
+ * @param parts Receives the packet, in two parts if it wraps around its
+ * ring, valid until mqtt_lanes_sent.
+ * @return Number of parts or 0 if the chunk continues a packet.
+ */
+int mqtt_lanes_starting(const mqtt_lanes *l, struct iovec parts[2]);
+
+/**
+ * @brief Account for a chunk written.
+ * @param l Lanes.
+ * @param len Chunk length, as returned by mqtt_lanes_chunk.
+ * @return None.
+ */
+void mqtt_lanes_sent(mqtt_lanes *l, int len);
+
+/**
+ * @brief Get the bytes left to write in a lane and those of higher priority.
+ * @param l Lanes.
+ * @param lane Lowest priority class counted, MQTT_LANE_BULK for all.
+ * @return Bytes queued.
+ */
+size_t mqtt_lanes_queued(const mqtt_lanes *l, mqtt_lane lane);
+
+/**
+ * @brief Get the largest packet the lanes hold.
+ * @param l Lanes.
+ * @return max_bytes.
+ */
+int mqtt_lanes_max(const mqtt_lanes *l);
+
+#endif /* _MQTT_LANES_H_ */
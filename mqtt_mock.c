@@ -0,0 +1,518 @@
+/**
+ * @file mqtt_mock.c
+ * @brief Minimal broker to replay captures against, see mqtt_replay.c, and
+ * to test clients without a real broker.
+ *
+ * Every CONNECT is accepted, QoS 1 and 2 publishes are acked, subscriptions
+ * are granted and publishes are delivered at QoS 0 to the connections whose
+ * filters match, the publisher included. Sessions, retained messages, wills
+ * and topic aliases are not supported. Connections are served in turn by
+ * one thread, each packet being answered as soon as it is read.
+ *
+ * Once every connection is closed, and on exit, it prints the publishes
+ * received and a digest of their QoS, retain flag, topic and payload. The
+ * digest does not depend on the order of arrival, so replaying a capture
+ * gives the same digest on every run, whatever the number of connections.
+ *
+ * $ ./mqtt_mock <port> [publishes]
+ * publishes: exit after receiving that many, 0 (default) to run until
+ * interrupted.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "signal.h"
+#include "unistd.h"
+#include "poll.h"
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "arpa/inet.h"
+
+#include "mqtt_prot.h"
+#include "mqtt_validate.h"
+
+#define MOCK_CONNS_MAX 1024
+#define MOCK_FILTERS_MAX 64
+/* Initial receive buffer, grown to the largest packet. */
+#define MOCK_BUF 65536
+/* Largest packet accepted. */
+#define MOCK_PACKET_MAX (16 * 1024 * 1024)
+
+typedef struct {
+	int fd;
+	uint8_t version;
+	uint8_t *buf;
+	int buf_size;
+	int len;
+	char *filters[MOCK_FILTERS_MAX];
+	int filters_len;
+} mock_conn;
+
+typedef struct {
+	long conns;
+	long publishes;
+	long qos[3];
+	long delivered;
+	uint64_t bytes;
+	uint64_t digest;
+} mock_stats;
+
+static mock_conn conns[MOCK_CONNS_MAX];
+static struct pollfd fds[MOCK_CONNS_MAX + 1];
+static int conns_len;
+static mock_stats stats;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/* FNV-1a, continued from hash. */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static void report(void)
+{
+	printf("Connections %ld, publishes %ld (QoS 0: %ld, 1: %ld, 2: %ld), "
+			"%llu payload bytes, delivered %ld, digest %016llx\n",
+			stats.conns, stats.publishes, stats.qos[0], stats.qos[1],
+			stats.qos[2], (unsigned long long)stats.bytes, stats.delivered,
+			(unsigned long long)stats.digest);
+	fflush(stdout);
+}
+
+static int conn_send(mock_conn *c, const uint8_t *data, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = send(c->fd, data, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void conn_close(int i)
+{
+	mock_conn *c = &conns[i];
+
+	close(c->fd);
+	free(c->buf);
+	for (int j = 0; j < c->filters_len; j++)
+		free(c->filters[j]);
+
+	conns_len--;
+	if (i != conns_len) {
+		conns[i] = conns[conns_len];
+		fds[i + 1] = fds[conns_len + 1];
+	}
+	if (conns_len == 0)
+		report();
+}
+
+/* Protocol level of a CONNECT, 4 for MQTT 3.1.1 or 5. */
+static int on_connect(mock_conn *c, const uint8_t *pkt, int len, int i)
+{
+	uint8_t connack[] = { MQTT_PROT_CONNACK << 4, 0x02, 0x00, 0x00, 0x00 };
+
+	if (len - i < 7 || pkt[i] != 0 || pkt[i + 1] != 4 ||
+		memcmp(&pkt[i + 2], "MQTT", 4) != 0)
+		return -1;
+	c->version = pkt[i + 6];
+	if (c->version != MQTT_PROT_VERSION_3_1_1 &&
+		c->version != MQTT_PROT_VERSION_5)
+		return -1;
+
+	/* MQTT v5 adds an empty property list. */
+	if (c->version == MQTT_PROT_VERSION_5) {
+		connack[1] = 0x03;
+		return conn_send(c, connack, 5);
+	}
+	return conn_send(c, connack, 4);
+}
+
+static void deliver(const mqtt_prot_publish_msg *pub)
+{
+	uint8_t *out = NULL;
+	int out_size = 0, n;
+	mock_conn *c;
+	char *topic;
+
+	topic = (char *)malloc(pub->topic_len + 1);
+	if (topic == NULL)
+		return;
+	memcpy(topic, pub->topic, pub->topic_len);
+	topic[pub->topic_len] = '\0';
+
+	for (int i = 0; i < conns_len; i++) {
+		c = &conns[i];
+		for (int j = 0; j < c->filters_len; j++) {
+			if (!mqtt_topic_match(c->filters[j], topic, pub->topic_len))
+				continue;
+			n = mqtt_prot_publish(NULL, 0, c->version, 0, 0, topic,
+									pub->topic_len, NULL, pub->payload,
+									pub->payload_len);
+			if (n > out_size) {
+				free(out);
+				out = (uint8_t *)malloc(n);
+				out_size = (out != NULL) ? n : 0;
+			}
+			if (out != NULL &&
+				mqtt_prot_publish(out, out_size, c->version, 0, 0, topic,
+									pub->topic_len, NULL, pub->payload,
+									pub->payload_len) == n &&
+				conn_send(c, out, n) == 0)
+				stats.delivered++;
+			break;
+		}
+	}
+
+	free(out);
+	free(topic);
+}
+
+static int on_publish(mock_conn *c, const uint8_t *pkt, int len)
+{
+	mqtt_prot_publish_msg pub;
+	uint8_t ack[5], qos, key;
+	int n;
+
+	if (mqtt_prot_publish_decode(c->version, pkt, len, &pub) < 0 ||
+		pub.topic_len == 0)
+		return -1;
+	qos = (pub.flags >> 1) & 0x03;
+
+	/* Sum of the hashes of each message, so the order does not matter. */
+	key = pub.flags & 0x07;
+	stats.digest += fnv1a(fnv1a(fnv1a(0xCBF29CE484222325ULL, &key, 1),
+								pub.topic, pub.topic_len),
+							pub.payload, pub.payload_len);
+	stats.publishes++;
+	stats.qos[qos]++;
+	stats.bytes += pub.payload_len;
+
+	if (qos > 0) {
+		n = mqtt_prot_pubresp(ack, sizeof(ack), c->version,
+								(qos == 1) ? MQTT_PROT_PUBACK :
+								MQTT_PROT_PUBREC, pub.packet_id, 0);
+		if (conn_send(c, ack, n) < 0)
+			return -1;
+	}
+	deliver(&pub);
+
+	return 0;
+}
+
+static int on_pubrel(mock_conn *c, const uint8_t *pkt, int len)
+{
+	uint8_t ack[5];
+	uint16_t id;
+	int n;
+
+	if (mqtt_prot_pubresp_decode(c->version, MQTT_PROT_PUBREL, pkt, len,
+									&id) < 0)
+		return -1;
+	n = mqtt_prot_pubresp(ack, sizeof(ack), c->version, MQTT_PROT_PUBCOMP,
+							id, 0);
+	return conn_send(c, ack, n);
+}
+
+/* Remove a filter, returns 0 if found or 0x11, no subscription existed. */
+static uint8_t filter_remove(mock_conn *c, const uint8_t *filter, int len)
+{
+	for (int j = 0; j < c->filters_len; j++) {
+		if ((int)strlen(c->filters[j]) != len ||
+			memcmp(c->filters[j], filter, len) != 0)
+			continue;
+		free(c->filters[j]);
+		c->filters[j] = c->filters[--c->filters_len];
+		return 0x00;
+	}
+
+	return 0x11;
+}
+
+/* Grant a filter at its QoS, returns the reason code. */
+static uint8_t filter_add(mock_conn *c, const uint8_t *filter, int len,
+							uint8_t qos)
+{
+	char *copy;
+
+	if (mqtt_valid_topic_filter((const char *)filter, len) < 0)
+		return 0x80;
+	filter_remove(c, filter, len);
+	if (c->filters_len == MOCK_FILTERS_MAX)
+		return 0x80;
+
+	copy = (char *)malloc(len + 1);
+	if (copy == NULL)
+		return 0x80;
+	memcpy(copy, filter, len);
+	copy[len] = '\0';
+	c->filters[c->filters_len++] = copy;
+
+	return qos;
+}
+
+/* SUBSCRIBE or UNSUBSCRIBE, answered with one code per filter. */
+static int on_filters(mock_conn *c, uint8_t type, const uint8_t *pkt,
+						int len, int i)
+{
+	mqtt_prot_properties props;
+	uint8_t *ack;
+	int options = (type == MQTT_PROT_SUBSCRIBE) ? 1 : 0;
+	int ack_len, codes = 0, n, ret;
+	uint16_t filter_len;
+
+	/* Room for a code per filter, the header and the identifier. */
+	ack = (uint8_t *)malloc(len + 8);
+	if (ack == NULL || len - i < 2)
+		goto fail;
+	ack_len = 5;
+	ack[ack_len++] = pkt[i];
+	ack[ack_len++] = pkt[i + 1];
+	i += 2;
+	if (c->version == MQTT_PROT_VERSION_5) {
+		n = mqtt_prot_properties_decode(&pkt[i], len - i, &props);
+		if (n < 0)
+			goto fail;
+		i += n;
+		ack[ack_len++] = 0x00;
+	}
+
+	while (i < len) {
+		if (len - i < 2)
+			goto fail;
+		filter_len = ((uint16_t)pkt[i] << 8) | pkt[i + 1];
+		i += 2;
+		if (len - i < filter_len + options)
+			goto fail;
+		if (options)
+			ack[ack_len++] = filter_add(c, &pkt[i], filter_len,
+										pkt[i + filter_len] & 0x03);
+		else
+			ack[ack_len++] = filter_remove(c, &pkt[i], filter_len);
+		i += filter_len + options;
+		codes++;
+	}
+	if (codes == 0)
+		goto fail;
+
+	/* MQTT 3.1.1 UNSUBACK holds no reason code. */
+	if (!options && c->version != MQTT_PROT_VERSION_5)
+		ack_len -= codes;
+
+	/* Fixed header right before the identifier. */
+	n = mqtt_prot_encode_varint(ack_len - 5, NULL);
+	ack[4 - n] = ((options ? MQTT_PROT_SUBACK : MQTT_PROT_UNSUBACK) << 4);
+	mqtt_prot_encode_varint(ack_len - 5, &ack[5 - n]);
+	ret = conn_send(c, &ack[4 - n], ack_len - 4 + n);
+	free(ack);
+	return ret;
+fail:
+	free(ack);
+	return -1;
+}
+
+/* Answer one complete packet, returns -1 to close the connection. */
+static int on_packet(mock_conn *c, const uint8_t *pkt, int len)
+{
+	const uint8_t pingresp[] = { MQTT_PROT_PINGRESP << 4, 0x00 };
+	uint8_t type = pkt[0] >> 4;
+	int i = 2;
+
+	while (pkt[i - 1] & 0x80)
+		i++;
+
+	/* CONNECT must come first, and only once. */
+	if ((c->version == 0) != (type == MQTT_PROT_CONNECT))
+		return -1;
+
+	switch (type) {
+		case MQTT_PROT_CONNECT:
+			return on_connect(c, pkt, len, i);
+		case MQTT_PROT_PUBLISH:
+			return on_publish(c, pkt, len);
+		case MQTT_PROT_PUBREL:
+			return on_pubrel(c, pkt, len);
+		case MQTT_PROT_PUBACK:
+		case MQTT_PROT_PUBREC:
+		case MQTT_PROT_PUBCOMP:
+			/* Deliveries are QoS 0, nothing to ack. */
+			return 0;
+		case MQTT_PROT_SUBSCRIBE:
+		case MQTT_PROT_UNSUBSCRIBE:
+			return on_filters(c, type, pkt, len, i);
+		case MQTT_PROT_PINGREQ:
+			return conn_send(c, pingresp, sizeof(pingresp));
+		default:
+			/* DISCONNECT, or a packet a client never sends. */
+			return -1;
+	}
+}
+
+/* Read and answer what a connection sent, returns -1 once it is closed. */
+static int conn_read(mock_conn *c)
+{
+	uint8_t *grown;
+	int n, pos = 0, pkt_len;
+
+	n = recv(c->fd, &c->buf[c->len], c->buf_size - c->len, 0);
+	if (n < 0 && errno == EINTR)
+		return 0;
+	if (n <= 0)
+		return -1;
+	c->len += n;
+
+	for (;;) {
+		pkt_len = mqtt_prot_packet_len(&c->buf[pos], c->len - pos);
+		if (pkt_len < 0 || pkt_len > MOCK_PACKET_MAX)
+			return -1;
+		if (pkt_len == 0 || pkt_len > c->len - pos)
+			break;
+		if (on_packet(c, &c->buf[pos], pkt_len) < 0)
+			return -1;
+		pos += pkt_len;
+	}
+
+	memmove(c->buf, &c->buf[pos], c->len - pos);
+	c->len -= pos;
+	/* Grown to hold the packet being received. */
+	if (pkt_len > c->buf_size) {
+		grown = (uint8_t *)realloc(c->buf, pkt_len);
+		if (grown == NULL)
+			return -1;
+		c->buf = grown;
+		c->buf_size = pkt_len;
+	}
+
+	return 0;
+}
+
+static void conn_accept(int listen_fd)
+{
+	mock_conn *c;
+	int fd, one = 1;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	if (conns_len == MOCK_CONNS_MAX) {
+		printf("Too many connections\n");
+		close(fd);
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	c = &conns[conns_len];
+	memset(c, 0, sizeof(mock_conn));
+	c->fd = fd;
+	c->buf_size = MOCK_BUF;
+	c->buf = (uint8_t *)malloc(c->buf_size);
+	if (c->buf == NULL) {
+		close(fd);
+		return;
+	}
+	fds[conns_len + 1].fd = fd;
+	fds[conns_len + 1].events = POLLIN;
+	fds[conns_len + 1].revents = 0;
+	conns_len++;
+	stats.conns++;
+}
+
+static int listen_on(int port)
+{
+	struct sockaddr_in addr = { 0 };
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa = { 0 };
+	int port, listen_fd;
+	long max_publishes;
+
+	if (argc < 2) {
+		printf("Usage: %s <port> [publishes]\n", argv[0]);
+		return -1;
+	}
+	port = atoi(argv[1]);
+	max_publishes = (argc > 2) ? atol(argv[2]) : 0;
+	if (port <= 0 || port > 65535 || max_publishes < 0) {
+		printf("Bad port or publishes\n");
+		return -1;
+	}
+
+	listen_fd = listen_on(port);
+	if (listen_fd < 0) {
+		printf("Couldn't listen on port %d: %s\n", port, strerror(errno));
+		return -1;
+	}
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	fds[0].fd = listen_fd;
+	fds[0].events = POLLIN;
+	printf("Listening on port %d\n", port);
+	fflush(stdout);
+
+	while (!stop) {
+		if (poll(fds, conns_len + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents & POLLIN)
+			conn_accept(listen_fd);
+		/* Backwards, a closed connection is replaced by the last one. */
+		for (int i = conns_len - 1; i >= 0; i--) {
+			if (fds[i + 1].revents && conn_read(&conns[i]) < 0)
+				conn_close(i);
+		}
+		if (max_publishes > 0 && stats.publishes >= max_publishes)
+			break;
+	}
+
+	while (conns_len > 0)
+		conn_close(conns_len - 1);
+	if (stats.conns == 0)
+		report();
+	close(listen_fd);
+
+	return 0;
+}
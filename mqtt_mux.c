@@ -0,0 +1,489 @@
+/**
+ * @file mqtt_mux.c
+ * @brief Local multiplexer daemon. Publishes the messages local processes
+ * hand over in shared memory on one broker connection per broker, see
+ * mqtt_shm.h.
+ *
+ * $ ./mqtt_mux [socket path]
+ */
+
+#define _GNU_SOURCE
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stddef.h"
+#include "errno.h"
+#include "signal.h"
+#include "unistd.h"
+#include "sys/epoll.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+
+#include "mqtt.h"
+#include "mqtt_shm.h"
+
+#define MUX_KEEPALIVE 60
+#define MUX_MAX_EVENTS 64
+/* Records published from a ring before looking at the others. */
+#define MUX_BATCH 64
+/* Longest sleep, brokers are kept alive in between. */
+#define MUX_TICK_MS 1000
+
+/* First member of what epoll events point to. */
+typedef enum {
+	MUX_LISTEN,
+	MUX_CLIENT,
+	MUX_CLIENT_EVENT,
+	MUX_BROKER
+} mux_kind;
+
+typedef struct mux_broker {
+	mux_kind kind;
+	char hostname[MQTT_SHM_HOST_LEN];
+	char username[MQTT_SHM_CRED_LEN];
+	char password[MQTT_SHM_CRED_LEN];
+	int port;
+	int sock;
+	int refs;
+	struct mux_broker *next;
+} mux_broker;
+
+typedef struct mux_client {
+	mux_kind kind;
+	mux_kind event_kind;
+	int sock;
+	int efd;
+	mqtt_shm_peer *peer;
+	mux_broker *broker;
+	/* QoS 1 or 2 publish waiting for its ack, 0 for none. The client waits
+	 * for it, nothing else is read from its ring meanwhile. */
+	uint32_t pending_seq;
+	int closed;
+	struct mux_client *next;
+} mux_client;
+
+static mux_kind listen_kind = MUX_LISTEN;
+static mux_broker *brokers;
+static mux_client *clients;
+/* Closed clients, freed once no event or callback can refer to them. */
+static mux_client *dead;
+static int epfd = -1;
+static unsigned int next_id;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int watch(int fd, uint32_t events, void *ptr)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = ptr };
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void broker_release(mux_broker *b)
+{
+	mux_broker **p;
+
+	if (--b->refs > 0)
+		return;
+
+	if (b->sock >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, b->sock, NULL);
+		mqtt_disconnect(b->sock);
+	}
+	for (p = &brokers; *p != NULL; p = &(*p)->next) {
+		if (*p == b) {
+			*p = b->next;
+			break;
+		}
+	}
+	print_dbg("Broker %s:%d released", b->hostname, b->port);
+	free(b);
+}
+
+static mux_broker *broker_get(const mqtt_shm_hello *hello)
+{
+	mqtt_connect_flags flags = CONNECT_FLAG_CLEAN_SESSION;
+	char client_id[32];
+	mux_broker *b;
+
+	for (b = brokers; b != NULL; b = b->next) {
+		if (b->sock >= 0 && b->port == hello->port &&
+			strcmp(b->hostname, hello->hostname) == 0 &&
+			strcmp(b->username, hello->username) == 0 &&
+			strcmp(b->password, hello->password) == 0) {
+			b->refs++;
+			return b;
+		}
+	}
+
+	b = (mux_broker *)calloc(1, sizeof(mux_broker));
+	if (b == NULL)
+		return NULL;
+	b->kind = MUX_BROKER;
+	b->port = hello->port;
+	strcpy(b->hostname, hello->hostname);
+	strcpy(b->username, hello->username);
+	strcpy(b->password, hello->password);
+
+	if (b->username[0] != '\0')
+		flags |= CONNECT_FLAG_USERNAME;
+	if (b->password[0] != '\0')
+		flags |= CONNECT_FLAG_PASSWORD;
+	snprintf(client_id, sizeof(client_id), "mux%d%u", (int)getpid(),
+				next_id++);
+
+	b->sock = mqtt_connect(b->hostname, b->port, client_id, flags,
+							MUX_KEEPALIVE,
+							b->username[0] ? b->username : NULL,
+							b->password[0] ? b->password : NULL);
+	if (b->sock < 0 || watch(b->sock, EPOLLIN, b) < 0) {
+		if (b->sock >= 0)
+			mqtt_disconnect(b->sock);
+		free(b);
+		return NULL;
+	}
+
+	b->refs = 1;
+	b->next = brokers;
+	brokers = b;
+	print_dbg("Connected to broker %s:%d", b->hostname, b->port);
+	return b;
+}
+
+static void client_bury(mux_client *c)
+{
+	c->next = dead;
+	dead = c;
+}
+
+static void clients_free_dead(void)
+{
+	mux_client *c;
+
+	while ((c = dead) != NULL) {
+		dead = c->next;
+		mqtt_shm_peer_close(c->peer);
+		free(c);
+	}
+}
+
+static void client_close(mux_client *c)
+{
+	mux_client **p;
+	mux_broker *b = c->broker;
+
+	for (p = &clients; *p != NULL; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->efd, NULL);
+	close(c->sock);
+	close(c->efd);
+
+	/* Buried by the ack callback otherwise, called at the latest when the
+	 * broker connection is released. */
+	c->closed = 1;
+	if (c->pending_seq == 0)
+		client_bury(c);
+	broker_release(b);
+}
+
+/* The broker connection is lost, its clients are closed so they see it. */
+static void broker_lost(mux_broker *b)
+{
+	mux_client *c, *next;
+	int sock = b->sock;
+
+	print_err("Lost broker %s:%d", b->hostname, b->port);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, sock, NULL);
+	b->sock = -1;
+	b->refs++;
+	mqtt_disconnect(sock);
+
+	for (c = clients; c != NULL; c = next) {
+		next = c->next;
+		if (c->broker == b)
+			client_close(c);
+	}
+	broker_release(b);
+}
+
+static void publish_done(void *user_data, int result)
+{
+	mux_client *c = (mux_client *)user_data;
+	uint32_t seq = c->pending_seq;
+
+	c->pending_seq = 0;
+	if (c->closed)
+		client_bury(c);
+	else
+		mqtt_shm_peer_done(c->peer, seq, result < 0);
+}
+
+/* Publish what the ring of a client holds, returns the number of records
+ * consumed or -1 if the client was closed. */
+static int client_drain(mux_client *c)
+{
+	mux_broker *b = c->broker;
+	const uint8_t *payload;
+	const char *topic;
+	mqtt_shm_record rec;
+	int n, ret;
+
+	for (n = 0; n < MUX_BATCH && c->pending_seq == 0; n++) {
+		ret = mqtt_shm_peer_peek(c->peer, &rec, &topic, &payload);
+		if (ret == 0)
+			break;
+		if (ret < 0) {
+			print_err("Corrupted ring, client dropped");
+			client_close(c);
+			return -1;
+		}
+
+		/* Left in the ring until the in-flight window has room. */
+		if (mqtt_async_ready(b->sock, (mqtt_publish_flags)rec.flags) == 0)
+			break;
+
+		c->pending_seq = rec.seq;
+		ret = mqtt_publish_async(b->sock, rec.flags & 0x0F, topic, payload,
+									(int)rec.payload_len, publish_done, c);
+		mqtt_shm_peer_pop(c->peer);
+		if (ret != 0) {
+			c->pending_seq = 0;
+			mqtt_shm_peer_done(c->peer, rec.seq, ret < 0);
+		}
+	}
+
+	if (n > 0)
+		mqtt_shm_peer_wake(c->peer);
+
+	return n;
+}
+
+static void client_accept(int listen_sock)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	mqtt_shm_hello hello;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+	struct cmsghdr *cmsg;
+	mux_client *c;
+	int fds[2] = { -1, -1 };
+	uint8_t status = 1;
+	int sock;
+	ssize_t n;
+
+	sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0)
+		return;
+
+	n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_RIGHTS &&
+		cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	c = (mux_client *)calloc(1, sizeof(mux_client));
+	if (c == NULL || n != (ssize_t)sizeof(hello) || fds[0] < 0 ||
+		hello.version != MQTT_SHM_VERSION)
+		goto fail;
+	hello.hostname[sizeof(hello.hostname) - 1] = '\0';
+	hello.username[sizeof(hello.username) - 1] = '\0';
+	hello.password[sizeof(hello.password) - 1] = '\0';
+
+	c->kind = MUX_CLIENT;
+	c->event_kind = MUX_CLIENT_EVENT;
+	c->sock = sock;
+	c->efd = fds[1];
+	c->peer = mqtt_shm_peer_open(fds[0], hello.ring_size);
+	close(fds[0]);
+	fds[0] = -1;
+	if (c->peer == NULL)
+		goto fail;
+
+	c->broker = broker_get(&hello);
+	if (c->broker == NULL)
+		goto fail;
+
+	if (watch(c->sock, EPOLLIN | EPOLLRDHUP, c) < 0 ||
+		watch(c->efd, EPOLLIN, &c->event_kind) < 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+		broker_release(c->broker);
+		goto fail;
+	}
+
+	status = 0;
+	if (send(sock, &status, 1, MSG_NOSIGNAL) != 1) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->efd, NULL);
+		broker_release(c->broker);
+		goto fail;
+	}
+
+	c->next = clients;
+	clients = c;
+	print_dbg("Client registered for %s:%d", hello.hostname, hello.port);
+	return;
+fail:
+	send(sock, &status, 1, MSG_NOSIGNAL);
+	close(sock);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	if (c != NULL)
+		mqtt_shm_peer_close(c->peer);
+	free(c);
+}
+
+static void client_event(mux_client *c)
+{
+	uint8_t byte;
+	ssize_t n;
+
+	/* Clients never write after registering, readable means closed. */
+	n = recv(c->sock, &byte, 1, MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		client_drain(c);
+		if (!c->closed) {
+			print_dbg("Client left");
+			client_close(c);
+		}
+	}
+}
+
+/* The eventfd only wakes us up, records are read by the main loop. */
+static void client_wakeup(mux_client *c)
+{
+	uint64_t count;
+
+	if (read(c->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		print_wrn("Couldn't read eventfd");
+}
+
+/* Announce the sleep to every client, returns 1 if one has records. */
+static int clients_sleep(int sleeping)
+{
+	int waiting = 0;
+
+	for (mux_client *c = clients; c != NULL; c = c->next)
+		waiting |= mqtt_shm_peer_sleep(c->peer, sleeping);
+
+	return waiting;
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		print_err("Socket path too long");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(sock, 64) < 0) {
+		print_err("Couldn't listen on %s: %s", path, strerror(errno));
+		if (sock >= 0)
+			close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = (argc > 1) ? argv[1] : MQTT_SHM_SOCKET;
+	struct epoll_event events[MUX_MAX_EVENTS];
+	struct sigaction sa = { .sa_handler = on_signal };
+	mux_client *c, *next_c;
+	mux_broker *b, *next_b;
+	int listen_sock, busy, n;
+
+	/* Our own connections go straight to the brokers, and are polled from
+	 * the epoll set so they must use plain sockets. */
+	mqtt_shm_set_path(NULL);
+	socket_set_backend(SOCKET_BACKEND_PLAIN);
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	listen_sock = listen_on(path);
+	if (epfd < 0 || listen_sock < 0 ||
+		watch(listen_sock, EPOLLIN, &listen_kind) < 0)
+		return -1;
+	printf("Multiplexer listening on %s\n", path);
+
+	while (!stop) {
+		busy = 0;
+		for (c = clients; c != NULL; c = next_c) {
+			next_c = c->next;
+			if (client_drain(c) > 0)
+				busy = 1;
+		}
+
+		/* Clients write to their eventfd only once told we sleep. */
+		if (!busy && clients_sleep(1))
+			busy = 1;
+		n = epoll_wait(epfd, events, MUX_MAX_EVENTS, busy ? 0 : MUX_TICK_MS);
+		clients_sleep(0);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		for (int i = 0; i < n; i++) {
+			mux_kind kind = *(mux_kind *)events[i].data.ptr;
+
+			if (kind == MUX_LISTEN) {
+				client_accept(listen_sock);
+			} else if (kind == MUX_CLIENT) {
+				c = (mux_client *)events[i].data.ptr;
+				if (!c->closed)
+					client_event(c);
+			} else if (kind == MUX_CLIENT_EVENT) {
+				c = (mux_client *)((char *)events[i].data.ptr -
+									offsetof(mux_client, event_kind));
+				if (!c->closed)
+					client_wakeup(c);
+			}
+		}
+
+		/* Acks, and pings when due. Clients of a lost broker are closed. */
+		for (b = brokers; b != NULL; b = next_b) {
+			next_b = b->next;
+			if (b->sock >= 0 && mqtt_loop(b->sock, 0) < 0)
+				broker_lost(b);
+		}
+		clients_free_dead();
+	}
+
+	for (c = clients; c != NULL; c = next_c) {
+		next_c = c->next;
+		client_close(c);
+	}
+	clients_free_dead();
+	close(listen_sock);
+	unlink(path);
+	return 0;
+}
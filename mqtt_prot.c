@@ -5,236 +5,894 @@
 
 #include "mqtt_prot.h"
 
+typedef enum {
+	PROP_BYTE,
+	PROP_U16,
+	PROP_U32,
+	PROP_VARINT,
+	PROP_STRING,
+	PROP_BINARY,
+	PROP_PAIR,
+	PROP_UNKNOWN
+} prop_type;
+
+/* Last property identifier defined by MQTT v5. */
+#define MQTT_PROP_LAST MQTT_PROP_SHARED_SUB_AVAILABLE
+
+static prop_type property_type(uint8_t id)
+{
+	switch (id) {
+		case MQTT_PROP_PAYLOAD_FORMAT:
+		case MQTT_PROP_REQUEST_PROBLEM_INFO:
+		case MQTT_PROP_REQUEST_RESPONSE_INFO:
+		case MQTT_PROP_MAX_QOS:
+		case MQTT_PROP_RETAIN_AVAILABLE:
+		case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+		case MQTT_PROP_SUB_ID_AVAILABLE:
+		case MQTT_PROP_SHARED_SUB_AVAILABLE:
+			return PROP_BYTE;
+		case MQTT_PROP_SERVER_KEEPALIVE:
+		case MQTT_PROP_RECEIVE_MAX:
+		case MQTT_PROP_TOPIC_ALIAS_MAX:
+		case MQTT_PROP_TOPIC_ALIAS:
+			return PROP_U16;
+		case MQTT_PROP_MESSAGE_EXPIRY:
+		case MQTT_PROP_SESSION_EXPIRY:
+		case MQTT_PROP_WILL_DELAY:
+		case MQTT_PROP_MAX_PACKET_SIZE:
+			return PROP_U32;
+		case MQTT_PROP_SUBSCRIPTION_ID:
+			return PROP_VARINT;
+		case MQTT_PROP_CONTENT_TYPE:
+		case MQTT_PROP_RESPONSE_TOPIC:
+		case MQTT_PROP_ASSIGNED_CLIENT_ID:
+		case MQTT_PROP_AUTH_METHOD:
+		case MQTT_PROP_RESPONSE_INFO:
+		case MQTT_PROP_SERVER_REFERENCE:
+		case MQTT_PROP_REASON_STRING:
+			return PROP_STRING;
+		case MQTT_PROP_CORRELATION_DATA:
+		case MQTT_PROP_AUTH_DATA:
+			return PROP_BINARY;
+		case MQTT_PROP_USER_PROPERTY:
+			return PROP_PAIR;
+		default:
+			return PROP_UNKNOWN;
+	}
+}
+
+static int property_get(const mqtt_prot_properties *props, uint8_t id,
+						uint32_t *value)
+{
+	switch (id) {
+		case MQTT_PROP_PAYLOAD_FORMAT:
+			*value = props->payload_format;
+			break;
+		case MQTT_PROP_MESSAGE_EXPIRY:
+			*value = props->message_expiry;
+			break;
+		case MQTT_PROP_SESSION_EXPIRY:
+			*value = props->session_expiry;
+			break;
+		case MQTT_PROP_SUBSCRIPTION_ID:
+			*value = props->subscription_id;
+			break;
+		case MQTT_PROP_SERVER_KEEPALIVE:
+			*value = props->server_keepalive;
+			break;
+		case MQTT_PROP_RECEIVE_MAX:
+			*value = props->receive_max;
+			break;
+		case MQTT_PROP_TOPIC_ALIAS_MAX:
+			*value = props->topic_alias_max;
+			break;
+		case MQTT_PROP_TOPIC_ALIAS:
+			*value = props->topic_alias;
+			break;
+		case MQTT_PROP_MAX_QOS:
+			*value = props->max_qos;
+			break;
+		case MQTT_PROP_RETAIN_AVAILABLE:
+			*value = props->retain_available;
+			break;
+		case MQTT_PROP_MAX_PACKET_SIZE:
+			*value = props->max_packet_size;
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+static int property_set(mqtt_prot_properties *props, uint8_t id,
+						uint32_t value)
+{
+	switch (id) {
+		case MQTT_PROP_PAYLOAD_FORMAT:
+			props->payload_format = (uint8_t)value;
+			break;
+		case MQTT_PROP_MESSAGE_EXPIRY:
+			props->message_expiry = value;
+			break;
+		case MQTT_PROP_SESSION_EXPIRY:
+			props->session_expiry = value;
+			break;
+		case MQTT_PROP_SUBSCRIPTION_ID:
+			props->subscription_id = value;
+			break;
+		case MQTT_PROP_SERVER_KEEPALIVE:
+			props->server_keepalive = (uint16_t)value;
+			break;
+		case MQTT_PROP_RECEIVE_MAX:
+			props->receive_max = (uint16_t)value;
+			break;
+		case MQTT_PROP_TOPIC_ALIAS_MAX:
+			props->topic_alias_max = (uint16_t)value;
+			break;
+		case MQTT_PROP_TOPIC_ALIAS:
+			props->topic_alias = (uint16_t)value;
+			break;
+		case MQTT_PROP_MAX_QOS:
+			props->max_qos = (uint8_t)value;
+			break;
+		case MQTT_PROP_RETAIN_AVAILABLE:
+			props->retain_available = (uint8_t)value;
+			break;
+		case MQTT_PROP_MAX_PACKET_SIZE:
+			props->max_packet_size = value;
+			break;
+		default:
+			return -1;
+	}
+	props->present |= MQTT_PROT_PROP_BIT(id);
+	return 0;
+}
+
+static const uint8_t **property_string(mqtt_prot_properties *props, uint8_t id,
+										uint16_t **len)
+{
+	switch (id) {
+		case MQTT_PROP_CONTENT_TYPE:
+			*len = &props->content_type_len;
+			return &props->content_type;
+		case MQTT_PROP_ASSIGNED_CLIENT_ID:
+			*len = &props->assigned_client_id_len;
+			return &props->assigned_client_id;
+		case MQTT_PROP_REASON_STRING:
+			*len = &props->reason_string_len;
+			return &props->reason_string;
+		default:
+			return NULL;
+	}
+}
+
+/* Write or only measure (out == NULL) the properties without their length. */
+static int properties_body(const mqtt_prot_properties *props, uint8_t *out)
+{
+	mqtt_prot_properties *writable = (mqtt_prot_properties *)props;
+	const uint8_t **str;
+	uint16_t *str_len;
+	uint32_t value;
+	prop_type type;
+	int i = 0, n;
+
+	for (uint8_t id = 1; id <= MQTT_PROP_LAST; id++) {
+		if (!(props->present & MQTT_PROT_PROP_BIT(id)))
+			continue;
+
+		type = property_type(id);
+		if (type == PROP_STRING) {
+			str = property_string(writable, id, &str_len);
+			if (str == NULL)
+				return -1;
+			if (out != NULL) {
+				out[i] = id;
+				out[i + 1] = (uint8_t)(*str_len >> 8);
+				out[i + 2] = (uint8_t)*str_len;
+				memcpy(&out[i + 3], *str, *str_len);
+			}
+			i += 3 + *str_len;
+			continue;
+		}
+
+		if (property_get(props, id, &value) < 0)
+			return -1;
+		if (out != NULL)
+			out[i] = id;
+		i++;
+
+		switch (type) {
+			case PROP_BYTE:
+				if (out != NULL)
+					out[i] = (uint8_t)value;
+				i += 1;
+				break;
+			case PROP_U16:
+				if (out != NULL) {
+					out[i] = (uint8_t)(value >> 8);
+					out[i + 1] = (uint8_t)value;
+				}
+				i += 2;
+				break;
+			case PROP_U32:
+				if (out != NULL) {
+					out[i] = (uint8_t)(value >> 24);
+					out[i + 1] = (uint8_t)(value >> 16);
+					out[i + 2] = (uint8_t)(value >> 8);
+					out[i + 3] = (uint8_t)value;
+				}
+				i += 4;
+				break;
+			case PROP_VARINT:
+				n = mqtt_prot_encode_varint(value, out ? &out[i] : NULL);
+				if (n < 0)
+					return -1;
+				i += n;
+				break;
+			default:
+				return -1;
+		}
+	}
+
+	return i;
+}
+
+int mqtt_prot_encode_varint(uint32_t value, uint8_t *out)
+{
+	int i = 0;
+	uint8_t byte;
+
+	if (value > MQTT_PROT_VARINT_MAX)
+		return -1;
+
+	do {
+		byte = value & 0x7F;
+		value >>= 7;
+		if (value > 0)
+			byte |= 0x80;
+		if (out != NULL)
+			out[i] = byte;
+		i++;
+	} while (value > 0);
+
+	return i;
+}
+
+int mqtt_prot_decode_varint(const uint8_t *in, int in_len, uint32_t *value)
+{
+	uint32_t result = 0;
+
+	for (int i = 0; i < 4; i++) {
+		if (i >= in_len)
+			return 0;
+		result |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+		if (!(in[i] & 0x80)) {
+			*value = result;
+			return i + 1;
+		}
+	}
+
+	return -1;
+}
+
+int mqtt_prot_packet_len(const uint8_t *msg, int bytes_received)
+{
+	uint32_t remaining;
+	int n;
+
+	if (msg == NULL || bytes_received < 2)
+		return 0;
+
+	n = mqtt_prot_decode_varint(&msg[1], bytes_received - 1, &remaining);
+	if (n <= 0)
+		return n;
+
+	return 1 + n + (int)remaining;
+}
+
+int mqtt_prot_properties_encode(const mqtt_prot_properties *props,
+								uint8_t *to_send,
+								int to_send_len)
+{
+	int body_len = 0, len_len;
+
+	if (props != NULL) {
+		body_len = properties_body(props, NULL);
+		if (body_len < 0)
+			return -1;
+	}
+
+	len_len = mqtt_prot_encode_varint(body_len, NULL);
+	if (to_send == NULL)
+		return len_len + body_len;
+	if (len_len + body_len > to_send_len)
+		return -1;
+
+	mqtt_prot_encode_varint(body_len, to_send);
+	if (props != NULL)
+		properties_body(props, &to_send[len_len]);
+
+	return len_len + body_len;
+}
+
+int mqtt_prot_properties_decode(const uint8_t *msg,
+								int msg_len,
+								mqtt_prot_properties *props)
+{
+	const uint8_t **str;
+	uint16_t *str_len, len;
+	uint32_t body_len, value;
+	int i, end, n;
+	uint8_t id;
+
+	memset(props, 0, sizeof(mqtt_prot_properties));
+
+	n = mqtt_prot_decode_varint(msg, msg_len, &body_len);
+	if (n <= 0 || body_len > (uint32_t)(msg_len - n))
+		return -1;
+
+	i = n;
+	end = n + (int)body_len;
+	while (i < end) {
+		id = msg[i++];
+		switch (property_type(id)) {
+			case PROP_BYTE:
+				if (end - i < 1)
+					return -1;
+				value = msg[i];
+				i += 1;
+				break;
+			case PROP_U16:
+				if (end - i < 2)
+					return -1;
+				value = ((uint32_t)msg[i] << 8) | msg[i + 1];
+				i += 2;
+				break;
+			case PROP_U32:
+				if (end - i < 4)
+					return -1;
+				value = ((uint32_t)msg[i] << 24) | ((uint32_t)msg[i + 1] << 16) |
+						((uint32_t)msg[i + 2] << 8) | msg[i + 3];
+				i += 4;
+				break;
+			case PROP_VARINT:
+				n = mqtt_prot_decode_varint(&msg[i], end - i, &value);
+				if (n <= 0)
+					return -1;
+				i += n;
+				break;
+			case PROP_STRING:
+			case PROP_BINARY:
+			case PROP_PAIR:
+				for (int k = 0; k < (property_type(id) == PROP_PAIR ? 2 : 1); k++) {
+					if (end - i < 2)
+						return -1;
+					len = ((uint16_t)msg[i] << 8) | msg[i + 1];
+					if (end - i - 2 < len)
+						return -1;
+					str = property_string(props, id, &str_len);
+					if (str != NULL) {
+						*str = &msg[i + 2];
+						*str_len = len;
+						props->present |= MQTT_PROT_PROP_BIT(id);
+					}
+					i += 2 + len;
+				}
+				continue;
+			default:
+				print_err("Unknown property 0x%02x", id);
+				return -1;
+		}
+		property_set(props, id, value);
+	}
+
+	return end;
+}
+
+/* Size of the fixed header of a packet already checked as complete. */
+static int header_len(const uint8_t *msg)
+{
+	int i = 1;
+
+	while (msg[i] & 0x80)
+		i++;
+
+	return i + 1;
+}
+
+/* Write the fixed header, returns its size. */
+static int fixed_header(uint8_t *to_send, uint8_t header, uint32_t remaining)
+{
+	to_send[0] = header;
+	return 1 + mqtt_prot_encode_varint(remaining, &to_send[1]);
+}
+
+static int packet_size(uint32_t remaining)
+{
+	int n = mqtt_prot_encode_varint(remaining, NULL);
+
+	return (n < 0) ? -1 : 1 + n + (int)remaining;
+}
+
+static int put_string(uint8_t *to_send, const char *str, uint16_t len)
+{
+	to_send[0] = (uint8_t)(len >> 8);
+	to_send[1] = (uint8_t)len;
+	memcpy(&to_send[2], str, len);
+	return 2 + len;
+}
+
 int mqtt_prot_connect(uint8_t *to_send,
+						int to_send_len,
+						uint8_t version,
 						uint8_t conn_flags,
 						uint16_t keepalive,
+						const mqtt_prot_properties *props,
 						const char *clientID,
 						const char *username,
 						const char *password)
 {
-	uint8_t conn_pkt[MQTT_PROT_PACKET_LEN];
-	uint16_t dummy;
-	uint8_t i = 0;
-	int bytes_to_send;
+	size_t id_len, user_len = 0, pass_len = 0;
+	int props_len = 0, total, i;
+	uint32_t remaining;
 
 	print_dbg("IN");
 
-	memset(&conn_pkt[0], 0, MQTT_PROT_PACKET_LEN * sizeof(char));
+	id_len = strlen(clientID);
+	if (username != NULL)
+		user_len = strlen(username);
+	if (password != NULL)
+		pass_len = strlen(password);
+	if (id_len > UINT16_MAX || user_len > UINT16_MAX || pass_len > UINT16_MAX)
+		return -1;
+
+	if (version == MQTT_PROT_VERSION_5) {
+		props_len = mqtt_prot_properties_encode(props, NULL, 0);
+		if (props_len < 0)
+			return -1;
+	}
+
+	/* Protocol name, level, flags and keepalive take 10 bytes. */
+	remaining = 10 + props_len + 2 + id_len;
+	if (username != NULL)
+		remaining += 2 + user_len;
+	if (password != NULL)
+		remaining += 2 + pass_len;
+
+	total = packet_size(remaining);
+	if (to_send == NULL || total < 0)
+		return total;
+	if (total > to_send_len)
+		return -1;
 
 	/* FIXED HEADER */
-	conn_pkt[i] = (MQTT_PROT_CONNECT << 4);
-	conn_pkt[++i] = 0x00; // Start with 0 value as we don't have the final size.
+	i = fixed_header(to_send, MQTT_PROT_CONNECT << 4, remaining);
 
 	/* VARIABLE HEADER */
-	conn_pkt[++i] = 0x00;
-	conn_pkt[++i] = 0x04;
-	conn_pkt[++i] = 'M';
-	conn_pkt[++i] = 'Q';
-	conn_pkt[++i] = 'T';
-	conn_pkt[++i] = 'T';
-	conn_pkt[++i] = 0x04;
-	conn_pkt[++i] = conn_flags;
-
-	/* TODO: Receive KeepAlive value. */
-	conn_pkt[++i] = ((keepalive & 0xFF00) >> 8);
-	conn_pkt[++i] = (keepalive & 0x00FF);
+	i += put_string(&to_send[i], "MQTT", 4);
+	to_send[i++] = version;
+	to_send[i++] = conn_flags;
+	to_send[i++] = ((keepalive & 0xFF00) >> 8);
+	to_send[i++] = (keepalive & 0x00FF);
+	if (version == MQTT_PROT_VERSION_5)
+		i += mqtt_prot_properties_encode(props, &to_send[i], to_send_len - i);
 
 	/* PAYLOAD */
-	dummy = strlen(clientID);
-	conn_pkt[++i] = (dummy >> 8);
-	conn_pkt[++i] = dummy;
-	for (int j = 0; j < dummy; j++)
-		conn_pkt[++i] = clientID[j];
-	if (username != NULL) {
-		dummy = strlen(username);
-		for (int j = 0; j < dummy; j++)
-			conn_pkt[++i] = username[j];
-	}
-	if (password != NULL) {
-		dummy = strlen(password);
-		for (int j = 0; j < dummy; j++)
-			conn_pkt[++i] = password[j];
-	}
-
-	conn_pkt[1] = (++i - 2); // Set size of Byte 2 as VARIABLE HEADER + PAYLOAD.
-
-	bytes_to_send = i;
-	memcpy(&to_send[0], conn_pkt, bytes_to_send * sizeof(uint8_t));
+	i += put_string(&to_send[i], clientID, id_len);
+	if (username != NULL)
+		i += put_string(&to_send[i], username, user_len);
+	if (password != NULL)
+		i += put_string(&to_send[i], password, pass_len);
 
-	return bytes_to_send;
+	return i;
 }
 
-int mqtt_prot_connack(const uint8_t *msg, int bytes_received)
+int mqtt_prot_connack(uint8_t version,
+						const uint8_t *msg,
+						int bytes_received,
+						mqtt_prot_properties *props)
 {
+	mqtt_prot_properties dummy;
+	int len, i;
+
 	print_dbg("IN");
 
-	if (msg == NULL || bytes_received != 4 ||
+	if (msg == NULL || bytes_received < 2 ||
 		msg[0] != (MQTT_PROT_CONNACK << 4))
 		return -1;
 
-	return (int)msg[3];
+	len = mqtt_prot_packet_len(msg, bytes_received);
+	if (len <= 0 || len > bytes_received)
+		return -1;
+
+	/* Byte 1 of variable header is acknowledge flags, byte 2 return code. */
+	i = header_len(msg);
+	if (len - i < 2)
+		return -1;
+
+	if (version == MQTT_PROT_VERSION_5) {
+		if (props == NULL)
+			props = &dummy;
+		if (mqtt_prot_properties_decode(&msg[i + 2], len - i - 2, props) < 0)
+			return -1;
+	} else if (len != 4) {
+		return -1;
+	}
+
+	return (int)msg[i + 1];
 }
 
-int mqtt_prot_disconnect(uint8_t *to_send)
+int mqtt_prot_disconnect(uint8_t *to_send, uint8_t version, uint8_t reason_code)
 {
-	uint8_t disc_pkt[2];
-	int bytes_to_send;
+	int bytes_to_send = 2;
 
 	print_dbg("IN");
 
-	memset(&disc_pkt[0], 0, 2 * sizeof(uint8_t));
-	disc_pkt[0] = (MQTT_PROT_DISCONNECT << 4);
-
-	bytes_to_send = strlen(disc_pkt);
-	memcpy(&to_send[0], disc_pkt, bytes_to_send * sizeof(uint8_t));
+	to_send[0] = (MQTT_PROT_DISCONNECT << 4);
+	to_send[1] = 0x00;
+	if (version == MQTT_PROT_VERSION_5 && reason_code != 0) {
+		to_send[1] = 0x01;
+		to_send[2] = reason_code;
+		bytes_to_send = 3;
+	}
 
 	return bytes_to_send;
 }
 
-int mqtt_prot_subscribe(mqtt_subs_params *params,
-						uint8_t nbParams,
-						uint8_t *to_send)
+int mqtt_prot_pingreq(uint8_t *to_send)
 {
-	uint8_t subs_pkt[MQTT_PROT_PACKET_LEN], i = 0;
-	uint16_t topic_len;
-	int bytes_to_send;
-
-	print_dbg("IN");
+	to_send[0] = (MQTT_PROT_PINGREQ << 4);
+	to_send[1] = 0x00;
 
-	memset(&subs_pkt[0], 0, MQTT_PROT_PACKET_LEN * sizeof(uint8_t));
+	return 2;
+}
 
-	/* FIXED HEADER */
-	subs_pkt[i] = (MQTT_PROT_SUBSCRIBE << 4);
-	subs_pkt[++i] = 0x00;
+/* SUBSCRIBE and UNSUBSCRIBE only differ by the options byte after filters. */
+static int encode_filters(uint8_t *to_send,
+							int to_send_len,
+							uint8_t version,
+							uint8_t type,
+							uint16_t packet_id,
+							const mqtt_subs_params *params,
+							int nbParams,
+							int *nb_encoded)
+{
+	int options = (type == MQTT_PROT_SUBSCRIBE) ? 1 : 0;
+	uint32_t remaining, entry;
+	int n = 0, total, i;
 
-	/* VARIABLE HEADER */
-	subs_pkt[++i] = 0x00;
-	subs_pkt[++i] = 0x02;
+	/* Packet identifier and, with MQTT v5, an empty property list. */
+	remaining = 2 + (version == MQTT_PROT_VERSION_5 ? 1 : 0);
+	total = packet_size(remaining);
 
-	/* PAYLOAD */
-	for (int j = 0; j < nbParams; j++) {
-		subs_pkt[++i] = (uint8_t)(params[j].topic_len >> 8);
-		subs_pkt[++i] = (uint8_t)params[j].topic_len;
-		for (int k = 0; k < params[j].topic_len; k++) {
-			subs_pkt[++i] = params[j].topic[k];
-		}
-		subs_pkt[++i] = params->qos;
+	/* Take as many filters as fit in to_send_len. */
+	for (n = 0; n < nbParams; n++) {
+		if (params[n].topic_len < 0 || params[n].topic_len > UINT16_MAX)
+			return -1;
+		entry = 2 + params[n].topic_len + options;
+		if (remaining + entry > MQTT_PROT_VARINT_MAX)
+			break;
+		if (to_send != NULL && packet_size(remaining + entry) > to_send_len)
+			break;
+		remaining += entry;
+		total = packet_size(remaining);
 	}
 
-	subs_pkt[1] = (++i - 2);
+	if (nb_encoded != NULL)
+		*nb_encoded = n;
+	if (to_send == NULL)
+		return total;
+	if (n == 0)
+		return -1;
+
+	i = fixed_header(to_send, (type << 4) | (1 << 1), remaining);
+	to_send[i++] = (uint8_t)(packet_id >> 8);
+	to_send[i++] = (uint8_t)packet_id;
+	if (version == MQTT_PROT_VERSION_5)
+		to_send[i++] = 0x00;
 
-	bytes_to_send = i;
-	memcpy(&to_send[0], subs_pkt, bytes_to_send * sizeof(uint8_t));
+	for (int j = 0; j < n; j++) {
+		i += put_string(&to_send[i], params[j].topic, params[j].topic_len);
+		if (options)
+			to_send[i++] = (uint8_t)(params[j].qos & 0x03);
+	}
 
-	return bytes_to_send;
+	return i;
 }
 
-int mqtt_prot_suback(const uint8_t *msg, int bytes_received)
+int mqtt_prot_subscribe(uint8_t *to_send,
+						int to_send_len,
+						uint8_t version,
+						uint16_t packet_id,
+						const mqtt_subs_params *params,
+						int nbParams,
+						int *nb_encoded)
 {
 	print_dbg("IN");
 
-	if (msg == NULL || bytes_received < 5 ||
-		msg[0] != (MQTT_PROT_SUBACK << 4))
+	return encode_filters(to_send, to_send_len, version, MQTT_PROT_SUBSCRIBE,
+							packet_id, params, nbParams, nb_encoded);
+}
+
+/* SUBACK and UNSUBACK end with one reason code per filter. */
+static int decode_codes(uint8_t version,
+						uint8_t type,
+						const uint8_t *msg,
+						int bytes_received,
+						uint16_t *packet_id,
+						uint8_t *codes,
+						int codes_len)
+{
+	mqtt_prot_properties props;
+	int len, i, n;
+
+	if (msg == NULL || bytes_received < 4 || msg[0] != (type << 4))
+		return -1;
+
+	len = mqtt_prot_packet_len(msg, bytes_received);
+	if (len < 4 || len > bytes_received)
 		return -1;
 
-	for (int i = 4; i < bytes_received; i++) {
-		if (msg[i] == 0x80) {
-			print_err("Topic %d bad QoS", i - 3);
+	i = header_len(msg);
+	if (len - i < 2)
+		return -1;
+	if (packet_id != NULL)
+		*packet_id = ((uint16_t)msg[i] << 8) | msg[i + 1];
+	i += 2;
+
+	if (version == MQTT_PROT_VERSION_5) {
+		n = mqtt_prot_properties_decode(&msg[i], len - i, &props);
+		if (n < 0)
 			return -1;
-		}
+		i += n;
 	}
 
-	return 0;
+	n = len - i;
+	if (codes != NULL)
+		memcpy(codes, &msg[i], (n < codes_len) ? n : codes_len);
+
+	return n;
 }
 
-int mqtt_prot_unsubscribe(mqtt_subs_params *params,
+int mqtt_prot_suback(uint8_t version,
+						const uint8_t *msg,
+						int bytes_received,
+						uint16_t *packet_id,
+						uint8_t *codes,
+						int codes_len)
+{
+	print_dbg("IN");
+
+	return decode_codes(version, MQTT_PROT_SUBACK, msg, bytes_received,
+						packet_id, codes, codes_len);
+}
+
+int mqtt_prot_unsubscribe(uint8_t *to_send,
+							int to_send_len,
+							uint8_t version,
+							uint16_t packet_id,
+							const mqtt_subs_params *params,
 							int nbParams,
-							uint8_t *to_send)
+							int *nb_encoded)
+{
+	print_dbg("IN");
+
+	return encode_filters(to_send, to_send_len, version,
+							MQTT_PROT_UNSUBSCRIBE, packet_id, params,
+							nbParams, nb_encoded);
+}
+
+int mqtt_prot_unsuback(uint8_t version,
+						const uint8_t *msg,
+						int bytes_received,
+						uint16_t *packet_id,
+						uint8_t *codes,
+						int codes_len)
+{
+	return decode_codes(version, MQTT_PROT_UNSUBACK, msg, bytes_received,
+						packet_id, codes, codes_len);
+}
+
+int mqtt_prot_publish_header(uint8_t *to_send,
+								int to_send_len,
+								uint8_t version,
+								uint8_t pub_flags,
+								uint16_t packet_id,
+								const char *topic,
+								uint16_t topic_len,
+								const mqtt_prot_properties *props,
+								uint32_t pub_msg_len)
 {
-	uint8_t unsub_pkt[MQTT_PROT_PACKET_LEN];
-	uint16_t topic_len, i = 0;
-	int bytes_to_send;
+	uint8_t qos = (pub_flags >> 1) & 0x03;
+	int props_len = 0, total, i;
+	uint32_t remaining;
 
 	print_dbg("IN");
 
-	memset(&unsub_pkt[0], 0, MQTT_PROT_PACKET_LEN * sizeof(uint8_t));
+	if (qos > 2)
+		return -1;
+
+	if (version == MQTT_PROT_VERSION_5) {
+		props_len = mqtt_prot_properties_encode(props, NULL, 0);
+		if (props_len < 0)
+			return -1;
+	}
+
+	remaining = 2 + topic_len + (qos ? 2 : 0) + props_len;
+	if (pub_msg_len > MQTT_PROT_VARINT_MAX - remaining)
+		return -1;
 
-	unsub_pkt[i] = (MQTT_PROT_UNSUBSCRIBE << 4) | (1 << 1);
-	unsub_pkt[++i] = 0x00;
+	total = packet_size(remaining + pub_msg_len);
+	if (total < 0)
+		return -1;
+	total -= pub_msg_len;
+	if (to_send == NULL)
+		return total;
+	if (total > to_send_len)
+		return -1;
 
-	unsub_pkt[++i] = 0x00;
-	unsub_pkt[++i] = 0x02;
+	i = fixed_header(to_send, (MQTT_PROT_PUBLISH << 4) | (pub_flags & 0xF),
+						remaining + pub_msg_len);
 
-	for (int j = 0; j < nbParams; j++) {
-		unsub_pkt[++i] = (uint8_t)(params[j].topic_len >> 8);
-		unsub_pkt[++i] = (uint8_t)params[j].topic_len;
-		for (int k = 0; k < params[j].topic_len; k++)
-			unsub_pkt[++i] = params[j].topic[k];
+	i += put_string(&to_send[i], topic, topic_len);
+	if (qos) {
+		to_send[i++] = (uint8_t)(packet_id >> 8);
+		to_send[i++] = (uint8_t)packet_id;
 	}
+	if (version == MQTT_PROT_VERSION_5)
+		i += mqtt_prot_properties_encode(props, &to_send[i], to_send_len - i);
+
+	return i;
+}
+
+int mqtt_prot_publish(uint8_t *to_send,
+						int to_send_len,
+						uint8_t version,
+						uint8_t pub_flags,
+						uint16_t packet_id,
+						const char *topic,
+						uint16_t topic_len,
+						const mqtt_prot_properties *props,
+						const uint8_t *pub_msg,
+						uint32_t pub_msg_len)
+{
+	int i;
 
-	unsub_pkt[1] = (++i - 2);
+	i = mqtt_prot_publish_header(to_send, to_send_len, version, pub_flags,
+									packet_id, topic, topic_len, props,
+									pub_msg_len);
+	if (i < 0)
+		return -1;
+	if (to_send == NULL)
+		return i + pub_msg_len;
+	if ((uint32_t)(to_send_len - i) < pub_msg_len)
+		return -1;
 
-	bytes_to_send = i;
-	memcpy(&to_send[0], unsub_pkt, bytes_to_send * sizeof(uint8_t));
+	memcpy(&to_send[i], pub_msg, pub_msg_len);
+	i += pub_msg_len;
 
-	return bytes_to_send;
+	return i;
 }
 
-int mqtt_prot_unsuback(const uint8_t *msg, int bytes_received)
+int mqtt_prot_publish_decode(uint8_t version,
+								const uint8_t *msg,
+								int bytes_received,
+								mqtt_prot_publish_msg *pub)
 {
-	if (msg == NULL || bytes_received < 4 ||
-		msg[0] != (MQTT_PROT_UNSUBACK << 4))
+	int len, i, n;
+
+	print_dbg("IN");
+
+	if (msg == NULL || bytes_received < 2 ||
+		(msg[0] >> 4) != MQTT_PROT_PUBLISH)
+		return -1;
+
+	len = mqtt_prot_packet_len(msg, bytes_received);
+	if (len <= 0 || len > bytes_received)
+		return -1;
+
+	memset(pub, 0, sizeof(mqtt_prot_publish_msg));
+	pub->flags = msg[0] & 0x0F;
+	if (((pub->flags >> 1) & 0x03) == 0x03)
 		return -1;
 
+	i = header_len(msg);
+
+	if (len - i < 2)
+		return -1;
+	pub->topic_len = ((uint16_t)msg[i] << 8) | msg[i + 1];
+	i += 2;
+	if (len - i < pub->topic_len)
+		return -1;
+	pub->topic = (const char *)&msg[i];
+	i += pub->topic_len;
+
+	if (pub->flags & 0x06) {
+		if (len - i < 2)
+			return -1;
+		pub->packet_id = ((uint16_t)msg[i] << 8) | msg[i + 1];
+		i += 2;
+	}
+
+	if (version == MQTT_PROT_VERSION_5) {
+		n = mqtt_prot_properties_decode(&msg[i], len - i, &pub->props);
+		if (n < 0)
+			return -1;
+		i += n;
+	}
+
+	pub->payload = &msg[i];
+	pub->payload_len = len - i;
+
 	return 0;
 }
 
-int mqtt_prot_publish(uint8_t pub_flags,
-						const char *topic,
-						const char *pub_msg,
-						uint8_t *to_send)
+int mqtt_prot_pubresp(uint8_t *to_send,
+						int to_send_len,
+						uint8_t version,
+						uint8_t type,
+						uint16_t packet_id,
+						uint8_t reason_code)
 {
-	uint8_t pub_pkt[MQTT_PROT_PACKET_LEN];
-	uint16_t topic_len, pub_msg_len, i = 0;
-	int bytes_to_send;
+	int total = (version == MQTT_PROT_VERSION_5 && reason_code != 0) ? 5 : 4;
 
-	print_dbg("IN");
+	if (to_send == NULL)
+		return total;
+	if (total > to_send_len)
+		return -1;
 
-	memset(&pub_pkt[0], 0, MQTT_PROT_PACKET_LEN * sizeof(uint8_t));
-	topic_len = (uint8_t)strlen(topic);
-	pub_msg_len = (uint8_t)strlen(pub_msg);
+	to_send[0] = (type << 4) | (type == MQTT_PROT_PUBREL ? (1 << 1) : 0);
+	to_send[1] = total - 2;
+	to_send[2] = (uint8_t)(packet_id >> 8);
+	to_send[3] = (uint8_t)packet_id;
+	if (total == 5)
+		to_send[4] = reason_code;
 
-	pub_pkt[i] = (MQTT_PROT_PUBLISH << 4) | (pub_flags & 0xF);
-	pub_pkt[++i] = 0x00;
+	return total;
+}
 
-	pub_pkt[++i] = (uint8_t)(topic_len >> 8);
-	pub_pkt[++i] = (uint8_t)topic_len;
-	for (int j = 0; j < topic_len; j++)
-		pub_pkt[++i] = topic[j];
+int mqtt_prot_pubresp_decode(uint8_t version,
+								uint8_t type,
+								const uint8_t *msg,
+								int bytes_received,
+								uint16_t *packet_id)
+{
+	uint8_t header = (type << 4) | (type == MQTT_PROT_PUBREL ? (1 << 1) : 0);
+	int len, i;
 
-	pub_pkt[++i] = 0x00;
-	pub_pkt[++i] = 0x02;
+	if (msg == NULL || bytes_received < 4 || msg[0] != header)
+		return -1;
 
-	pub_pkt[++i] = (uint8_t)(pub_msg_len >> 8);
-	pub_pkt[++i] = (uint8_t)pub_msg_len;
-	for (int j = 0; j < pub_msg_len; j++)
-		pub_pkt[++i] = pub_msg[j];
+	len = mqtt_prot_packet_len(msg, bytes_received);
+	if (len < 4 || len > bytes_received)
+		return -1;
+	if (version != MQTT_PROT_VERSION_5 && len != 4)
+		return -1;
 
-	pub_pkt[1] = (++i - 2);
+	i = header_len(msg);
+	if (len - i < 2)
+		return -1;
 
-	bytes_to_send = i;
-	memcpy(&to_send[0], pub_pkt, bytes_to_send * sizeof(uint8_t));
+	if (packet_id != NULL)
+		*packet_id = ((uint16_t)msg[i] << 8) | msg[i + 1];
 
-	return bytes_to_send;
+	/* MQTT v5 omits the reason code on success. */
+	return (len - i > 2) ? msg[i + 2] : 0;
 }
 
-int mqtt_prot_puback(const uint8_t *msg, int bytes_received)
+int mqtt_prot_puback(uint8_t version,
+						const uint8_t *msg,
+						int bytes_received,
+						uint16_t *packet_id)
 {
+	int reason;
+
 	print_dbg("IN");
 
-	if (msg == NULL || bytes_received < 4 || 
-		msg[0] != (MQTT_PROT_PUBACK << 4))
+	reason = mqtt_prot_pubresp_decode(version, MQTT_PROT_PUBACK, msg,
+										bytes_received, packet_id);
+	if (reason < 0 || reason >= 0x80)
 		return -1;
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -3,6 +3,14 @@
  * @brief MQTT protocol functions declaration.
  * This header file and implementations are based on:
  * http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.html
+ * https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html
+ *
+ * Every encoder receives the protocol version, packets are written in the
+ * MQTT 3.1.1 layout for MQTT_PROT_VERSION_3_1_1 and with properties and
+ * reason codes for MQTT_PROT_VERSION_5.
+ * Encoders return the number of bytes written to to_send. When to_send is
+ * NULL nothing is written and the needed size is returned, -1 is returned if
+ * to_send_len is too small.
  */
 
 #ifndef _MQTT_PROT_H_
@@ -17,6 +25,15 @@
 
 #define MQTT_PROT_PACKET_LEN 256
 
+#define MQTT_PROT_VERSION_3_1_1 0x04
+#define MQTT_PROT_VERSION_5 0x05
+
+/* Fixed header is 1 byte of type and flags plus up to 4 bytes of length. */
+#define MQTT_PROT_FIXED_HEADER_MAX 5
+#define MQTT_PROT_VARINT_MAX 268435455
+
+#define MQTT_PROT_PROP_BIT(id) (1ULL << (id))
+
 typedef enum {
     MQTT_PROT_CONNECT = 1,
     MQTT_PROT_CONNACK,
@@ -31,25 +48,147 @@ typedef enum {
     MQTT_PROT_UNSUBACK,
     MQTT_PROT_PINGREQ,
     MQTT_PROT_PINGRESP,
-    MQTT_PROT_DISCONNECT
+    MQTT_PROT_DISCONNECT,
+    MQTT_PROT_AUTH
 } mqtt_prot;
 
+/* MQTT 5 property identifiers, section 2.2.2.2. */
+typedef enum {
+    MQTT_PROP_PAYLOAD_FORMAT = 0x01,
+    MQTT_PROP_MESSAGE_EXPIRY = 0x02,
+    MQTT_PROP_CONTENT_TYPE = 0x03,
+    MQTT_PROP_RESPONSE_TOPIC = 0x08,
+    MQTT_PROP_CORRELATION_DATA = 0x09,
+    MQTT_PROP_SUBSCRIPTION_ID = 0x0B,
+    MQTT_PROP_SESSION_EXPIRY = 0x11,
+    MQTT_PROP_ASSIGNED_CLIENT_ID = 0x12,
+    MQTT_PROP_SERVER_KEEPALIVE = 0x13,
+    MQTT_PROP_AUTH_METHOD = 0x15,
+    MQTT_PROP_AUTH_DATA = 0x16,
+    MQTT_PROP_REQUEST_PROBLEM_INFO = 0x17,
+    MQTT_PROP_WILL_DELAY = 0x18,
+    MQTT_PROP_REQUEST_RESPONSE_INFO = 0x19,
+    MQTT_PROP_RESPONSE_INFO = 0x1A,
+    MQTT_PROP_SERVER_REFERENCE = 0x1C,
+    MQTT_PROP_REASON_STRING = 0x1F,
+    MQTT_PROP_RECEIVE_MAX = 0x21,
+    MQTT_PROP_TOPIC_ALIAS_MAX = 0x22,
+    MQTT_PROP_TOPIC_ALIAS = 0x23,
+    MQTT_PROP_MAX_QOS = 0x24,
+    MQTT_PROP_RETAIN_AVAILABLE = 0x25,
+    MQTT_PROP_USER_PROPERTY = 0x26,
+    MQTT_PROP_MAX_PACKET_SIZE = 0x27,
+    MQTT_PROP_WILDCARD_SUB_AVAILABLE = 0x28,
+    MQTT_PROP_SUB_ID_AVAILABLE = 0x29,
+    MQTT_PROP_SHARED_SUB_AVAILABLE = 0x2A
+} mqtt_prot_property_id;
+
+/**
+ * @brief MQTT 5 properties handled by this library. A property is encoded or
+ * was decoded only if its MQTT_PROT_PROP_BIT(id) is set in present.
+ * Properties not listed here are skipped when decoding. String fields point
+ * into the decoded packet and are not NUL terminated.
+ */
+typedef struct {
+    uint64_t present;
+    uint8_t payload_format;
+    uint32_t message_expiry;
+    uint32_t session_expiry;
+    uint32_t subscription_id;
+    uint16_t server_keepalive;
+    uint16_t receive_max;
+    uint16_t topic_alias_max;
+    uint16_t topic_alias;
+    uint8_t max_qos;
+    uint8_t retain_available;
+    uint32_t max_packet_size;
+    const uint8_t *content_type;
+    uint16_t content_type_len;
+    const uint8_t *assigned_client_id;
+    uint16_t assigned_client_id_len;
+    const uint8_t *reason_string;
+    uint16_t reason_string_len;
+} mqtt_prot_properties;
+
 typedef struct {
     int qos;
     int topic_len;
     char *topic;
 } mqtt_subs_params;
 
+/**
+ * @brief Decoded PUBLISH packet. topic and payload point into the packet.
+ */
+typedef struct {
+    uint8_t flags;
+    uint16_t packet_id;
+    const char *topic;
+    uint16_t topic_len;
+    mqtt_prot_properties props;
+    const uint8_t *payload;
+    uint32_t payload_len;
+} mqtt_prot_publish_msg;
+
+/**
+ * @brief Encode a Variable Byte Integer, 7 bits per byte with bit 7 set when
+ * more bytes follow.
+ * @param value Value to encode, up to MQTT_PROT_VARINT_MAX.
+ * @param out Output buffer, must have room for 4 bytes. May be NULL.
+ * @return Number of bytes of the encoded value or -1 if value is too big.
+ */
+int mqtt_prot_encode_varint(uint32_t value, uint8_t *out);
+
+/**
+ * @brief Decode a Variable Byte Integer.
+ * @param in Input buffer.
+ * @param in_len Input buffer length.
+ * @param value Decoded value.
+ * @return Number of bytes consumed, 0 if more bytes are needed or -1 if the
+ * value is malformed.
+ */
+int mqtt_prot_decode_varint(const uint8_t *in, int in_len, uint32_t *value);
+
+/**
+ * @brief Find the size of the first packet of a receive buffer.
+ * @param msg Received bytes.
+ * @param bytes_received Number of bytes received.
+ * @return Fixed header plus remaining length, 0 if the fixed header is not
+ * complete yet or -1 if malformed.
+ */
+int mqtt_prot_packet_len(const uint8_t *msg, int bytes_received);
+
+/**
+ * @brief Encode a property list preceded by its length.
+ * @param props Properties to encode, NULL for an empty list.
+ * @param to_send Output buffer, may be NULL.
+ * @param to_send_len Output buffer length.
+ * @return Number of bytes of the encoded list or -1 if error.
+ */
+int mqtt_prot_properties_encode(const mqtt_prot_properties *props,
+                                uint8_t *to_send,
+                                int to_send_len);
+
+/**
+ * @brief Decode a property list preceded by its length.
+ * @param msg Input buffer.
+ * @param msg_len Input buffer length.
+ * @param props Decoded properties.
+ * @return Number of bytes consumed or -1 if malformed.
+ */
+int mqtt_prot_properties_decode(const uint8_t *msg,
+                                int msg_len,
+                                mqtt_prot_properties *props);
+
 /**
  * @brief
  * Byte 1: Control Header.
  * Byte 2: Remaining length of Variable Header + Payload.
  * Bytes 3 and 4: 16bit protocol length.
  * Bytes 5 to 8: MQTT protocol name.
- * Byte 9: Protocol level, 0x04 for MQTT v3.1.1.
+ * Byte 9: Protocol level, 0x04 for MQTT v3.1.1 and 0x05 for MQTT v5.
  * Byte 10: Connect flags
  *   Bit 0: Reserved
- *   Bit 1: Clean session flag. Set to 1 if is desirable to the server to 
+ *   Bit 1: Clean session flag. Set to 1 if is desirable to the server to
  *   store previously values, 0 if desires to start new session.
  *   Bit 2: Will flag: Set to 1 if is desirable to to store a Will message
  *   in the server when Connect is accepted, 0 if not. Will message must be
@@ -64,33 +203,45 @@ typedef struct {
  *   Bit 7: Password flag: Set to 1 if password is present in the payload. If
  *   user name flag is 0, password must to be 0.
  * Bytes 11 and 12: 16bits keepalive interval.
+ * MQTT v5 only: connect properties.
  * The following bytes are destinated for ClientID, Will Topic, Will Message,
  * User Name and Password. Before each field, must preceed a two bytes field
  * length.
  * @param to_send Formated 'connect' protocol packet.
+ * @param to_send_len to_send buffer length.
+ * @param version Protocol version.
  * @param conn_flags 1 byte bit to bit array with connection flags.
  * @param keepalive maximum time interval that is permitted to elapse between
  * the point at which the Client finishes transmitting one Control Packet and
  * the point it starts sending the next.
+ * @param props Connect properties, MQTT v5 only, may be NULL.
  * @param clientID Client Identification
  * @param username Username to connect MQTT server.
  * @param password Password to connect MQTT server.
  * @return Size in bytes to send.
  */
 int mqtt_prot_connect(uint8_t *to_send,
+                        int to_send_len,
+                        uint8_t version,
                         uint8_t conn_flags,
                         uint16_t keepalive,
+                        const mqtt_prot_properties *props,
                         const char *clientID,
                         const char *username,
                         const char *password);
 
 /**
  * @brief Answer packet for connect request.
+ * @param version Protocol version.
  * @param msg Connack packet received.
  * @param bytes_received Number of bytes received.
- * @return The error code retrieved from connack.
+ * @param props Decoded connack properties, MQTT v5 only, may be NULL.
+ * @return The error code retrieved from connack or -1 if malformed.
  */
-int mqtt_prot_connack(const uint8_t *msg, int bytes_received);
+int mqtt_prot_connack(uint8_t version,
+                        const uint8_t *msg,
+                        int bytes_received,
+                        mqtt_prot_properties *props);
 
 /**
  * @brief
@@ -102,93 +253,224 @@ int mqtt_prot_connack(const uint8_t *msg, int bytes_received);
  *   Bit 3: DUP flag: Set to 0 if this is the first attempt of publishing the
  *   message, otherwise 1.
  *   Bit 4 to 7: Control packet.
- * Byte 2: Remaining length of Variable Header + Payload.
- * Bytes 3 and 4: 16bit topic name length.
- * Bytes 5 to n: Topic name.
- * Bytes n+1 to n+2: 16 bit message length.
- * Bytes n+3 and following: Message to publish.
+ * Bytes 2 to 5: Remaining length of Variable Header + Payload.
+ * 16 bit topic name length followed by the topic name. With MQTT v5 the topic
+ * may be empty when a topic alias property is set.
+ * 16 bit packet identifier, only if QoS is 1 or 2.
+ * MQTT v5 only: publish properties.
+ * Following bytes are the message to publish, up to the end of the packet.
+ * @param to_send Formated 'publish' protocol packet.
+ * @param to_send_len to_send buffer length.
+ * @param version Protocol version.
  * @param pub_flags Publish flags for the message being published.
+ * @param packet_id Packet identifier, ignored for QoS 0.
  * @param topic Topic in what pub_msg will be published.
+ * @param topic_len Topic length, may be 0 with a topic alias.
+ * @param props Publish properties, MQTT v5 only, may be NULL.
  * @param pub_msg Message to be published.
- * @param to_send Formated 'publish' protocol packet.
+ * @param pub_msg_len Message length.
  * @return Size in bytes to send.
  */
-int mqtt_prot_publish(uint8_t pub_flags,
+int mqtt_prot_publish(uint8_t *to_send,
+                        int to_send_len,
+                        uint8_t version,
+                        uint8_t pub_flags,
+                        uint16_t packet_id,
                         const char *topic,
-                        const char *pub_msg,
-                        uint8_t *to_send);
+                        uint16_t topic_len,
+                        const mqtt_prot_properties *props,
+                        const uint8_t *pub_msg,
+                        uint32_t pub_msg_len);
 
 /**
- * @brief Answer packet for publish request.
- * @param msg Puback packet received.
+ * @brief Build a publish packet up to its message, see mqtt_prot_publish.
+ * The message is sent right after, from where it already is.
+ * @param to_send Formated 'publish' protocol packet header.
+ * @param to_send_len to_send buffer length.
+ * @param version Protocol version.
+ * @param pub_flags Publish flags for the message being published.
+ * @param packet_id Packet identifier, ignored for QoS 0.
+ * @param topic Topic in what the message will be published.
+ * @param topic_len Topic length, may be 0 with a topic alias.
+ * @param props Publish properties, MQTT v5 only, may be NULL.
+ * @param pub_msg_len Message length.
+ * @return Header size in bytes, or -1 if error.
+ */
+int mqtt_prot_publish_header(uint8_t *to_send,
+                                int to_send_len,
+                                uint8_t version,
+                                uint8_t pub_flags,
+                                uint16_t packet_id,
+                                const char *topic,
+                                uint16_t topic_len,
+                                const mqtt_prot_properties *props,
+                                uint32_t pub_msg_len);
+
+/**
+ * @brief Decode a received publish packet.
+ * @param version Protocol version.
+ * @param msg Publish packet received.
  * @param bytes_received Number of bytes received.
+ * @param pub Decoded publish.
  * @return Return 0 in case of success otherwise -1.
  */
-int mqtt_prot_puback(const uint8_t *msg, int bytes_received);
+int mqtt_prot_publish_decode(uint8_t version,
+                                const uint8_t *msg,
+                                int bytes_received,
+                                mqtt_prot_publish_msg *pub);
 
-/* TODO:
-void mqtt_pubrec();
+/**
+ * @brief PUBACK, PUBREC, PUBREL and PUBCOMP share the same layout:
+ * Byte 1: Control Header, PUBREL has 0b0010 as flags.
+ * Byte 2: Remaining length.
+ * Bytes 3 and 4: Packet identifier.
+ * MQTT v5 only: reason code, omitted when success.
+ * @param to_send Formated packet.
+ * @param to_send_len to_send buffer length.
+ * @param version Protocol version.
+ * @param type MQTT_PROT_PUBACK, MQTT_PROT_PUBREC, MQTT_PROT_PUBREL or
+ * MQTT_PROT_PUBCOMP.
+ * @param packet_id Packet identifier being answered.
+ * @param reason_code MQTT v5 reason code.
+ * @return Size in bytes to send.
+ */
+int mqtt_prot_pubresp(uint8_t *to_send,
+                        int to_send_len,
+                        uint8_t version,
+                        uint8_t type,
+                        uint16_t packet_id,
+                        uint8_t reason_code);
 
-void mqtt_pubrel();
+/**
+ * @brief Decode PUBACK, PUBREC, PUBREL or PUBCOMP packets.
+ * @param version Protocol version.
+ * @param type Expected packet type.
+ * @param msg Packet received.
+ * @param bytes_received Number of bytes received.
+ * @param packet_id Packet identifier acknowledged.
+ * @return Reason code, 0 in case of success, otherwise -1 if malformed.
+ */
+int mqtt_prot_pubresp_decode(uint8_t version,
+                                uint8_t type,
+                                const uint8_t *msg,
+                                int bytes_received,
+                                uint16_t *packet_id);
 
-void mqtt_pubcomp();
-*/
+/**
+ * @brief Answer packet for publish request.
+ * @param version Protocol version.
+ * @param msg Puback packet received.
+ * @param bytes_received Number of bytes received.
+ * @param packet_id Packet identifier acknowledged.
+ * @return Return 0 in case of success otherwise -1.
+ */
+int mqtt_prot_puback(uint8_t version,
+                        const uint8_t *msg,
+                        int bytes_received,
+                        uint16_t *packet_id);
 
 /**
  * @brief
  * Byte 1: Control Header.
- * Byte 2: Remaining length of Variable Header + Payload.
- * Byte 3: Packet Identifier MSB.
- * Byte 4: Packet Identifier LSB.
- * Following bytes are destinated for 2 bytes topic size, n bytes topic and 
- * 1 byte QoS.
+ * Bytes 2 to 5: Remaining length of Variable Header + Payload.
+ * 16 bit packet identifier.
+ * MQTT v5 only: subscribe properties, always empty.
+ * Following bytes are destinated for 2 bytes topic size, n bytes topic and
+ * 1 byte QoS, for each filter.
+ * When to_send is given, as many filters as fit in to_send_len are encoded,
+ * so a large set is sent as several packets by calling again with the
+ * remaining filters.
+ * @param to_send Formated 'subscribe' protocol packet.
+ * @param to_send_len to_send buffer length, the largest packet to build.
+ * @param version Protocol version.
+ * @param packet_id Packet identifier.
  * @param params mqtt_subscribe_params pointer, contains topic and QoS values.
  * @param nbParams params array size.
- * @param to_send Formated 'subscribe' protocol packet.
- * @return Number of bytes to send
+ * @param nb_encoded Number of filters in the packet, may be NULL.
+ * @return Number of bytes to send or -1 if not even one filter fits.
  */
-int mqtt_prot_subscribe(mqtt_subs_params *params,
-                        uint8_t nbParams,
-                        uint8_t *to_send);
+int mqtt_prot_subscribe(uint8_t *to_send,
+                        int to_send_len,
+                        uint8_t version,
+                        uint16_t packet_id,
+                        const mqtt_subs_params *params,
+                        int nbParams,
+                        int *nb_encoded);
 
 /**
- * @brief Answer packet for subscribe request.
+ * @brief Answer packet for subscribe request. Holds one return code per
+ * filter of the request: the granted QoS or 0x80 and above on failure.
+ * @param version Protocol version.
  * @param msg Suback packet received
  * @param bytes_received Number of bytes received
- * @return Return 0 in case of success otherwise -1.
+ * @param packet_id Packet identifier acknowledged, may be NULL.
+ * @param codes Return codes, may be NULL.
+ * @param codes_len codes array size.
+ * @return Number of return codes in the packet or -1 if malformed.
  */
-int mqtt_prot_suback(const uint8_t *msg, int bytes_received);
+int mqtt_prot_suback(uint8_t version,
+                        const uint8_t *msg,
+                        int bytes_received,
+                        uint16_t *packet_id,
+                        uint8_t *codes,
+                        int codes_len);
 
 /**
- * @brief
- * @param params mqtt_subscribe_params pointer, contains topic and QoS values.
- * @param nbParams params array size.
+ * @brief Same layout as subscribe without the QoS byte.
  * @param to_send Formated 'unsubscribe' protocol packet.
- * @return Number of bytes to send.
+ * @param to_send_len to_send buffer length, the largest packet to build.
+ * @param version Protocol version.
+ * @param packet_id Packet identifier.
+ * @param params mqtt_subscribe_params pointer, contains topic values.
+ * @param nbParams params array size.
+ * @param nb_encoded Number of filters in the packet, may be NULL.
+ * @return Number of bytes to send or -1 if not even one filter fits.
  */
-int mqtt_prot_unsubscribe(mqtt_subs_params *params,
+int mqtt_prot_unsubscribe(uint8_t *to_send,
+                            int to_send_len,
+                            uint8_t version,
+                            uint16_t packet_id,
+                            const mqtt_subs_params *params,
                             int nbParams,
-                            uint8_t *to_send);
+                            int *nb_encoded);
 
 /**
- * @brief Answer packet for unsubscribe request.
+ * @brief Answer packet for unsubscribe request. With MQTT v5 it holds one
+ * reason code per filter, 0x80 and above on failure.
+ * @param version Protocol version.
  * @param msg Unsuback packet received.
  * @param bytes_received Number of bytes received
- * @return Return 1 in case of success otherwise -1.
+ * @param packet_id Packet identifier acknowledged, may be NULL.
+ * @param codes Reason codes, may be NULL.
+ * @param codes_len codes array size.
+ * @return Number of reason codes in the packet or -1 if malformed.
  */
-int mqtt_prot_unsuback(const uint8_t *msg, int bytes_received);
-
-/* TODO:
-void mqtt_pingreq();
+int mqtt_prot_unsuback(uint8_t version,
+                        const uint8_t *msg,
+                        int bytes_received,
+                        uint16_t *packet_id,
+                        uint8_t *codes,
+                        int codes_len);
 
-void mqtt_pingresp();
-*/
+/**
+ * @brief
+ * Byte 1: Control Header.
+ * Byte 2: Remaining length, always 0.
+ * @param to_send Formated 'pingreq' protocol packet.
+ * @return Number of bytes to send.
+ */
+int mqtt_prot_pingreq(uint8_t *to_send);
 
 /**
  * @brief
+ * Byte 1: Control Header.
+ * Byte 2: Remaining length.
+ * MQTT v5 only: reason code, omitted for a normal disconnection.
  * @param to_send Formated 'disconnect' protocol packet.
+ * @param version Protocol version.
+ * @param reason_code MQTT v5 reason code.
  * @return Number of bytes to send.
  */
-int mqtt_prot_disconnect(uint8_t *to_send);
+int mqtt_prot_disconnect(uint8_t *to_send, uint8_t version, uint8_t reason_code);
 
 #endif /* _MQTT_PROT_H_ */
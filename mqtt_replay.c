@@ -0,0 +1,298 @@
+/**
+ * @file mqtt_replay.c
+ * @brief Replay the publishes of a capture to a broker, see mqtt_capture.h,
+ * and report the rate reached and the ack latency.
+ *
+ * $ ./mqtt_replay <capture> <broker url> <port> [connections] [speed]
+ * speed: 1 for the captured pace (default), 2 for twice as fast, 0 for as
+ * fast as possible.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+
+#include "mqtt.h"
+#include "mqtt_prot.h"
+#include "mqtt_alias.h"
+#include "mqtt_capture.h"
+
+/* Publishes sent between two looks at the acks. */
+#define REPLAY_BATCH 64
+/* Time waiting for the last acks. */
+#define REPLAY_DRAIN_MS 10000
+#define REPLAY_CONNS_MAX 1024
+
+static int *conns;
+static int conns_len;
+/* Send time of each publish, to measure its ack latency. */
+static long *sent_us;
+static uint32_t *latencies;
+static int acked;
+static int failed;
+/* Topic aliases of the captured connections, by socket handler. */
+static mqtt_alias_table *aliases[UINT16_MAX + 1];
+
+static long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void publish_done(void *user_data, int result)
+{
+	long i = (long)(intptr_t)user_data;
+
+	if (result < 0) {
+		failed++;
+		return;
+	}
+	latencies[acked++] = (uint32_t)(now_us() - sent_us[i]);
+}
+
+/* Read the acks received on every connection. */
+static int replay_poll(void)
+{
+	for (int i = 0; i < conns_len; i++) {
+		if (mqtt_loop(conns[i], 0) < 0) {
+			printf("Connection %d lost\n", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Keep reading acks until the time a publish was captured at. */
+static int replay_wait(long due_us)
+{
+	struct timespec ts;
+	long wait_us;
+
+	for (;;) {
+		if (replay_poll() < 0)
+			return -1;
+		wait_us = due_us - now_us();
+		if (wait_us <= 0)
+			return 0;
+		if (wait_us > 1000)
+			wait_us = 1000;
+		ts.tv_sec = 0;
+		ts.tv_nsec = wait_us * 1000L;
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Decode a captured publish, resolving the topic alias of its connection. */
+static int replay_decode(const mqtt_capture_record *rec, const uint8_t *pkt,
+							mqtt_prot_publish_msg *pub)
+{
+	mqtt_alias_table **table = &aliases[rec->conn];
+
+	if (mqtt_prot_publish_decode(rec->version, pkt, (int)rec->len, pub) < 0)
+		return -1;
+	if (!(pub->props.present & MQTT_PROT_PROP_BIT(MQTT_PROP_TOPIC_ALIAS)))
+		return 0;
+
+	if (*table == NULL) {
+		*table = (mqtt_alias_table *)calloc(1, sizeof(mqtt_alias_table));
+		if (*table == NULL || mqtt_alias_init(*table, UINT16_MAX) < 0)
+			return -1;
+	}
+	return mqtt_alias_inbound(*table, pub->props.topic_alias, &pub->topic,
+								&pub->topic_len);
+}
+
+static int is_publish(const mqtt_capture_record *rec, const uint8_t *pkt)
+{
+	return rec->dir == MQTT_CAPTURE_OUT && rec->len > 0 &&
+			(pkt[0] >> 4) == MQTT_PROT_PUBLISH;
+}
+
+static void report(int sent, int skipped, long elapsed_us, uint64_t bytes)
+{
+	double secs = elapsed_us / 1e6;
+	double sum = 0;
+
+	printf("Replayed %d publishes on %d connections in %.3f s", sent,
+			conns_len, secs);
+	if (skipped > 0)
+		printf(", %d skipped", skipped);
+	printf("\n");
+	if (secs > 0)
+		printf(" Rate: %.0f msg/s, %.2f MB/s\n", sent / secs,
+				bytes / secs / (1024 * 1024));
+
+	printf(" Acks: %d, failed %d\n", acked, failed);
+	if (acked == 0)
+		return;
+
+	qsort(latencies, acked, sizeof(uint32_t), cmp_u32);
+	for (int i = 0; i < acked; i++)
+		sum += latencies[i];
+	printf(" Ack latency (us): min %u avg %.0f p50 %u p99 %u max %u\n",
+			latencies[0], sum / acked, latencies[acked / 2],
+			latencies[(int)((acked - 1) * 0.99)], latencies[acked - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+	mqtt_connect_options opts = { 0 };
+	mqtt_flow_stats flow;
+	mqtt_capture_reader *r;
+	mqtt_capture_record rec;
+	mqtt_prot_publish_msg pub;
+	const uint8_t *pkt;
+	char client_id[32];
+	char topic[UINT16_MAX + 1];
+	uint64_t first_us = 0, bytes = 0;
+	long start_us, due_us, deadline_us;
+	int publishes = 0, sent = 0, skipped = 0, ret = -1;
+	mqtt_publish_flags flags;
+	int pending, n;
+	double speed;
+	int sock;
+
+	if (argc < 4) {
+		printf("Usage: %s <capture> <broker url> <port> [connections] "
+				"[speed]\n", argv[0]);
+		return -1;
+	}
+	conns_len = (argc > 4) ? atoi(argv[4]) : 1;
+	speed = (argc > 5) ? atof(argv[5]) : 1.0;
+	if (conns_len < 1 || conns_len > REPLAY_CONNS_MAX || speed < 0) {
+		printf("Bad connections or speed\n");
+		return -1;
+	}
+
+	r = mqtt_capture_open(argv[1]);
+	if (r == NULL)
+		return -1;
+
+	/* Size the latency records, and take the pace and protocol version
+	 * from the first publish. */
+	while ((n = mqtt_capture_next(r, &rec, &pkt)) == 1) {
+		if (!is_publish(&rec, pkt))
+			continue;
+		if (publishes++ == 0) {
+			first_us = rec.time_us;
+			opts.version = (mqtt_version)rec.version;
+		}
+	}
+	if (n < 0) {
+		printf("Corrupted capture\n");
+		goto finish;
+	}
+	if (publishes == 0) {
+		printf("No publish captured\n");
+		goto finish;
+	}
+	mqtt_capture_rewind(r);
+
+	sent_us = (long *)calloc(publishes, sizeof(long));
+	latencies = (uint32_t *)calloc(publishes, sizeof(uint32_t));
+	conns = (int *)calloc(conns_len, sizeof(int));
+	if (sent_us == NULL || latencies == NULL || conns == NULL)
+		goto finish;
+
+	printf("Replaying %d publishes to %s:%s on %d connections, ", publishes,
+			argv[2], argv[3], conns_len);
+	if (speed > 0)
+		printf("speed x%g\n", speed);
+	else
+		printf("maximum speed\n");
+	for (int i = 0; i < conns_len; i++)
+		conns[i] = -1;
+	for (int i = 0; i < conns_len; i++) {
+		snprintf(client_id, sizeof(client_id), "replay%d%d", (int)getpid(), i);
+		/* Options given, so the replay never goes through a multiplexer. */
+		conns[i] = mqtt_connect_opts(argv[2], atoi(argv[3]), client_id,
+										CONNECT_FLAG_CLEAN_SESSION, 60, NULL,
+										NULL, &opts);
+		if (conns[i] < 0) {
+			printf("MQTT connect failure!\n");
+			goto finish;
+		}
+	}
+
+	start_us = now_us();
+	while (mqtt_capture_next(r, &rec, &pkt) == 1) {
+		if (!is_publish(&rec, pkt))
+			continue;
+		if (replay_decode(&rec, pkt, &pub) < 0 || pub.topic_len == 0) {
+			skipped++;
+			continue;
+		}
+
+		if (speed > 0) {
+			due_us = start_us + (long)((rec.time_us - first_us) / speed);
+			if (replay_wait(due_us) < 0)
+				goto finish;
+		} else if (sent % REPLAY_BATCH == 0 && replay_poll() < 0) {
+			goto finish;
+		}
+
+		/* Spread over the connections in turn. */
+		sock = conns[sent % conns_len];
+		/* Captured payloads are already framed, compressed or escaped. */
+		flags = (mqtt_publish_flags)((pub.flags & 0x07) | PUBLISH_FLAG_AS_IS);
+		while (mqtt_async_ready(sock, flags) == 0) {
+			if (mqtt_loop(sock, 1) < 0)
+				goto finish;
+		}
+
+		memcpy(topic, pub.topic, pub.topic_len);
+		topic[pub.topic_len] = '\0';
+		sent_us[sent] = now_us();
+		if (mqtt_publish_async(sock, flags, topic, pub.payload,
+								(int)pub.payload_len, publish_done,
+								(void *)(intptr_t)sent) < 0)
+			failed++;
+		bytes += pub.payload_len;
+		sent++;
+	}
+
+	/* Wait for the last acks. */
+	deadline_us = now_us() + REPLAY_DRAIN_MS * 1000L;
+	do {
+		pending = 0;
+		for (int i = 0; i < conns_len; i++) {
+			if (mqtt_flush(conns[i]) < 0 || mqtt_loop(conns[i], 1) < 0)
+				goto finish;
+			pending += mqtt_async_pending(conns[i]);
+		}
+	} while (pending > 0 && now_us() < deadline_us);
+
+	report(sent, skipped, now_us() - start_us, bytes);
+	if (mqtt_get_flow_stats(conns[0], &flow) == 0)
+		printf(" Window: %d, ack rtt %ld us (lowest %ld us)\n", flow.window,
+				flow.srtt_us, flow.min_rtt_us);
+	ret = 0;
+
+finish:
+	for (int i = 0; conns != NULL && i < conns_len; i++) {
+		if (conns[i] >= 0)
+			mqtt_disconnect(conns[i]);
+	}
+	for (int i = 0; i <= UINT16_MAX; i++) {
+		if (aliases[i] != NULL)
+			mqtt_alias_free(aliases[i]);
+		free(aliases[i]);
+	}
+	mqtt_capture_close(r);
+	free(conns);
+	free(sent_us);
+	free(latencies);
+	return ret;
+}
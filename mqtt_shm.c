@@ -0,0 +1,540 @@
+/**
+ * @file mqtt_shm.c
+ * @brief Shared memory route to a local multiplexer daemon implementation.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+#include "stdio.h"
+#include "time.h"
+
+#include "mqtt_shm.h"
+
+#define ENABLE_TRACES
+#include "trace.h"
+
+#ifdef MQTT_WITH_SHM
+
+#include "errno.h"
+#include "limits.h"
+#include "poll.h"
+#include "unistd.h"
+#include "stdatomic.h"
+#include "sys/mman.h"
+#include "sys/socket.h"
+#include "sys/stat.h"
+#include "sys/syscall.h"
+#include "sys/un.h"
+#include "sys/eventfd.h"
+#include "linux/futex.h"
+#include "linux/memfd.h"
+
+/* Time for the daemon to connect to the broker. */
+#define SHM_CONNECT_TIMEOUT_MS 10000
+/* Waits are split to notice a daemon gone meanwhile. */
+#define SHM_WAIT_SLICE_MS 100
+
+/*
+ * Ring shared by a client and the daemon. head and tail count the bytes
+ * written and consumed, data is indexed modulo size. wake is a futex word
+ * bumped by the daemon when it consumed records or completed a publish,
+ * done_seq and failed_seq the last publish completed and failed.
+ */
+typedef struct {
+	_Alignas(64) _Atomic uint64_t head;
+	_Atomic uint32_t client_waiting;
+	_Alignas(64) _Atomic uint64_t tail;
+	_Atomic uint32_t daemon_sleeping;
+	_Atomic uint32_t wake;
+	_Atomic uint32_t done_seq;
+	_Atomic uint32_t failed_seq;
+	_Alignas(64) uint8_t data[];
+} mqtt_shm_ring;
+
+struct mqtt_shm {
+	int sock;
+	int efd;
+	mqtt_shm_ring *ring;
+	size_t map_len;
+	uint32_t size;
+	uint32_t seq;
+};
+
+struct mqtt_shm_peer {
+	mqtt_shm_ring *ring;
+	size_t map_len;
+	uint32_t size;
+	/* Length of the record returned by the last peek. */
+	uint32_t peeked;
+	/* Topic of the last peek, copied out of the client memory. */
+	char topic[UINT16_MAX + 1];
+};
+
+static char *path;
+static int path_set;
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int futex_wait(_Atomic uint32_t *word, uint32_t value, int timeout_ms)
+{
+	struct timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000L
+	};
+
+	return (int)syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, value, &ts,
+						NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word)
+{
+	syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static size_t ring_map_len(uint32_t size)
+{
+	return sizeof(mqtt_shm_ring) + size;
+}
+
+static const char *shm_path(void)
+{
+	const char *env;
+
+	if (path_set)
+		return path;
+
+	env = getenv("MQTT_MULTIPLEXER");
+	if (env != NULL && strcmp(env, "off") == 0)
+		return NULL;
+
+	return (env != NULL && env[0] != '\0') ? env : MQTT_SHM_SOCKET;
+}
+
+void mqtt_shm_set_path(const char *new_path)
+{
+	free(path);
+	path = new_path ? strdup(new_path) : NULL;
+	path_set = 1;
+}
+
+/* Send the registration with the ring memory and the eventfd. */
+static int send_hello(int sock, const mqtt_shm_hello *hello, int memfd,
+						int efd)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = {
+		.iov_base = (void *)hello,
+		.iov_len = sizeof(mqtt_shm_hello)
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+	struct cmsghdr *cmsg;
+	int fds[2] = { memfd, efd };
+
+	memset(control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	return (sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(*hello)) ?
+			0 : -1;
+}
+
+static int copy_field(char *dst, size_t dst_len, const char *src)
+{
+	if (src == NULL)
+		return 0;
+	if (strlen(src) >= dst_len)
+		return -1;
+
+	strcpy(dst, src);
+	return 0;
+}
+
+int mqtt_shm_connect(const char *hostname, int port, const char *username,
+						const char *password, mqtt_shm **shm)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct pollfd pfd = { .events = POLLIN };
+	const char *sock_path = shm_path();
+	mqtt_shm_hello hello;
+	mqtt_shm *c = NULL;
+	int memfd = -1;
+	uint8_t status;
+
+	if (sock_path == NULL || strlen(sock_path) >= sizeof(addr.sun_path))
+		return -1;
+
+	memset(&hello, 0, sizeof(hello));
+	hello.version = MQTT_SHM_VERSION;
+	hello.ring_size = MQTT_SHM_RING_SIZE;
+	hello.port = (uint16_t)port;
+	if (copy_field(hello.hostname, sizeof(hello.hostname), hostname) < 0 ||
+		copy_field(hello.username, sizeof(hello.username), username) < 0 ||
+		copy_field(hello.password, sizeof(hello.password), password) < 0)
+		return -1;
+
+	c = (mqtt_shm *)calloc(1, sizeof(mqtt_shm));
+	if (c == NULL)
+		return -1;
+	c->efd = -1;
+	c->size = MQTT_SHM_RING_SIZE;
+	c->map_len = ring_map_len(c->size);
+
+	/* No daemon is the usual case, not an error. */
+	c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	strcpy(addr.sun_path, sock_path);
+	if (c->sock < 0 ||
+		connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		print_dbg("No multiplexer at %s", sock_path);
+		goto fail;
+	}
+
+	memfd = (int)syscall(SYS_memfd_create, "simple_mqtt_ring", MFD_CLOEXEC);
+	c->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (memfd < 0 || c->efd < 0 || ftruncate(memfd, c->map_len) < 0)
+		goto fail;
+	c->ring = (mqtt_shm_ring *)mmap(NULL, c->map_len, PROT_READ | PROT_WRITE,
+									MAP_SHARED, memfd, 0);
+	if (c->ring == MAP_FAILED) {
+		c->ring = NULL;
+		goto fail;
+	}
+
+	if (send_hello(c->sock, &hello, memfd, c->efd) < 0)
+		goto fail;
+	close(memfd);
+	memfd = -1;
+
+	pfd.fd = c->sock;
+	if (poll(&pfd, 1, SHM_CONNECT_TIMEOUT_MS) <= 0 ||
+		recv(c->sock, &status, 1, 0) != 1 || status != 0) {
+		print_err("Multiplexer couldn't connect to %s:%d", hostname, port);
+		goto fail;
+	}
+
+	print_dbg("Publishing to %s:%d through %s", hostname, port, sock_path);
+	*shm = c;
+	return c->sock;
+fail:
+	if (memfd >= 0)
+		close(memfd);
+	mqtt_shm_close(c);
+	return -1;
+}
+
+static int daemon_gone(mqtt_shm *c)
+{
+	struct pollfd pfd = { .fd = c->sock, .events = POLLIN };
+	uint8_t byte;
+
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+
+	return recv(c->sock, &byte, 1, MSG_DONTWAIT) <= 0;
+}
+
+/* Room for len bytes and, if seq is not 0, publish seq completed. */
+static int ring_ready(mqtt_shm *c, uint32_t len, uint32_t seq)
+{
+	uint64_t used = atomic_load(&c->ring->head) - atomic_load(&c->ring->tail);
+
+	if (c->size - used < len)
+		return 0;
+
+	return seq == 0 || (int32_t)(atomic_load(&c->ring->done_seq) - seq) >= 0;
+}
+
+static int ring_wait(mqtt_shm *c, uint32_t len, uint32_t seq, long deadline_ms)
+{
+	mqtt_shm_ring *r = c->ring;
+	uint32_t wake;
+	long left;
+
+	for (;;) {
+		wake = atomic_load(&r->wake);
+		if (ring_ready(c, len, seq))
+			return 0;
+
+		left = deadline_ms - now_ms();
+		if (left <= 0 || daemon_gone(c))
+			return -1;
+		if (left > SHM_WAIT_SLICE_MS)
+			left = SHM_WAIT_SLICE_MS;
+
+		/* Checked again once announced, the daemon looks at the flag after
+		 * bumping wake. */
+		atomic_store(&r->client_waiting, 1);
+		if (!ring_ready(c, len, seq))
+			futex_wait(&r->wake, wake, (int)left);
+		atomic_store(&r->client_waiting, 0);
+	}
+}
+
+int mqtt_shm_publish(mqtt_shm *c, uint8_t flags, const char *topic,
+						int topic_len, const uint8_t *payload, int payload_len,
+						int timeout_ms)
+{
+	long deadline_ms = now_ms() + timeout_ms;
+	mqtt_shm_record rec;
+	uint64_t head;
+	uint32_t len, pos, pad;
+	uint8_t *at;
+
+	if (c == NULL || topic_len < 0 || payload_len < 0)
+		return -1;
+
+	len = (sizeof(rec) + topic_len + 1 + payload_len + MQTT_SHM_ALIGN - 1) &
+			~(uint32_t)(MQTT_SHM_ALIGN - 1);
+	if ((uint64_t)sizeof(rec) + topic_len + 1 + payload_len > c->size / 2) {
+		print_err("Message of %d bytes too large for the multiplexer",
+					payload_len);
+		return -1;
+	}
+
+	/* Records are contiguous, the end of the ring is skipped if too short. */
+	head = atomic_load_explicit(&c->ring->head, memory_order_relaxed);
+	pos = (uint32_t)head & (c->size - 1);
+	pad = (c->size - pos < len) ? c->size - pos : 0;
+	if (ring_wait(c, pad + len, 0, deadline_ms) < 0) {
+		print_err("Multiplexer ring full");
+		return -1;
+	}
+
+	if (pad > 0) {
+		memset(&rec, 0, sizeof(rec));
+		rec.len = pad;
+		rec.flags = MQTT_SHM_WRAP;
+		memcpy(&c->ring->data[pos], &rec, sizeof(rec));
+		pos = 0;
+	}
+
+	c->seq++;
+	if (c->seq == 0)
+		c->seq = 1;
+	memset(&rec, 0, sizeof(rec));
+	rec.len = len;
+	rec.seq = c->seq;
+	rec.payload_len = payload_len;
+	rec.topic_len = topic_len;
+	rec.flags = flags;
+	at = &c->ring->data[pos];
+	memcpy(at, &rec, sizeof(rec));
+	memcpy(at + sizeof(rec), topic, topic_len);
+	at[sizeof(rec) + topic_len] = '\0';
+	if (payload_len > 0)
+		memcpy(at + sizeof(rec) + topic_len + 1, payload, payload_len);
+
+	atomic_store(&c->ring->head, head + pad + len);
+	if (atomic_load(&c->ring->daemon_sleeping)) {
+		uint64_t one = 1;
+
+		if (write(c->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			return -1;
+	}
+
+	if (((flags >> 1) & 0x03) == 0)
+		return 0;
+
+	if (ring_wait(c, 0, rec.seq, deadline_ms) < 0) {
+		print_err("No ack from the multiplexer");
+		return -1;
+	}
+
+	return (atomic_load(&c->ring->failed_seq) == rec.seq) ? -1 : 0;
+}
+
+int mqtt_shm_wait(mqtt_shm *c, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = c->sock, .events = POLLIN };
+
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+		return 0;
+
+	return daemon_gone(c) ? -1 : 0;
+}
+
+void mqtt_shm_close(mqtt_shm *c)
+{
+	if (c == NULL)
+		return;
+
+	if (c->ring != NULL) {
+		if (ring_wait(c, c->size, 0, now_ms() + SHM_CONNECT_TIMEOUT_MS) < 0)
+			print_wrn("Closing with messages not yet sent");
+		munmap(c->ring, c->map_len);
+	}
+	if (c->efd >= 0)
+		close(c->efd);
+	if (c->sock >= 0)
+		close(c->sock);
+	free(c);
+}
+
+mqtt_shm_peer *mqtt_shm_peer_open(int memfd, uint32_t size)
+{
+	mqtt_shm_peer *p;
+	struct stat st;
+
+	/* At least room for two largest records of a small message. */
+	if (size < 4096 || size > (1U << 30) || (size & (size - 1)) != 0 ||
+		fstat(memfd, &st) < 0 || (size_t)st.st_size < ring_map_len(size))
+		return NULL;
+
+	p = (mqtt_shm_peer *)calloc(1, sizeof(mqtt_shm_peer));
+	if (p == NULL)
+		return NULL;
+
+	p->size = size;
+	p->map_len = ring_map_len(size);
+	p->ring = (mqtt_shm_ring *)mmap(NULL, p->map_len, PROT_READ | PROT_WRITE,
+									MAP_SHARED, memfd, 0);
+	if (p->ring == MAP_FAILED) {
+		free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void mqtt_shm_peer_close(mqtt_shm_peer *p)
+{
+	if (p == NULL)
+		return;
+
+	munmap(p->ring, p->map_len);
+	free(p);
+}
+
+int mqtt_shm_peer_peek(mqtt_shm_peer *p, mqtt_shm_record *rec,
+						const char **topic, const uint8_t **payload)
+{
+	mqtt_shm_ring *r = p->ring;
+	uint64_t head, tail;
+	uint32_t pos;
+	const uint8_t *at;
+
+	for (;;) {
+		head = atomic_load(&r->head);
+		tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		if (head == tail)
+			return 0;
+		if (head - tail > p->size)
+			return -1;
+
+		pos = (uint32_t)tail & (p->size - 1);
+		at = &r->data[pos];
+		memcpy(rec, at, sizeof(mqtt_shm_record));
+		if (rec->len < sizeof(mqtt_shm_record) ||
+			rec->len % MQTT_SHM_ALIGN != 0 || rec->len > p->size - pos ||
+			rec->len > head - tail)
+			return -1;
+
+		if (rec->flags & MQTT_SHM_WRAP) {
+			atomic_store(&r->tail, tail + rec->len);
+			continue;
+		}
+
+		if ((uint64_t)sizeof(mqtt_shm_record) + rec->topic_len + 1 +
+			rec->payload_len > rec->len)
+			return -1;
+
+		/* The client may still write the record, the topic is used from a
+		 * copy terminated here. */
+		memcpy(p->topic, at + sizeof(mqtt_shm_record), rec->topic_len);
+		p->topic[rec->topic_len] = '\0';
+		if (memchr(p->topic, '\0', rec->topic_len) != NULL)
+			return -1;
+
+		p->peeked = rec->len;
+		*topic = p->topic;
+		*payload = at + sizeof(mqtt_shm_record) + rec->topic_len + 1;
+		return 1;
+	}
+}
+
+void mqtt_shm_peer_pop(mqtt_shm_peer *p)
+{
+	atomic_store(&p->ring->tail, atomic_load(&p->ring->tail) + p->peeked);
+	p->peeked = 0;
+}
+
+int mqtt_shm_peer_sleep(mqtt_shm_peer *p, int sleeping)
+{
+	atomic_store(&p->ring->daemon_sleeping, (uint32_t)sleeping);
+
+	return atomic_load(&p->ring->head) != atomic_load(&p->ring->tail);
+}
+
+void mqtt_shm_peer_done(mqtt_shm_peer *p, uint32_t seq, int failed)
+{
+	if (failed)
+		atomic_store(&p->ring->failed_seq, seq);
+	atomic_store(&p->ring->done_seq, seq);
+	mqtt_shm_peer_wake(p);
+}
+
+void mqtt_shm_peer_wake(mqtt_shm_peer *p)
+{
+	atomic_fetch_add(&p->ring->wake, 1);
+	if (atomic_load(&p->ring->client_waiting))
+		futex_wake(&p->ring->wake);
+}
+
+#else /* MQTT_WITH_SHM */
+
+void mqtt_shm_set_path(const char *new_path)
+{
+	(void)new_path;
+}
+
+int mqtt_shm_connect(const char *hostname, int port, const char *username,
+						const char *password, mqtt_shm **shm)
+{
+	(void)hostname;
+	(void)port;
+	(void)username;
+	(void)password;
+	(void)shm;
+	return -1;
+}
+
+int mqtt_shm_publish(mqtt_shm *c, uint8_t flags, const char *topic,
+						int topic_len, const uint8_t *payload, int payload_len,
+						int timeout_ms)
+{
+	(void)c;
+	(void)flags;
+	(void)topic;
+	(void)topic_len;
+	(void)payload;
+	(void)payload_len;
+	(void)timeout_ms;
+	return -1;
+}
+
+int mqtt_shm_wait(mqtt_shm *c, int timeout_ms)
+{
+	(void)c;
+	(void)timeout_ms;
+	return -1;
+}
+
+void mqtt_shm_close(mqtt_shm *c)
+{
+	(void)c;
+}
+
+#endif /* MQTT_WITH_SHM */
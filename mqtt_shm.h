@@ -0,0 +1,183 @@
+/**
+ * @file mqtt_shm.h
+ * @brief Shared memory route to a local multiplexer daemon, see mqtt_mux.c.
+ *
+ * A client process creates a ring in a memfd and registers it with the
+ * daemon over a Unix socket, passing the memfd and an eventfd. The daemon
+ * connects to the broker once per broker host, port and credentials and
+ * publishes what every registered ring carries. The Unix socket stays open
+ * for the client lifetime, only to detect when either side goes away.
+ *
+ * Each ring has one producer, the client, and one consumer, the daemon.
+ * Records are written in place in the shared memory and their payload is
+ * published from there, the daemon copies only the topic. The client
+ * writes to the eventfd only when the daemon sleeps, and waits on a futex
+ * in the ring when it is full or for the broker ack of a QoS 1 or 2
+ * publish.
+ *
+ * Linux only, available when built with memfd_create and futex support.
+ */
+
+#ifndef _MQTT_SHM_H_
+#define _MQTT_SHM_H_
+
+#include "stdint.h"
+
+#if defined(__linux__)
+#define MQTT_WITH_SHM
+#endif
+
+/* Unix socket of the daemon, MQTT_MULTIPLEXER in the environment sets
+ * another one, "off" disables the shared memory route. */
+#define MQTT_SHM_SOCKET "/tmp/simple_mqtt_mux.sock"
+/* Ring data size, a power of 2. Messages are limited to half of it. */
+#define MQTT_SHM_RING_SIZE (1024 * 1024)
+#define MQTT_SHM_VERSION 1
+
+#define MQTT_SHM_HOST_LEN 256
+#define MQTT_SHM_CRED_LEN 128
+
+/* Record header, followed by the NUL terminated topic then the payload,
+ * padded to MQTT_SHM_ALIGN bytes. A record with MQTT_SHM_WRAP in flags
+ * fills the end of the ring and is skipped. */
+#define MQTT_SHM_ALIGN 16
+#define MQTT_SHM_WRAP 0x80
+
+typedef struct {
+    uint32_t len;
+    uint32_t seq;
+    uint32_t payload_len;
+    uint16_t topic_len;
+    uint8_t flags;
+    uint8_t reserved;
+} mqtt_shm_record;
+
+/* Registration sent by the client with the memfd and eventfd. */
+typedef struct {
+    uint32_t version;
+    uint32_t ring_size;
+    uint16_t port;
+    char hostname[MQTT_SHM_HOST_LEN];
+    char username[MQTT_SHM_CRED_LEN];
+    char password[MQTT_SHM_CRED_LEN];
+} mqtt_shm_hello;
+
+typedef struct mqtt_shm mqtt_shm;
+typedef struct mqtt_shm_peer mqtt_shm_peer;
+
+/**
+ * @brief Set the daemon socket, overriding MQTT_MULTIPLEXER.
+ * @param path Unix socket path, NULL to disable the shared memory route.
+ * @return None.
+ */
+void mqtt_shm_set_path(const char *path);
+
+/**
+ * @brief Register with the daemon if one is running. Waits until the daemon
+ * is connected to the broker.
+ * @param hostname Broker hostname.
+ * @param port Broker port.
+ * @param username Username, NULL for none.
+ * @param password Password, NULL for none.
+ * @param shm Receives the client state.
+ * @return Handler, a file descriptor unique to this registration, or -1 if
+ * no daemon is available or it could not connect.
+ */
+int mqtt_shm_connect(const char *hostname, int port, const char *username,
+                        const char *password, mqtt_shm **shm);
+
+/**
+ * @brief Hand a message to the daemon. QoS 0 messages return once in the
+ * ring, QoS 1 and 2 once the broker acknowledged them.
+ * @param shm Client state.
+ * @param flags Publish flags.
+ * @param topic Topic name.
+ * @param topic_len Topic name length.
+ * @param payload Message.
+ * @param payload_len Message length.
+ * @param timeout_ms Maximum time waiting for room or for the ack.
+ * @return 0 if success or -1 if fail.
+ */
+int mqtt_shm_publish(mqtt_shm *shm, uint8_t flags, const char *topic,
+                        int topic_len, const uint8_t *payload, int payload_len,
+                        int timeout_ms);
+
+/**
+ * @brief Check the daemon is still there, waiting up to timeout_ms.
+ * @param shm Client state.
+ * @param timeout_ms Time to wait.
+ * @return 0 if alive or -1 if the daemon closed the registration.
+ */
+int mqtt_shm_wait(mqtt_shm *shm, int timeout_ms);
+
+/**
+ * @brief Wait for queued messages to be consumed, then unregister.
+ * @param shm Client state.
+ * @return None.
+ */
+void mqtt_shm_close(mqtt_shm *shm);
+
+/**
+ * @brief Daemon side: map a ring received from a client. The client memory
+ * is not trusted, records are checked before use.
+ * @param memfd Ring memory received from the client.
+ * @param size Ring data size announced by the client.
+ * @return Peer or NULL if fail.
+ */
+mqtt_shm_peer *mqtt_shm_peer_open(int memfd, uint32_t size);
+
+/**
+ * @brief Daemon side: unmap a ring.
+ * @param peer Peer.
+ * @return None.
+ */
+void mqtt_shm_peer_close(mqtt_shm_peer *peer);
+
+/**
+ * @brief Daemon side: get the oldest record without consuming it.
+ * @param peer Peer.
+ * @param rec Receives the record header.
+ * @param topic Receives the topic, NUL terminated, copied to the peer and
+ * valid until the next peek.
+ * @param payload Receives the payload, in the client memory: only its
+ * rec->payload_len bytes are read.
+ * @return 1 if a record was found, 0 if the ring is empty or -1 if it is
+ * corrupted.
+ */
+int mqtt_shm_peer_peek(mqtt_shm_peer *peer, mqtt_shm_record *rec,
+                        const char **topic, const uint8_t **payload);
+
+/**
+ * @brief Daemon side: consume the record from mqtt_shm_peer_peek.
+ * @param peer Peer.
+ * @return None.
+ */
+void mqtt_shm_peer_pop(mqtt_shm_peer *peer);
+
+/**
+ * @brief Daemon side: announce that the daemon sleeps, so the client
+ * writes to the eventfd for the next record, or that it is awake.
+ * @param peer Peer.
+ * @param sleeping 1 before sleeping, 0 once awake.
+ * @return 1 if records are waiting, then the daemon must not sleep.
+ */
+int mqtt_shm_peer_sleep(mqtt_shm_peer *peer, int sleeping);
+
+/**
+ * @brief Daemon side: report a publish completed and wake the client if it
+ * waits.
+ * @param peer Peer.
+ * @param seq Record sequence number.
+ * @param failed 1 if the publish failed.
+ * @return None.
+ */
+void mqtt_shm_peer_done(mqtt_shm_peer *peer, uint32_t seq, int failed);
+
+/**
+ * @brief Daemon side: wake the client if it waits for room.
+ * @param peer Peer.
+ * @return None.
+ */
+void mqtt_shm_peer_wake(mqtt_shm_peer *peer);
+
+#endif /* _MQTT_SHM_H_ */
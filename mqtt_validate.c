@@ -0,0 +1,601 @@
+/**
+ * @file mqtt_validate.c
+ * @brief MQTT string, topic and client identifier validation implementation.
+ */
+
+#include "stdint.h"
+#include "string.h"
+
+#include "mqtt_validate.h"
+
+#if defined(__AVX2__)
+#include "immintrin.h"
+#define VALIDATE_BLOCK 32
+#define VALIDATE_VECTOR
+typedef __m256i utf8_vec;
+#elif defined(__SSSE3__)
+#include "tmmintrin.h"
+#define VALIDATE_BLOCK 16
+#define VALIDATE_VECTOR
+typedef __m128i utf8_vec;
+#elif defined(__SSE2__)
+#include "emmintrin.h"
+#define VALIDATE_BLOCK 16
+#define VALIDATE_VECTOR
+typedef __m128i utf8_vec;
+#else
+#define VALIDATE_BLOCK 8
+#endif
+
+/* Short blocks are padded with a character valid everywhere. */
+#define VALIDATE_PAD 'a'
+
+typedef enum {
+	CHECK_UTF8,
+	CHECK_TOPIC_NAME,
+	CHECK_TOPIC_FILTER
+} check_mode;
+
+typedef struct {
+	uint32_t high;	/* Bytes >= 0x80, part of a multi-byte sequence. */
+	uint32_t nul;	/* 0x00 bytes, never allowed. */
+	uint32_t wild;	/* '+' and '#' bytes. */
+} block_masks;
+
+static inline uint32_t low_bits(unsigned int n)
+{
+	return (n >= 32) ? 0xFFFFFFFFu : ((1u << n) - 1);
+}
+
+static inline void scan_block(const uint8_t *p, block_masks *m)
+{
+#if defined(__AVX2__)
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+	m->high = (uint32_t)_mm256_movemask_epi8(v);
+	m->nul = (uint32_t)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+	m->wild = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('#'))));
+#elif defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+	m->high = (uint32_t)_mm_movemask_epi8(v);
+	m->nul = (uint32_t)_mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	m->wild = (uint32_t)_mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('#'))));
+#else
+	m->high = m->nul = m->wild = 0;
+	for (int i = 0; i < VALIDATE_BLOCK; i++) {
+		m->high |= (uint32_t)(p[i] >> 7) << i;
+		m->nul |= (uint32_t)(p[i] == 0) << i;
+		m->wild |= (uint32_t)(p[i] == '+' || p[i] == '#') << i;
+	}
+#endif
+}
+
+static inline uint32_t alnum_block(const uint8_t *p)
+{
+#if defined(__AVX2__)
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	__m256i digit = _mm256_and_si256(
+				_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+				_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+	__m256i alpha = _mm256_and_si256(
+				_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+				_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+
+	return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(digit, alpha));
+#elif defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(
+				_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+				_mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+	__m128i alpha = _mm_and_si128(
+				_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				_mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower));
+
+	return (uint32_t)_mm_movemask_epi8(_mm_or_si128(digit, alpha));
+#else
+	uint32_t mask = 0;
+	uint8_t lower;
+
+	for (int i = 0; i < VALIDATE_BLOCK; i++) {
+		lower = p[i] | 0x20;
+		if ((p[i] >= '0' && p[i] <= '9') || (lower >= 'a' && lower <= 'z'))
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+#ifdef VALIDATE_VECTOR
+/*
+ * UTF-8 of whole blocks, each byte checked against the 3 bytes before it,
+ * the last ones of the previous block included. error gathers the errors
+ * found so far and incomplete the end of the previous block still waiting
+ * for continuation bytes.
+ */
+typedef struct {
+	utf8_vec prev;
+	utf8_vec incomplete;
+	utf8_vec error;
+} utf8_state;
+
+/* Block of bytes n places earlier. */
+#if defined(__AVX2__)
+#define UTF8_PREV(v, prev, n) _mm256_alignr_epi8(v, \
+			_mm256_permute2x128_si256(prev, v, 0x21), 16 - (n))
+#elif defined(__SSSE3__)
+#define UTF8_PREV(v, prev, n) _mm_alignr_epi8(v, prev, 16 - (n))
+#else
+#define UTF8_PREV(v, prev, n) _mm_or_si128(_mm_slli_si128(v, n), \
+			_mm_srli_si128(prev, 16 - (n)))
+#endif
+
+#if defined(__AVX2__)
+static inline utf8_vec vec_load(const uint8_t *p)
+{
+	return _mm256_loadu_si256((const __m256i *)p);
+}
+
+static inline utf8_vec vec_set1(uint8_t x)
+{
+	return _mm256_set1_epi8((char)x);
+}
+
+static inline utf8_vec vec_and(utf8_vec a, utf8_vec b)
+{
+	return _mm256_and_si256(a, b);
+}
+
+static inline utf8_vec vec_or(utf8_vec a, utf8_vec b)
+{
+	return _mm256_or_si256(a, b);
+}
+
+static inline utf8_vec vec_xor(utf8_vec a, utf8_vec b)
+{
+	return _mm256_xor_si256(a, b);
+}
+
+/* Saturating a - b of unsigned bytes. */
+static inline utf8_vec vec_subs(utf8_vec a, utf8_vec b)
+{
+	return _mm256_subs_epu8(a, b);
+}
+
+static inline int vec_any(utf8_vec a)
+{
+	return !_mm256_testz_si256(a, a);
+}
+#else
+static inline utf8_vec vec_load(const uint8_t *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline utf8_vec vec_set1(uint8_t x)
+{
+	return _mm_set1_epi8((char)x);
+}
+
+static inline utf8_vec vec_and(utf8_vec a, utf8_vec b)
+{
+	return _mm_and_si128(a, b);
+}
+
+static inline utf8_vec vec_or(utf8_vec a, utf8_vec b)
+{
+	return _mm_or_si128(a, b);
+}
+
+static inline utf8_vec vec_xor(utf8_vec a, utf8_vec b)
+{
+	return _mm_xor_si128(a, b);
+}
+
+static inline utf8_vec vec_subs(utf8_vec a, utf8_vec b)
+{
+	return _mm_subs_epu8(a, b);
+}
+
+static inline int vec_any(utf8_vec a)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) !=
+			0xFFFF;
+}
+#endif
+
+/* Error bits of the classifier, see utf8_errors. */
+#define UTF8_TOO_SHORT 0x01		/* Lead byte or ASCII after a lead byte. */
+#define UTF8_TOO_LONG 0x02		/* Continuation byte after ASCII. */
+#define UTF8_OVERLONG_3 0x04	/* E0 80..9F. */
+#define UTF8_TOO_LARGE 0x08		/* Above U+10FFFF, F4 90..BF or F5 and above. */
+#define UTF8_SURROGATE 0x10		/* ED A0..BF. */
+#define UTF8_OVERLONG_2 0x20	/* C0 or C1. */
+#define UTF8_TOO_LARGE_1000 0x40	/* F5 and above followed by 80..8F. */
+#define UTF8_OVERLONG_4 0x40	/* F0 80..8F. */
+#define UTF8_TWO_CONTS 0x80		/* Continuation after continuation. */
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+/* Look up 16 byte tables by the nibbles of the byte pairs, after Keiser and
+ * Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte": a bit
+ * is left only where the high and low nibbles of the previous byte and the
+ * high nibble of the byte all allow that error. */
+static inline utf8_vec vec_lookup(const int8_t *table, utf8_vec idx)
+{
+#if defined(__AVX2__)
+	__m256i t = _mm256_broadcastsi128_si256(
+				_mm_loadu_si128((const __m128i *)table));
+
+	return _mm256_shuffle_epi8(t, idx);
+#else
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)table), idx);
+#endif
+}
+
+static inline utf8_vec vec_high_nibble(utf8_vec v)
+{
+#if defined(__AVX2__)
+	return vec_and(_mm256_srli_epi16(v, 4), vec_set1(0x0F));
+#else
+	return vec_and(_mm_srli_epi16(v, 4), vec_set1(0x0F));
+#endif
+}
+
+static const int8_t utf8_byte1_high[16] = {
+	/* 0_______: ASCII. */
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	/* 10______: continuation. */
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	/* 1100____, 1101____: 2 byte lead. */
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	UTF8_TOO_SHORT,
+	/* 1110____: 3 byte lead. */
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	/* 1111____: 4 byte lead. */
+	(int8_t)(UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+				UTF8_OVERLONG_4)
+};
+
+static const int8_t utf8_byte1_low[16] = {
+	(int8_t)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 |
+				UTF8_OVERLONG_4),
+	(int8_t)(UTF8_CARRY | UTF8_OVERLONG_2),
+	(int8_t)UTF8_CARRY,
+	(int8_t)UTF8_CARRY,
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	/* ____1101: ED. */
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+				UTF8_SURROGATE),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+	(int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000)
+};
+
+static const int8_t utf8_byte2_high[16] = {
+	/* 0_______: ASCII. */
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	/* 1000____. */
+	(int8_t)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+				UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+	/* 1001____. */
+	(int8_t)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+				UTF8_OVERLONG_3 | UTF8_TOO_LARGE),
+	/* 101_____. */
+	(int8_t)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+				UTF8_SURROGATE | UTF8_TOO_LARGE),
+	(int8_t)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+				UTF8_SURROGATE | UTF8_TOO_LARGE),
+	/* 11______: lead. */
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/* Errors of each byte given the one before it. Bit 7 is set for a
+ * continuation after a continuation, utf8_block matches it with the third
+ * and fourth bytes of sequences. */
+static inline utf8_vec utf8_errors(utf8_vec v, utf8_vec prev1)
+{
+	return vec_and(vec_and(
+				vec_lookup(utf8_byte1_high, vec_high_nibble(prev1)),
+				vec_lookup(utf8_byte1_low, vec_and(prev1, vec_set1(0x0F)))),
+				vec_lookup(utf8_byte2_high, vec_high_nibble(v)));
+}
+#else
+/* x >= k for each unsigned byte. */
+static inline utf8_vec vec_ge(utf8_vec x, uint8_t k)
+{
+	return _mm_cmpeq_epi8(_mm_max_epu8(x, vec_set1(k)), x);
+}
+
+static inline utf8_vec vec_eq(utf8_vec x, uint8_t k)
+{
+	return _mm_cmpeq_epi8(x, vec_set1(k));
+}
+
+/* Without a byte shuffle the same errors are found by comparisons: bit 7
+ * for a continuation after a continuation, bit 0 for the others, which
+ * are a lead not followed by a continuation, a continuation after ASCII,
+ * an invalid lead, and the second bytes restricted by table 3-7 of the
+ * Unicode standard. */
+static inline utf8_vec utf8_errors(utf8_vec v, utf8_vec prev1)
+{
+	utf8_vec cont = _mm_cmplt_epi8(v, vec_set1(0xC0));
+	utf8_vec prev_cont = _mm_cmplt_epi8(prev1, vec_set1(0xC0));
+	utf8_vec prev_ascii = _mm_cmpgt_epi8(prev1, vec_set1(0xFF));
+	utf8_vec err;
+
+	err = _mm_andnot_si128(cont, vec_ge(prev1, 0xC0));
+	err = vec_or(err, vec_and(prev_ascii, cont));
+	err = vec_or(err, vec_or(vec_ge(prev1, 0xF5),
+							vec_eq(vec_and(prev1, vec_set1(0xFE)), 0xC0)));
+	err = vec_or(err, vec_and(vec_eq(prev1, 0xE0),
+								_mm_cmplt_epi8(v, vec_set1(0xA0))));
+	err = vec_or(err, vec_and(vec_eq(prev1, 0xED), vec_ge(v, 0xA0)));
+	err = vec_or(err, vec_and(vec_eq(prev1, 0xF0),
+								_mm_cmplt_epi8(v, vec_set1(0x90))));
+	err = vec_or(err, vec_and(vec_eq(prev1, 0xF4), vec_ge(v, 0x90)));
+
+	return vec_or(vec_and(err, vec_set1(0x01)),
+					vec_and(vec_and(prev_cont, cont), vec_set1(0x80)));
+}
+#endif
+
+static inline void utf8_init(utf8_state *u)
+{
+	u->prev = vec_set1(0);
+	u->incomplete = vec_set1(0);
+	u->error = vec_set1(0);
+}
+
+/* Check a block, high set if it holds bytes >= 0x80. */
+static inline void utf8_block(utf8_state *u, const uint8_t *p, uint32_t high)
+{
+	/* Above 0 in the last 3 bytes when they start a sequence ending in the
+	 * next block. */
+	static const uint8_t last_max[VALIDATE_BLOCK] = {
+		[0 ... VALIDATE_BLOCK - 4] = 0xFF,
+		0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+	};
+	utf8_vec v = vec_load(p);
+	utf8_vec prev1, must23;
+
+	if (!high) {
+		u->error = vec_or(u->error, u->incomplete);
+		u->prev = v;
+		return;
+	}
+
+	prev1 = UTF8_PREV(v, u->prev, 1);
+	/* Third and fourth bytes of sequences, in bit 7. */
+	must23 = vec_or(vec_subs(UTF8_PREV(v, u->prev, 2), vec_set1(0xE0 - 0x80)),
+					vec_subs(UTF8_PREV(v, u->prev, 3), vec_set1(0xF0 - 0x80)));
+	u->error = vec_or(u->error, vec_xor(utf8_errors(v, prev1),
+										vec_and(must23, vec_set1(0x80))));
+	u->incomplete = vec_subs(v, vec_load(last_max));
+	u->prev = v;
+}
+
+/* 0 if every block was valid and the last one ended its sequences. */
+static inline int utf8_end(const utf8_state *u)
+{
+	return vec_any(vec_or(u->error, u->incomplete)) ? -1 : 0;
+}
+#else
+/*
+ * Returns the length of the UTF-8 sequence starting at p or 0 if it is
+ * malformed. Follows table 3-7 of the Unicode standard, which already
+ * rejects overlong forms, surrogates and code points above U+10FFFF.
+ */
+static size_t utf8_sequence(const uint8_t *p, size_t n)
+{
+	uint8_t lo = 0x80, hi = 0xBF;
+	size_t len;
+
+	if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+		len = 2;
+	} else if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+		len = 3;
+		if (p[0] == 0xE0)
+			lo = 0xA0;
+		else if (p[0] == 0xED)
+			hi = 0x9F;
+	} else if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+		len = 4;
+		if (p[0] == 0xF0)
+			lo = 0x90;
+		else if (p[0] == 0xF4)
+			hi = 0x8F;
+	} else {
+		return 0;
+	}
+
+	if (n < len || p[1] < lo || p[1] > hi)
+		return 0;
+	for (size_t i = 2; i < len; i++) {
+		if (p[i] < 0x80 || p[i] > 0xBF)
+			return 0;
+	}
+
+	return len;
+}
+#endif
+
+static int valid_wildcard(const uint8_t *s, size_t len, size_t i)
+{
+	int level_start = (i == 0 || s[i - 1] == '/');
+
+	if (s[i] == '+')
+		return (level_start && (i == len - 1 || s[i + 1] == '/')) ? 0 : -1;
+
+	return (level_start && i == len - 1) ? 0 : -1;
+}
+
+static int validate(const uint8_t *s, size_t len, check_mode mode)
+{
+	uint8_t tail[VALIDATE_BLOCK];
+	const uint8_t *p;
+	block_masks m;
+	size_t pos = 0, n;
+	uint32_t wild;
+#ifdef VALIDATE_VECTOR
+	utf8_state u;
+
+	utf8_init(&u);
+#else
+	unsigned int limit;
+	size_t seq;
+#endif
+
+	while (pos < len) {
+		n = len - pos;
+		if (n >= VALIDATE_BLOCK) {
+			p = s + pos;
+			n = VALIDATE_BLOCK;
+		} else {
+			memset(tail, VALIDATE_PAD, sizeof(tail));
+			memcpy(tail, s + pos, n);
+			p = tail;
+		}
+
+		scan_block(p, &m);
+		if (m.nul)
+			return -1;
+
+#ifdef VALIDATE_VECTOR
+		/* Multi-byte sequences are checked with the whole block, the
+		 * padding of the last one ends them. */
+		utf8_block(&u, p, m.high);
+		wild = m.wild;
+#else
+		/* Only the ASCII run before the first multi-byte sequence is done,
+		 * the rest of the block is scanned again after the sequence. */
+		limit = m.high ? (unsigned int)__builtin_ctz(m.high) : (unsigned int)n;
+		wild = m.wild & low_bits(limit);
+#endif
+		if (wild && mode == CHECK_TOPIC_NAME)
+			return -1;
+		if (mode == CHECK_TOPIC_FILTER) {
+			while (wild) {
+				if (valid_wildcard(s, len, pos + __builtin_ctz(wild)) < 0)
+					return -1;
+				wild &= wild - 1;
+			}
+		}
+
+#ifdef VALIDATE_VECTOR
+		pos += n;
+#else
+		pos += limit;
+		if (m.high) {
+			seq = utf8_sequence(s + pos, len - pos);
+			if (seq == 0)
+				return -1;
+			pos += seq;
+		}
+#endif
+	}
+
+#ifdef VALIDATE_VECTOR
+	return utf8_end(&u);
+#else
+	return 0;
+#endif
+}
+
+int mqtt_valid_utf8(const char *str, size_t len)
+{
+	if (str == NULL || len > MQTT_STRING_MAX_LEN)
+		return -1;
+
+	return validate((const uint8_t *)str, len, CHECK_UTF8);
+}
+
+int mqtt_valid_topic_name(const char *topic, size_t len)
+{
+	if (topic == NULL || len == 0 || len > MQTT_STRING_MAX_LEN)
+		return -1;
+
+	return validate((const uint8_t *)topic, len, CHECK_TOPIC_NAME);
+}
+
+int mqtt_valid_topic_filter(const char *filter, size_t len)
+{
+	if (filter == NULL || len == 0 || len > MQTT_STRING_MAX_LEN)
+		return -1;
+
+	return validate((const uint8_t *)filter, len, CHECK_TOPIC_FILTER);
+}
+
+int mqtt_valid_clientID(const char *clientID, size_t len)
+{
+	uint8_t tail[VALIDATE_BLOCK];
+	const uint8_t *p;
+	size_t pos;
+
+	if (clientID == NULL || len > MQTT_STRING_MAX_LEN)
+		return -1;
+
+	for (pos = 0; pos + VALIDATE_BLOCK <= len; pos += VALIDATE_BLOCK) {
+		p = (const uint8_t *)clientID + pos;
+		if (alnum_block(p) != low_bits(VALIDATE_BLOCK))
+			return -1;
+	}
+
+	if (pos < len) {
+		memset(tail, VALIDATE_PAD, sizeof(tail));
+		memcpy(tail, clientID + pos, len - pos);
+		if (alnum_block(tail) != low_bits(VALIDATE_BLOCK))
+			return -1;
+	}
+
+	return 0;
+}
+
+int mqtt_topic_match(const char *filter, const char *topic, size_t len)
+{
+	size_t i = 0;
+
+	/* Wildcards never match topics starting with '$', section 4.7.2. */
+	if (len > 0 && topic[0] == '$' && (*filter == '+' || *filter == '#'))
+		return 0;
+
+	while (*filter != '\0') {
+		if (*filter == '#')
+			return 1;
+
+		if (*filter == '+') {
+			while (i < len && topic[i] != '/')
+				i++;
+			filter++;
+		} else {
+			if (i >= len || *filter != topic[i])
+				return 0;
+			filter++;
+			i++;
+		}
+
+		/* "a/#" also matches "a". */
+		if (i == len && filter[0] == '/' && filter[1] == '#' &&
+			filter[2] == '\0')
+			return 1;
+	}
+
+	return i == len;
+}
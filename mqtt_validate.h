@@ -0,0 +1,68 @@
+/**
+ * @file mqtt_validate.h
+ * @brief MQTT string, topic and client identifier validation, topic matching.
+ * Rules are taken from sections 1.5.3, 4.7 and 3.1.3.1 of:
+ * http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.html
+ *
+ * Checks run on 32 bytes (AVX2) or 16 bytes (SSSE3, SSE2) at a time when the
+ * compiler targets those instruction sets, otherwise a scalar version is used.
+ * Multi-byte UTF-8 is checked a whole block at a time from each byte and the
+ * ones before it, with nibble lookup tables on SSSE3 and AVX2 and byte range
+ * comparisons on SSE2. Pure ASCII blocks skip that check.
+ */
+
+#ifndef _MQTT_VALIDATE_H_
+#define _MQTT_VALIDATE_H_
+
+#include "stddef.h"
+
+#define MQTT_STRING_MAX_LEN 65535
+
+/**
+ * @brief Check that a string is well-formed UTF-8 as required by MQTT: no
+ * overlong encodings, no UTF-16 surrogates, nothing above U+10FFFF and no
+ * U+0000 character.
+ * @param str String to check, does not need to be NUL terminated.
+ * @param len String length in bytes.
+ * @return 0 if valid or -1 if not.
+ */
+int mqtt_valid_utf8(const char *str, size_t len);
+
+/**
+ * @brief Check a topic name used to publish. Must be valid UTF-8, between
+ * 1 and 65535 bytes long and must not contain '+' or '#' wildcards.
+ * @param topic Topic name.
+ * @param len Topic name length in bytes.
+ * @return 0 if valid or -1 if not.
+ */
+int mqtt_valid_topic_name(const char *topic, size_t len);
+
+/**
+ * @brief Check a topic filter used to subscribe or unsubscribe. Must be
+ * valid UTF-8, between 1 and 65535 bytes long, '+' must take a whole topic
+ * level and '#' must be alone in the last level.
+ * @param filter Topic filter.
+ * @param len Topic filter length in bytes.
+ * @return 0 if valid or -1 if not.
+ */
+int mqtt_valid_topic_filter(const char *filter, size_t len);
+
+/**
+ * @brief Check a client identifier, only [0-9][a-z][A-Z] are accepted.
+ * @param clientID Client identifier.
+ * @param len Client identifier length in bytes.
+ * @return 0 if valid or -1 if not.
+ */
+int mqtt_valid_clientID(const char *clientID, size_t len);
+
+/**
+ * @brief Check if a topic name matches a topic filter, following the
+ * wildcard rules of section 4.7. Both are expected to be valid.
+ * @param filter Topic filter, NUL terminated.
+ * @param topic Topic name.
+ * @param len Topic name length in bytes.
+ * @return 1 if the topic matches or 0 if not.
+ */
+int mqtt_topic_match(const char *filter, const char *topic, size_t len);
+
+#endif /* _MQTT_VALIDATE_H_ */
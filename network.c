@@ -5,16 +5,212 @@
 
 #include "stdlib.h"
 #include "sys/socket.h"
+#include "sys/uio.h"
 #include "netdb.h"
 #include "arpa/inet.h"
 #include "string.h"
 #include "unistd.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "poll.h"
+#include "time.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
 
 #include "network.h"
+#include "network_uring.h"
+
+/* Userspace TLS makes at least one record per write, buffers are joined
+ * up to the largest record first. */
+#define SOCKET_JOIN_BYTES 16384
+
+static int backend = -1;
+
+/* Writer state of sockets created with options. */
+typedef struct {
+	socket_options opts;
+	uint8_t *wbuf;
+	/* Set when wbuf was allocated here rather than given. */
+	int wbuf_owned;
+	int wlen;
+	long first_us;
+	/* Bytes were written since the socket was last uncorked. */
+	int corked;
+} socket_state;
+
+#ifdef MQTT_STATIC_ALLOC
+/* One slot per socket descriptor, never allocated. */
+static socket_state state_pool[MQTT_STATIC_SOCKETS];
+static socket_state *states[MQTT_STATIC_SOCKETS];
+static const int states_len = MQTT_STATIC_SOCKETS;
+#else
+static socket_state **states;
+static int states_len;
+#endif
+
+static long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+static socket_state *state_get(int sockfd)
+{
+	if (sockfd < 0 || sockfd >= states_len)
+		return NULL;
+
+	return states[sockfd];
+}
+
+static void state_free(int sockfd)
+{
+	socket_state *st = state_get(sockfd);
+
+	if (st == NULL)
+		return;
+
+	if (st->wbuf_owned)
+		free(st->wbuf);
+#ifndef MQTT_STATIC_ALLOC
+	free(st);
+#endif
+	states[sockfd] = NULL;
+}
+
+static socket_state *state_new(int sockfd, const socket_options *opts)
+{
+	socket_state *st;
+
+#ifdef MQTT_STATIC_ALLOC
+	if (opts->coalesce_bytes > 0 && opts->coalesce_buf == NULL) {
+		print_err("Static builds coalesce in the buffer given");
+		return NULL;
+	}
+
+	st = &state_pool[sockfd];
+	memset(st, 0, sizeof(socket_state));
+	st->opts = *opts;
+	st->wbuf = opts->coalesce_buf;
+	return st;
+#else
+	(void)sockfd;
+
+	st = (socket_state *)calloc(1, sizeof(socket_state));
+	if (st == NULL)
+		return NULL;
+
+	st->opts = *opts;
+	if (opts->coalesce_bytes > 0 && opts->coalesce_buf != NULL) {
+		st->wbuf = opts->coalesce_buf;
+	} else if (opts->coalesce_bytes > 0) {
+		st->wbuf = (uint8_t *)malloc(opts->coalesce_bytes);
+		st->wbuf_owned = 1;
+		if (st->wbuf == NULL) {
+			free(st);
+			return NULL;
+		}
+	}
+
+	return st;
+#endif
+}
+
+/* What the previous options buffered is sent first, the socket is left
+ * without options if fail. */
+static int state_set(int sockfd, const socket_options *opts)
+{
+#ifndef MQTT_STATIC_ALLOC
+	socket_state **grown;
+	int len;
+#endif
+
+	if (sockfd >= states_len) {
+#ifdef MQTT_STATIC_ALLOC
+		print_err("Socket %d above MQTT_STATIC_SOCKETS", sockfd);
+		return -1;
+#else
+		len = (sockfd + 1) * 2;
+		grown = (socket_state **)realloc(states, len * sizeof(socket_state *));
+		if (grown == NULL)
+			return -1;
+		memset(&grown[states_len], 0,
+				(len - states_len) * sizeof(socket_state *));
+		states = grown;
+		states_len = len;
+#endif
+	}
+
+	if (states[sockfd] != NULL && states[sockfd]->wlen > 0)
+		socket_flush(sockfd);
+	state_free(sockfd);
+	states[sockfd] = state_new(sockfd, opts);
+
+	return (states[sockfd] != NULL) ? 0 : -1;
+}
+
+static int set_opt(int sockfd, int level, int name, int value, const char *what)
+{
+	if (setsockopt(sockfd, level, name, &value, sizeof(value)) < 0) {
+		print_wrn("Couldn't set %s", what);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Options that can not be applied are reported and skipped. */
+static void apply_options(int sockfd, const socket_options *opts)
+{
+	if (opts->sndbuf > 0)
+		set_opt(sockfd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, "SO_SNDBUF");
+	if (opts->rcvbuf > 0)
+		set_opt(sockfd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, "SO_RCVBUF");
+	if (opts->nodelay)
+		set_opt(sockfd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	if (opts->cork)
+		set_opt(sockfd, IPPROTO_TCP, TCP_CORK, 1, "TCP_CORK");
+	if (opts->keepalive_idle > 0) {
+		set_opt(sockfd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+		set_opt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, opts->keepalive_idle,
+				"TCP_KEEPIDLE");
+		if (opts->keepalive_interval > 0)
+			set_opt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL,
+					opts->keepalive_interval, "TCP_KEEPINTVL");
+		if (opts->keepalive_count > 0)
+			set_opt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, opts->keepalive_count,
+					"TCP_KEEPCNT");
+	}
+#ifdef SO_BUSY_POLL
+	if (opts->busy_poll_us > 0)
+		set_opt(sockfd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll_us,
+				"SO_BUSY_POLL");
+#endif
+}
+
+int socket_set_backend(socket_backend b)
+{
+#if !defined(NETWORK_WITH_URING) || defined(MQTT_STATIC_ALLOC)
+	if (b == SOCKET_BACKEND_URING)
+		return -1;
+#endif
+	backend = b;
+	return 0;
+}
+
+static void backend_from_env(void)
+{
+	const char *env = getenv(SOCKET_BACKEND_ENV);
+
+	backend = SOCKET_BACKEND_PLAIN;
+	if (env != NULL && strcmp(env, "uring") == 0)
+		socket_set_backend(SOCKET_BACKEND_URING);
+}
 
 int resolve_hostname(const char *hostname, char *addr)
 {
-	int addr_len, i;
+	int i;
 	struct hostent *he;
 	struct in_addr **addr_list;
 
@@ -40,14 +236,12 @@ int resolve_hostname(const char *hostname, char *addr)
 	return 0;
 }
 
-int socket_create(const char *hostname, int port)
+static int tcp_connect(const char *hostname, int port,
+						const socket_options *opts)
 {
-	int ret = 0, sock = 0;
+	int sock = -1;
 	struct sockaddr_in serv_addr;
-	char *addr;
-
-	addr = (char *)malloc(IPV4_MAX_LEN * sizeof(char));
-	memset(addr, 0, IPV4_MAX_LEN * sizeof(char));
+	char addr[IPV4_MAX_LEN] = { 0 };
 
 	if (resolve_hostname(hostname, addr) < 0)
 		goto fail;
@@ -60,16 +254,217 @@ int socket_create(const char *hostname, int port)
 	serv_addr.sin_port = htons(port);
 	inet_pton(AF_INET, (const char *)addr, &serv_addr.sin_addr);
 
+	/* Before connecting, so buffer sizes are known to the handshake. */
+	if (opts != NULL)
+		apply_options(sock, opts);
+
 	if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
 		goto fail;
 
 	return sock;
 fail:
-	free(addr);
-	addr = NULL;
+	if (sock >= 0)
+		close(sock);
+	return -1;
+}
+
+/* Set up TLS or the backend and the writer state of a connected socket, it
+ * is closed if fail. */
+static int socket_attach(int sock, const char *hostname, int port,
+							const socket_tls_options *tls,
+							const socket_options *opts)
+{
+	if (tls != NULL) {
+		if (tls_attach(sock, hostname, port, tls) < 0)
+			goto fail;
+	} else {
+		if (backend < 0)
+			backend_from_env();
+		if (backend == SOCKET_BACKEND_URING && uring_attach(sock) < 0)
+			print_wrn("io_uring unavailable, using plain socket");
+	}
+
+	if (opts != NULL && state_set(sock, opts) < 0)
+		goto fail;
+
+	return sock;
+fail:
+	socket_close(sock);
+	return -1;
+}
+
+int socket_create_opts(const char *hostname, int port,
+						const socket_tls_options *tls,
+						const socket_options *opts)
+{
+	int sock = tcp_connect(hostname, port, opts);
+
+	if (sock < 0)
+		return -1;
+
+	return socket_attach(sock, hostname, port, tls, opts);
+}
+
+int socket_connect_start(const char *addr, int port, const socket_options *opts)
+{
+	struct sockaddr_in serv_addr;
+	int sock;
+
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &serv_addr.sin_addr) != 1)
+		return -1;
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock < 0)
+		return -1;
+
+	if (opts != NULL)
+		apply_options(sock, opts);
+
+	if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 &&
+		errno != EINPROGRESS) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int socket_connect_finish(int sockfd, const char *hostname, int port,
+							const socket_tls_options *tls,
+							const socket_options *opts)
+{
+	socklen_t len = sizeof(int);
+	int err = 0, flags;
+
+	if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		goto fail;
+
+	flags = fcntl(sockfd, F_GETFL);
+	if (flags < 0 || fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+		goto fail;
+
+	return (socket_attach(sockfd, hostname, port, tls, opts) < 0) ? -1 : 0;
+fail:
+	close(sockfd);
 	return -1;
 }
 
+int socket_create(const char *hostname, int port)
+{
+	return socket_create_opts(hostname, port, NULL, NULL);
+}
+
+int socket_create_tls(const char *hostname, int port,
+						const socket_tls_options *tls)
+{
+	return socket_create_opts(hostname, port, tls, NULL);
+}
+
+int socket_set_options(int sockfd, const socket_options *opts)
+{
+	if (opts == NULL)
+		return -1;
+
+	apply_options(sockfd, opts);
+	return state_set(sockfd, opts);
+}
+
+/* Corked sockets hold what was written until uncorked. */
+static void mark_corked(int sockfd)
+{
+	socket_state *st = state_get(sockfd);
+
+	if (st != NULL && st->opts.cork)
+		st->corked = 1;
+}
+
+/* A closed connection fails the call instead of raising SIGPIPE. */
+static int send_all(int sockfd, const uint8_t *buffer, int buffer_length)
+{
+	ssize_t n;
+
+	mark_corked(sockfd);
+	if (tls_attached(sockfd))
+		return tls_send(sockfd, buffer, buffer_length);
+
+	while (buffer_length > 0) {
+		n = send(sockfd, buffer, buffer_length, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buffer += n;
+		buffer_length -= (int)n;
+	}
+
+	return 0;
+}
+
+int socket_flush(int sockfd)
+{
+	socket_state *st = state_get(sockfd);
+	int ret = 0;
+
+	if (uring_attached(sockfd))
+		return uring_flush();
+	if (st == NULL)
+		return 0;
+
+	if (st->wlen > 0) {
+		ret = send_all(sockfd, st->wbuf, st->wlen);
+		st->wlen = 0;
+	}
+	/* Uncorking sends the partial frame held by the kernel. */
+	if (st->corked) {
+		set_opt(sockfd, IPPROTO_TCP, TCP_CORK, 0, "TCP_CORK");
+		set_opt(sockfd, IPPROTO_TCP, TCP_CORK, 1, "TCP_CORK");
+		st->corked = 0;
+	}
+
+	return ret;
+}
+
+/* Nothing is held back while the caller blocks, likely waiting for an
+ * answer to what is buffered. Polling receives respect the time budget. */
+static int flush_before_wait(int sockfd, int timeout_ms)
+{
+	socket_state *st = state_get(sockfd);
+
+	if (st == NULL || (st->wlen == 0 && !st->corked))
+		return 0;
+	if (timeout_ms == 0 && (st->wlen == 0 || st->opts.coalesce_us <= 0 ||
+		now_us() - st->first_us < st->opts.coalesce_us))
+		return 0;
+
+	return socket_flush(sockfd);
+}
+
+static int coalesce(socket_state *st, int sockfd, const uint8_t *buffer,
+					int buffer_length)
+{
+	int limit = st->opts.coalesce_bytes;
+
+	if (st->wlen > 0 && st->wlen + buffer_length > limit &&
+		socket_flush(sockfd) < 0)
+		return -1;
+	if (buffer_length >= limit)
+		return send_all(sockfd, buffer, buffer_length);
+
+	if (st->wlen == 0)
+		st->first_us = now_us();
+	memcpy(&st->wbuf[st->wlen], buffer, buffer_length);
+	st->wlen += buffer_length;
+
+	if (st->wlen >= limit || (st->opts.coalesce_us > 0 &&
+		now_us() - st->first_us >= st->opts.coalesce_us))
+		return socket_flush(sockfd);
+
+	return 0;
+}
+
 int socket_receive(int sockfd, uint8_t *buffer)
 {
 	ssize_t bytes_recv;
@@ -77,7 +472,14 @@ int socket_receive(int sockfd, uint8_t *buffer)
 
 	memset(&received[0], 0, BUFFER_SIZE * sizeof(uint8_t));
 
-	bytes_recv = recv(sockfd, received, BUFFER_SIZE, 0);
+	if (flush_before_wait(sockfd, -1) < 0)
+		return -1;
+	if (tls_attached(sockfd))
+		bytes_recv = tls_receive(sockfd, received, BUFFER_SIZE, -1);
+	else if (uring_attached(sockfd))
+		bytes_recv = uring_receive(sockfd, received, BUFFER_SIZE, -1);
+	else
+		bytes_recv = recv(sockfd, received, BUFFER_SIZE, 0);
 	if (bytes_recv < 0)
 		return -1;
 	
@@ -97,28 +499,155 @@ int socket_receive(int sockfd, uint8_t *buffer)
 	return (int)bytes_recv;
 }
 
+int socket_receive_timeout(int sockfd, uint8_t *buffer, int buffer_length,
+							int timeout_ms)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	ssize_t bytes_recv;
+	int ret;
+
+	if (flush_before_wait(sockfd, timeout_ms) < 0)
+		return -1;
+	if (tls_attached(sockfd))
+		return tls_receive(sockfd, buffer, buffer_length, timeout_ms);
+	if (uring_attached(sockfd))
+		return uring_receive(sockfd, buffer, buffer_length, timeout_ms);
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0)
+		return -1;
+	if (ret == 0)
+		return 0;
+
+	bytes_recv = recv(sockfd, buffer, buffer_length, 0);
+	if (bytes_recv <= 0)
+		return -1;
+
+	return (int)bytes_recv;
+}
+
 int socket_send(int sockfd, const uint8_t *buffer, int buffer_lenght)
 {
-	uint8_t *to_send;
+	socket_state *st = state_get(sockfd);
 
 	if (buffer == NULL) {
 		print_err("Buffer is NULL");
 		return -1;
 	}
 
-	to_send = (uint8_t *)malloc(buffer_lenght * sizeof(uint8_t));
-	memcpy(&to_send[0], buffer, buffer_lenght * sizeof(uint8_t));
+	if (uring_attached(sockfd))
+		return uring_send(sockfd, buffer, buffer_lenght);
+	if (st != NULL && st->opts.coalesce_bytes > 0)
+		return coalesce(st, sockfd, buffer, buffer_lenght);
 
-	if (send(sockfd, to_send, buffer_lenght, 0) < 0)
-		return -1;
+	return send_all(sockfd, buffer, buffer_lenght);
+}
+
+/* Write whole buffers, the array is advanced past what was written. */
+static int writev_all(int sockfd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg = { 0 };
+	ssize_t n;
+
+	mark_corked(sockfd);
+	while (iovcnt > 0) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
 
-	free(to_send);
-	to_send = NULL;
+	return 0;
+}
+
+/* Send the buffers in chunks of SOCKET_JOIN_BYTES, one write each. */
+static int send_joined(int sockfd, const struct iovec *iov, int iovcnt)
+{
+	uint8_t joined[SOCKET_JOIN_BYTES];
+	size_t used = 0, len, off;
+
+	for (int i = 0; i < iovcnt; i++) {
+		for (off = 0; off < iov[i].iov_len; off += len) {
+			len = iov[i].iov_len - off;
+			if (len > sizeof(joined) - used)
+				len = sizeof(joined) - used;
+			memcpy(&joined[used], (const uint8_t *)iov[i].iov_base + off, len);
+			used += len;
+			if (used == sizeof(joined)) {
+				if (socket_send(sockfd, joined, (int)used) < 0)
+					return -1;
+				used = 0;
+			}
+		}
+	}
+
+	if (used > 0 && socket_send(sockfd, joined, (int)used) < 0)
+		return -1;
 
 	return 0;
 }
 
+int socket_sendv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+	socket_state *st = state_get(sockfd);
+	struct iovec v[SOCKET_IOV_MAX + 1];
+	size_t total = 0;
+	int n = 0;
+
+	if (iov == NULL || iovcnt <= 0 || iovcnt > SOCKET_IOV_MAX) {
+		print_err("Bad buffer array");
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	/* Coalesced sends small enough to be buffered, and the io_uring
+	 * backend copying anyway, take each buffer in turn. */
+	if (uring_attached(sockfd) ||
+		(st != NULL && st->opts.coalesce_bytes > 0 &&
+		total < (size_t)st->opts.coalesce_bytes)) {
+		for (int i = 0; i < iovcnt; i++) {
+			if (iov[i].iov_len > 0 &&
+				socket_send(sockfd, (const uint8_t *)iov[i].iov_base,
+							(int)iov[i].iov_len) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	/* With kTLS the kernel builds the records, the socket is written as a
+	 * plain one. */
+	if (tls_attached(sockfd) && !tls_ktls_send(sockfd))
+		return send_joined(sockfd, iov, iovcnt);
+
+	/* Coalesced bytes leave in the same write, ahead of the buffers. */
+	if (st != NULL && st->wlen > 0) {
+		v[n].iov_base = st->wbuf;
+		v[n++].iov_len = st->wlen;
+		st->wlen = 0;
+	}
+	memcpy(&v[n], iov, iovcnt * sizeof(struct iovec));
+
+	return writev_all(sockfd, v, n + iovcnt);
+}
+
 void socket_close(int sockfd)
 {
+	socket_flush(sockfd);
+	state_free(sockfd);
+	tls_detach(sockfd);
+	uring_detach(sockfd);
 	close(sockfd);
 }
@@ -8,13 +8,81 @@
 
 #include "stdio.h"
 #include "stdint.h"
+#include "sys/uio.h"
 
 #define ENABLE_TRACES
 #include "trace.h"
+#include "network_tls.h"
 
 #define IPV4_MAX_LEN 17
 #define BUFFER_SIZE 128
 #define RECV_TIMEOUT 10000
+/* Buffers sent at once by socket_sendv at most. */
+#define SOCKET_IOV_MAX 8
+
+/* Static builds (MQTT_STATIC_ALLOC) never allocate: socket and session
+ * tables are sized for descriptors below this, TLS and io_uring are out. */
+#ifdef MQTT_STATIC_ALLOC
+#ifndef MQTT_STATIC_SOCKETS
+#define MQTT_STATIC_SOCKETS 64
+#endif
+#endif
+
+/* Environment variable selecting the backend, "uring" or "plain". */
+#define SOCKET_BACKEND_ENV "MQTT_SOCKET_BACKEND"
+
+typedef enum {
+    SOCKET_BACKEND_PLAIN = 0,
+    SOCKET_BACKEND_URING
+} socket_backend;
+
+/**
+ * @brief Select the backend of sockets created afterwards. Without a call,
+ * SOCKET_BACKEND_ENV is read on the first socket_create.
+ * With SOCKET_BACKEND_URING, sends are queued and submitted in batches:
+ * queued bytes leave with the next socket_receive_timeout or socket_close,
+ * or once enough of them are queued. If io_uring is not available the
+ * socket silently uses the plain backend.
+ * @param backend Backend.
+ * @return 0 if success or -1 if the backend is not built in.
+ */
+int socket_set_backend(socket_backend backend);
+
+/* Suggested coalescing budget, a latency of a fifth of a millisecond at
+ * most for far fewer system calls and packets. */
+#define SOCKET_COALESCE_US 200
+#define SOCKET_COALESCE_BYTES 16384
+
+/**
+ * @brief Socket tuning, a zero value keeps the kernel default.
+ * sndbuf, rcvbuf: SO_SNDBUF and SO_RCVBUF sizes.
+ * nodelay: Set TCP_NODELAY, small writes are not delayed by Nagle.
+ * cork: Keep TCP_CORK set, the kernel only sends full frames until
+ * socket_flush, or a receive that may block, pushes the rest.
+ * keepalive_idle, keepalive_interval, keepalive_count: Enable TCP keepalive
+ * with TCP_KEEPIDLE, TCP_KEEPINTVL and TCP_KEEPCNT.
+ * busy_poll_us: SO_BUSY_POLL, busy wait for receives instead of sleeping.
+ * coalesce_bytes: Buffer sends and write them together once this many bytes
+ * are buffered, 0 sends each packet at once. Also flushed by socket_flush
+ * and before a receive that may block.
+ * coalesce_us: Also write the buffer once its oldest byte waited this long,
+ * checked on each send and polling receive.
+ * coalesce_buf: coalesce_bytes bytes to buffer sends in, kept until the
+ * socket is closed, NULL to allocate them. Required by static builds.
+ */
+typedef struct {
+    int sndbuf;
+    int rcvbuf;
+    int nodelay;
+    int cork;
+    int keepalive_idle;
+    int keepalive_interval;
+    int keepalive_count;
+    int busy_poll_us;
+    int coalesce_bytes;
+    int coalesce_us;
+    uint8_t *coalesce_buf;
+} socket_options;
 
 /**
  * @brief
@@ -32,6 +100,72 @@ int resolve_hostname(const char *hostname, char *addr);
  */
 int socket_create(const char *hostname, int port);
 
+/**
+ * @brief Same as socket_create, then run a TLS handshake. TLS sockets do not
+ * use the io_uring backend, with kTLS their sends still go straight to the
+ * kernel.
+ * @param hostname Hostname to open socket.
+ * @param port Port to open socket, usually MQTT_TLS_PORT.
+ * @param tls TLS options, NULL for a plain socket.
+ * @return Socket handler or -1 if fail.
+ */
+int socket_create_tls(const char *hostname, int port,
+                        const socket_tls_options *tls);
+
+/**
+ * @brief Same as socket_create_tls, with socket options applied before
+ * connecting.
+ * @param hostname Hostname to open socket.
+ * @param port Port to open socket.
+ * @param tls TLS options, NULL for a plain socket.
+ * @param opts Socket options, NULL for kernel defaults.
+ * @return Socket handler or -1 if fail.
+ */
+int socket_create_opts(const char *hostname, int port,
+                        const socket_tls_options *tls,
+                        const socket_options *opts);
+
+/**
+ * @brief Start connecting without waiting, the socket becomes writable once
+ * connected or failed, then call socket_connect_finish.
+ * @param addr IPv4 address, see resolve_hostname.
+ * @param port Port to connect to.
+ * @param opts Socket options, NULL for kernel defaults.
+ * @return Socket handler, not blocking until finished, or -1 if fail.
+ */
+int socket_connect_start(const char *addr, int port, const socket_options *opts);
+
+/**
+ * @brief Complete a connection started by socket_connect_start: check it
+ * succeeded, make the socket blocking again and set it up as
+ * socket_create_opts does, TLS handshake included.
+ * @param sockfd Socket handler.
+ * @param hostname Hostname, for TLS server name checks.
+ * @param port Port connected to.
+ * @param tls TLS options, NULL for a plain socket.
+ * @param opts Socket options, NULL for kernel defaults.
+ * @return 0 if success or -1 if fail, the socket is then closed.
+ */
+int socket_connect_finish(int sockfd, const char *hostname, int port,
+                            const socket_tls_options *tls,
+                            const socket_options *opts);
+
+/**
+ * @brief Change the options of a connected socket. Buffered bytes are sent
+ * first.
+ * @param sockfd Socket handler.
+ * @param opts Socket options.
+ * @return 0 if success or -1 if fail.
+ */
+int socket_set_options(int sockfd, const socket_options *opts);
+
+/**
+ * @brief Send everything buffered or queued for a socket now.
+ * @param sockfd Socket handler.
+ * @return 0 if success or -1 if fail.
+ */
+int socket_flush(int sockfd);
+
 /**
  * @brief
  * @param sockfd Socket handler.
@@ -41,6 +175,19 @@ int socket_create(const char *hostname, int port);
  */
 int socket_send(int sockfd, const uint8_t *buffer, int buffer_lenght);
 
+/**
+ * @brief Send several buffers one after the other without joining them
+ * first: plain and kTLS sockets write them with a single writev, along with
+ * the bytes held back by write coalescing. Sends small enough to be
+ * coalesced are buffered as with socket_send. With userspace TLS the
+ * buffers are joined, so a small packet makes a single record.
+ * @param sockfd Socket handler.
+ * @param iov Buffers to send.
+ * @param iovcnt Number of buffers, SOCKET_IOV_MAX at most.
+ * @return 0 if success or -1 if fail.
+ */
+int socket_sendv(int sockfd, const struct iovec *iov, int iovcnt);
+
 /**
  * @brief
  * @param sockfd Socket handler.
@@ -49,6 +196,17 @@ int socket_send(int sockfd, const uint8_t *buffer, int buffer_lenght);
  */
 int socket_receive(int sockfd, uint8_t *buffer);
 
+/**
+ * @brief Receive whatever is available, waiting at most timeout_ms for data.
+ * @param sockfd Socket handler.
+ * @param buffer Buffer to receive.
+ * @param buffer_length Buffer length.
+ * @param timeout_ms Maximum time to wait, -1 waits forever.
+ * @return Number of bytes received, 0 if timed out or -1 if fail or closed.
+ */
+int socket_receive_timeout(int sockfd, uint8_t *buffer, int buffer_length,
+                            int timeout_ms);
+
 /**
  * @brief 
  * @param sockfd Socket handler.
@@ -0,0 +1,454 @@
+/**
+ * @file network_tls.c
+ * @brief TLS socket layer implementation, OpenSSL based.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+
+#include "network.h"
+#include "network_tls.h"
+
+#ifdef MQTT_WITH_TLS
+
+#ifdef MQTT_STATIC_ALLOC
+#error "OpenSSL allocates per connection, TLS is not in static builds"
+#endif
+
+#include "errno.h"
+#include "poll.h"
+#include "sys/socket.h"
+#include "arpa/inet.h"
+#include "openssl/ssl.h"
+#include "openssl/err.h"
+#include "openssl/x509v3.h"
+
+/* "hostname:port server_name", the session cache key within a context. */
+#define TLS_KEY_LEN 520
+
+typedef struct tls_session_entry {
+	char key[TLS_KEY_LEN];
+	SSL_SESSION *session;
+	struct tls_session_entry *next;
+} tls_session_entry;
+
+/* Contexts are shared by connections with the same options, so CA files
+ * are loaded once. Each keeps its own sessions: one established without
+ * verification or with another client certificate is never resumed. */
+typedef struct tls_ctx_entry {
+	SSL_CTX *ctx;
+	char *ca_file;
+	char *cert_file;
+	char *key_file;
+	int insecure;
+	int disable_ktls;
+	tls_session_entry *sessions;
+	struct tls_ctx_entry *next;
+} tls_ctx_entry;
+
+typedef struct {
+	SSL *ssl;
+	tls_ctx_entry *entry;
+	/* Empty if too long, the session is then not cached. */
+	char key[TLS_KEY_LEN];
+	int ktls_send;
+} tls_sock;
+
+static tls_sock **socks;
+static int socks_len;
+static tls_ctx_entry *contexts;
+
+static void print_ssl_err(const char *what)
+{
+	unsigned long err = ERR_get_error();
+
+	print_err("%s: %s", what, err ? ERR_error_string(err, NULL) : "no reason");
+	ERR_clear_error();
+}
+
+static int str_eq(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	return strcmp(a, b) == 0;
+}
+
+static char *str_dup(const char *s)
+{
+	return s ? strdup(s) : NULL;
+}
+
+static tls_sock *sock_get(int sockfd)
+{
+	if (sockfd < 0 || sockfd >= socks_len)
+		return NULL;
+
+	return socks[sockfd];
+}
+
+static tls_session_entry *session_find(const tls_ctx_entry *entry,
+										const char *key)
+{
+	tls_session_entry *e;
+
+	for (e = entry->sessions; e != NULL; e = e->next) {
+		if (strcmp(e->key, key) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+/* Called once the broker sent a session, after the handshake with TLS 1.2
+ * and with each ticket with TLS 1.3. Keeps the latest one per broker and
+ * server name in the context of the connection. */
+static int session_new_cb(SSL *ssl, SSL_SESSION *session)
+{
+	tls_sock *t = (tls_sock *)SSL_get_app_data(ssl);
+	tls_session_entry *e;
+
+	if (t == NULL || t->key[0] == '\0' ||
+		!SSL_SESSION_is_resumable(session))
+		return 0;
+	/* A resumed session skips verification, only verified ones are kept
+	 * by verifying contexts. */
+	if (!t->entry->insecure && SSL_get_verify_result(ssl) != X509_V_OK)
+		return 0;
+
+	e = session_find(t->entry, t->key);
+	if (e == NULL) {
+		e = (tls_session_entry *)calloc(1, sizeof(tls_session_entry));
+		if (e == NULL)
+			return 0;
+		strcpy(e->key, t->key);
+		e->next = t->entry->sessions;
+		t->entry->sessions = e;
+	}
+
+	SSL_SESSION_free(e->session);
+	e->session = session;
+	print_dbg("TLS session cached for %s", t->key);
+
+	return 1;
+}
+
+static tls_ctx_entry *ctx_get(const socket_tls_options *opts)
+{
+	tls_ctx_entry *e;
+	SSL_CTX *ctx;
+
+	for (e = contexts; e != NULL; e = e->next) {
+		if (str_eq(e->ca_file, opts->ca_file) &&
+			str_eq(e->cert_file, opts->cert_file) &&
+			str_eq(e->key_file, opts->key_file) &&
+			e->insecure == opts->insecure &&
+			e->disable_ktls == opts->disable_ktls)
+			return e;
+	}
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == NULL) {
+		print_ssl_err("Couldn't create TLS context");
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	/* Give control back after non application records, so receive
+	 * timeouts hold while tickets arrive. */
+	SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+									SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, session_new_cb);
+#ifdef SSL_OP_ENABLE_KTLS
+	if (!opts->disable_ktls)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	if (opts->insecure) {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	} else {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		if ((opts->ca_file != NULL &&
+			SSL_CTX_load_verify_locations(ctx, opts->ca_file, NULL) != 1) ||
+			(opts->ca_file == NULL && SSL_CTX_set_default_verify_paths(ctx) != 1)) {
+			print_ssl_err("Couldn't load CA");
+			goto fail;
+		}
+	}
+
+	if (opts->cert_file != NULL &&
+		(SSL_CTX_use_certificate_chain_file(ctx, opts->cert_file) != 1 ||
+		SSL_CTX_use_PrivateKey_file(ctx, opts->key_file ? opts->key_file :
+									opts->cert_file, SSL_FILETYPE_PEM) != 1)) {
+		print_ssl_err("Couldn't load client certificate");
+		goto fail;
+	}
+
+	e = (tls_ctx_entry *)calloc(1, sizeof(tls_ctx_entry));
+	if (e == NULL)
+		goto fail;
+	e->ctx = ctx;
+	e->ca_file = str_dup(opts->ca_file);
+	e->cert_file = str_dup(opts->cert_file);
+	e->key_file = str_dup(opts->key_file);
+	e->insecure = opts->insecure;
+	e->disable_ktls = opts->disable_ktls;
+	e->next = contexts;
+	contexts = e;
+
+	return e;
+fail:
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+static int sock_add(int sockfd, tls_sock *t)
+{
+	tls_sock **grown;
+	int len;
+
+	if (sockfd >= socks_len) {
+		len = (sockfd + 1) * 2;
+		grown = (tls_sock **)realloc(socks, len * sizeof(tls_sock *));
+		if (grown == NULL)
+			return -1;
+		memset(&grown[socks_len], 0, (len - socks_len) * sizeof(tls_sock *));
+		socks = grown;
+		socks_len = len;
+	}
+
+	socks[sockfd] = t;
+	return 0;
+}
+
+int tls_attach(int sockfd, const char *hostname, int port,
+				const socket_tls_options *opts)
+{
+	const char *name = opts->server_name ? opts->server_name : hostname;
+	struct in_addr ip;
+	tls_session_entry *cached;
+	tls_ctx_entry *entry;
+	tls_sock *t;
+	int n;
+
+	entry = ctx_get(opts);
+	if (entry == NULL)
+		return -1;
+
+	t = (tls_sock *)calloc(1, sizeof(tls_sock));
+	if (t == NULL)
+		return -1;
+	t->entry = entry;
+	n = snprintf(t->key, sizeof(t->key), "%s:%d %s", hostname, port, name);
+	if (n < 0 || n >= (int)sizeof(t->key))
+		t->key[0] = '\0';
+
+	t->ssl = SSL_new(entry->ctx);
+	if (t->ssl == NULL || SSL_set_fd(t->ssl, sockfd) != 1) {
+		print_ssl_err("Couldn't create TLS connection");
+		goto fail;
+	}
+	SSL_set_app_data(t->ssl, t);
+
+	/* No SNI for addresses, they are checked against IP entries. */
+	if (inet_pton(AF_INET, name, &ip) == 1) {
+		if (!opts->insecure)
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(t->ssl), name);
+	} else {
+		SSL_set_tlsext_host_name(t->ssl, name);
+		if (!opts->insecure)
+			SSL_set1_host(t->ssl, name);
+	}
+
+	cached = (t->key[0] != '\0') ? session_find(entry, t->key) : NULL;
+	if (cached != NULL && cached->session != NULL)
+		SSL_set_session(t->ssl, cached->session);
+
+	if (SSL_connect(t->ssl) != 1) {
+		print_ssl_err("TLS handshake failed");
+		goto fail;
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	t->ktls_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl)) > 0;
+#endif
+	print_dbg("TLS connected to %s:%d as %s, %s, session %s, kTLS send %s",
+				hostname, port, name, SSL_get_version(t->ssl),
+				SSL_session_reused(t->ssl) ? "resumed" : "new",
+				t->ktls_send ? "on" : "off");
+
+	if (sock_add(sockfd, t) < 0)
+		goto fail;
+
+	return 0;
+fail:
+	SSL_free(t->ssl);
+	free(t);
+	return -1;
+}
+
+int tls_attached(int sockfd)
+{
+	return sock_get(sockfd) != NULL;
+}
+
+int tls_ktls_send(int sockfd)
+{
+	tls_sock *t = sock_get(sockfd);
+
+	return (t != NULL) ? t->ktls_send : 0;
+}
+
+int tls_send(int sockfd, const uint8_t *buffer, int buffer_length)
+{
+	tls_sock *t = sock_get(sockfd);
+	size_t written;
+	ssize_t n;
+	int err;
+
+	if (t == NULL)
+		return -1;
+
+	/* The kernel builds the records, the socket is written as is. */
+	if (t->ktls_send) {
+		while (buffer_length > 0) {
+			n = send(sockfd, buffer, buffer_length, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				return -1;
+			buffer += n;
+			buffer_length -= (int)n;
+		}
+		return 0;
+	}
+
+	while (buffer_length > 0) {
+		if (SSL_write_ex(t->ssl, buffer, buffer_length, &written) == 1) {
+			buffer += written;
+			buffer_length -= (int)written;
+			continue;
+		}
+
+		err = SSL_get_error(t->ssl, 0);
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+			print_ssl_err("TLS send failed");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+int tls_receive(int sockfd, uint8_t *buffer, int buffer_length,
+				int timeout_ms)
+{
+	tls_sock *t = sock_get(sockfd);
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	long deadline_ms = now_ms() + timeout_ms;
+	int remaining = timeout_ms, ret, err;
+	size_t n;
+
+	if (t == NULL)
+		return -1;
+
+	for (;;) {
+		/* Records already decrypted by OpenSSL are not seen by poll. */
+		if (SSL_pending(t->ssl) == 0) {
+			if (timeout_ms >= 0) {
+				remaining = (int)(deadline_ms - now_ms());
+				if (remaining < 0)
+					remaining = 0;
+			}
+			ret = poll(&pfd, 1, remaining);
+			if (ret < 0)
+				return -1;
+			if (ret == 0)
+				return 0;
+		}
+
+		if (SSL_read_ex(t->ssl, buffer, buffer_length, &n) == 1)
+			return (int)n;
+
+		err = SSL_get_error(t->ssl, 0);
+		if (err == SSL_ERROR_ZERO_RETURN)
+			return -1;
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+			print_ssl_err("TLS receive failed");
+			return -1;
+		}
+	}
+}
+
+void tls_detach(int sockfd)
+{
+	tls_sock *t = sock_get(sockfd);
+
+	if (t == NULL)
+		return;
+
+	SSL_shutdown(t->ssl);
+	SSL_free(t->ssl);
+	free(t);
+	socks[sockfd] = NULL;
+}
+
+#else /* MQTT_WITH_TLS */
+
+int tls_attach(int sockfd, const char *hostname, int port,
+				const socket_tls_options *opts)
+{
+	(void)sockfd;
+	(void)hostname;
+	(void)port;
+	(void)opts;
+	print_err("Built without TLS, add -DMQTT_WITH_TLS -lssl -lcrypto");
+	return -1;
+}
+
+int tls_attached(int sockfd)
+{
+	(void)sockfd;
+	return 0;
+}
+
+int tls_ktls_send(int sockfd)
+{
+	(void)sockfd;
+	return 0;
+}
+
+int tls_send(int sockfd, const uint8_t *buffer, int buffer_length)
+{
+	(void)sockfd;
+	(void)buffer;
+	(void)buffer_length;
+	return -1;
+}
+
+int tls_receive(int sockfd, uint8_t *buffer, int buffer_length,
+				int timeout_ms)
+{
+	(void)sockfd;
+	(void)buffer;
+	(void)buffer_length;
+	(void)timeout_ms;
+	return -1;
+}
+
+void tls_detach(int sockfd)
+{
+	(void)sockfd;
+}
+
+#endif /* MQTT_WITH_TLS */
@@ -0,0 +1,98 @@
+/**
+ * @file network_tls.h
+ * @brief TLS socket layer declaration, OpenSSL based.
+ * Built with -DMQTT_WITH_TLS -lssl -lcrypto, otherwise TLS sockets can not
+ * be created.
+ *
+ * Sessions are cached per broker host, port and server name, apart for
+ * each set of CA, client certificate and verification options: reconnecting
+ * to the same broker with the same options resumes the last session from
+ * its ticket instead of doing a full handshake. Sessions of connections
+ * that were not verified are never offered by verifying ones. Where the kernel supports it (tls module, OpenSSL 3 built with
+ * kTLS), record encryption is moved to the kernel after the handshake and
+ * sends go straight to the socket.
+ */
+
+#ifndef _NETWORK_TLS_H_
+#define _NETWORK_TLS_H_
+
+#include "stdint.h"
+
+#define MQTT_TLS_PORT 8883
+
+/**
+ * @brief TLS options, a zero value verifies the broker with the system CA
+ * paths.
+ * ca_file: PEM file of trusted CAs, NULL for the system defaults.
+ * cert_file: PEM client certificate, NULL for none.
+ * key_file: PEM client private key, needed with cert_file.
+ * server_name: Name sent with SNI and checked in the broker certificate,
+ * the hostname by default.
+ * insecure: Do not verify the broker certificate, for tests only.
+ * disable_ktls: Keep record encryption in user space.
+ */
+typedef struct {
+    const char *ca_file;
+    const char *cert_file;
+    const char *key_file;
+    const char *server_name;
+    int insecure;
+    int disable_ktls;
+} socket_tls_options;
+
+/**
+ * @brief Run the TLS handshake on a connected socket, resuming the cached
+ * session of the broker if any.
+ * @param sockfd Connected socket handler.
+ * @param hostname Broker hostname, with port and server name the session
+ * cache key.
+ * @param port Broker port.
+ * @param opts TLS options.
+ * @return 0 if success or -1 if fail.
+ */
+int tls_attach(int sockfd, const char *hostname, int port,
+                const socket_tls_options *opts);
+
+/**
+ * @brief Check if a socket uses TLS.
+ * @param sockfd Socket handler.
+ * @return 1 if attached or 0 if not.
+ */
+int tls_attached(int sockfd);
+
+/**
+ * @brief Check if the kernel encrypts the records sent on a socket (kTLS).
+ * @param sockfd Socket handler.
+ * @return 1 if so or 0 if not or not attached.
+ */
+int tls_ktls_send(int sockfd);
+
+/**
+ * @brief Send over TLS, see socket_send.
+ * @param sockfd Socket handler.
+ * @param buffer Buffer to send.
+ * @param buffer_length Buffer length to send.
+ * @return 0 if success or -1 if fail.
+ */
+int tls_send(int sockfd, const uint8_t *buffer, int buffer_length);
+
+/**
+ * @brief Receive over TLS, see socket_receive_timeout.
+ * @param sockfd Socket handler.
+ * @param buffer Buffer to receive.
+ * @param buffer_length Buffer length.
+ * @param timeout_ms Maximum time to wait, -1 waits forever.
+ * @return Number of bytes received, 0 if timed out or -1 if fail or closed.
+ */
+int tls_receive(int sockfd, uint8_t *buffer, int buffer_length,
+                int timeout_ms);
+
+/**
+ * @brief Send close_notify and release the TLS state. The socket itself is
+ * not closed.
+ * @param sockfd Socket handler.
+ * @return None.
+ */
+void tls_detach(int sockfd);
+
+#endif /* _NETWORK_TLS_H_ */
@@ -0,0 +1,700 @@
+/**
+ * @file network_uring.c
+ * @brief io_uring socket backend implementation, raw system calls only.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "time.h"
+
+#include "network.h"
+#include "network_uring.h"
+
+#ifdef NETWORK_WITH_URING
+
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+#include "sys/uio.h"
+#include "linux/io_uring.h"
+
+#define URING_ENTRIES 256
+/* Registered buffer table size, sockets above it send from plain memory. */
+#define URING_MAX_FIXED 1024
+
+/* user_data: socket in the high bits, operation in the low byte. */
+#define URING_OP_SEND 1
+#define URING_OP_RECV 2
+#define URING_OP_CANCEL 3
+#define URING_DATA(fd, op) (((uint64_t)(fd) << 8) | (op))
+/* Longest wait for queued sends and the receive cancel on detach. */
+#define URING_DETACH_TIMEOUT_MS 1000
+
+typedef struct {
+	int fd;
+	/* tx[0, tx_inflight) is being sent, tx[tx_inflight, tx_len) is queued. */
+	uint8_t *tx;
+	int tx_size;
+	int tx_len;
+	int tx_inflight;
+	int fixed;
+	int queued;
+	int error;
+	int eof;
+	int recv_armed;
+	struct io_uring_buf_ring *br;
+	uint16_t br_tail;
+	uint8_t *rx;
+	/* Filled receive buffers, oldest first, rx_off bytes of the oldest
+	 * already returned. */
+	uint16_t rx_bid[URING_RX_BUFS];
+	int rx_len[URING_RX_BUFS];
+	int rx_head;
+	int rx_count;
+	int rx_off;
+} uring_sock;
+
+static struct {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int to_submit;
+	int fixed_ok;
+	uring_sock **socks;
+	int socks_len;
+	/* Sockets with queued bytes and no send in flight. */
+	int *queue;
+	int queue_len;
+} ring = { .fd = -1 };
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned int to_submit, unsigned int min_complete,
+						unsigned int flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit,
+						min_complete, flags, arg, argsz);
+}
+
+static int sys_register(unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg,
+						nr_args);
+}
+
+static int ring_init(void)
+{
+	struct io_uring_params p;
+	struct io_uring_rsrc_register reg;
+	size_t sq_len, cq_len;
+	uint8_t *sq, *cq;
+	unsigned int *array;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	ring.fd = sys_setup(URING_ENTRIES, &p);
+	if (ring.fd < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		ring.fd = sys_setup(URING_ENTRIES, &p);
+	}
+	if (ring.fd < 0) {
+		print_wrn("io_uring_setup failed, errno %d", errno);
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+		!(p.features & IORING_FEAT_EXT_ARG)) {
+		print_wrn("io_uring too old");
+		goto fail;
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len)
+		sq_len = cq_len;
+
+	sq = (uint8_t *)mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, ring.fd,
+							IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	cq = sq;
+
+	ring.sqes = (struct io_uring_sqe *)mmap(NULL,
+							p.sq_entries * sizeof(struct io_uring_sqe),
+							PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+							ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto fail;
+
+	ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring.sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	ring.sq_entries = p.sq_entries;
+	ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring.cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Submission entries are always used in ring order. */
+	array = (unsigned int *)(sq + p.sq_off.array);
+	for (unsigned int i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	/* Empty registered buffer table, filled as sockets attach. */
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = URING_MAX_FIXED;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	ring.fixed_ok = (sys_register(IORING_REGISTER_BUFFERS2, &reg,
+									sizeof(reg)) == 0);
+	if (!ring.fixed_ok)
+		print_wrn("io_uring registered buffers unavailable");
+
+	return 0;
+fail:
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+}
+
+static int ring_enter(unsigned int min_complete, int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = 0;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	if (min_complete > 0) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+	}
+
+	ret = sys_enter(ring.to_submit, min_complete, flags, &arg, sizeof(arg));
+	if (ret < 0) {
+		if (errno == ETIME || errno == EINTR || errno == EBUSY)
+			return 0;
+		print_err("io_uring_enter failed, errno %d", errno);
+		return -1;
+	}
+
+	ring.to_submit -= (unsigned int)ret;
+	return 0;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	unsigned int tail = *ring.sq_tail;
+	struct io_uring_sqe *sqe;
+
+	while (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >=
+			ring.sq_entries) {
+		if (ring_enter(0, 0) < 0)
+			return NULL;
+	}
+
+	sqe = &ring.sqes[tail & ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void commit_sqe(void)
+{
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+	ring.to_submit++;
+}
+
+static uring_sock *sock_get(int sockfd)
+{
+	if (sockfd < 0 || sockfd >= ring.socks_len)
+		return NULL;
+
+	return ring.socks[sockfd];
+}
+
+static int queue_send(uring_sock *s)
+{
+	int *grown;
+
+	if (s->queued)
+		return 0;
+
+	grown = (int *)realloc(ring.queue, (ring.queue_len + 1) * sizeof(int));
+	if (grown == NULL)
+		return -1;
+
+	ring.queue = grown;
+	ring.queue[ring.queue_len++] = s->fd;
+	s->queued = 1;
+	return 0;
+}
+
+static void recycle_rx(uring_sock *s, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &s->br->bufs[s->br_tail & (URING_RX_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(s->rx + (size_t)bid * URING_RX_BUF_SIZE);
+	buf->len = URING_RX_BUF_SIZE;
+	buf->bid = bid;
+	s->br_tail++;
+	__atomic_store_n(&s->br->tail, s->br_tail, __ATOMIC_RELEASE);
+}
+
+static int arm_recv(uring_sock *s)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = s->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = (uint16_t)s->fd;
+	sqe->user_data = URING_DATA(s->fd, URING_OP_RECV);
+	commit_sqe();
+
+	s->recv_armed = 1;
+	return 0;
+}
+
+static void complete_send(uring_sock *s, int res)
+{
+	if (res < 0 && res != -EAGAIN && res != -EINTR) {
+		print_err("Send failed, errno %d", -res);
+		s->error = -res;
+		s->tx_len = s->tx_inflight = 0;
+		return;
+	}
+
+	/* Short sends leave the rest at the start of the queue. */
+	if (res > 0) {
+		memmove(s->tx, s->tx + res, s->tx_len - res);
+		s->tx_len -= res;
+	}
+	s->tx_inflight = 0;
+	if (s->tx_len > 0)
+		queue_send(s);
+}
+
+static void complete_recv(uring_sock *s, int res, uint32_t flags)
+{
+	int i;
+
+	if (!(flags & IORING_CQE_F_MORE))
+		s->recv_armed = 0;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		if (res > 0) {
+			i = (s->rx_head + s->rx_count) % URING_RX_BUFS;
+			s->rx_bid[i] = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+			s->rx_len[i] = res;
+			s->rx_count++;
+		} else {
+			recycle_rx(s, (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT));
+		}
+	}
+
+	if (res == 0)
+		s->eof = 1;
+	else if (res < 0 && res != -ENOBUFS && res != -ECANCELED)
+		s->error = -res;
+}
+
+static void reap(void)
+{
+	unsigned int head = *ring.cq_head;
+	struct io_uring_cqe *cqe;
+	uring_sock *s;
+
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring.cqes[head & ring.cq_mask];
+		s = sock_get((int)(cqe->user_data >> 8));
+		if (s != NULL) {
+			switch (cqe->user_data & 0xFF) {
+				case URING_OP_SEND:
+					complete_send(s, cqe->res);
+					break;
+				case URING_OP_RECV:
+					complete_recv(s, cqe->res, cqe->flags);
+					break;
+			}
+		}
+		head++;
+	}
+
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Prepare one send per socket with queued bytes, without submitting. */
+static int prepare_sends(void)
+{
+	struct io_uring_sqe *sqe;
+	uring_sock *s;
+	int i;
+
+	for (i = 0; i < ring.queue_len; i++) {
+		s = sock_get(ring.queue[i]);
+		if (s == NULL)
+			continue;
+		s->queued = 0;
+		if (s->tx_inflight > 0 || s->tx_len == 0 || s->error)
+			continue;
+
+		sqe = get_sqe();
+		if (sqe == NULL)
+			return -1;
+		if (s->fixed >= 0) {
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = (uint16_t)s->fixed;
+			sqe->off = (uint64_t)-1;
+		} else {
+			sqe->opcode = IORING_OP_SEND;
+		}
+		sqe->fd = s->fd;
+		sqe->addr = (uint64_t)(uintptr_t)s->tx;
+		sqe->len = (uint32_t)s->tx_len;
+		sqe->user_data = URING_DATA(s->fd, URING_OP_SEND);
+		commit_sqe();
+		s->tx_inflight = s->tx_len;
+	}
+	ring.queue_len = 0;
+
+	return 0;
+}
+
+static int register_tx(uring_sock *s)
+{
+	struct io_uring_rsrc_update2 up;
+	struct iovec iov;
+
+	if (s->fixed < 0)
+		return 0;
+
+	iov.iov_base = s->tx;
+	iov.iov_len = s->tx ? s->tx_size : 0;
+	memset(&up, 0, sizeof(up));
+	up.offset = (uint32_t)s->fixed;
+	up.data = (uint64_t)(uintptr_t)&iov;
+	up.nr = 1;
+
+	if (sys_register(IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) < 0) {
+		print_wrn("Couldn't register send buffer, errno %d", errno);
+		s->fixed = -1;
+	}
+
+	return 0;
+}
+
+static int register_rx(uring_sock *s, int enable)
+{
+	struct io_uring_buf_reg reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = (uint16_t)s->fd;
+	if (!enable)
+		return sys_register(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+	reg.ring_addr = (uint64_t)(uintptr_t)s->br;
+	reg.ring_entries = URING_RX_BUFS;
+	if (sys_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	for (uint16_t bid = 0; bid < URING_RX_BUFS; bid++)
+		recycle_rx(s, bid);
+
+	return 0;
+}
+
+static void sock_free(uring_sock *s)
+{
+	if (s == NULL)
+		return;
+
+	ring.socks[s->fd] = NULL;
+	if (s->br != NULL)
+		munmap(s->br, URING_RX_BUFS * sizeof(struct io_uring_buf));
+	free(s->rx);
+	free(s->tx);
+	free(s);
+}
+
+int uring_attach(int sockfd)
+{
+	uring_sock **grown, *s;
+	int len;
+
+	if (sockfd < 0 || sockfd > UINT16_MAX)
+		return -1;
+	if (ring.fd < 0 && ring_init() < 0)
+		return -1;
+
+	if (sockfd >= ring.socks_len) {
+		len = (sockfd + 1) * 2;
+		grown = (uring_sock **)realloc(ring.socks, len * sizeof(uring_sock *));
+		if (grown == NULL)
+			return -1;
+		memset(&grown[ring.socks_len], 0,
+				(len - ring.socks_len) * sizeof(uring_sock *));
+		ring.socks = grown;
+		ring.socks_len = len;
+	}
+
+	s = (uring_sock *)calloc(1, sizeof(uring_sock));
+	if (s == NULL)
+		return -1;
+	ring.socks[sockfd] = s;
+
+	s->fd = sockfd;
+	s->fixed = (ring.fixed_ok && sockfd < URING_MAX_FIXED) ? sockfd : -1;
+	s->tx_size = URING_TX_SIZE;
+	s->tx = (uint8_t *)malloc(s->tx_size);
+	s->rx = (uint8_t *)malloc((size_t)URING_RX_BUFS * URING_RX_BUF_SIZE);
+	s->br = (struct io_uring_buf_ring *)mmap(NULL,
+							URING_RX_BUFS * sizeof(struct io_uring_buf),
+							PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (s->br == MAP_FAILED)
+		s->br = NULL;
+	if (s->tx == NULL || s->rx == NULL || s->br == NULL)
+		goto fail;
+
+	if (register_rx(s, 1) < 0) {
+		print_wrn("Couldn't register receive buffers, errno %d", errno);
+		goto fail;
+	}
+	register_tx(s);
+
+	return 0;
+fail:
+	sock_free(s);
+	return -1;
+}
+
+int uring_attached(int sockfd)
+{
+	return sock_get(sockfd) != NULL;
+}
+
+int uring_flush(void)
+{
+	if (ring.fd < 0)
+		return 0;
+
+	reap();
+	if (prepare_sends() < 0)
+		return -1;
+	if (ring.to_submit == 0)
+		return 0;
+
+	return ring_enter(0, 0);
+}
+
+/* Wait for at least one completion. */
+static int wait_cqe(int timeout_ms)
+{
+	if (prepare_sends() < 0 || ring_enter(1, timeout_ms) < 0)
+		return -1;
+
+	reap();
+	return 0;
+}
+
+int uring_send(int sockfd, const uint8_t *buffer, int buffer_length)
+{
+	uring_sock *s = sock_get(sockfd);
+	uint8_t *grown;
+
+	if (s == NULL || buffer == NULL || buffer_length < 0)
+		return -1;
+
+	reap();
+	while (!s->error && s->tx_len + buffer_length > s->tx_size) {
+		if (s->tx_len > 0) {
+			if (wait_cqe(-1) < 0)
+				return -1;
+			continue;
+		}
+
+		/* Nothing in flight, the registered buffer may be replaced. */
+		grown = (uint8_t *)realloc(s->tx, buffer_length);
+		if (grown == NULL)
+			return -1;
+		s->tx = grown;
+		s->tx_size = buffer_length;
+		register_tx(s);
+	}
+	if (s->error)
+		return -1;
+
+	memcpy(&s->tx[s->tx_len], buffer, buffer_length);
+	s->tx_len += buffer_length;
+	if (s->tx_inflight == 0 && queue_send(s) < 0)
+		return -1;
+
+	if (s->tx_len - s->tx_inflight >= URING_FLUSH_BYTES)
+		return uring_flush();
+
+	return 0;
+}
+
+static int copy_rx(uring_sock *s, uint8_t *buffer, int buffer_length)
+{
+	int copied = 0, n;
+
+	while (s->rx_count > 0 && copied < buffer_length) {
+		n = s->rx_len[s->rx_head] - s->rx_off;
+		if (n > buffer_length - copied)
+			n = buffer_length - copied;
+		memcpy(&buffer[copied],
+				s->rx + (size_t)s->rx_bid[s->rx_head] * URING_RX_BUF_SIZE +
+				s->rx_off, n);
+		copied += n;
+		s->rx_off += n;
+
+		if (s->rx_off == s->rx_len[s->rx_head]) {
+			recycle_rx(s, s->rx_bid[s->rx_head]);
+			s->rx_head = (s->rx_head + 1) % URING_RX_BUFS;
+			s->rx_count--;
+			s->rx_off = 0;
+		}
+	}
+
+	return copied;
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+int uring_receive(int sockfd, uint8_t *buffer, int buffer_length,
+					int timeout_ms)
+{
+	uring_sock *s = sock_get(sockfd);
+	long deadline_ms = now_ms() + timeout_ms;
+	int remaining = timeout_ms;
+
+	if (s == NULL || buffer == NULL || buffer_length <= 0)
+		return -1;
+
+	for (;;) {
+		reap();
+		if (s->rx_count > 0)
+			return copy_rx(s, buffer, buffer_length);
+		if (s->eof || s->error)
+			return -1;
+		/* Buffers were all in use, all returned by now. */
+		if (!s->recv_armed && arm_recv(s) < 0)
+			return -1;
+
+		if (timeout_ms >= 0) {
+			remaining = (int)(deadline_ms - now_ms());
+			if (remaining < 0)
+				remaining = 0;
+		}
+		if (wait_cqe(remaining) < 0)
+			return -1;
+		if (s->rx_count == 0 && timeout_ms >= 0 && now_ms() >= deadline_ms)
+			return 0;
+	}
+}
+
+void uring_detach(int sockfd)
+{
+	uring_sock *s = sock_get(sockfd);
+	long deadline_ms = now_ms() + URING_DETACH_TIMEOUT_MS;
+	struct io_uring_sqe *sqe;
+
+	if (s == NULL)
+		return;
+
+	/* Finish queued sends, then cancel the receive, so nothing refers to
+	 * the socket or its buffers once it is closed. */
+	while (!s->error && s->tx_len > 0 && now_ms() < deadline_ms)
+		wait_cqe((int)(deadline_ms - now_ms()));
+
+	if (s->recv_armed) {
+		sqe = get_sqe();
+		if (sqe != NULL) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_DATA(s->fd, URING_OP_RECV);
+			sqe->user_data = URING_DATA(s->fd, URING_OP_CANCEL);
+			commit_sqe();
+		}
+		while (s->recv_armed && now_ms() < deadline_ms)
+			wait_cqe((int)(deadline_ms - now_ms()));
+	}
+
+	register_rx(s, 0);
+	if (s->fixed >= 0) {
+		free(s->tx);
+		s->tx = NULL;
+		register_tx(s);
+	}
+	sock_free(s);
+}
+
+#else /* NETWORK_WITH_URING */
+
+int uring_attach(int sockfd)
+{
+	(void)sockfd;
+	print_wrn("Built without io_uring");
+	return -1;
+}
+
+int uring_attached(int sockfd)
+{
+	(void)sockfd;
+	return 0;
+}
+
+int uring_send(int sockfd, const uint8_t *buffer, int buffer_length)
+{
+	(void)sockfd;
+	(void)buffer;
+	(void)buffer_length;
+	return -1;
+}
+
+int uring_flush(void)
+{
+	return 0;
+}
+
+int uring_receive(int sockfd, uint8_t *buffer, int buffer_length,
+					int timeout_ms)
+{
+	(void)sockfd;
+	(void)buffer;
+	(void)buffer_length;
+	(void)timeout_ms;
+	return -1;
+}
+
+void uring_detach(int sockfd)
+{
+	(void)sockfd;
+}
+
+#endif /* NETWORK_WITH_URING */
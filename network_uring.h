@@ -0,0 +1,85 @@
+/**
+ * @file network_uring.h
+ * @brief io_uring socket backend declaration, used by network.c only.
+ *
+ * All sockets share one ring. Sends are copied into a per socket buffer
+ * registered with the ring and are not submitted one by one: queued bytes
+ * leave with the next receive, close or once URING_FLUSH_BYTES are queued,
+ * so many sends of many sockets go in a single io_uring_enter and each
+ * socket has at most one send in flight, always its whole queue.
+ * Receives use a multishot recv armed once per socket, filling buffers of a
+ * per socket provided buffer ring.
+ *
+ * Available when built on Linux with linux/io_uring.h, kernel 5.19 or later
+ * is needed at runtime for multishot receive.
+ */
+
+#ifndef _NETWORK_URING_H_
+#define _NETWORK_URING_H_
+
+#include "stdint.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include("linux/io_uring.h")
+#define NETWORK_WITH_URING
+#endif
+#endif
+
+/* Send buffer of a socket, grown for larger packets. */
+#define URING_TX_SIZE 65536
+/* Queued bytes of a socket submitted without waiting for a receive. */
+#define URING_FLUSH_BYTES 16384
+/* Receive buffers of a socket, a power of 2. */
+#define URING_RX_BUFS 8
+#define URING_RX_BUF_SIZE 8192
+
+/**
+ * @brief Set up the ring if needed and attach a connected socket to it.
+ * @param sockfd Socket handler.
+ * @return 0 if success or -1 if io_uring is not available.
+ */
+int uring_attach(int sockfd);
+
+/**
+ * @brief Check if a socket uses the io_uring backend.
+ * @param sockfd Socket handler.
+ * @return 1 if attached or 0 if not.
+ */
+int uring_attached(int sockfd);
+
+/**
+ * @brief Queue bytes to send, see socket_send.
+ * @param sockfd Socket handler.
+ * @param buffer Bytes to send, copied.
+ * @param buffer_length Number of bytes.
+ * @return 0 if success or -1 if fail, including a previous send failure.
+ */
+int uring_send(int sockfd, const uint8_t *buffer, int buffer_length);
+
+/**
+ * @brief Submit the queued sends of every socket.
+ * @return 0 if success or -1 if fail.
+ */
+int uring_flush(void);
+
+/**
+ * @brief Receive, see socket_receive_timeout. Queued sends are submitted
+ * first.
+ * @param sockfd Socket handler.
+ * @param buffer Buffer to receive.
+ * @param buffer_length Buffer length.
+ * @param timeout_ms Maximum time to wait, -1 waits forever.
+ * @return Number of bytes received, 0 if timed out or -1 if fail or closed.
+ */
+int uring_receive(int sockfd, uint8_t *buffer, int buffer_length,
+                    int timeout_ms);
+
+/**
+ * @brief Send what is queued, stop receiving and detach a socket. The
+ * socket itself is not closed.
+ * @param sockfd Socket handler.
+ * @return None.
+ */
+void uring_detach(int sockfd);
+
+#endif /* _NETWORK_URING_H_ */
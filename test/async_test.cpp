@@ -0,0 +1,327 @@
+/**
+ * @file async_test.cpp
+ * @brief mqtt_async.hpp coroutines against the mqtt_mock broker: tasks
+ * subscribe, publish at QoS 1 and 2 and take the messages the mock sends
+ * back. Once a first round warmed up the pools, a second round must reuse
+ * the same arena frames and allocate nothing, C library included. A task
+ * closing the client when resumed must not break the mqtt_loop that
+ * completed its operation.
+ *
+ * $ make -C test
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mqtt_async.hpp"
+
+/* Heap allocations of the test, of its coroutine frames and, through
+ * -Wl,--wrap, of the C library. */
+static long allocations;
+
+extern "C" {
+void *__real_malloc(std::size_t size);
+void *__real_calloc(std::size_t n, std::size_t size);
+void *__real_realloc(void *p, std::size_t size);
+
+void *__wrap_malloc(std::size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(std::size_t n, std::size_t size)
+{
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, std::size_t size)
+{
+    allocations++;
+    return __real_realloc(p, size);
+}
+}
+
+void *operator new(std::size_t size)
+{
+    void *p = std::malloc(size);
+
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+#define TOPIC "async/t"
+#define FILTER "async/#"
+/* Publishes of a round, alternating QoS 1 and 2. */
+#define ROUND 16
+#define RUN_MS 50
+#define RUNS_MAX 200
+
+int checks;
+int failures;
+
+void check(bool ok, const char *what)
+{
+    checks++;
+    if (!ok) {
+        failures++;
+        std::fprintf(stderr, "FAIL %s\n", what);
+    }
+}
+
+/* State of a round, written by its tasks. */
+struct round_state {
+    int published = 0;
+    int publish_errors = 0;
+    int received = 0;
+    int out_of_order = 0;
+    bool closed = false;
+    /* A local of each task, it lives in the coroutine frame. */
+    const void *producer_frame = nullptr;
+    const void *consumer_frame = nullptr;
+};
+
+mqtt::task subscriber(mqtt::client &c, int &granted)
+{
+    granted = co_await c.subscribe(FILTER, SUBSCRIBE_QOS_1);
+}
+
+mqtt::task producer(mqtt::client &c, round_state &r)
+{
+    char payload[16];
+    mqtt_publish_flags qos;
+
+    r.producer_frame = payload;
+    for (int i = 0; i < ROUND; i++) {
+        qos = (i % 2 == 0) ? PUBLISH_FLAG_QOS_2 : PUBLISH_FLAG_QOS_3;
+        std::snprintf(payload, sizeof(payload), "m%d", i);
+        if (co_await c.publish(qos, TOPIC, payload) == 0)
+            r.published++;
+        else
+            r.publish_errors++;
+    }
+}
+
+/* The mock delivers every publish back, at QoS 0. */
+mqtt::task consumer(mqtt::client &c, round_state &r)
+{
+    char expect[16];
+
+    r.consumer_frame = expect;
+    while (r.received < ROUND) {
+        auto msg = co_await c.next_message();
+        if (!msg)
+            break;
+        std::snprintf(expect, sizeof(expect), "m%d", r.received);
+        if (msg->topic != TOPIC || msg->payload.size() != std::strlen(expect) ||
+            std::memcmp(msg->payload.data(), expect, msg->payload.size()) != 0)
+            r.out_of_order++;
+        r.received++;
+    }
+}
+
+/* Closes the client as soon as its publish completes, then once a
+ * message arrives. */
+mqtt::task closer(mqtt::client &c, round_state &r, bool on_message)
+{
+    if (on_message) {
+        auto msg = co_await c.next_message();
+        r.received += msg ? 1 : 0;
+    } else {
+        r.published += (co_await c.publish(PUBLISH_FLAG_QOS_2, TOPIC, "x")
+                            == 0) ? 1 : 0;
+    }
+    c.close();
+    r.closed = true;
+}
+
+template <typename F>
+bool run_until(mqtt::client &c, F done)
+{
+    for (int i = 0; i < RUNS_MAX && !done(); i++) {
+        if (c.run(RUN_MS) < 0)
+            break;
+    }
+    return done();
+}
+
+/* Start the mock broker on a free loopback port, once it listens. */
+pid_t start_mock(int &port)
+{
+    struct sockaddr_in addr = {};
+    socklen_t addr_len = sizeof(addr);
+    char buf[64], arg[8];
+    struct pollfd pfd;
+    int fd, out[2];
+    pid_t pid;
+    ssize_t n;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0 ||
+        pipe(out) < 0)
+        return -1;
+    port = ntohs(addr.sin_port);
+    close(fd);
+
+    pid = fork();
+    if (pid == 0) {
+        /* Not left behind by a test aborted by a sanitizer. */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        std::snprintf(arg, sizeof(arg), "%d", port);
+        dup2(out[1], STDOUT_FILENO);
+        execl("./mqtt_mock", "mqtt_mock", arg, (char *)nullptr);
+        _exit(1);
+    }
+    close(out[1]);
+
+    /* "Listening on port" */
+    pfd = {out[0], POLLIN, 0};
+    n = (pid > 0 && poll(&pfd, 1, 5000) == 1) ?
+            read(out[0], buf, sizeof(buf)) : -1;
+    close(out[0]);
+    if (n <= 0) {
+        if (pid > 0)
+            kill(pid, SIGTERM);
+        return -1;
+    }
+
+    return pid;
+}
+
+int connect_mock(int port, const char *id)
+{
+    return mqtt_connect("127.0.0.1", port, id, (mqtt_connect_flags)0, 60,
+                        nullptr, nullptr);
+}
+
+/* Both rounds get the same frames, in either order. */
+bool same_frames(const round_state &a, const round_state &b)
+{
+    return (a.producer_frame == b.producer_frame &&
+            a.consumer_frame == b.consumer_frame) ||
+            (a.producer_frame == b.consumer_frame &&
+            a.consumer_frame == b.producer_frame);
+}
+
+void test_rounds(int port)
+{
+    /* Before the client, which resumes its tasks when destroyed. */
+    round_state first, second;
+    int granted = -1;
+    mqtt::client c(connect_mock(port, "asyncrounds"));
+    bool subscribed = false;
+    long before;
+
+    check(c.socket() >= 0, "connect");
+    subscriber(c, granted);
+    for (int i = 0; i < RUNS_MAX && granted < 0; i++)
+        c.run(RUN_MS);
+    subscribed = (granted == SUBSCRIBE_QOS_1);
+    check(subscribed, "subscribe granted");
+    if (!subscribed)
+        return;
+
+    /* The first round grows the pools and the arena, and the backlog to
+     * every message of a round: they are all taken once published. */
+    producer(c, first);
+    check(run_until(c, [&] {
+                return first.published + first.publish_errors == ROUND;
+            }),
+            "first round published");
+    consumer(c, first);
+    check(run_until(c, [&] { return first.received == ROUND; }),
+            "first round received");
+    check(first.publish_errors == 0 && first.out_of_order == 0,
+            "first round in order");
+
+    before = allocations;
+    consumer(c, second);
+    producer(c, second);
+    check(run_until(c, [&] {
+                return second.published == ROUND && second.received == ROUND;
+            }), "second round done");
+    check(second.publish_errors == 0 && second.out_of_order == 0,
+            "second round in order");
+    check(allocations == before, "nothing allocated per operation");
+    check(same_frames(first, second), "arena frames reused");
+}
+
+/* The operation completes from within mqtt_loop, the task resumed closes
+ * the session mqtt_loop was using. Under AddressSanitizer a resume from
+ * within the callbacks would be a use after free. */
+void test_close(int port, bool on_message)
+{
+    round_state r;
+    int granted = -1;
+    mqtt::client c(connect_mock(port, "asyncclose"));
+
+    check(c.socket() >= 0, "connect");
+    subscriber(c, granted);
+    for (int i = 0; i < RUNS_MAX && granted < 0; i++)
+        c.run(RUN_MS);
+    check(granted == SUBSCRIBE_QOS_1, "subscribe granted");
+
+    closer(c, r, on_message);
+    if (on_message) {
+        /* Several messages read by the same mqtt_loop. */
+        for (int i = 0; i < 4; i++)
+            mqtt_publish_async(c.socket(), PUBLISH_FLAG_QOS_1, TOPIC,
+                                (const uint8_t *)"y", 1, nullptr, nullptr);
+    }
+    check(run_until(c, [&] { return r.closed; }),
+            "closed from a resumed task");
+    check(r.published + r.received == 1, "operation completed first");
+    check(c.socket() < 0 && c.run(RUN_MS) < 0, "client closed");
+}
+
+}
+
+int main()
+{
+    int port = -1, status;
+    pid_t mock;
+
+    /* Traces go to stdout. */
+    if (std::freopen("/dev/null", "w", stdout) == nullptr)
+        return 1;
+    mock = start_mock(port);
+    check(mock > 0, "start mqtt_mock");
+    if (mock > 0) {
+        test_rounds(port);
+        test_close(port, false);
+        test_close(port, true);
+        kill(mock, SIGTERM);
+        waitpid(mock, &status, 0);
+    }
+
+    std::fprintf(stderr, "async: %d checks, %d failures\n", checks, failures);
+    return (failures == 0) ? 0 : 1;
+}
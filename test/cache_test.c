@@ -0,0 +1,257 @@
+/**
+ * @file cache_test.c
+ * @brief Last known value cache: stores and removals, CLOCK eviction once
+ * the pool is full, filter drops, then lock free readers against a writer
+ * that updates their topics and churns others, so the index is rebuilt
+ * while they read. Readers must never miss a topic that stays cached nor
+ * see a torn or older value.
+ *
+ * $ make -C test
+ * $ make -C test tsan
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "pthread.h"
+
+#include "mqtt_cache.h"
+
+#define RETAIN 0x01
+/* Topics read by the reader threads, updated by the writer. */
+#define STABLE_TOPICS 16
+#define READERS 3
+#define WRITES 200000
+/* Bytes of a value: version, then bytes derived from it. */
+#define VALUE_LEN 64
+
+static int checks;
+static int failures;
+
+static atomic_int stop;
+static atomic_int reader_misses;
+static atomic_int reader_torn;
+static atomic_int reader_older;
+static atomic_long reader_reads;
+
+static void check(int ok, const char *what)
+{
+	checks++;
+	if (!ok) {
+		failures++;
+		fprintf(stderr, "FAIL %s\n", what);
+	}
+}
+
+static int put(mqtt_cache *c, const char *topic, const char *payload,
+				uint8_t flags)
+{
+	return mqtt_cache_put(c, topic, strlen(topic), (const uint8_t *)payload,
+							strlen(payload), flags);
+}
+
+/* 1 if topic holds payload. */
+static int holds(mqtt_cache *c, const char *topic, const char *payload)
+{
+	uint8_t buf[256];
+	int len;
+
+	len = mqtt_cache_get(c, topic, strlen(topic), buf, sizeof(buf), NULL);
+	return len == (int)strlen(payload) && memcmp(buf, payload, len) == 0;
+}
+
+static int cached(mqtt_cache *c, const char *topic)
+{
+	uint8_t buf[256];
+
+	return mqtt_cache_get(c, topic, strlen(topic), buf, sizeof(buf),
+							NULL) >= 0;
+}
+
+static void test_put_get(void)
+{
+	mqtt_cache *c = mqtt_cache_create(65536, 64);
+	char big[128];
+	uint8_t flags = 0, buf[8];
+
+	check(c != NULL, "create");
+	check(put(c, "a/b", "one", 0) == 0 && holds(c, "a/b", "one"), "put");
+	check(put(c, "a/b", "two", RETAIN) == 0 && holds(c, "a/b", "two"),
+			"replace");
+	mqtt_cache_get(c, "a/b", 3, buf, sizeof(buf), &flags);
+	check(flags == RETAIN, "flags");
+	check(mqtt_cache_get(c, "a/b", 3, buf, 2, NULL) == 3, "short buffer");
+	check(!cached(c, "a/c"), "miss");
+
+	/* A value too large removes the stale one. */
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	check(put(c, "a/b", big, 0) == 1 && !cached(c, "a/b"), "too large");
+
+	/* Empty payloads: kept unless retained, retained ones remove. */
+	check(put(c, "e/1", "", 0) == 0 && holds(c, "e/1", ""), "empty kept");
+	check(put(c, "e/2", "v", RETAIN) == 0 && holds(c, "e/2", "v"),
+			"retained");
+	check(put(c, "e/2", "", RETAIN) == 0 && !cached(c, "e/2"),
+			"retained empty removes");
+	check(put(c, "e/3", "", RETAIN) == 0 && !cached(c, "e/3"),
+			"retained empty of unknown topic");
+
+	check(put(c, "d/1", "1", 0) == 0 && put(c, "d/2/x", "2", 0) == 0 &&
+			put(c, "k/1", "3", 0) == 0, "put for drop");
+	check(mqtt_cache_drop(c, "d/#") == 2, "drop count");
+	check(!cached(c, "d/1") && !cached(c, "d/2/x") && holds(c, "k/1", "3"),
+			"drop filter");
+
+	mqtt_cache_destroy(c);
+}
+
+/* The pool is full once topics start being evicted, count its slots. */
+static int pool_slots(size_t budget)
+{
+	mqtt_cache *c = mqtt_cache_create(budget, 64);
+	char topic[32];
+	int n;
+
+	for (n = 0; n < 100000; n++) {
+		snprintf(topic, sizeof(topic), "p/%d", n);
+		put(c, topic, "v", 0);
+		if (!cached(c, "p/0"))
+			break;
+	}
+	mqtt_cache_destroy(c);
+
+	return n;
+}
+
+static void test_clock(void)
+{
+	size_t budget = 4096;
+	int slots = pool_slots(budget);
+	mqtt_cache *c = mqtt_cache_create(budget, 64);
+	char topic[32];
+	int i, present = 0;
+
+	check(slots >= 4, "pool of several slots");
+	for (i = 0; i < slots; i++) {
+		snprintf(topic, sizeof(topic), "p/%d", i);
+		put(c, topic, "v", 0);
+	}
+
+	/* Every slot was just written: the hand clears them all, then reuses
+	 * the first one. */
+	put(c, "n/0", "v", 0);
+	check(!cached(c, "p/0") && cached(c, "n/0"), "clock evicts oldest");
+
+	/* The read marks p/1, the hand passes it and takes p/2. */
+	check(cached(c, "p/1"), "read marks");
+	put(c, "n/1", "v", 0);
+	check(cached(c, "p/1"), "clock keeps the slot read");
+	check(!cached(c, "p/2"), "clock evicts the next slot not read");
+
+	for (i = 0; i < slots; i++) {
+		snprintf(topic, sizeof(topic), "p/%d", i);
+		present += cached(c, topic);
+	}
+	check(present == slots - 2, "other slots kept");
+
+	mqtt_cache_destroy(c);
+}
+
+static void value_make(uint8_t *value, uint32_t topic, uint32_t version)
+{
+	memcpy(value, &topic, 4);
+	memcpy(value + 4, &version, 4);
+	for (int i = 8; i < VALUE_LEN; i++)
+		value[i] = (uint8_t)(version * 131 + topic * 7 + i);
+}
+
+static void *reader_run(void *arg)
+{
+	mqtt_cache *c = (mqtt_cache *)arg;
+	uint32_t last[STABLE_TOPICS] = { 0 }, topic, version;
+	uint8_t buf[VALUE_LEN], expect[VALUE_LEN];
+	char name[32];
+	long reads = 0;
+	int len;
+
+	while (!atomic_load(&stop)) {
+		for (uint32_t t = 0; t < STABLE_TOPICS; t++) {
+			snprintf(name, sizeof(name), "stable/%u", t);
+			len = mqtt_cache_get(c, name, strlen(name), buf, sizeof(buf),
+									NULL);
+			reads++;
+			if (len != VALUE_LEN) {
+				atomic_fetch_add(&reader_misses, 1);
+				continue;
+			}
+			memcpy(&topic, buf, 4);
+			memcpy(&version, buf + 4, 4);
+			value_make(expect, topic, version);
+			if (topic != t || memcmp(buf, expect, VALUE_LEN) != 0)
+				atomic_fetch_add(&reader_torn, 1);
+			else if (version < last[t])
+				atomic_fetch_add(&reader_older, 1);
+			else
+				last[t] = version;
+		}
+	}
+	atomic_fetch_add(&reader_reads, reads);
+
+	return NULL;
+}
+
+/* Readers of stable topics while the writer updates them and adds then
+ * removes churn topics, whose removed index entries force rebuilds. */
+static void test_concurrent(void)
+{
+	/* About 64 slots, the removals fill a small index: it is rebuilt
+	 * every few hundred writes. */
+	mqtt_cache *c = mqtt_cache_create(64 * 224, 128);
+	pthread_t readers[READERS];
+	uint8_t value[VALUE_LEN];
+	char name[32];
+	int ok = 1;
+
+	for (uint32_t t = 0; t < STABLE_TOPICS; t++) {
+		snprintf(name, sizeof(name), "stable/%u", t);
+		value_make(value, t, 0);
+		mqtt_cache_put(c, name, strlen(name), value, VALUE_LEN, 0);
+	}
+	for (int i = 0; i < READERS; i++)
+		ok &= pthread_create(&readers[i], NULL, reader_run, c) == 0;
+	check(ok, "start readers");
+
+	for (uint32_t i = 1; i <= WRITES; i++) {
+		snprintf(name, sizeof(name), "stable/%u", i % STABLE_TOPICS);
+		value_make(value, i % STABLE_TOPICS, i);
+		mqtt_cache_put(c, name, strlen(name), value, VALUE_LEN, 0);
+
+		snprintf(name, sizeof(name), "churn/%u", i);
+		mqtt_cache_put(c, name, strlen(name), value, VALUE_LEN, RETAIN);
+		mqtt_cache_put(c, name, strlen(name), NULL, 0, RETAIN);
+	}
+
+	atomic_store(&stop, 1);
+	for (int i = 0; i < READERS; i++)
+		pthread_join(readers[i], NULL);
+
+	fprintf(stderr, "cache: %ld lock free reads against %d writes\n",
+			atomic_load(&reader_reads), WRITES);
+	check(atomic_load(&reader_misses) == 0, "no miss during rebuilds");
+	check(atomic_load(&reader_torn) == 0, "no torn value");
+	check(atomic_load(&reader_older) == 0, "no older value");
+
+	mqtt_cache_destroy(c);
+}
+
+int main(void)
+{
+	test_put_get();
+	test_clock();
+	test_concurrent();
+
+	fprintf(stderr, "cache: %d checks, %d failures\n", checks, failures);
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,280 @@
+/**
+ * @file mqtt_encode_test.cpp
+ * @brief Compare the mqtt_encode.hpp encoders with the mqtt_prot.h ones
+ * byte for byte over a sweep of their parameters: protocol versions, QoS,
+ * retain flag, topics, packet identifiers and payload sizes on each side of
+ * every Variable Byte Integer boundary. Sizes asked with a NULL buffer and
+ * results for a buffer one byte too small are compared too.
+ *
+ * $ make -C test
+ */
+
+#include <cstdio>
+#include <vector>
+
+#include "mqtt_encode.hpp"
+
+namespace {
+
+using namespace mqtt::prot;
+
+int checks;
+int failures;
+
+const std::uint16_t packet_ids[] = { 1, 0x7F, 0x80, 0xFF, 0x100, 0xBEEF,
+                                     0xFFFF };
+
+void fail(const char *what, int a, int b)
+{
+    failures++;
+    std::fprintf(stderr, "MISMATCH %s: template %d, C %d\n", what, a, b);
+}
+
+/* Both encoders return the same length and, when positive, bytes. */
+void compare(const char *what, const std::uint8_t *a, int a_len,
+             const std::uint8_t *b, int b_len)
+{
+    checks++;
+    if (a_len != b_len || (a_len > 0 && std::memcmp(a, b, a_len) != 0))
+        fail(what, a_len, b_len);
+}
+
+void compare_len(const char *what, int a_len, int b_len)
+{
+    checks++;
+    if (a_len != b_len)
+        fail(what, a_len, b_len);
+}
+
+/* Payload sizes putting the remaining length on each side of the Variable
+ * Byte Integer boundaries, for a publish whose header takes header_len. */
+std::vector<std::uint32_t> payload_sizes(std::uint32_t header_len)
+{
+    std::vector<std::uint32_t> sizes = { 0, 1, 2 };
+
+    for (std::uint32_t edge : { 127u, 16383u, 2097151u }) {
+        for (std::uint32_t remaining : { edge - 1, edge, edge + 1 }) {
+            if (remaining >= header_len)
+                sizes.push_back(remaining - header_len);
+        }
+    }
+
+    return sizes;
+}
+
+template <int Qos, fixed_string Topic, std::uint8_t Version, bool Retain>
+void sweep_publish(std::vector<std::uint8_t> &a, std::vector<std::uint8_t> &b,
+                   const std::vector<std::uint8_t> &payload)
+{
+    using P = publish<Qos, Topic, Version, Retain>;
+    mqtt_prot_properties props = {};
+    std::uint8_t flags = (Qos << 1) | (Retain ? 1 : 0);
+    int a_len, b_len;
+
+    for (std::uint32_t n : payload_sizes(P::header_len)) {
+        for (std::uint16_t id : packet_ids) {
+            if constexpr (Qos == 0) {
+                a_len = encode<P>(a.data(), (int)a.size(), payload.data(), n);
+            } else {
+                a_len = encode<P>(a.data(), (int)a.size(), id, payload.data(),
+                                  n);
+            }
+            b_len = mqtt_prot_publish(b.data(), (int)b.size(), Version, flags,
+                                      Qos ? id : 0, Topic.data,
+                                      Topic.size(), &props, payload.data(),
+                                      n);
+            compare("publish", a.data(), a_len, b.data(), b_len);
+
+            /* Sizes and a buffer one byte short. */
+            if constexpr (Qos == 0) {
+                compare_len("publish size",
+                            encode<P>(nullptr, 0, payload.data(), n),
+                            b_len);
+                compare_len("publish short",
+                            encode<P>(a.data(), b_len - 1, payload.data(), n),
+                            -1);
+            } else {
+                compare_len("publish size",
+                            encode<P>(nullptr, 0, id, payload.data(), n),
+                            b_len);
+                compare_len("publish short",
+                            encode<P>(a.data(), b_len - 1, id,
+                                      payload.data(), n),
+                            -1);
+            }
+            compare_len("publish C short",
+                        mqtt_prot_publish(b.data(), b_len - 1, Version, flags,
+                                          Qos ? id : 0, Topic.data,
+                                          Topic.size(), &props,
+                                          payload.data(), n),
+                        -1);
+            /* QoS 0 publishes have no identifier to sweep. */
+            if constexpr (Qos == 0)
+                break;
+        }
+    }
+}
+
+template <fixed_string Topic, std::uint8_t Version>
+void sweep_topic(std::vector<std::uint8_t> &a, std::vector<std::uint8_t> &b,
+                 const std::vector<std::uint8_t> &payload)
+{
+    sweep_publish<0, Topic, Version, false>(a, b, payload);
+    sweep_publish<0, Topic, Version, true>(a, b, payload);
+    sweep_publish<1, Topic, Version, false>(a, b, payload);
+    sweep_publish<1, Topic, Version, true>(a, b, payload);
+    sweep_publish<2, Topic, Version, false>(a, b, payload);
+    sweep_publish<2, Topic, Version, true>(a, b, payload);
+}
+
+template <fixed_string Filter, int Qos, std::uint8_t Version>
+void sweep_subscribe()
+{
+    mqtt_subs_params params = {};
+    std::uint8_t a[512], b[512];
+    int a_len, b_len, n;
+
+    params.topic = const_cast<char *>(Filter.data);
+    params.topic_len = Filter.size();
+    params.qos = Qos;
+    for (std::uint16_t id : packet_ids) {
+        a_len = encode<subscribe<Filter, Qos, Version>>(a, sizeof(a), id);
+        b_len = mqtt_prot_subscribe(b, sizeof(b), Version, id, &params, 1,
+                                    &n);
+        compare("subscribe", a, a_len, b, b_len);
+        compare_len("subscribe short",
+                    encode<subscribe<Filter, Qos, Version>>(a, b_len - 1,
+                                                            id),
+                    -1);
+
+        a_len = encode<unsubscribe<Filter, Version>>(a, sizeof(a), id);
+        b_len = mqtt_prot_unsubscribe(b, sizeof(b), Version, id, &params, 1,
+                                      &n);
+        compare("unsubscribe", a, a_len, b, b_len);
+        compare_len("unsubscribe short",
+                    encode<unsubscribe<Filter, Version>>(a, b_len - 1, id),
+                    -1);
+    }
+}
+
+template <fixed_string Filter, std::uint8_t Version>
+void sweep_filter()
+{
+    sweep_subscribe<Filter, 0, Version>();
+    sweep_subscribe<Filter, 1, Version>();
+    sweep_subscribe<Filter, 2, Version>();
+}
+
+template <std::uint8_t Version>
+void sweep_connect()
+{
+    const char *client_ids[] = { "c", "client-1", "a-client-id-of-23-chars" };
+    const char *usernames[] = { nullptr, "", "user" };
+    const char *passwords[] = { nullptr, "", "secret" };
+    std::uint8_t a[512], b[512];
+    mqtt_prot_properties props = {};
+    int a_len, b_len;
+
+    props.session_expiry = 3600;
+    props.present |= MQTT_PROT_PROP_BIT(MQTT_PROP_SESSION_EXPIRY);
+    for (std::uint8_t flags : { 0x00, 0x02, 0xC2 }) {
+        for (std::uint16_t keepalive : { 0, 60, 0xFFFF }) {
+            for (const char *id : client_ids) {
+                for (const char *user : usernames) {
+                    for (const char *pass : passwords) {
+                        a_len = encode<connect<Version>>(a, sizeof(a), flags,
+                                                         keepalive, id, user,
+                                                         pass);
+                        b_len = mqtt_prot_connect(b, sizeof(b), Version,
+                                                  flags, keepalive, nullptr,
+                                                  id, user, pass);
+                        compare("connect", a, a_len, b, b_len);
+                        compare_len("connect size",
+                                    encode<connect<Version>>(nullptr, 0,
+                                                             flags, keepalive,
+                                                             id, user, pass),
+                                    b_len);
+                        compare_len("connect short",
+                                    encode<connect<Version>>(a, b_len - 1,
+                                                             flags, keepalive,
+                                                             id, user, pass),
+                                    -1);
+                    }
+                }
+            }
+            if constexpr (Version == MQTT_PROT_VERSION_5) {
+                a_len = encode<connect<Version>>(a, sizeof(a), flags,
+                                                 keepalive, "c", nullptr,
+                                                 nullptr, &props);
+                b_len = mqtt_prot_connect(b, sizeof(b), Version, flags,
+                                          keepalive, &props, "c", nullptr,
+                                          nullptr);
+                compare("connect properties", a, a_len, b, b_len);
+            }
+        }
+    }
+}
+
+template <std::uint8_t Version>
+void sweep_constant()
+{
+    std::uint8_t a[16], b[16];
+
+    for (std::uint16_t id : packet_ids) {
+        compare("puback", a, encode<puback>(a, sizeof(a), id), b,
+                mqtt_prot_pubresp(b, sizeof(b), Version, MQTT_PROT_PUBACK, id,
+                                  0));
+        compare("pubrec", a, encode<pubrec>(a, sizeof(a), id), b,
+                mqtt_prot_pubresp(b, sizeof(b), Version, MQTT_PROT_PUBREC, id,
+                                  0));
+        compare("pubrel", a, encode<pubrel>(a, sizeof(a), id), b,
+                mqtt_prot_pubresp(b, sizeof(b), Version, MQTT_PROT_PUBREL, id,
+                                  0));
+        compare("pubcomp", a, encode<pubcomp>(a, sizeof(a), id), b,
+                mqtt_prot_pubresp(b, sizeof(b), Version, MQTT_PROT_PUBCOMP,
+                                  id, 0));
+        compare_len("puback short", encode<puback>(a, 3, id), -1);
+    }
+    compare("pingreq", a, encode<pingreq>(a, sizeof(a)), b,
+            mqtt_prot_pingreq(b));
+    compare("disconnect", a, encode<disconnect>(a, sizeof(a)), b,
+            mqtt_prot_disconnect(b, Version, 0));
+    compare_len("pingreq short", encode<pingreq>(a, 1), -1);
+}
+
+template <std::uint8_t Version>
+void sweep_version(std::vector<std::uint8_t> &a, std::vector<std::uint8_t> &b,
+                   const std::vector<std::uint8_t> &payload)
+{
+    sweep_topic<"t", Version>(a, b, payload);
+    sweep_topic<"sensors/temperature", Version>(a, b, payload);
+    sweep_topic<"a/very/long/topic/name/that/pushes/the/header/past/one/"
+                "hundred/and/twenty/seven/bytes/of/remaining/length/on/its/"
+                "own/without/any/payload", Version>(a, b, payload);
+    sweep_filter<"t", Version>();
+    sweep_filter<"a/+/c", Version>();
+    sweep_filter<"sensors/#", Version>();
+    sweep_connect<Version>();
+    sweep_constant<Version>();
+}
+
+} // namespace
+
+int main()
+{
+    std::vector<std::uint8_t> payload(2097152), a(2097160), b(2097160);
+
+    for (std::size_t i = 0; i < payload.size(); i++)
+        payload[i] = static_cast<std::uint8_t>(i * 31 + 7);
+
+    /* The C encoders print a trace on each call. */
+    if (std::freopen("/dev/null", "w", stdout) == nullptr)
+        return 1;
+
+    sweep_version<MQTT_PROT_VERSION_3_1_1>(a, b, payload);
+    sweep_version<MQTT_PROT_VERSION_5>(a, b, payload);
+
+    std::fprintf(stderr, "mqtt_encode: %d checks, %d mismatches\n", checks,
+                 failures);
+    return (failures == 0) ? 0 : 1;
+}
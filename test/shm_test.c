@@ -0,0 +1,273 @@
+/**
+ * @file shm_test.c
+ * @brief Shared memory ring between a client and the multiplexer: the test
+ * registers a client with itself as the daemon, then checks records that
+ * wrap around the end of the ring, a full ring, QoS 1 completion and
+ * failure, and that the daemon never uses the topic from memory the client
+ * still writes.
+ *
+ * $ make -C test
+ */
+
+#define _GNU_SOURCE
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "pthread.h"
+#include "unistd.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+
+#include "mqtt_shm.h"
+
+#define QOS_1 0x02
+/* Three records of this payload do not fit the ring, two do. */
+#define BIG_LEN (MQTT_SHM_RING_SIZE * 3 / 8)
+
+static int checks;
+static int failures;
+
+/* Daemon side of the registration. */
+static int listen_sock = -1;
+static int daemon_sock = -1;
+static mqtt_shm_peer *peer;
+
+static uint8_t big[BIG_LEN];
+static uint8_t expect[BIG_LEN];
+
+static void check(int ok, const char *what)
+{
+	checks++;
+	if (!ok) {
+		failures++;
+		fprintf(stderr, "FAIL %s\n", what);
+	}
+}
+
+/* Accept the registration like mqtt_mux.c. */
+static void *daemon_accept(void *arg)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	mqtt_shm_hello hello;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+	struct cmsghdr *cmsg;
+	int fds[2] = { -1, -1 };
+	uint8_t status = 0;
+
+	(void)arg;
+	daemon_sock = accept(listen_sock, NULL, NULL);
+	if (daemon_sock < 0 || recvmsg(daemon_sock, &msg, 0) != sizeof(hello))
+		return NULL;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+		return NULL;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	peer = mqtt_shm_peer_open(fds[0], hello.ring_size);
+	close(fds[0]);
+	close(fds[1]);
+	send(daemon_sock, &status, 1, MSG_NOSIGNAL);
+
+	return NULL;
+}
+
+static mqtt_shm *connect_ring(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	mqtt_shm *shm = NULL;
+	pthread_t t;
+
+	listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	strcpy(addr.sun_path, path);
+	if (listen_sock < 0 ||
+		bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(listen_sock, 1) < 0 ||
+		pthread_create(&t, NULL, daemon_accept, NULL) != 0)
+		return NULL;
+
+	mqtt_shm_set_path(path);
+	if (mqtt_shm_connect("localhost", 1883, NULL, NULL, &shm) < 0)
+		shm = NULL;
+	pthread_join(t, NULL);
+
+	return shm;
+}
+
+/* Peek the next record and check it is topic with payload. */
+static int next_is(const char *topic, const uint8_t *payload, int len,
+					mqtt_shm_record *rec)
+{
+	const uint8_t *p;
+	const char *t;
+
+	if (mqtt_shm_peer_peek(peer, rec, &t, &p) != 1)
+		return 0;
+
+	return strcmp(t, topic) == 0 && rec->topic_len == strlen(topic) &&
+			(int)rec->payload_len == len && memcmp(p, payload, len) == 0;
+}
+
+static int publish_big(mqtt_shm *shm, const char *topic, uint8_t fill,
+						int timeout_ms)
+{
+	memset(big, fill, sizeof(big));
+	return mqtt_shm_publish(shm, 0, topic, strlen(topic), big, sizeof(big),
+							timeout_ms);
+}
+
+/* Records that do not fit before the end of the ring start over at its
+ * beginning, after a record skipped by the daemon. */
+static void test_wrap(mqtt_shm *shm)
+{
+	mqtt_shm_record rec;
+	const uint8_t *payload;
+	const char *topic;
+
+	for (int i = 0; i < 3; i++) {
+		check(publish_big(shm, "w/big", (uint8_t)i, 100) == 0, "publish");
+		memset(expect, i, sizeof(expect));
+		check(next_is("w/big", expect, sizeof(expect), &rec),
+				"record read back");
+		mqtt_shm_peer_pop(peer);
+	}
+	check(mqtt_shm_peer_peek(peer, &rec, &topic, &payload) == 0,
+			"ring empty after the wrapped record");
+}
+
+/* A full ring makes the client wait, then fail, until records are
+ * consumed. */
+static void test_full(mqtt_shm *shm)
+{
+	mqtt_shm_record rec;
+
+	check(publish_big(shm, "f/1", 1, 100) == 0 &&
+			publish_big(shm, "f/2", 2, 100) == 0, "fill the ring");
+	check(publish_big(shm, "f/3", 3, 50) < 0, "full ring times out");
+
+	memset(expect, 1, sizeof(expect));
+	check(next_is("f/1", expect, sizeof(expect), &rec), "oldest first");
+	mqtt_shm_peer_pop(peer);
+	check(publish_big(shm, "f/3", 3, 100) == 0, "room once consumed");
+
+	memset(expect, 2, sizeof(expect));
+	check(next_is("f/2", expect, sizeof(expect), &rec), "second record");
+	mqtt_shm_peer_pop(peer);
+	memset(expect, 3, sizeof(expect));
+	check(next_is("f/3", expect, sizeof(expect), &rec), "third record");
+	mqtt_shm_peer_pop(peer);
+}
+
+/* Completes the QoS 1 publishes like the broker ack would, those on topic
+ * q/fail as failed. */
+static void *daemon_ack(void *arg)
+{
+	int *count = (int *)arg;
+	mqtt_shm_record rec;
+	const uint8_t *payload;
+	const char *topic;
+	int ret;
+
+	for (int done = 0; done < *count;) {
+		ret = mqtt_shm_peer_peek(peer, &rec, &topic, &payload);
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			usleep(1000);
+			continue;
+		}
+		mqtt_shm_peer_pop(peer);
+		mqtt_shm_peer_done(peer, rec.seq, strcmp(topic, "q/fail") == 0);
+		done++;
+	}
+
+	return NULL;
+}
+
+static void test_qos1(mqtt_shm *shm)
+{
+	const uint8_t msg[] = "m";
+	int count = 4;
+	pthread_t t;
+
+	if (pthread_create(&t, NULL, daemon_ack, &count) != 0) {
+		check(0, "start daemon");
+		return;
+	}
+	check(mqtt_shm_publish(shm, QOS_1, "q/ok", 4, msg, 1, 2000) == 0,
+			"QoS 1 completed");
+	check(mqtt_shm_publish(shm, QOS_1, "q/fail", 6, msg, 1, 2000) < 0,
+			"QoS 1 failed");
+	check(mqtt_shm_publish(shm, QOS_1, "q/ok", 4, msg, 1, 2000) == 0,
+			"QoS 1 completed after a failure");
+	check(mqtt_shm_publish(shm, QOS_1, "q/fail", 6, msg, 1, 2000) < 0,
+			"QoS 1 failed again");
+	pthread_join(t, NULL);
+}
+
+/* The ring is mapped by both sides, writes to it stand for the client.
+ * Those after the checks must not reach the topic in use, and a topic
+ * holding a NUL is refused. */
+static void test_untrusted(mqtt_shm *shm)
+{
+	mqtt_shm_record rec;
+	const uint8_t msg[] = "m", *payload;
+	const char *topic;
+	uint8_t *at;
+
+	check(mqtt_shm_publish(shm, 0, "u/topic", 7, msg, 1, 100) == 0,
+			"publish");
+	check(mqtt_shm_peer_peek(peer, &rec, &topic, &payload) == 1, "peek");
+	at = (uint8_t *)payload - rec.topic_len - 1;
+	at[rec.topic_len] = 'x';
+	memset(at, 'y', rec.topic_len);
+	check(strcmp(topic, "u/topic") == 0,
+			"topic kept from client writes after peek");
+	check((const uint8_t *)topic != at, "topic out of the client memory");
+	mqtt_shm_peer_pop(peer);
+
+	check(mqtt_shm_publish(shm, 0, "u/a_b", 5, msg, 1, 100) == 0,
+			"publish");
+	check(mqtt_shm_peer_peek(peer, &rec, &topic, &payload) == 1, "peek");
+	at = (uint8_t *)payload - rec.topic_len - 1;
+	at[3] = '\0';
+	check(mqtt_shm_peer_peek(peer, &rec, &topic, &payload) < 0,
+			"topic holding a NUL refused");
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/shm_test.XXXXXX", path[64];
+	mqtt_shm *shm;
+
+	/* Traces go to stdout. */
+	if (freopen("/dev/null", "w", stdout) == NULL || mkdtemp(dir) == NULL)
+		return 1;
+	snprintf(path, sizeof(path), "%s/sock", dir);
+
+	shm = connect_ring(path);
+	check(shm != NULL && peer != NULL, "register");
+	if (shm != NULL && peer != NULL) {
+		test_wrap(shm);
+		test_full(shm);
+		test_qos1(shm);
+		test_untrusted(shm);
+	}
+
+	/* The daemon goes away first, the client does not wait for it. */
+	mqtt_shm_peer_close(peer);
+	close(daemon_sock);
+	mqtt_shm_close(shm);
+	close(listen_sock);
+	unlink(path);
+	rmdir(dir);
+
+	fprintf(stderr, "shm: %d checks, %d failures\n", checks, failures);
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,536 @@
+/**
+ * @file tls_test.c
+ * @brief TLS transport against a mock broker thread on loopback, with a
+ * self-signed certificate made at start. Checks which connections resume
+ * a session: a verifying context never resumes one of an insecure context
+ * or of another client certificate, a wrong server name fails even after a
+ * verified session to the same address. Payloads up to several records are
+ * echoed back with kTLS enabled and disabled, with TLS 1.3 then TLS 1.2,
+ * a publish smaller than a record arriving in a single record.
+ * kTLS send must be on where the kernel has the tls module, off otherwise.
+ *
+ * $ make -C test
+ */
+
+#define _GNU_SOURCE
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "errno.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "arpa/inet.h"
+#include "openssl/ssl.h"
+#include "openssl/err.h"
+#include "openssl/x509v3.h"
+
+#include "mqtt.h"
+#include "network_tls.h"
+
+#define MOCK_NAME "mock.test"
+#define MOCK_BUF 131072
+#define ECHO_TOPIC "tls/echo"
+/* Connections recorded by the mock broker. */
+#define MOCK_CONNS 64
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+static int checks;
+static int failures;
+
+/* Written by the mock broker thread, one result per connection accepted:
+ * -1 if the handshake failed, else 1 if the session was resumed. */
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mock_cond = PTHREAD_COND_INITIALIZER;
+static int mock_results[MOCK_CONNS];
+static int mock_client_cert[MOCK_CONNS];
+static int mock_conns;
+static int mock_fd = -1;
+static SSL_CTX *mock_ctx;
+static int mock_version = TLS1_3_VERSION;
+/* Next connection to be recorded. */
+static int mock_next;
+
+static char ca_path[] = "/tmp/tls_test_ca_XXXXXX";
+static char client_path[] = "/tmp/tls_test_client_XXXXXX";
+
+/* Payloads echoed on each connection, the last ones span several records. */
+static const int echo_sizes[] = { 1, 1000, 16384, 20000, 60000 };
+#define ECHO_LEN (int)(sizeof(echo_sizes) / sizeof(echo_sizes[0]))
+/* Publishes of echo sizes below this fit a record, header included. */
+#define ECHO_ONE_RECORD 16000
+static uint8_t *echo_payload;
+static int echo_received;
+static int echo_bad;
+/* Application data records read by the mock broker. */
+static atomic_int mock_records;
+
+static void check(int ok, const char *what)
+{
+	checks++;
+	if (!ok) {
+		failures++;
+		fprintf(stderr, "FAIL %s\n", what);
+	}
+}
+
+/* Self-signed P-256 certificate for cn, also its subjectAltName. */
+static X509 *cert_make(EVP_PKEY *key, const char *cn)
+{
+	X509V3_CTX ext_ctx;
+	X509_EXTENSION *ext;
+	X509_NAME *subject;
+	char san[64];
+	X509 *cert;
+
+	cert = X509_new();
+	if (cert == NULL)
+		return NULL;
+
+	snprintf(san, sizeof(san), "DNS:%s", cn);
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+	X509_set_pubkey(cert, key);
+	subject = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC,
+								(const unsigned char *)cn, -1, -1, 0);
+	X509_set_issuer_name(cert, subject);
+
+	X509V3_set_ctx(&ext_ctx, cert, cert, NULL, NULL, 0);
+	ext = X509V3_EXT_conf_nid(NULL, &ext_ctx, NID_subject_alt_name, san);
+	if (ext == NULL || X509_add_ext(cert, ext, -1) != 1 ||
+		X509_sign(cert, key, EVP_sha256()) == 0) {
+		X509_EXTENSION_free(ext);
+		X509_free(cert);
+		return NULL;
+	}
+	X509_EXTENSION_free(ext);
+
+	return cert;
+}
+
+/* Write the certificate, and the key if any, to a new temporary file. */
+static int pem_write(char *path, X509 *cert, EVP_PKEY *key)
+{
+	FILE *f;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	ret = PEM_write_X509(f, cert) == 1 &&
+			(key == NULL ||
+			PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL) == 1);
+	fclose(f);
+
+	return ret ? 0 : -1;
+}
+
+/* Accept every client certificate, the broker only notes if one came. */
+static int mock_verify_cb(int ok, X509_STORE_CTX *store)
+{
+	(void)ok;
+	(void)store;
+	return 1;
+}
+
+static void mock_record(int result, int client_cert)
+{
+	pthread_mutex_lock(&mock_lock);
+	if (mock_conns < MOCK_CONNS) {
+		mock_results[mock_conns] = result;
+		mock_client_cert[mock_conns] = client_cert;
+	}
+	mock_conns++;
+	pthread_cond_broadcast(&mock_cond);
+	pthread_mutex_unlock(&mock_lock);
+}
+
+static void mock_msg_cb(int write_p, int version, int content_type,
+						const void *buf, size_t len, SSL *ssl, void *arg)
+{
+	(void)version;
+	(void)ssl;
+	(void)arg;
+	if (!write_p && content_type == SSL3_RT_HEADER && len > 0 &&
+		((const uint8_t *)buf)[0] == SSL3_RT_APPLICATION_DATA)
+		atomic_fetch_add(&mock_records, 1);
+}
+
+static int mock_write(SSL *ssl, const uint8_t *buf, int len)
+{
+	return (len == 0 || SSL_write(ssl, buf, len) == len) ? 0 : -1;
+}
+
+/* Answer CONNECT, SUBSCRIBE and pings, ack QoS 1 publishes and echo every
+ * publish back at QoS 0, until DISCONNECT or the connection is closed. */
+static void mock_serve(SSL *ssl)
+{
+	static uint8_t buf[MOCK_BUF], out[MOCK_BUF + 8];
+	int len = 0, pos, out_len, n, pkt_len, i, hdr, topic_len;
+	uint32_t rem, mult, echo_rem;
+
+	for (;;) {
+		n = SSL_read(ssl, &buf[len], sizeof(buf) - len);
+		if (n <= 0)
+			return;
+		len += n;
+
+		pos = 0;
+		for (;;) {
+			rem = 0;
+			mult = 1;
+			for (i = pos + 1; i < len && i < pos + 5; i++) {
+				rem += (buf[i] & 0x7F) * mult;
+				mult *= 128;
+				if (!(buf[i] & 0x80))
+					break;
+			}
+			if (i >= len || i >= pos + 5)
+				break;
+			hdr = i + 1;
+			pkt_len = hdr - pos + (int)rem;
+			if (pos + pkt_len > len)
+				break;
+
+			out_len = 0;
+			switch (buf[pos] >> 4) {
+				case 1: /* CONNECT */
+					memcpy(out, "\x20\x02\x00\x00", 4);
+					out_len = 4;
+					break;
+				case 3: /* PUBLISH */
+					topic_len = (buf[hdr] << 8) | buf[hdr + 1];
+					echo_rem = rem;
+					if (((buf[pos] >> 1) & 0x03) == 1) {
+						i = hdr + 2 + topic_len;
+						out[out_len++] = 0x40;
+						out[out_len++] = 0x02;
+						out[out_len++] = buf[i];
+						out[out_len++] = buf[i + 1];
+						/* The echo has no packet identifier. */
+						echo_rem -= 2;
+					}
+					out[out_len++] = 0x30;
+					do {
+						out[out_len] = echo_rem & 0x7F;
+						echo_rem >>= 7;
+						if (echo_rem > 0)
+							out[out_len] |= 0x80;
+						out_len++;
+					} while (echo_rem > 0);
+					memcpy(&out[out_len], &buf[hdr], 2 + topic_len);
+					out_len += 2 + topic_len;
+					i = hdr + 2 + topic_len;
+					if (((buf[pos] >> 1) & 0x03) != 0)
+						i += 2;
+					memcpy(&out[out_len], &buf[i], pos + pkt_len - i);
+					out_len += pos + pkt_len - i;
+					break;
+				case 8: /* SUBSCRIBE, one filter granted QoS 0 */
+					out[out_len++] = 0x90;
+					out[out_len++] = 0x03;
+					out[out_len++] = buf[hdr];
+					out[out_len++] = buf[hdr + 1];
+					out[out_len++] = 0x00;
+					break;
+				case 12: /* PINGREQ */
+					memcpy(out, "\xD0\x00", 2);
+					out_len = 2;
+					break;
+				case 14: /* DISCONNECT */
+					return;
+				default:
+					break;
+			}
+			if (mock_write(ssl, out, out_len) < 0)
+				return;
+			pos += pkt_len;
+		}
+		memmove(buf, &buf[pos], len - pos);
+		len -= pos;
+		if (len == (int)sizeof(buf))
+			return;
+	}
+}
+
+static void *mock_run(void *arg)
+{
+	X509 *peer;
+	SSL *ssl;
+	int fd;
+
+	(void)arg;
+	while ((fd = accept(mock_fd, NULL, NULL)) >= 0) {
+		ssl = SSL_new(mock_ctx);
+		if (ssl == NULL) {
+			close(fd);
+			mock_record(-1, 0);
+			continue;
+		}
+		SSL_set_fd(ssl, fd);
+		SSL_set_max_proto_version(ssl, mock_version);
+		if (SSL_accept(ssl) != 1) {
+			ERR_clear_error();
+			mock_record(-1, 0);
+		} else {
+			peer = SSL_get1_peer_certificate(ssl);
+			mock_record(SSL_session_reused(ssl), peer != NULL);
+			X509_free(peer);
+			mock_serve(ssl);
+			SSL_shutdown(ssl);
+		}
+		SSL_free(ssl);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* Make the certificates, start the broker on an ephemeral loopback port,
+ * returns it or -1. */
+static int mock_start(void)
+{
+	struct sockaddr_in addr = { 0 };
+	socklen_t addr_len = sizeof(addr);
+	EVP_PKEY *key = NULL, *client_key = NULL;
+	X509 *cert = NULL, *client_cert = NULL;
+	pthread_t thread;
+	int port = -1;
+
+	key = EVP_EC_gen("P-256");
+	client_key = EVP_EC_gen("P-256");
+	if (key == NULL || client_key == NULL)
+		goto fail;
+	cert = cert_make(key, MOCK_NAME);
+	client_cert = cert_make(client_key, "client.test");
+	if (cert == NULL || client_cert == NULL ||
+		pem_write(ca_path, cert, NULL) < 0 ||
+		pem_write(client_path, client_cert, client_key) < 0)
+		goto fail;
+
+	mock_ctx = SSL_CTX_new(TLS_server_method());
+	if (mock_ctx == NULL ||
+		SSL_CTX_use_certificate(mock_ctx, cert) != 1 ||
+		SSL_CTX_use_PrivateKey(mock_ctx, key) != 1)
+		goto fail;
+	SSL_CTX_set_min_proto_version(mock_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(mock_ctx, SSL_VERIFY_PEER, mock_verify_cb);
+	SSL_CTX_set_msg_callback(mock_ctx, mock_msg_cb);
+	/* Needed to resume sessions once client certificates are asked. */
+	SSL_CTX_set_session_id_context(mock_ctx, (const unsigned char *)"mock",
+									4);
+
+	mock_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (mock_fd < 0)
+		goto fail;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(mock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(mock_fd, 4) < 0 ||
+		getsockname(mock_fd, (struct sockaddr *)&addr, &addr_len) < 0 ||
+		pthread_create(&thread, NULL, mock_run, NULL) != 0)
+		goto fail;
+	pthread_detach(thread);
+	port = ntohs(addr.sin_port);
+
+fail:
+	X509_free(cert);
+	X509_free(client_cert);
+	EVP_PKEY_free(key);
+	EVP_PKEY_free(client_key);
+	return port;
+}
+
+/* 1 if the kernel takes the tls upper layer protocol on a TCP socket. */
+static int kernel_ktls(int port)
+{
+	struct sockaddr_in addr = { 0 };
+	int fd, ret = 0;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	/* The mock broker sees a failed handshake. */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		ret = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", 3) == 0;
+	close(fd);
+
+	return ret;
+}
+
+/* Wait for the mock broker to record connection index. */
+static int mock_result(int index, int *client_cert)
+{
+	int result;
+
+	pthread_mutex_lock(&mock_lock);
+	while (mock_conns <= index)
+		pthread_cond_wait(&mock_cond, &mock_lock);
+	result = mock_results[index];
+	*client_cert = mock_client_cert[index];
+	pthread_mutex_unlock(&mock_lock);
+
+	return result;
+}
+
+static void echo_cb(void *user_data, const char *topic, int topic_len,
+					const uint8_t *payload, int payload_len, uint8_t flags)
+{
+	(void)user_data;
+	(void)flags;
+	if (echo_received >= ECHO_LEN ||
+		topic_len != (int)strlen(ECHO_TOPIC) ||
+		memcmp(topic, ECHO_TOPIC, topic_len) != 0 ||
+		payload_len != echo_sizes[echo_received] ||
+		memcmp(payload, echo_payload, payload_len) != 0)
+		echo_bad++;
+	echo_received++;
+}
+
+/* Connect, subscribe, publish every echo size at QoS 1 and wait for the
+ * echoes. expect: -1 if the handshake must fail, else 1 if the session
+ * must be resumed. */
+static void run(const char *what, int port, const socket_tls_options *tls,
+				int expect, int expect_client_cert, int expect_ktls)
+{
+	mqtt_connect_options opts = { 0 };
+	subscribe_parameters sub = { SUBSCRIBE_QOS_0, (int)strlen(ECHO_TOPIC),
+									ECHO_TOPIC };
+	char label[160];
+	int sock, result, client_cert, ok, i, records, single = 1;
+
+	opts.tls = tls;
+	sock = mqtt_connect_opts("127.0.0.1", port, "tlstest",
+								CONNECT_FLAG_CLEAN_SESSION, 60, NULL, NULL,
+								&opts);
+	result = mock_result(mock_next++, &client_cert);
+	fprintf(stderr, "%-36s %s, kTLS send %s\n", what,
+			(result < 0) ? "handshake failed" :
+			result ? "session resumed" : "new session",
+			(sock >= 0 && tls_ktls_send(sock)) ? "on" : "off");
+
+	snprintf(label, sizeof(label), "%s: session", what);
+	check(result == expect, label);
+	snprintf(label, sizeof(label), "%s: connect", what);
+	check((sock >= 0) == (expect >= 0), label);
+	if (sock < 0)
+		return;
+
+	snprintf(label, sizeof(label), "%s: client certificate", what);
+	check(client_cert == expect_client_cert, label);
+	snprintf(label, sizeof(label), "%s: kTLS send", what);
+	check(tls_ktls_send(sock) == expect_ktls, label);
+
+	echo_received = 0;
+	echo_bad = 0;
+	ok = mqtt_set_message_callback(sock, echo_cb, NULL) == 0 &&
+			mqtt_subscribe(sock, 1, &sub) == 0;
+	/* The broker reads the whole publish before its ack. */
+	for (i = 0; ok && i < ECHO_LEN; i++) {
+		records = atomic_load(&mock_records);
+		ok = mqtt_publish_bin(sock, PUBLISH_FLAG_QOS_2, ECHO_TOPIC,
+								echo_payload, echo_sizes[i]) == 0;
+		if (echo_sizes[i] < ECHO_ONE_RECORD &&
+			atomic_load(&mock_records) - records != 1)
+			single = 0;
+	}
+	while (ok && echo_received < ECHO_LEN)
+		ok = mqtt_loop(sock, 1000) >= 0;
+	snprintf(label, sizeof(label), "%s: echo", what);
+	check(ok && echo_received == ECHO_LEN && echo_bad == 0, label);
+	snprintf(label, sizeof(label), "%s: one record per small publish", what);
+	check(single, label);
+
+	mqtt_disconnect(sock);
+}
+
+/* Every case with the mock broker limited to version. */
+static void run_version(int port, int version, int ktls)
+{
+	socket_tls_options insecure = { 0 }, verify = { 0 }, wrong = { 0 };
+	socket_tls_options client = { 0 }, no_ktls = { 0 };
+	char what[4][64];
+	const char *name = (version == TLS1_3_VERSION) ? "TLS 1.3" : "TLS 1.2";
+
+	mock_version = version;
+	insecure.insecure = 1;
+	verify.ca_file = ca_path;
+	verify.server_name = MOCK_NAME;
+	wrong = verify;
+	wrong.server_name = "other.test";
+	client = verify;
+	client.cert_file = client_path;
+	no_ktls = verify;
+	no_ktls.disable_ktls = 1;
+
+	snprintf(what[0], sizeof(what[0]), "%s insecure", name);
+	snprintf(what[1], sizeof(what[1]), "%s verified", name);
+	snprintf(what[2], sizeof(what[2]), "%s client certificate", name);
+	snprintf(what[3], sizeof(what[3]), "%s kTLS disabled", name);
+
+	/* Sessions cached before, with the other version, are not resumed. */
+	run(what[0], port, &insecure, 0, 0, ktls);
+	run(what[0], port, &insecure, 1, 0, ktls);
+	run(what[1], port, &verify, 0, 0, ktls);
+	run(what[1], port, &verify, 1, 0, ktls);
+	run("wrong server name", port, &wrong, -1, 0, 0);
+	run(what[2], port, &client, 0, 1, ktls);
+	run(what[2], port, &client, 1, 1, ktls);
+	run(what[3], port, &no_ktls, 0, 0, 0);
+	run(what[3], port, &no_ktls, 1, 0, 0);
+}
+
+int main(void)
+{
+	int port, ktls, i;
+
+	port = mock_start();
+	echo_payload = (uint8_t *)malloc(MOCK_BUF);
+	if (port < 0 || echo_payload == NULL) {
+		fprintf(stderr, "Couldn't start the mock broker\n");
+		return 1;
+	}
+	for (i = 0; i < MOCK_BUF; i++)
+		echo_payload[i] = (uint8_t)(i * 31 + 7);
+
+	/* The library prints a trace on each call. */
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		return 1;
+
+	ktls = kernel_ktls(port);
+	mock_result(mock_next++, &i);
+#ifdef OPENSSL_NO_KTLS
+	fprintf(stderr, "OpenSSL built without kTLS\n");
+	ktls = 0;
+#else
+	fprintf(stderr, "kernel tls module %s\n", ktls ? "loaded" : "missing");
+#endif
+
+	run_version(port, TLS1_3_VERSION, ktls);
+	run_version(port, TLS1_2_VERSION, ktls);
+
+	unlink(ca_path);
+	unlink(client_path);
+	free(echo_payload);
+	fprintf(stderr, "tls: %d checks, %d failures\n", checks, failures);
+	return (failures == 0) ? 0 : 1;
+}